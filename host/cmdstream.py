@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+"""Host side packer for the EP2 command stream (EP2_MODE_CMDSTREAM).
+
+Every EP2 OUT packet carries back-to-back records (see TCmdStreamRecord in
+include/commands.h), every record produces one reply (TCmdStreamReply) in
+EP2 IN. Run this script to compare the number of USB transfers needed for a
+batch of commands via EP0 vendor requests and via the command stream.
+"""
+
+import argparse
+import struct
+
+# see include/commands.h
+CMD_GET_VERSION        = 0x80
+CMD_GET_VERSION_STRING = 0x81
+CMD_GET_STATUS         = 0x82
+CMD_SET_EP2_MODE       = 0x83
+
+EP2_MODE_IDLE          = 0x00
+EP2_MODE_CMDSTREAM     = 0x03
+
+ID_VENDOR  = 0xFFF0
+ID_PRODUCT = 0x0002
+
+PACKET_SIZE = 64
+RECORD = struct.Struct('<BBHH')   # TCmdStreamRecord
+REPLY  = struct.Struct('<BB')     # TCmdStreamReply
+
+
+def pack(commands):
+    """Pack (command, value, index, payload) tuples into EP2 OUT packets.
+
+    Records never span two packets.
+    """
+    packets = []
+    packet = b''
+    for command, value, index, payload in commands:
+        record = RECORD.pack(command, len(payload), value, index) + payload
+        if len(record) > PACKET_SIZE:
+            raise ValueError('record for command 0x%02x too long' % command)
+        if len(packet) + len(record) > PACKET_SIZE:
+            packets.append(packet)
+            packet = b''
+        packet += record
+    if packet:
+        packets.append(packet)
+    return packets
+
+
+def unpack(data):
+    """Split the concatenated EP2 IN data into (command, response) tuples."""
+    replies = []
+    pos = 0
+    while pos + REPLY.size <= len(data):
+        command, length = REPLY.unpack_from(data, pos)
+        pos += REPLY.size
+        replies.append((command, bytes(data[pos:pos + length])))
+        pos += length
+    return replies
+
+
+def execute(dev, commands):
+    """Send commands via the command stream and return their replies."""
+    packets = pack(commands)
+    for packet in packets:
+        dev.write(0x02, packet)
+    replies = []
+    in_transfers = 0
+    while len(replies) < len(commands):
+        data = dev.read(0x82, PACKET_SIZE)
+        in_transfers += 1
+        replies += unpack(data)
+    return replies, len(packets) + in_transfers
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('-n', '--count', type=int, default=100,
+                        help='number of CMD_GET_STATUS commands')
+    args = parser.parse_args()
+
+    import usb.core
+    dev = usb.core.find(idVendor=ID_VENDOR, idProduct=ID_PRODUCT)
+    if dev is None:
+        raise SystemExit('device not found')
+    dev.set_configuration()
+
+    # EP0: one control transfer per command
+    for _ in range(args.count):
+        dev.ctrl_transfer(0xC0, CMD_GET_STATUS, 0, 0, 1)
+
+    # EP2: batched
+    dev.ctrl_transfer(0x40, CMD_SET_EP2_MODE, EP2_MODE_CMDSTREAM, 0)
+    commands = [(CMD_GET_STATUS, 0, 0, b'')] * args.count
+    replies, transfers = execute(dev, commands)
+    dev.ctrl_transfer(0x40, CMD_SET_EP2_MODE, EP2_MODE_IDLE, 0)
+
+    print('commands:                 %d' % args.count)
+    print('EP0 control transfers:    %d' % args.count)
+    print('command stream transfers: %d' % transfers)
+    assert all(command == CMD_GET_STATUS for command, _ in replies)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+"""Read the performance counters of the firmware (CMD_GET_STATUS).
+
+The counters are returned in TGetStatus (see include/commands.h and
+include/stats.h). With --clear they are cleared by the same request, so
+repeated calls show the counts since the previous call. MaxUsbI2cIsr is
+only measured by firmware built with "make ISR_STATS=1".
+"""
+
+import argparse
+import struct
+
+# see include/commands.h and include/delay.h
+CMD_GET_STATUS      = 0x82
+TIMER_COUNTS_PER_US = 6
+
+ID_VENDOR  = 0xFFF0
+ID_PRODUCT = 0x0002
+
+STATUS = struct.Struct('<BIIIIIHHHIHH')   # TGetStatus
+FIELDS = ('MyStatus', 'Setups', 'Ep2InPackets', 'Ep2OutPackets',
+          'Ep2InBytes', 'Ep2OutBytes', 'I2CTransfers', 'I2CNacks',
+          'I2CBusErrors', 'LoopPasses', 'MaxUsbI2cIsr', 'MaxLoopPass')
+DURATIONS = ('MaxUsbI2cIsr', 'MaxLoopPass')
+
+
+def unpack(data):
+    """Return the counters of a TGetStatus response as dict."""
+    # newer firmware may append fields
+    return dict(zip(FIELDS, STATUS.unpack_from(bytes(data))))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('-c', '--clear', action='store_true',
+                        help='clear the counters after reading them')
+    args = parser.parse_args()
+
+    import usb.core
+    dev = usb.core.find(idVendor=ID_VENDOR, idProduct=ID_PRODUCT)
+    if dev is None:
+        raise SystemExit('device not found')
+    dev.set_configuration()
+
+    data = dev.ctrl_transfer(0xC0, CMD_GET_STATUS, int(args.clear), 0,
+                             STATUS.size)
+    if len(data) < STATUS.size:
+        raise SystemExit('firmware without performance counters')
+    for name, value in unpack(data).items():
+        if name == 'MyStatus':
+            continue
+        if name in DURATIONS:
+            print('%-14s %8.1f us' % (name + ':', value / TIMER_COUNTS_PER_US))
+        else:
+            print('%-14s %8d' % (name + ':', value))
+
+
+if __name__ == '__main__':
+    main()
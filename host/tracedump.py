@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+"""Drain and decode the binary event trace of the firmware (CMD_TRACE_READ).
+
+Every response is a TTraceHeader followed by TTraceRecord (see
+include/trace.h). The time of every record is reconstructed from its
+predecessor, TRACE_SYNC records carry the full millisecond counter. Before
+the first TRACE_SYNC record and after lost records the time only counts
+from an arbitrary start (marked with "*") until the next TRACE_SYNC record.
+
+The timeline lists the activity of sudav_isr() (SETUP packets), the
+endpoint ISRs, i2c_isr() (transactions) and the commands executed by the
+main loop, followed by a summary per source. The firmware must be built
+with "make TRACE=1".
+"""
+
+import argparse
+import struct
+import time
+
+# see include/commands.h, include/trace.h, include/delay.h and include/i2c.h
+CMD_TRACE_READ      = 0x98
+TIMER_COUNTS_PER_MS = 6000
+
+TRACE_SYNC          = 0
+TRACE_SETUP         = 1
+TRACE_EP_IN         = 2
+TRACE_EP_OUT        = 3
+TRACE_I2C_START     = 4
+TRACE_I2C_DONE      = 5
+TRACE_COMMAND       = 6
+
+ID_VENDOR  = 0xFFF0
+ID_PRODUCT = 0x0002
+
+HEADER = struct.Struct('<BBB')   # TTraceHeader
+RECORD = struct.Struct('<BBH')   # TTraceRecord
+MAX_LENGTH = 256
+
+COMMANDS = {
+    0x80: 'GetVersion', 0x81: 'GetVersionString', 0x82: 'GetStatus',
+    0x83: 'SetEP2Mode', 0x84: 'I2CWriteRead', 0x85: 'EEPROMRead',
+    0x86: 'EEPROMWrite', 0x87: 'EEPROMStatus', 0x88: 'GetProfile',
+    0x89: 'Capture', 0x8A: 'Pattern', 0x8B: 'PatternStatus',
+    0x8C: 'SPIConfig', 0x8D: 'FlashID', 0x8E: 'FlashErase',
+    0x8F: 'FlashRead', 0x90: 'FlashWrite', 0x91: 'FlashStatus',
+    0x92: 'JTAGConfig', 0x93: 'I2CWrite', 0x94: 'UARTConfig',
+    0x95: 'UARTStatus', 0x96: 'GetNAKs', 0x97: 'NotifyConfig',
+    0x98: 'TraceRead',
+}
+STANDARD_REQUESTS = {
+    0x00: 'GET_STATUS', 0x01: 'CLEAR_FEATURE', 0x03: 'SET_FEATURE',
+    0x05: 'SET_ADDRESS', 0x06: 'GET_DESCRIPTOR', 0x07: 'SET_DESCRIPTOR',
+    0x08: 'GET_CONFIGURATION', 0x09: 'SET_CONFIGURATION',
+    0x0A: 'GET_INTERFACE', 0x0B: 'SET_INTERFACE', 0x0C: 'SYNCH_FRAME',
+}
+I2C_STATUS = ['OK', 'BUSY', 'BERROR', 'NACK', 'PENDING']
+
+
+def describe(record_id, arg):
+    """Return the source and the argument of a record as text."""
+    if record_id == TRACE_SETUP:
+        name = COMMANDS.get(arg) or STANDARD_REQUESTS.get(arg, '0x%02x' % arg)
+        return 'sudav_isr', 'SETUP %s' % name
+    if record_id == TRACE_EP_IN:
+        return 'ep%din_isr' % arg, 'EP%d IN' % arg
+    if record_id == TRACE_EP_OUT:
+        return 'ep%dout_isr' % arg, 'EP%d OUT' % arg
+    if record_id == TRACE_I2C_START:
+        return 'i2c_isr', 'start 0x%02x' % arg
+    if record_id == TRACE_I2C_DONE:
+        status = I2C_STATUS[arg] if arg < len(I2C_STATUS) else '%d' % arg
+        return 'i2c_isr', 'done %s' % status
+    if record_id == TRACE_COMMAND:
+        return 'command', COMMANDS.get(arg, '0x%02x' % arg)
+    return 'id %d' % record_id, '0x%02x' % arg
+
+
+class Decoder:
+    """Reconstruct the time of the records of consecutive responses."""
+
+    def __init__(self):
+        self.tick = None     # full ms of the previous record, None: unknown
+        self.synced = False  # False: tick counts from an arbitrary start
+
+    def feed(self, data):
+        """Decode one response.
+
+        Returns the number of records left in the ring and a list of
+        (time in us, synced, record id, arg) tuples. Lost records are
+        reported as (None, False, None, count).
+        """
+        count, lost, left = HEADER.unpack_from(data)
+        events = []
+        if lost:
+            events.append((None, False, None, lost))
+            self.tick = None
+        for i in range(count):
+            record_id, arg, stamp = RECORD.unpack_from(data, HEADER.size + i * RECORD.size)
+            if record_id == TRACE_SYNC:
+                if self.tick is None or not self.synced:
+                    self.tick = stamp
+                else:
+                    self.tick += (stamp - self.tick) & 0xFFFF
+                self.synced = True
+                continue
+            if self.tick is None:
+                self.tick = stamp >> 13
+                self.synced = False
+            self.tick += ((stamp >> 13) - self.tick) & 7
+            counts = self.tick * TIMER_COUNTS_PER_MS + (stamp & 0x1FFF)
+            events.append((counts * 1000.0 / TIMER_COUNTS_PER_MS, self.synced, record_id, arg))
+        return left, events
+
+
+def split(data):
+    """Split concatenated responses (e.g. a file written by hostsim/tracering)."""
+    pos = 0
+    while pos + HEADER.size <= len(data):
+        length = HEADER.size + data[pos] * RECORD.size
+        yield data[pos:pos + length]
+        pos += length
+
+
+def print_timeline(events):
+    """Print the timeline and return the times per source."""
+    sources = {}
+    previous = None
+    segment = 0          # the times of different segments aren't related
+    was_synced = True
+    for t, synced, record_id, arg in events:
+        if record_id is None:
+            print('%13s %10s  %d records lost' % ('', '', arg))
+            previous = None
+            segment += 1
+            continue
+        if synced != was_synced:
+            previous = None
+            segment += 1
+            was_synced = synced
+        source, text = describe(record_id, arg)
+        delta = '' if previous is None else '+%.1f' % (t - previous)
+        print('%12.1f%s %10s  %-12s %s' % (t, ' ' if synced else '*', delta, source, text))
+        previous = t
+        sources.setdefault(source, []).append((segment, t))
+    return sources
+
+
+def print_summary(sources):
+    print()
+    print('%-12s %6s %12s %12s' % ('source', 'count', 'mean gap us', 'max gap us'))
+    for source, times in sorted(sources.items()):
+        gaps = [b - a for (sa, a), (sb, b) in zip(times, times[1:]) if sa == sb]
+        mean = sum(gaps) / len(gaps) if gaps else 0
+        print('%-12s %6d %12.1f %12.1f' % (source, len(times), mean, max(gaps, default=0)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('-f', '--file',
+                        help='decode the responses stored in FILE instead of reading the device')
+    parser.add_argument('-s', '--save', help='append the raw responses to SAVE')
+    parser.add_argument('-p', '--poll', type=float, default=0,
+                        help='keep draining the ring every POLL seconds')
+    args = parser.parse_args()
+
+    decoder = Decoder()
+    events = []
+    if args.file:
+        with open(args.file, 'rb') as f:
+            for response in split(f.read()):
+                events += decoder.feed(response)[1]
+        print_summary(print_timeline(events))
+        return
+
+    import usb.core
+    dev = usb.core.find(idVendor=ID_VENDOR, idProduct=ID_PRODUCT)
+    if dev is None:
+        raise SystemExit('device not found')
+    dev.set_configuration()
+
+    save = open(args.save, 'ab') if args.save else None
+    try:
+        while True:
+            data = bytes(dev.ctrl_transfer(0xC0, CMD_TRACE_READ, 0, 0, MAX_LENGTH))
+            if save:
+                save.write(data)
+            left, new = decoder.feed(data)
+            events += new
+            if left:
+                continue
+            if not args.poll:
+                break
+            time.sleep(args.poll)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if save:
+            save.close()
+    print_summary(print_timeline(events))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,113 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Burst absorption test of the EP2 OUT buffering
+ *
+ * Sends back-to-back EP2 OUT packets in EP2_MODE_LOOPBACK while the main
+ * loop of the firmware doesn't run (e.g. because it executes a long
+ * command) and counts the packets accepted before the first NAK, for every
+ * combination of the EP2_FLAG_* buffering options. Afterwards the main loop
+ * runs and all accepted packets must be returned on EP2 IN in order.
+ *
+ * Usage: burst
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "commands.h"
+
+#define MAX_PACKETS              64
+
+typedef struct {
+  const char* Name;
+  uint8_t     Flags;
+} TConfig;
+
+static const TConfig configs[] = {
+  { "single",      0 },
+  { "double",      EP2_FLAG_DOUBLE_BUFFER },
+  { "pool",        EP2_FLAG_POOL },
+  { "double+pool", EP2_FLAG_DOUBLE_BUFFER | EP2_FLAG_POOL },
+};
+
+/// packet @a n of a burst, its length and contents depend on @a n
+static uint8_t make_packet(unsigned int n, uint8_t* data) {
+  uint8_t length = 64 - (n % 7);
+  uint8_t i;
+
+  for (i = 0; i < length; i++)
+    data[i] = n * 31 + i;
+  return length;
+}
+
+/**
+ * Send a burst with the buffering options @a flags
+ *
+ * @return number of absorbed packets or -1 if the loopback data is wrong
+ */
+static int burst(uint8_t flags) {
+  uint8_t  data[64];
+  uint8_t  expected[64];
+  unsigned int absorbed;
+  unsigned int n;
+  unsigned int retry;
+  int      length;
+
+  sim_reset();
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_LOOPBACK, flags);
+
+  for (absorbed = 0; absorbed < MAX_PACKETS; absorbed++) {
+    length = make_packet(absorbed, data);
+    if (!sim_ep2_burst(data, length))
+      break;
+  }
+
+  for (n = 0; n < absorbed; n++) {
+    for (retry = 0; retry < 4; retry++) {
+      sim_run();
+      length = sim_ep2_in(data);
+      if (length >= 0)
+        break;
+    }
+    if ((length != make_packet(n, expected)) || memcmp(data, expected, length))
+      return -1;
+  }
+  return absorbed;
+}
+
+int main(void) {
+  unsigned int c;
+  int result;
+  int status = 0;
+
+  for (c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    result = burst(configs[c].Flags);
+    if (result < 0) {
+      printf("%-12s loopback data mismatch\n", configs[c].Name);
+      status = 1;
+    } else {
+      printf("%-12s %3d packets absorbed\n", configs[c].Name, result);
+    }
+  }
+  return status;
+}
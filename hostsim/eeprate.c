@@ -0,0 +1,179 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Throughput of the I2C EEPROM engine
+ *
+ * Dumps and programs the whole 64 KiB EEPROM through EP2_MODE_EEPROM with
+ * the I2C bus at 100 and 400 kHz (see sim_i2c_clock()), including the
+ * internal write cycle of 5 ms per page. The host polls EP2 every 10 us.
+ * The throughput is printed in MB/s together with the limit of the bus:
+ * reads of 64 bytes per transaction and writes of EEPROM_PAGE_SIZE bytes
+ * per write cycle. The data read and written must be right.
+ *
+ * Usage: eeprate
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "eeprom.h"
+#include "delay.h"
+#include "commands.h"
+
+#define POLL_COUNTS   (10 * TIMER_COUNTS_PER_US)
+#define TIMEOUT       (60000UL * TIMER_COUNTS_PER_MS)
+
+static const uint16_t clocks_khz[] = { 100, 400 };
+
+static uint8_t image[SIM_EEPROM_SIZE];
+
+/**
+ * Issue a vendor request, the first response byte must be I2C_OK
+ */
+static void request(uint8_t command, uint16_t value, uint16_t index) {
+  uint8_t data[64];
+  int     length;
+
+  length = sim_vendor_in(command, value, index, data);
+  if ((length < 1) || (data[0] != I2C_OK)) {
+    printf("request 0x%02X failed: %d, 0x%02X\n", command, length, length > 0 ? data[0] : 0);
+    exit(1);
+  }
+}
+
+/**
+ * Return the state of the EEPROM operation
+ */
+static TEEPROMStatus status(void) {
+  uint8_t data[64];
+  TEEPROMStatus s;
+
+  sim_vendor_in(CMD_EEPROM_STATUS, 0, 0, data);
+  memcpy(&s, data, sizeof(s));
+  return s;
+}
+
+static void check_time(uint32_t start, const char* what) {
+  if (sim_time() - start > TIMEOUT) {
+    printf("%s: timeout\n", what);
+    exit(1);
+  }
+}
+
+/**
+ * Dump the EEPROM
+ *
+ * @return the simulated time in Timer 2 counts
+ */
+static uint32_t dump(void) {
+  uint8_t  data[64];
+  uint32_t got = 0;
+  uint32_t start;
+  int      length;
+
+  request(CMD_EEPROM_READ, 0, 0);
+  start = sim_time();
+  while (got < SIM_EEPROM_SIZE) {
+    while ((length = sim_ep2_in(data)) > 0) {
+      if ((got + length > SIM_EEPROM_SIZE) || memcmp(data, image + got, length)) {
+        printf("dump: wrong data at 0x%04X\n", got);
+        exit(1);
+      }
+      got += length;
+    }
+    sim_elapse(POLL_COUNTS);
+    sim_run();
+    check_time(start, "dump");
+  }
+  return sim_time() - start;
+}
+
+/**
+ * Program the EEPROM until EEPROMStatus reports the end of the operation
+ *
+ * @return the simulated time in Timer 2 counts
+ */
+static uint32_t program(void) {
+  uint32_t sent = 0;
+  uint32_t start;
+  TEEPROMStatus s;
+
+  request(CMD_EEPROM_WRITE, 0, 0);
+  start = sim_time();
+  while (true) {
+    while ((sent < SIM_EEPROM_SIZE) && sim_ep2_out(image + sent, 64))
+      sent += 64;
+    s = status();
+    if ((sent == SIM_EEPROM_SIZE) && !s.Busy)
+      break;
+    sim_elapse(POLL_COUNTS);
+    sim_run();
+    check_time(start, "program");
+  }
+  if (s.Status != I2C_OK) {
+    printf("program: status %u\n", s.Status);
+    exit(1);
+  }
+  return sim_time() - start;
+}
+
+static double rate(uint32_t counts) {
+  return SIM_EEPROM_SIZE / ((double)counts / (TIMER_COUNTS_PER_MS * 1000.0)) / 1e6;
+}
+
+int main(void) {
+  unsigned c;
+  unsigned i;
+  double   write_rate, write_limit;
+  double   read_rate, read_limit;
+
+  for (i = 0; i < SIM_EEPROM_SIZE; i++)
+    image[i] = i * 13 + (i >> 8) * 7;
+
+  printf("clock [kHz]  program [MB/s]  (limit)  dump [MB/s]  (limit)\n");
+  for (c = 0; c < sizeof(clocks_khz) / sizeof(clocks_khz[0]); c++) {
+    sim_reset();
+    sim_i2c_clock(clocks_khz[c]);
+    sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_EEPROM, EP2_FLAG_DOUBLE_BUFFER);
+
+    // program first, then dump what was written
+    write_rate = rate(program());
+    if (memcmp(sim_eeprom, image, SIM_EEPROM_SIZE)) {
+      printf("program: wrong EEPROM contents\n");
+      return 1;
+    }
+    read_rate = rate(dump());
+
+    // START, address, 2 address bytes, page, STOP, then the write cycle
+    write_limit = EEPROM_PAGE_SIZE /
+                  ((10 + 2 * 9 + EEPROM_PAGE_SIZE * 9 + 1) * 1e-3 / clocks_khz[c] + SIM_EEPROM_TWR * 1e-3) / 1e6;
+    // START, address, 2 address bytes, repeated START, address, 64 bytes, STOP
+    read_limit  = 64 / ((10 + 2 * 9 + 10 + 64 * 9 + 1) * 1e-3 / clocks_khz[c]) / 1e6;
+    printf("%11u  %14.4f  (%.4f)  %11.4f  (%.4f)\n", clocks_khz[c],
+           write_rate, write_limit, read_rate, read_limit);
+    if ((write_rate < 0.9 * write_limit) || (read_rate < 0.9 * read_limit)) {
+      printf("less than 90%% of the limit\n");
+      return 1;
+    }
+  }
+  return 0;
+}
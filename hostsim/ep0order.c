@@ -0,0 +1,121 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Ordering of the EP0 status stage and deferred vendor requests
+ *
+ * The host polls the status stage of every control transfer from the SETUP
+ * packet on (see sim_ep0_poll() in sim.c). The test checks that
+ *
+ *  - standard requests complete in sudav_isr(),
+ *  - vendor requests stay NAKed until the main loop has executed them,
+ *  - an I2C read is completed by its I2C callback with the EEPROM data,
+ *    while the main loop keeps running,
+ *  - a completion of a transfer aborted by a new SETUP packet is dropped,
+ *  - FlashErase with CMD_FLASH_ERASE_WAIT completes when the erase is done.
+ *
+ * Usage: ep0order
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "commands.h"
+#include "i2c.h"
+#include "eeprom.h"
+#include "spi.h"
+#include "flash.h"
+
+#define PIN_SCK                  SPI_PIN(SPI_PORT_A, 0)
+#define PIN_MOSI                 SPI_PIN(SPI_PORT_A, 1)
+#define PIN_CS                   SPI_PIN(SPI_PORT_A, 2)
+#define PIN_MISO                 SPI_PIN(SPI_PORT_B, 3)
+
+#define I2C_BYTES                16
+#define I2C_REG                  0x1234
+#define MAX_POLLS                100000
+
+
+int main(void) {
+  static const uint8_t get_status_std[8] = { 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00 };
+  uint8_t  s[8], data[64];
+  uint32_t start;
+  int      polls, i;
+  bool     ok;
+
+  sim_reset();
+  for (i = 0; i < I2C_BYTES; i++)
+    sim_eeprom[I2C_REG + i] = i * 7 + 1;
+
+  // standard request: handled in the ISR
+  sim_setup(get_status_std, NULL);
+  sim_check(!sim_ep0_pending() && sim_ep0_result(data) == 2, "standard request completes in ISR");
+
+  // vendor OUT request without data stage
+  sim_setup_packet(s, 0x40, CMD_SET_EP2_MODE, EP2_MODE_LOOPBACK, 0, 0);
+  sim_setup(s, NULL);
+  ok = sim_ep0_pending();
+  sim_run();
+  sim_check(ok && sim_ep0_result(data) == 0, "vendor OUT request waits for main loop");
+
+  // vendor IN request, completed from the I2C callback
+  sim_setup_packet(s, 0xC0, CMD_I2C_WRITE_READ, (I2C_BYTES << 8) | CMD_I2C_REG16 | EEPROM_I2C_ADDR, I2C_REG, 64);
+  sim_setup(s, NULL);
+  command_poll();
+  ok = sim_ep0_pending();
+  sim_run();
+  sim_check(ok && sim_ep0_result(data) == 1 + I2C_BYTES && data[0] == I2C_OK &&
+            !memcmp(data + 1, sim_eeprom + I2C_REG, I2C_BYTES),
+            "I2C read completes from callback");
+
+  // I2C read aborted by a GetStatus, whose response must not be replaced
+  sim_setup(s, NULL);
+  command_poll();
+  sim_setup_packet(s, 0xC0, CMD_GET_STATUS, 0, 0, 64);
+  sim_setup(s, NULL);
+  sim_run();
+  i = sim_ep0_result(data);
+  sim_check(i > 0 && i != 1 + I2C_BYTES, "aborted request completion dropped");
+  // the aborted transfer's buffer is free again
+  sim_check(sim_vendor_in(CMD_I2C_WRITE_READ, (I2C_BYTES << 8) | CMD_I2C_REG16 | EEPROM_I2C_ADDR,
+                          I2C_REG, data) == 1 + I2C_BYTES && data[0] == I2C_OK, "I2C read after abort");
+
+  // sector erase, the vendor request completes when the flash is idle
+  memset(sim_flash, 0, 4096);
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_FLASH, 0);
+  sim_vendor_in(CMD_SPI_CONFIG, (PIN_MOSI << 8) | PIN_SCK, (PIN_CS << 8) | PIN_MISO, data);
+  sim_flash_attach();
+  start = sim_spi_cycle();
+  sim_setup_packet(s, 0xC0, CMD_FLASH_ERASE, 0, CMD_FLASH_ERASE_WAIT, 64);
+  sim_setup(s, NULL);
+  for (polls = 0; sim_ep0_pending() && polls < MAX_POLLS; polls++)
+    sim_run();
+  sim_check(polls > 1 && sim_ep0_result(data) == 1 && data[0] == FLASH_OK &&
+            sim_flash[0] == 0xFF && sim_flash[4095] == 0xFF,
+            "erase completes when finished");
+  printf("  status stage NAKed for %d main loop iterations, %u cycles\n",
+         polls, sim_spi_cycle() - start);
+  // without CMD_FLASH_ERASE_WAIT the request completes at once
+  sim_check(sim_vendor_in(CMD_FLASH_ERASE, 0, 0, data) == 1 && data[0] == FLASH_OK,
+            "erase without wait completes at once");
+
+  sim_check(!sim_ep0_early() && !sim_flash_violations(), "no status stage before execution");
+  return sim_failures() ? 1 : 0;
+}
@@ -0,0 +1,134 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Control transfers with data stages of several packets
+ *
+ * OUT: CMD_I2C_WRITE writes a 24C512 page (2 address bytes and 128 data
+ * bytes, i.e. 3 packets) to the EEPROM model. Writes to a missing slave,
+ * data stages larger than USB_EP0_BUFFER_SIZE and writes while the I2C
+ * queue is full must stall EP0. A write aborted by the host must still
+ * send its own data, the next request is stalled meanwhile.
+ *
+ * IN: a test handler of EVENT_COMMAND responds with wValue bytes from
+ * usb_ep0_buffer. The host must receive at most wLength bytes, split into
+ * 64 byte packets, with a zero length packet after a full last packet if
+ * the response is shorter than wLength.
+ *
+ * Usage: ep0xfer
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "usb.h"
+#include "event.h"
+#include "commands.h"
+#include "i2c.h"
+#include "eeprom.h"
+#include "delay.h"
+
+#define PAGE_ADDR                0x0100
+#define PAGE_SIZE                128
+
+
+/**
+ * EVENT_COMMAND handler: respond with wValue bytes of a test pattern
+ */
+static void respond(void) {
+  uint8_t i;
+
+  for (i = 0; i < USB_EP0_BUFFER_SIZE; i++)
+    usb_ep0_buffer[i] = i ^ 0x5A;
+  usb_ep0_complete(usb_ep0_tag(), NULL, setup_data.wValue);
+}
+
+/**
+ * Request a response of @a length bytes with @a wlength
+ */
+static void in_transfer(uint8_t length, uint16_t wlength, int expected, unsigned packets) {
+  uint8_t data[SIM_EP0_MAX];
+  char    what[64];
+  int     result, i;
+  bool    ok;
+
+  result = sim_request(0xC0, 0x80, length, 0, wlength, data);
+  ok = (result == expected) && (sim_ep0_packets() == packets);
+  for (i = 0; ok && i < result; i++)
+    ok = (data[i] == (i ^ 0x5A));
+  snprintf(what, sizeof(what), "IN %3u bytes, wLength %3u", length, wlength);
+  sim_check(ok, what);
+}
+
+int main(void) {
+  uint8_t data[SIM_EP0_MAX];
+  int     i;
+
+  sim_reset();
+
+  // OUT: EEPROM page write
+  data[0] = PAGE_ADDR >> 8;
+  data[1] = PAGE_ADDR & 0xFF;
+  for (i = 0; i < PAGE_SIZE; i++)
+    data[2 + i] = i * 3 + 7;
+  sim_check(sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 2 + PAGE_SIZE, data) == 0 &&
+            sim_ep0_packets() == 3 &&
+            !memcmp(sim_eeprom + PAGE_ADDR, data + 2, PAGE_SIZE), "OUT 130 bytes to EEPROM");
+  sim_check(sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR + 1, 0, 2 + PAGE_SIZE, data) == SIM_STALL,
+            "OUT to missing slave stalls");
+  sim_check(sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, USB_EP0_BUFFER_SIZE + 1, data) == SIM_STALL &&
+            sim_ep0_packets() == 0, "OUT larger than buffer stalls");
+  // the bus is timed, so the queued writes stay pending
+  sim_i2c_clock(100);
+  for (i = 0; i2c_start_write(EEPROM_I2C_ADDR, 2, data) == I2C_OK; i++)
+    ;
+  sim_check(i == I2C_QUEUE_SIZE - 1 &&
+            sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 2 + PAGE_SIZE, data) == SIM_STALL,
+            "OUT with full I2C queue stalls");
+  sim_reset();
+  // the host gives up on a slow write and sends the next request
+  sim_i2c_clock(100);
+  for (i = 0; i < PAGE_SIZE; i++)
+    data[2 + i] = i * 5 + 1;
+  sim_check(sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 2 + PAGE_SIZE, data) == SIM_PENDING,
+            "OUT to slow I2C bus pending");
+  data[2] ^= 0xFF;
+  sim_check(sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 2 + PAGE_SIZE, data) == SIM_STALL,
+            "OUT while EP0 buffer in use stalls");
+  data[2] ^= 0xFF;
+  sim_elapse(30 * TIMER_COUNTS_PER_MS);
+  sim_run();
+  sim_check(!memcmp(sim_eeprom + PAGE_ADDR, data + 2, PAGE_SIZE) &&
+            sim_request(0xC0, CMD_GET_VERSION, 0, 0, 64, data) == sizeof(TGetVersion),
+            "aborted OUT writes its own data");
+  sim_reset();
+
+  // IN: packet splitting
+  event_register(EVENT_COMMAND, respond);
+  in_transfer(10,  64,  10,  1);
+  in_transfer(150, 192, 150, 3);
+  in_transfer(128, 192, 128, 3);   // 64 + 64 + zero length packet
+  in_transfer(128, 128, 128, 2);
+  in_transfer(150, 100, 100, 2);
+  in_transfer(0,   64,  0,   1);
+
+  sim_check(!sim_ep0_early(), "no status stage before execution");
+  return sim_failures() ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Event-to-handler latency of the main loop under mixed load
+ *
+ * Every round posts a random mix of EP2 OUT packets (loopback mode with the
+ * packet pool) and vendor requests (a short GetStatus or an I2C EEPROM
+ * read, which is completed later by its I2C callback) in random order,
+ * then lets the main loop run and reads the looped back packets. The
+ * handlers are wrapped via event_register() to measure the host time from
+ * posting to the start of the handler and the number of handlers which ran
+ * in between.
+ *
+ * The EP2 handlers must always run before a vendor request posted in the
+ * same round. Finally event_idle() must only idle without pending events.
+ *
+ * Usage: eventlat [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+#include "event.h"
+#include "commands.h"
+
+void HandleEP2Out(void);
+
+static const char* const event_names[EVENT_COUNT] = { "ep2_out", "ep2_in", "ibn", "command" };
+
+static const uint8_t get_status[8]     = { 0xC0, 0x82, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00 };
+static const uint8_t i2c_read_eeprom[8] = { 0xC0, 0x84, 0xD0, 0x10, 0x00, 0x00, 0x11, 0x00 };
+
+static double   posted[EVENT_COUNT];     // host time of the first unhandled post, 0 if none
+static unsigned posted_handlers[EVENT_COUNT];
+static double   worst[EVENT_COUNT];
+static double   total[EVENT_COUNT];
+static unsigned count[EVENT_COUNT];
+static unsigned worst_ahead[EVENT_COUNT];
+static unsigned handlers;
+static unsigned violations;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void post(uint8_t event) {
+  if (!posted[event]) {
+    posted[event]          = now();
+    posted_handlers[event] = handlers;
+  }
+}
+
+static void dispatched(uint8_t event) {
+  double   latency;
+  unsigned ahead;
+
+  if (posted[event]) {
+    latency = now() - posted[event];
+    ahead   = handlers - posted_handlers[event];
+    if (latency > worst[event])
+      worst[event] = latency;
+    if (ahead > worst_ahead[event])
+      worst_ahead[event] = ahead;
+    total[event] += latency;
+    count[event]++;
+    posted[event] = 0;
+  }
+  // EP2 data must not wait behind a vendor request
+  if (event == EVENT_COMMAND && posted[EVENT_EP2_OUT])
+    violations++;
+  handlers++;
+}
+
+static void on_ep2_out(void) {
+  dispatched(EVENT_EP2_OUT);
+  HandleEP2Out();
+}
+
+static void on_ep2_in(void) {
+  dispatched(EVENT_EP2_IN);
+  HandleEP2Out();
+}
+
+static void on_command(void) {
+  dispatched(EVENT_COMMAND);
+  HandleCmd();
+}
+
+int main(int argc, char** argv) {
+  unsigned long rounds = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000;
+  unsigned long r;
+  uint8_t  data[64];
+  int      packets, command, i;
+  unsigned idles;
+  int      status = 0;
+
+  srand(1);
+  sim_reset();
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_LOOPBACK, EP2_FLAG_POOL);
+  for (i = 0; i < 64; i++)
+    data[i] = i;
+  event_register(EVENT_EP2_OUT, on_ep2_out);
+  event_register(EVENT_EP2_IN,  on_ep2_in);
+  event_register(EVENT_COMMAND, on_command);
+
+  for (r = 0; r < rounds; r++) {
+    packets = rand() % 4;
+    // 0: none, 1: GetStatus, 2: I2C EEPROM read, posted before or after
+    // the packets
+    command = rand() % 3;
+    i       = rand() % (packets + 1);
+    for (; packets >= 0; packets--) {
+      if (command && packets == i) {
+        post(EVENT_COMMAND);
+        sim_setup(command == 1 ? get_status : i2c_read_eeprom, NULL);
+      }
+      if (packets) {
+        post(EVENT_EP2_OUT);
+        sim_ep2_burst(data, 64);
+      }
+    }
+    sim_run();
+    post(EVENT_EP2_IN);
+    while (sim_ep2_in(data) >= 0)
+      post(EVENT_EP2_IN);
+    posted[EVENT_EP2_IN] = 0;
+  }
+
+  for (i = 0; i < EVENT_COUNT; i++) {
+    printf("%-8s %8u events  worst %7.2f us  avg %5.2f us  worst %u handlers ahead\n",
+           event_names[i], count[i], worst[i] * 1e6,
+           count[i] ? total[i] * 1e6 / count[i] : 0.0, worst_ahead[i]);
+  }
+  if (violations) {
+    printf("%u vendor requests handled before EP2 data\n", violations);
+    status = 1;
+  }
+
+  // idle only without pending events
+  idles = sim_idles();
+  event_idle();
+  EVENT_POST(command);
+  event_idle();
+  if (sim_idles() != idles + 1 || !event_pending()) {
+    printf("event_idle() idled with a pending event\n");
+    status = 1;
+  }
+  return status;
+}
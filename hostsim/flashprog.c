@@ -0,0 +1,175 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file SPI flash programming test and throughput report
+ *
+ * The SPI master is connected to the flash model (see sim_flash.c). The
+ * test reads the JEDEC ID, erases 4 sectors, programs 16 KiB streamed on
+ * EP2 OUT and reads them back on EP2 IN. The programmed contents are
+ * compared with the sent data and the flash model must not report any
+ * protocol violations.
+ *
+ * The throughput is calculated from the instruction cycles of the SPI
+ * shift loops (see sim_spi_shift.c) at 6 cycles/us, i.e. it is the upper
+ * bound given by the SPI transfers and the write cycles of the flash. USB
+ * and the remaining firmware are not included.
+ *
+ * Usage: flashprog
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "commands.h"
+#include "spi.h"
+#include "flash.h"
+
+#define PIN_SCK                  SPI_PIN(SPI_PORT_A, 0)
+#define PIN_MOSI                 SPI_PIN(SPI_PORT_A, 1)
+#define PIN_CS                   SPI_PIN(SPI_PORT_A, 2)
+#define PIN_MISO                 SPI_PIN(SPI_PORT_B, 3)
+
+#define CYCLES_PER_SECOND        6000000.0
+#define SECTORS                  4
+#define BYTES                    (SECTORS * 4096)
+#define MAX_POLLS                100000
+
+static uint8_t data[BYTES];
+static uint8_t received[BYTES];
+
+/**
+ * Poll CMD_FLASH_STATUS until the operation is finished
+ *
+ * @return false on a timeout or if the operation failed
+ */
+static bool wait_idle(void) {
+  uint8_t response[64];
+  int     i;
+
+  for (i = 0; i < MAX_POLLS; i++) {
+    if (sim_vendor_in(CMD_FLASH_STATUS, 0, 0, response) < 2)
+      return false;
+    if (!response[0])
+      return response[1] == FLASH_OK;
+  }
+  return false;
+}
+
+static double kib_per_second(uint32_t cycles) {
+  return BYTES / 1024.0 / (cycles / CYCLES_PER_SECOND);
+}
+
+int main(void) {
+  static const uint8_t id[3] = { 0xEF, 0x40, 0x14 };
+  uint8_t  response[64];
+  uint32_t start, cycles;
+  int      sent, length, n, i;
+  int      polls;
+
+  for (i = 0; i < BYTES; i++)
+    data[i] = (uint8_t)(i * 13 + (i >> 8));
+  memset(sim_flash, 0, sizeof(sim_flash));
+
+  sim_reset();
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_FLASH, EP2_FLAG_POOL);
+  if (sim_vendor_in(CMD_SPI_CONFIG, (PIN_MOSI << 8) | PIN_SCK, (PIN_CS << 8) | PIN_MISO,
+                    response) != 1 || response[0] != SPI_OK) {
+    printf("SPI configuration failed\n");
+    return 1;
+  }
+  sim_flash_attach();
+
+  if (sim_vendor_in(CMD_FLASH_ID, 0, 0, response) != 4 || response[0] != FLASH_OK ||
+      memcmp(response + 1, id, 3)) {
+    printf("wrong JEDEC ID\n");
+    return 1;
+  }
+
+  // the erase is only advanced in EP2_MODE_FLASH
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_IDLE, 0);
+  if (sim_vendor_in(CMD_FLASH_ERASE, 0, 0, response) != 1 || response[0] != FLASH_BUSY) {
+    printf("erase accepted outside EP2_MODE_FLASH\n");
+    return 1;
+  }
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_FLASH, EP2_FLAG_POOL);
+
+  for (i = 0; i < SECTORS; i++) {
+    if (sim_vendor_in(CMD_FLASH_ERASE, i * 16, 0, response) != 1 || response[0] != FLASH_OK ||
+        !wait_idle()) {
+      printf("erasing sector %d failed\n", i);
+      return 1;
+    }
+  }
+
+  // program, packets which are NAKed are repeated after a status poll
+  start = sim_spi_cycle();
+  if (sim_vendor_in(CMD_FLASH_WRITE, 0, BYTES / 256, response) != 1 || response[0] != FLASH_OK) {
+    printf("write not started\n");
+    return 1;
+  }
+  for (sent = 0, polls = 0; sent < BYTES && polls < MAX_POLLS; ) {
+    if (sim_ep2_out(data + sent, 64)) {
+      sent += 64;
+    } else {
+      sim_vendor_in(CMD_FLASH_STATUS, 0, 0, response);
+      polls++;
+    }
+  }
+  if (sent < BYTES || !wait_idle()) {
+    printf("programming failed\n");
+    return 1;
+  }
+  cycles = sim_spi_cycle() - start;
+  // the byte after the erased sectors must not be touched
+  if (memcmp(sim_flash, data, BYTES) || sim_flash[BYTES] != 0) {
+    printf("flash contents differ\n");
+    return 1;
+  }
+  printf("program  %5d bytes  %8u cycles  %6.1f KiB/s\n", BYTES, cycles, kib_per_second(cycles));
+
+  // read back
+  start = sim_spi_cycle();
+  if (sim_vendor_in(CMD_FLASH_READ, 0, BYTES / 256, response) != 1 || response[0] != FLASH_OK) {
+    printf("read not started\n");
+    return 1;
+  }
+  for (length = 0, polls = 0; length < BYTES && polls < MAX_POLLS; ) {
+    n = sim_ep2_in(received + length);
+    if (n < 0) {
+      sim_vendor_in(CMD_FLASH_STATUS, 0, 0, response);
+      polls++;
+    } else {
+      length += n;
+    }
+  }
+  cycles = sim_spi_cycle() - start;
+  if (length != BYTES || memcmp(received, data, BYTES) || !wait_idle()) {
+    printf("read back failed\n");
+    return 1;
+  }
+  printf("read     %5d bytes  %8u cycles  %6.1f KiB/s\n", BYTES, cycles, kib_per_second(cycles));
+
+  if (sim_flash_violations()) {
+    printf("%u protocol violations\n", sim_flash_violations());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,150 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Fuzzer for the USB request parser and the command dispatcher
+ *
+ * Feeds random SETUP packets (biased towards valid request types and
+ * numbers) and random EP2 OUT packets to the simulated firmware and checks
+ * the responses. Build with hostsim/Makefile, which enables the address and
+ * undefined behaviour sanitizers, so out of bounds accesses abort.
+ *
+ * Usage: fuzz [iterations [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sim.h"
+#include "usb.h"
+
+static uint32_t rnd_state;
+
+/// xorshift32, reproducible for a given seed
+static uint32_t rnd(void) {
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 17;
+  rnd_state ^= rnd_state << 5;
+  return rnd_state;
+}
+
+/// values with a special meaning in SETUP packets
+static const uint16_t dictionary[] = {
+  0x0409,                                  // language ID English (US)
+  0x0100, 0x0200, 0x0300, 0x0400, 0x0500,  // descriptor types
+  0x0080, 0x0081, 0x0082, 0x0002,          // endpoint addresses
+};
+
+/// random 16 bit value, small and special values are more likely
+static uint16_t rnd_word(void) {
+  switch (rnd() & 7) {
+    case 0:  return rnd() & 0x0007;
+    case 1:  return rnd() & 0x00FF;
+    case 2:  return (rnd() & 0x00FF) << 8 | (rnd() & 0x0007);
+    case 3:  return dictionary[rnd() % (sizeof(dictionary) / sizeof(dictionary[0]))] + (rnd() & 7);
+    case 4:  return dictionary[rnd() % (sizeof(dictionary) / sizeof(dictionary[0]))];
+    default: return rnd();
+  }
+}
+
+static const uint8_t request_types[] = {
+  0x00, 0x01, 0x02, 0x80, 0x81, 0x82,   // standard
+  0x40, 0xC0,                           // vendor
+  0x20, 0xA0,                           // class
+};
+
+static void random_setup(uint8_t* setup) {
+  uint16_t w;
+  uint8_t  i;
+
+  if ((rnd() & 15) == 0) {
+    for (i = 0; i < 8; i++)
+      setup[i] = rnd();
+    return;
+  }
+  setup[0] = request_types[rnd() % sizeof(request_types)];
+  setup[1] = (setup[0] & 0x40) ? 0x80 + (rnd() & 0x0F) : (rnd() & 0x0F);
+  for (i = 2; i < 8; i += 2) {
+    w = rnd_word();
+    setup[i]   = w & 0xFF;
+    setup[i+1] = w >> 8;
+  }
+}
+
+static void fail(unsigned long iteration, const uint8_t* setup, const char* msg) {
+  fprintf(stderr, "iteration %lu: SETUP %02x %02x %02x %02x %02x %02x %02x %02x: %s\n",
+          iteration, setup[0], setup[1], setup[2], setup[3],
+          setup[4], setup[5], setup[6], setup[7], msg);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+  unsigned long i;
+  uint8_t setup[8];
+  uint8_t data[SIM_EP0_MAX];
+  uint8_t length;
+  int     result;
+  int     n;
+  clock_t start;
+  double  seconds;
+
+  rnd_state = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+  if (!rnd_state)
+    rnd_state = 1;
+
+  sim_reset();
+  start = clock();
+  for (i = 0; i < iterations; i++) {
+    random_setup(setup);
+    result = sim_control(setup, data);
+    if ((result > (setup[6] | setup[7] << 8)) || (result < SIM_PENDING))
+      fail(i, setup, "invalid EP0 response");
+    // standard requests answered without data are a host timeout, but
+    // requests passed to HandleCmd() must always complete
+    if ((result == SIM_PENDING) && (setup[1] > USB_REQ_SYNCH_FRAME))
+      fail(i, setup, "vendor request not completed");
+    if (sim_ep0_early())
+      fail(i, setup, "status stage before the request was executed");
+
+    // random EP2 OUT traffic for the command stream and loopback modes
+    if ((rnd() & 7) == 0) {
+      length = 1 + rnd() % 64;
+      for (n = 0; n < length; n++)
+        data[n] = rnd_word();
+      sim_ep2_out(data, length);
+    }
+    // the host reads a few EP2 IN packets
+    for (n = 0; n < 4; n++) {
+      result = sim_ep2_in(data);
+      if (result < 0)
+        break;
+      if (result > 64)
+        fail(i, setup, "invalid EP2 IN packet");
+    }
+
+    if ((rnd() & 1023) == 0)
+      sim_reset();
+  }
+  seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  printf("%lu iterations in %.2f s (%.0f requests/s)\n",
+         iterations, seconds, seconds > 0 ? iterations / seconds : 0.0);
+  return 0;
+}
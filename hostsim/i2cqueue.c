@@ -0,0 +1,156 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Queue-depth benchmark of the I2C transaction queue
+ *
+ * Reads EEPROM registers with combined write-then-read transactions at
+ * 400 kHz (see sim_i2c_clock()), keeping up to a given number of them in
+ * the queue, like a driver polling many sensor registers. Between two
+ * passes of the main loop, other work takes a fixed time. For every queue
+ * depth and pass time the time per transaction and the bus utilization are
+ * printed.
+ *
+ * The next transaction is started by the main loop when the STOP condition
+ * of the previous one is done, so with more than one queued transaction
+ * the bus is idle for at most one pass between them. The data read must
+ * match the EEPROM contents.
+ *
+ * Before, reads of 0 bytes must complete with I2C_OK without accessing the
+ * bus, and a write-then-read without bytes to read must be a plain write.
+ *
+ * Usage: i2cqueue
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "i2c.h"
+#include "eeprom.h"
+#include "delay.h"
+#include "commands.h"
+
+#define CLOCK_KHZ     400
+#define TRANSACTIONS  64
+#define READ_LENGTH   4
+
+static const unsigned pass_us[] = { 10, 200 };
+
+static uint8_t addr[TRANSACTIONS][2];
+static uint8_t data[TRANSACTIONS][READ_LENGTH];
+
+/**
+ * Check the transactions which read 0 bytes
+ */
+static void zero_length(void) {
+  uint8_t    reg[2] = { 0x12, 0x34 };
+  uint8_t*   buf = malloc(1);   // the sanitizer catches writes beyond it
+  I2C_Status status;
+  uint32_t   busy;
+
+  sim_reset();
+  sim_i2c_clock(CLOCK_KHZ);
+  status = i2c_read(EEPROM_I2C_ADDR, 0, buf);
+  if ((status != I2C_OK) || sim_i2c_busy()) {
+    printf("read of 0 bytes: status %u, %u bus counts\n", status, sim_i2c_busy());
+    exit(1);
+  }
+  status = i2c_write_read(EEPROM_I2C_ADDR, 0, NULL, 0, buf);
+  if ((status != I2C_OK) || sim_i2c_busy()) {
+    printf("write-then-read of 0 bytes: status %u, %u bus counts\n", status, sim_i2c_busy());
+    exit(1);
+  }
+  // START and address, 2 bytes and STOP
+  status = i2c_write_read(EEPROM_I2C_ADDR, 2, reg, 0, buf);
+  busy   = (10 + 2 * 9 + 1) * (TIMER_COUNTS_PER_MS / CLOCK_KHZ);
+  if ((status != I2C_OK) || (sim_i2c_busy() != busy)) {
+    printf("write-then-read of 0 bytes after 2: status %u, %u bus counts instead of %u\n",
+           status, sim_i2c_busy(), busy);
+    exit(1);
+  }
+  free(buf);
+}
+
+/**
+ * Execute all transactions with at most @a depth queued ones
+ *
+ * @return the simulated time in Timer 2 counts
+ */
+static uint32_t run(uint8_t depth, unsigned pass) {
+  unsigned submitted = 0;
+  unsigned i;
+  uint32_t start;
+
+  sim_reset();
+  for (i = 0; i < SIM_EEPROM_SIZE; i++)
+    sim_eeprom[i] = i * 7 + (i >> 8);
+  memset(data, 0, sizeof(data));
+  sim_i2c_clock(CLOCK_KHZ);
+
+  start = sim_time();
+  do {
+    while ((submitted < TRANSACTIONS) && (i2c_queue_depth() < depth)) {
+      addr[submitted][0] = 0x10;
+      addr[submitted][1] = submitted * READ_LENGTH;
+      if (i2c_start_write_read(EEPROM_I2C_ADDR, 2, addr[submitted],
+                               READ_LENGTH, data[submitted]) != I2C_OK) {
+        printf("depth %u: queue full\n", depth);
+        exit(1);
+      }
+      submitted++;
+    }
+    command_poll();
+    sim_elapse(pass * TIMER_COUNTS_PER_US);
+  } while ((submitted < TRANSACTIONS) || i2c_queue_depth());
+
+  for (i = 0; i < TRANSACTIONS; i++) {
+    if (memcmp(data[i], sim_eeprom + 0x1000 + i * READ_LENGTH, READ_LENGTH)) {
+      printf("depth %u: transaction %u read wrong data\n", depth, i);
+      exit(1);
+    }
+  }
+  return sim_time() - start;
+}
+
+int main(void) {
+  unsigned p;
+  uint8_t  depth;
+  uint32_t counts;
+  double   utilization;
+
+  zero_length();
+
+  printf("pass [us]  depth  us/transaction  bus utilization\n");
+  for (p = 0; p < sizeof(pass_us) / sizeof(pass_us[0]); p++) {
+    for (depth = 1; depth < I2C_QUEUE_SIZE; depth++) {
+      counts = run(depth, pass_us[p]);
+      utilization = 100.0 * sim_i2c_busy() / counts;
+      printf("%9u  %5u  %14.1f  %14.1f%%\n", pass_us[p], depth,
+             (double)counts / TIMER_COUNTS_PER_US / TRANSACTIONS, utilization);
+      if ((depth > 1) &&
+          (counts - sim_i2c_busy() > TRANSACTIONS * pass_us[p] * TIMER_COUNTS_PER_US)) {
+        printf("bus idle for more than one pass between transactions\n");
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,152 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Lazy production of EP2 IN packets with the IN-Bulk-NAK interrupt
+ *
+ * Every scenario selects EP2_MODE_STREAM, with or without EP2_FLAG_LAZY,
+ * and lets the host read PACKETS packets, one every POLL_COUNTS Timer 2
+ * counts. A NAKed IN token is retried after the main loop ran once. Eagerly
+ * the firmware keeps all IN buffers filled, so the data waits in the
+ * buffers and the packets produced ahead are wasted when the host stops
+ * reading. Lazily the host's NAK calls the producer, so exactly the packets
+ * read are produced and they are sent right away.
+ *
+ * Meanwhile the host polls the idle EP4 IN (UART bridge disabled) every
+ * time. Its NAK must be counted once and cause a single ibn_isr(), not one
+ * per IN token. EP2 IN may only cause one ibn_isr() per lazily produced
+ * packet.
+ *
+ * The packets produced, the average age of the packets read and the NAK
+ * counts of CMD_GET_NAKS are printed.
+ *
+ * Usage: ibnlazy
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "usb.h"
+#include "commands.h"
+#include "delay.h"
+
+#define PACKETS                  50
+#define POLL_COUNTS              TIMER_COUNTS_PER_MS
+
+typedef struct {
+  const char* Name;
+  uint8_t     Flags;         // EP2_FLAG_*
+  unsigned    Produced;      // expected packets produced
+  unsigned    Ep2Naks;       // expected NAK count of EP2 IN
+  uint32_t    MaxAge;        // max. average age in counts
+} TScenario;
+
+static const TScenario scenarios[] = {
+  { "eager",        0,                                      PACKETS + 1, 0,       POLL_COUNTS     },
+  { "eager-double", EP2_FLAG_DOUBLE_BUFFER,                 PACKETS + 2, 0,       2 * POLL_COUNTS },
+  { "lazy",         EP2_FLAG_LAZY,                          PACKETS,     PACKETS, 0               },
+  { "lazy-double",  EP2_FLAG_LAZY | EP2_FLAG_DOUBLE_BUFFER, PACKETS,     PACKETS, 0               },
+};
+
+/**
+ * Read the NAK counts of IN1 .. IN6 with CMD_GET_NAKS
+ *
+ * @return false if the request failed
+ */
+static bool get_naks(uint16_t* naks) {
+  uint8_t r[64];
+  int     i;
+
+  if (sim_request(0xC0, CMD_GET_NAKS, 0, 0, 2 * USB_IBN_COUNT, r) != 2 * USB_IBN_COUNT)
+    return false;
+  for (i = 0; i < USB_IBN_COUNT; i++)
+    naks[i] = r[2 * i] | (r[2 * i + 1] << 8);
+  return true;
+}
+
+/**
+ * Run scenario @a s
+ *
+ * @return true if the data, the production and the NAK counts match
+ */
+static bool run(const TScenario* s) {
+  uint8_t  packet[64];
+  uint8_t  pattern = 0;
+  uint16_t naks[USB_IBN_COUNT];
+  uint64_t age = 0;
+  unsigned produced;
+  unsigned i;
+  int      j;
+  int      n;
+
+  sim_reset();
+  if (sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_STREAM, s->Flags) != 0)
+    return false;
+  sim_run();
+
+  for (i = 0; i < PACKETS; i++) {
+    sim_elapse(POLL_COUNTS);
+    sim_run();
+    if (sim_uart_in(0, packet) >= 0)
+      return false;
+    n = sim_ep2_in(packet);
+    if (n < 0) {
+      // the host retries the IN token
+      sim_run();
+      n = sim_ep2_in(packet);
+    }
+    if (n != 64) {
+      printf("%-12s packet %u: no data\n", s->Name, i);
+      return false;
+    }
+    for (j = 0; j < 64; j++) {
+      if (packet[j] != pattern++) {
+        printf("%-12s packet %u: wrong data at byte %d\n", s->Name, i, j);
+        return false;
+      }
+    }
+    age += sim_stream_age();
+  }
+  // the host stops reading
+  sim_elapse(10 * POLL_COUNTS);
+  sim_run();
+  produced = sim_stream_commits();
+
+  if (!get_naks(naks))
+    return false;
+  printf("%-12s %3u packets produced for %u read, average age %5.0f us, NAKs: EP2 %2u, EP4 %u, %2u IBN interrupts\n",
+         s->Name, produced, PACKETS, (double)age / PACKETS / TIMER_COUNTS_PER_US, naks[1], naks[3],
+         sim_ibns());
+  return (produced == s->Produced) && (age <= (uint64_t)s->MaxAge * PACKETS) &&
+         (naks[1] == s->Ep2Naks) && (naks[3] == 1) && (sim_ibns() == s->Ep2Naks + 1);
+}
+
+int main(void) {
+  unsigned int i;
+  int          status = 0;
+
+  for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    if (!run(&scenarios[i])) {
+      printf("%-12s failed\n", scenarios[i].Name);
+      status = 1;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,62 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __HOSTSIM_COMPILER_H
+#define __HOSTSIM_COMPILER_H
+
+/**
+ * @file Host replacement of SDCC's <mcs51/compiler.h>
+ *
+ * Maps the SDCC language extensions to plain C and declares every special
+ * function register of reg_ezusb.h as ordinary variable. The variables are
+ * defined in sim.c, which includes reg_ezusb.h with SIM_DEFINE_REGISTERS.
+ * Therefore the register part is outside of the include guard.
+ *
+ * "__interrupt N" and "__at N" can't be removed by the preprocessor, these
+ * are stripped by hostsim/Makefile.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define __xdata
+#define __code
+#define __data
+#define __idata
+#define __pdata
+#define __bit         bool
+#define __naked
+#define __reentrant
+#define __critical
+#define __using(x)
+
+#endif  // __HOSTSIM_COMPILER_H
+
+#undef SFR
+#undef SFRX
+#undef SBIT
+#ifdef SIM_DEFINE_REGISTERS
+#define SFR(name, addr)         volatile uint8_t name
+#define SFRX(name, addr)        volatile uint8_t name
+#define SBIT(name, addr, bit)   volatile bool    name
+#else
+#define SFR(name, addr)         extern volatile uint8_t name
+#define SFRX(name, addr)        extern volatile uint8_t name
+#define SBIT(name, addr, bit)   extern volatile bool    name
+#endif
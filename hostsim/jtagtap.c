@@ -0,0 +1,368 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file JTAG batch test with a TAP model
+ *
+ * TCK, TDI and TMS are on Port A, TDO on Port B. The wiring model is a TAP
+ * controller with a 4 bit instruction register and the IDCODE, BYPASS and a
+ * 300 bit USER data register. It samples TMS and TDI at the rising edge of
+ * TCK and changes TDO at the falling edge, TMS and TDI must not change with
+ * the rising edge.
+ *
+ * Two EP2 OUT packets of JTAG records reset the TAP, read the IDCODE, write
+ * and read back the USER register with scans split into several records
+ * and check the BYPASS register. The TDO data, the number of TCK cycles and
+ * the final TAP state are checked. Finally the SPI master is configured on
+ * other pins of Port A, neither its configuration nor deselecting its slave
+ * may affect the JTAG pins.
+ *
+ * Usage: jtagtap
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "commands.h"
+#include "spi.h"
+#include "jtag.h"
+
+#define TCK                      0x01   // Port A
+#define TDI                      0x02   // Port A
+#define TMS                      0x04   // Port A
+#define TDO                      0x08   // Port B
+#define PIN_TCK                  SPI_PIN(SPI_PORT_A, 0)
+#define PIN_TDI                  SPI_PIN(SPI_PORT_A, 1)
+#define PIN_TMS                  SPI_PIN(SPI_PORT_A, 2)
+#define PIN_TDO                  SPI_PIN(SPI_PORT_B, 3)
+// SPI master on the other pins of Port A
+#define SPI_SCK                  0x10   // Port A
+#define SPI_CS                   0x40   // Port A
+#define PIN_SCK                  SPI_PIN(SPI_PORT_A, 4)
+#define PIN_MOSI                 SPI_PIN(SPI_PORT_A, 5)
+#define PIN_CS                   SPI_PIN(SPI_PORT_A, 6)
+#define PIN_MISO                 SPI_PIN(SPI_PORT_B, 7)
+
+// see include/reg_ezusb.h, not included as it defines RESET as well
+extern volatile uint8_t OUTA, PINSB;
+
+/***  TAP Model  *************************************************************/
+
+enum {
+  RESET, IDLE, SELECT_DR, CAPTURE_DR, SHIFT_DR, EXIT1_DR, PAUSE_DR, EXIT2_DR,
+  UPDATE_DR, SELECT_IR, CAPTURE_IR, SHIFT_IR, EXIT1_IR, PAUSE_IR, EXIT2_IR,
+  UPDATE_IR
+};
+
+/// next state for TMS = 0 and TMS = 1
+static const uint8_t tap_next[16][2] = {
+  { IDLE,       RESET     }, { IDLE,       SELECT_DR },
+  { CAPTURE_DR, SELECT_IR }, { SHIFT_DR,   EXIT1_DR  },
+  { SHIFT_DR,   EXIT1_DR  }, { PAUSE_DR,   UPDATE_DR },
+  { PAUSE_DR,   EXIT2_DR  }, { SHIFT_DR,   UPDATE_DR },
+  { IDLE,       SELECT_DR }, { CAPTURE_IR, RESET     },
+  { SHIFT_IR,   EXIT1_IR  }, { SHIFT_IR,   EXIT1_IR  },
+  { PAUSE_IR,   UPDATE_IR }, { PAUSE_IR,   EXIT2_IR  },
+  { SHIFT_IR,   UPDATE_IR }, { IDLE,       SELECT_DR },
+};
+
+#define IR_BITS        4
+#define IR_IDCODE      0x1
+#define IR_USER        0x2
+#define IR_BYPASS      0xF
+#define IDCODE         0x1234A0EDu
+#define USER_BITS      300
+
+static uint8_t  tap_state;
+static uint8_t  tap_ir;
+static uint8_t  tap_shift[USER_BITS];     // one bit per byte, [0] is next at TDO
+static int      tap_length;
+static uint8_t  tap_user[USER_BITS];
+static unsigned tap_clocks;
+static bool     tap_error;
+static uint8_t  last_outa;
+
+static void tap_capture_dr(void) {
+  int i;
+
+  switch (tap_ir) {
+    case IR_IDCODE:
+      tap_length = 32;
+      for (i = 0; i < 32; i++)
+        tap_shift[i] = (IDCODE >> i) & 1;
+      break;
+    case IR_USER:
+      tap_length = USER_BITS;
+      memcpy(tap_shift, tap_user, USER_BITS);
+      break;
+    default:
+      tap_length   = 1;
+      tap_shift[0] = 0;
+      break;
+  }
+}
+
+static void tap_shift_in(bool tdi) {
+  memmove(tap_shift, tap_shift + 1, tap_length - 1);
+  tap_shift[tap_length - 1] = tdi;
+}
+
+/**
+ * Rising edge of TCK
+ */
+static void tap_rising(bool tms, bool tdi) {
+  int i;
+
+  tap_clocks++;
+  switch (tap_state) {
+    case RESET:
+      tap_ir = IR_IDCODE;
+      break;
+    case CAPTURE_DR:
+      tap_capture_dr();
+      break;
+    case CAPTURE_IR:
+      tap_length = IR_BITS;
+      memset(tap_shift, 0, IR_BITS);
+      tap_shift[0] = 1;
+      break;
+    case SHIFT_DR:
+    case SHIFT_IR:
+      tap_shift_in(tdi);
+      break;
+    case UPDATE_DR:
+      if (tap_ir == IR_USER)
+        memcpy(tap_user, tap_shift, USER_BITS);
+      break;
+    case UPDATE_IR:
+      tap_ir = 0;
+      for (i = 0; i < IR_BITS; i++)
+        tap_ir |= tap_shift[i] << i;
+      break;
+  }
+  tap_state = tap_next[tap_state][tms];
+}
+
+/**
+ * TAP, called after every write of OUTA
+ */
+static void wiring(void) {
+  uint8_t changed = OUTA ^ last_outa;
+
+  if (changed & TCK) {
+    if (OUTA & TCK) {
+      // TMS and TDI must be stable at the rising edge
+      if (changed & (TMS | TDI))
+        tap_error = true;
+      tap_rising((OUTA & TMS) != 0, (OUTA & TDI) != 0);
+    } else if ((tap_state == SHIFT_DR) || (tap_state == SHIFT_IR)) {
+      PINSB = tap_shift[0] ? TDO : 0;
+    } else {
+      PINSB = 0;
+    }
+  }
+  last_outa = OUTA;
+}
+
+/***  Records  ***************************************************************/
+
+static uint8_t  packet[64];
+static int      packet_length;
+static unsigned expected_clocks;
+
+static void put_tms(uint8_t tms, uint8_t count) {
+  packet[packet_length++] = JTAG_TMS;
+  packet[packet_length++] = count;
+  packet[packet_length++] = tms;
+  expected_clocks += count;
+}
+
+static void put_clock(uint16_t count) {
+  packet[packet_length++] = JTAG_CLOCK;
+  packet[packet_length++] = count & 0xFF;
+  packet[packet_length++] = count >> 8;
+  expected_clocks += count;
+}
+
+/**
+ * Append a scan, @a tdi is NULL for JTAG_SCAN_OUT not set
+ */
+static void put_scan(uint8_t flags, uint16_t bits, uint8_t start, uint8_t start_count,
+                     uint8_t end, uint8_t end_count, const uint8_t* tdi) {
+  packet[packet_length++] = JTAG_SCAN | flags | (tdi ? JTAG_SCAN_OUT : 0);
+  packet[packet_length++] = bits & 0xFF;
+  packet[packet_length++] = bits >> 8;
+  packet[packet_length++] = start;
+  packet[packet_length++] = end;
+  packet[packet_length++] = (start_count << 4) | end_count;
+  if (tdi) {
+    memcpy(packet + packet_length, tdi, (bits + 7) / 8);
+    packet_length += (bits + 7) / 8;
+  }
+  // the first bit of end is clocked with the last data bit
+  expected_clocks += start_count + bits + (end_count ? end_count - 1 : 0);
+}
+
+/**
+ * Send the packet and append the TDO data to @a tdo
+ */
+static bool send(uint8_t* tdo, int* length) {
+  int n;
+
+  if (!sim_ep2_out(packet, packet_length))
+    return false;
+  packet_length = 0;
+  while ((n = sim_ep2_in(tdo + *length)) >= 0)
+    *length += n;
+  return true;
+}
+
+/**
+ * Pack the bits of tap_user into bytes, LSB first
+ */
+static void user_bytes(uint8_t* dst) {
+  int i;
+
+  memset(dst, 0, (USER_BITS + 7) / 8);
+  for (i = 0; i < USER_BITS; i++)
+    dst[i / 8] |= tap_user[i] << (i % 8);
+}
+
+// TMS sequences (LSB first) between Run-Test/Idle and the shift states
+#define TO_SHIFT_DR    0x01, 3        // 1, 0, 0
+#define TO_SHIFT_IR    0x03, 4        // 1, 1, 0, 0
+#define TO_IDLE        0x03, 3        // 1 (Exit1), 1 (Update), 0
+#define STAY           0x00, 0
+
+int main(void) {
+  static uint8_t user_old[(USER_BITS + 7) / 8];
+  static uint8_t user_new[(USER_BITS + 7) / 8];
+  static uint8_t tdo[256];
+  uint8_t        response[64];
+  uint8_t        ir;
+  uint8_t        bypass = 0xA5;
+  int            length = 0;
+  int            status = 0;
+  int            i;
+
+  sim_reset();
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_JTAG, 0);
+  if (sim_vendor_in(CMD_JTAG_CONFIG, (PIN_TMS << 8) | PIN_TCK, (PIN_TDO << 8) | PIN_TDI,
+                    response) != 1 || response[0] != JTAG_OK) {
+    printf("JTAG configuration failed\n");
+    return 1;
+  }
+  if (OUTA & (TCK | TMS | TDI)) {
+    printf("wrong idle levels\n");
+    return 1;
+  }
+  for (i = 0; i < USER_BITS; i++) {
+    tap_user[i] = (i * 7 / 3) & 1;
+    user_new[i / 8] |= ((i * 5 / 2 + 1) & 1) << (i % 8);
+  }
+  user_bytes(user_old);
+  tap_state = IDLE;
+  last_outa = OUTA;
+  sim_spi_wiring(wiring);
+
+  // packet 1: reset, IDCODE, select USER, write the first 200 bits
+  ir = IR_USER;
+  put_tms(0x1F, 6);                                     // Test-Logic-Reset, Idle
+  put_scan(JTAG_SCAN_IN, 32, TO_SHIFT_DR, TO_IDLE, NULL);
+  put_scan(JTAG_SCAN_IN, IR_BITS, TO_SHIFT_IR, TO_IDLE, &ir);
+  put_clock(10);
+  put_scan(JTAG_SCAN_IN, 200, TO_SHIFT_DR, STAY, user_new);
+  if (!send(tdo, &length))
+    return 1;
+  // packet 2: remaining 100 bits, read back, select and check BYPASS
+  put_scan(JTAG_SCAN_IN, 100, STAY, TO_IDLE, user_new + 25);
+  put_scan(JTAG_SCAN_IN, 200, TO_SHIFT_DR, STAY, NULL);
+  put_scan(JTAG_SCAN_IN, 100, STAY, TO_IDLE, NULL);
+  ir = IR_BYPASS;
+  put_scan(0, IR_BITS, TO_SHIFT_IR, TO_IDLE, &ir);
+  put_scan(JTAG_SCAN_IN, 8, TO_SHIFT_DR, TO_IDLE, &bypass);
+  if (!send(tdo, &length))
+    return 1;
+
+  if (length != 4 + 1 + 25 + 13 + 25 + 13 + 1) {
+    printf("%d TDO bytes received\n", length);
+    return 1;
+  }
+  if (tdo[0] != 0xED || tdo[1] != 0xA0 || tdo[2] != 0x34 || tdo[3] != 0x12) {
+    printf("wrong IDCODE %02x%02x%02x%02x\n", tdo[3], tdo[2], tdo[1], tdo[0]);
+    status = 1;
+  }
+  if (tdo[4] != 0x01) {
+    printf("wrong IR capture value %02x\n", tdo[4]);
+    status = 1;
+  }
+  // the first 200 bits end at a byte boundary, the last byte of the 100
+  // bits has 4 unused bits
+  if (memcmp(tdo + 5, user_old, 25) || memcmp(tdo + 30, user_old + 25, 13) ||
+      memcmp(tdo + 43, user_new, 25) || memcmp(tdo + 68, user_new + 25, 13)) {
+    printf("wrong USER register\n");
+    status = 1;
+  }
+  if (tdo[81] != (uint8_t)(bypass << 1)) {
+    printf("wrong BYPASS data %02x\n", tdo[81]);
+    status = 1;
+  }
+  if (tap_error || tap_state != IDLE || tap_clocks != expected_clocks) {
+    printf("TAP error, state %u, %u of %u TCK cycles\n", tap_state, tap_clocks, expected_clocks);
+    status = 1;
+  }
+  if (!status)
+    printf("%u TCK cycles, %d TDO bytes ok\n", tap_clocks, length);
+
+  // the SPI master keeps its own pins
+  if (sim_vendor_in(CMD_SPI_CONFIG, (PIN_MOSI << 8) | PIN_SCK, (PIN_CS << 8) | PIN_MISO,
+                    response) != 1 || response[0] != SPI_OK) {
+    printf("SPI configuration failed\n");
+    return 1;
+  }
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_JTAG, 0);
+  if ((OUTA & (TCK | TMS | TDI)) || !(OUTA & SPI_CS)) {
+    printf("JTAG pins changed by the SPI master\n");
+    status = 1;
+  }
+  length = 0;
+  user_new[0] = 0xA5;
+  user_new[1] = 0x3C;
+  put_scan(JTAG_SCAN_IN, 16, TO_SHIFT_DR, TO_IDLE, user_new);
+  if (!send(tdo, &length))
+    return 1;
+  if (length != 2 || tdo[0] != 0x4A || tdo[1] != 0x79 || tap_error || tap_state != IDLE ||
+      tap_clocks != expected_clocks) {
+    printf("wrong BYPASS data after CMD_SPI_CONFIG\n");
+    status = 1;
+  }
+  if (spi_sck_mask != SPI_SCK || !(OUTA & SPI_CS)) {
+    printf("SPI configuration changed by a scan\n");
+    status = 1;
+  }
+
+  // TMS on another port than TCK
+  if (sim_vendor_in(CMD_JTAG_CONFIG, (0x0A << 8) | PIN_TCK, (PIN_TDO << 8) | PIN_TDI, response) != 1 ||
+      response[0] != JTAG_INVALID) {
+    printf("invalid pins accepted\n");
+    status = 1;
+  }
+  return status;
+}
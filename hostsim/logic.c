@@ -0,0 +1,156 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Logic analyzer test with a scripted pin waveform
+ *
+ * Port A counts up every COUNTER_CYCLES instruction cycles, Port B bit 0
+ * rises at EDGE_CYCLE and Port C is constant. Every scenario arms a capture
+ * in EP2_MODE_CAPTURE, runs the main loop until all samples were received
+ * on EP2 IN and checks them against the waveform: the trigger condition
+ * holds for the first sample, Port C is constant and the sample rate
+ * derived from the Port A counter matches the sampling loop.
+ *
+ * Usage: logic
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "commands.h"
+#include "capture.h"
+
+#define CYCLES_PER_SECOND        6000000
+#define COUNTER_CYCLES           64
+#define EDGE_CYCLE               100000
+#define PORT_C                   0x5A
+
+#define MAX_BYTES                512
+#define MAX_POLLS                1000
+
+typedef struct {
+  const char* Name;
+  uint8_t     Config;
+  uint8_t     Divider;
+  uint8_t     TriggerMask;
+  uint8_t     TriggerValue;
+  uint16_t    Period;        // expected cycles per sample
+  uint16_t    Samples;       // expected samples (shortened to 1 ms)
+} TScenario;
+
+static const TScenario scenarios[] = {
+  { "8_pins",            CAPTURE_PORT_A,                 0, 0x00, 0x00,   7, 512 },
+  { "8_pins_divider_4",  CAPTURE_PORT_A,                 4, 0x00, 0x00,  21, 284 },
+  { "8_pins_divider_40", CAPTURE_PORT_A,                40, 0x00, 0x00, 129,  44 },
+  { "8_pins_trigger",    CAPTURE_PORT_B,                 0, 0x01, 0x01,   7, 512 },
+  { "24_pins",           CAPTURE_WIDE,                   0, 0x00, 0x00,  19, 168 },
+  { "24_pins_trigger",   CAPTURE_WIDE | CAPTURE_PORT_B,  1, 0x01, 0x01,  24, 168 },
+};
+
+static uint32_t waveform(uint32_t cycle) {
+  uint32_t a = (cycle / COUNTER_CYCLES) & 0xFF;
+  uint32_t b = cycle >= EDGE_CYCLE;
+
+  return a | (b << 8) | ((uint32_t)PORT_C << 16);
+}
+
+/**
+ * Capture and receive the samples of @a s
+ *
+ * @return number of bytes in @a data or -1 on error
+ */
+static int capture(const TScenario* s, uint8_t* data) {
+  uint8_t response[64];
+  int     length = 0;
+  int     n;
+  int     polls;
+
+  sim_reset();
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_CAPTURE, EP2_FLAG_DOUBLE_BUFFER);
+  sim_capture_waveform(waveform);
+
+  if ((sim_vendor_in(CMD_CAPTURE, (s->Config << 8) | s->Divider,
+                     (s->TriggerValue << 8) | s->TriggerMask, response) != 1) ||
+      (response[0] != CAPTURE_OK))
+    return -1;
+
+  for (polls = 0; polls < MAX_POLLS; polls++) {
+    while ((n = sim_ep2_in(data + length)) >= 0) {
+      length += n;
+      if (length > MAX_BYTES - 64)
+        return length;
+    }
+    sim_run();
+  }
+  return length;
+}
+
+/**
+ * Check the samples of @a s and print the sample rate
+ *
+ * @return true if the samples match the waveform
+ */
+static bool check(const TScenario* s, const uint8_t* data, int length) {
+  int      width   = (s->Config & CAPTURE_WIDE) ? 3 : 1;
+  int      samples = length / width;
+  int      port    = (s->Config & CAPTURE_WIDE) ? CAPTURE_PORT_A : (s->Config & 3);
+  int      trigger = (s->Config & 3) - port;    // byte of the trigger port
+  uint32_t counts;
+  int      i;
+
+  if (samples != s->Samples)
+    return false;
+  if ((samples - 1) * s->Period > CAPTURE_MAX_CYCLES)
+    return false;
+  if ((data[trigger] & s->TriggerMask) != s->TriggerValue)
+    return false;
+  for (i = 0; i < samples; i++) {
+    if ((width == 3) && (data[3 * i + 2] != PORT_C))
+      return false;
+  }
+  if (port != CAPTURE_PORT_A) {
+    printf("%-18s %4d samples, triggered\n", s->Name, samples);
+    return true;
+  }
+  // the Port A counter advanced by counts * COUNTER_CYCLES cycles
+  counts = (uint8_t)(data[width * (samples - 1)] - data[0]);
+  if (counts * COUNTER_CYCLES / (samples - 1) + 1 < s->Period ||
+      counts * COUNTER_CYCLES / (samples - 1) > s->Period + 1)
+    return false;
+  printf("%-18s %4d samples, %6.0f samples/s\n", s->Name, samples,
+         (double)CYCLES_PER_SECOND * (samples - 1) / (counts * COUNTER_CYCLES));
+  return true;
+}
+
+int main(void) {
+  uint8_t  data[MAX_BYTES];
+  unsigned int i;
+  int      length;
+  int      status = 0;
+
+  for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    length = capture(&scenarios[i], data);
+    if ((length < 0) || !check(&scenarios[i], data, length)) {
+      printf("%-18s failed (%d bytes)\n", scenarios[i].Name, length);
+      status = 1;
+    }
+  }
+  return status;
+}
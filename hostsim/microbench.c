@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Microbenchmark of the USB request parser and the command dispatcher
+ *
+ * Executes every request of a fixed set many times in the simulated
+ * firmware and prints the host time per request. This measures the
+ * algorithmic cost on the host, for cycle counts on the 8051 see
+ * "make bench".
+ *
+ * Usage: microbench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sim.h"
+#include "commands.h"
+
+typedef struct {
+  const char* Name;
+  uint8_t     Setup[8];
+} TRequest;
+
+static const TRequest requests[] = {
+  { "get_descriptor_device", { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 } },
+  { "get_descriptor_string", { 0x80, 0x06, 0x02, 0x03, 0x09, 0x04, 0xFF, 0x00 } },
+  { "get_status_endpoint",   { 0x82, 0x00, 0x00, 0x00, 0x82, 0x00, 0x02, 0x00 } },
+  { "set_configuration",     { 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+  { "get_version",           { 0xC0, 0x80, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00 } },
+  { "get_version_string",    { 0xC0, 0x81, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00 } },
+  { "get_status",            { 0xC0, 0x82, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00 } },
+  { "i2c_write_read_eeprom", { 0xC0, 0x84, 0xD0, 0x04, 0x00, 0x00, 0x05, 0x00 } },
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* name, unsigned long iterations, double seconds) {
+  printf("%-24s %10.1f ns/request\n", name, seconds * 1e9 / iterations);
+}
+
+int main(int argc, char** argv) {
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+  unsigned long i;
+  unsigned int  r;
+  uint8_t data[64];
+  uint8_t records[64];
+  double  start;
+
+  sim_reset();
+  for (r = 0; r < sizeof(requests) / sizeof(requests[0]); r++) {
+    start = now();
+    for (i = 0; i < iterations; i++)
+      sim_control(requests[r].Setup, data);
+    report(requests[r].Name, iterations, now() - start);
+  }
+
+  // 10 GetVersion records (TCmdStreamRecord) per EP2 OUT packet
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_CMDSTREAM, 0);
+  for (r = 0; r < 10; r++) {
+    records[6*r+0] = CMD_GET_VERSION;
+    records[6*r+1] = 0;
+    records[6*r+2] = records[6*r+3] = records[6*r+4] = records[6*r+5] = 0;
+  }
+  start = now();
+  for (i = 0; i < iterations; i++) {
+    sim_ep2_out(records, 60);
+    while (sim_ep2_in(data) >= 0) ;
+  }
+  report("cmdstream_10_records", iterations, now() - start);
+  return 0;
+}
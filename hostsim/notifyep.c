@@ -0,0 +1,183 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Event records on the EP1 IN interrupt endpoint
+ *
+ * The host reads EP1 IN instead of polling CMD_GET_STATUS (see notify.h).
+ * The test checks that
+ *
+ *  - nothing is sent while the sources are disabled,
+ *  - a pin edge, an I2C write and a UART overrun are reported with the
+ *    next main loop iteration, a burst of overruns coalesced,
+ *  - the timer records come every period,
+ *  - records queue up while the host doesn't read EP1 IN, the ones which
+ *    don't fit are reported by NOTIFY_LOST,
+ *  - an idle EP1 IN costs no interrupts but the first IBN.
+ *
+ * Usage: notifyep
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "commands.h"
+#include "notify.h"
+#include "uart.h"
+#include "i2c.h"
+#include "eeprom.h"
+#include "delay.h"
+
+#define STEP_COUNTS              300       // 50 us
+#define PERIOD_MS                5
+#define TIMER_MS                 50
+#define BURST_EDGES              (NOTIFY_RING_SIZE + 4)
+
+
+/**
+ * Select the sources with CMD_NOTIFY_CONFIG
+ */
+static bool config(uint8_t sources, uint16_t period) {
+  uint8_t r[64];
+
+  return (sim_request(0xC0, CMD_NOTIFY_CONFIG, sources, period, 1, r) == 1) && (r[0] == NOTIFY_OK);
+}
+
+/**
+ * Read one EP1 IN packet
+ *
+ * @return number of records or -1 on NAK
+ */
+static int records(uint8_t* r) {
+  int n = sim_ep1_in(r);
+
+  return (n < 0) ? n : n / 4;
+}
+
+static uint16_t record_time(const uint8_t* r, int i) {
+  return r[4 * i + 2] | (r[4 * i + 3] << 8);
+}
+
+int main(void) {
+  uint8_t  data[130], r[64];
+  unsigned ibns;
+  uint16_t time = 0;
+  int      i, n, count;
+  bool     ok;
+
+  // disabled: the pins aren't connected, no records
+  sim_reset();
+  ok = !sim_int_edge(0);
+  sim_run();
+  sim_check(ok && records(r) < 0, "no records while disabled");
+
+  // pin edges
+  ok = config(NOTIFY_ALL, 0) && sim_int_edge(1);
+  sim_run();
+  n = records(r);
+  sim_check(ok && n == 1 && r[0] == NOTIFY_PIN && r[1] == 0x02, "INT1# edge reported");
+  sim_int_edge(0);
+  sim_int_edge(1);
+  sim_run();
+  n = records(r);
+  sim_check(n == 1 && r[0] == NOTIFY_PIN && r[1] == 0x03, "INT0# and INT1# edges coalesced");
+
+  // an idle endpoint: one IBN, then no further interrupts
+  ibns = sim_ibns();
+  for (i = 0; i < 100; i++) {
+    sim_elapse(TIMER_COUNTS_PER_MS);
+    sim_run();
+    records(r);
+  }
+  sim_check(sim_ibns() - ibns == 1, "idle EP1 IN costs one IBN interrupt");
+
+  // I2C writes, completed by the main loop
+  data[0] = 0x01;
+  data[1] = 0x00;
+  for (i = 2; i < 10; i++)
+    data[i] = i;
+  ok = sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 10, data) == 0;
+  n = records(r);
+  sim_check(ok && n == 1 && r[0] == NOTIFY_I2C && r[1] == I2C_OK, "I2C write reported");
+  ok = sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR + 1, 0, 10, data) == SIM_STALL;
+  n = records(r);
+  sim_check(ok && n == 1 && r[0] == NOTIFY_I2C && r[1] != I2C_OK, "failed I2C write reported");
+
+  // UART overruns: loopback of 192 bytes without reading EP4 IN, the RX
+  // ring and the IN buffer only hold 128 of them. The main loop runs every
+  // 50 us, the host reads EP1 IN every ms.
+  ok = (sim_request(0xC0, CMD_UART_CONFIG, 3, UART_ENABLE | UART_DOUBLE, 1, r) == 1) && (r[0] == UART_OK);
+  memset(data, 0x55, 64);
+  count = 0;
+  for (i = 0; i < 400; i++) {
+    if ((i < 3) && !sim_uart_out(0, data, 64))
+      i--;
+    sim_run();
+    sim_elapse(STEP_COUNTS);
+    if (i % (TIMER_COUNTS_PER_MS / STEP_COUNTS))
+      continue;
+    n = records(r);
+    while (n-- > 0)
+      if ((r[4 * n] == NOTIFY_OVERRUN) && (r[4 * n + 1] == 0))
+        count++;
+  }
+  ok = ok && (sim_request(0xC0, CMD_UART_STATUS, 0, 0, 4, r) == 4);
+  printf("  %u bytes overrun, %d records\n", r[2] | (r[3] << 8), count);
+  sim_check(ok && (r[2] | (r[3] << 8)) > 1 && count >= 1 && count < (r[2] | (r[3] << 8)),
+            "UART overruns reported, coalesced");
+  sim_request(0xC0, CMD_UART_CONFIG, 3, 0, 1, r);
+  records(r);
+
+  // timer records every PERIOD_MS, the host reads EP1 IN every ms
+  records(r);
+  ok = config(1 << NOTIFY_TIMER, PERIOD_MS);
+  count = 0;
+  for (i = 0; i < TIMER_MS; i++) {
+    sim_elapse(TIMER_COUNTS_PER_MS);
+    sim_run();
+    n = records(r);
+    if (n < 0)
+      continue;
+    if ((n != 1) || (r[0] != NOTIFY_TIMER) || (r[1] != 1) ||
+        (count && (uint16_t)(record_time(r, 0) - time) != PERIOD_MS))
+      ok = false;
+    time = record_time(r, 0);
+    count++;
+  }
+  // the first one comes after PERIOD_MS + 1 ms (see deadline_set())
+  sim_check(ok && count == (TIMER_MS - 1) / PERIOD_MS, "timer records every period");
+
+  // the host doesn't read: one record in flight, a full ring, the rest lost
+  ok = config(1 << NOTIFY_PIN, 0);
+  for (i = 0; i < BURST_EDGES; i++) {
+    sim_int_edge(0);
+    sim_run();
+  }
+  n = records(r);
+  sim_run();
+  ok = ok && (n == 1) && (records(r) == NOTIFY_RING_SIZE);
+  sim_int_edge(0);
+  sim_run();
+  n = records(r);
+  sim_check(ok && n == 2 && r[0] == NOTIFY_LOST && r[1] == BURST_EDGES - 1 - NOTIFY_RING_SIZE &&
+            r[4] == NOTIFY_PIN, "lost records reported");
+
+  return sim_failures() ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Pattern generator test
+ *
+ * Every scenario starts the pattern generator in EP2_MODE_PATTERN with the
+ * packet pool, sends PACKETS packets on EP2 OUT and lets Timer 0 overflow
+ * a fixed number of times after every packet. After every overflow OUTA and
+ * OUTB must either show the next sample or keep the previous one, which is
+ * counted as underrun. At the end the counts are compared with
+ * CMD_PATTERN_STATUS, then DRAIN_TICKS overflows without data must be
+ * reported as underruns.
+ *
+ * Usage: patgen
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "reg_ezusb.h"
+#include "commands.h"
+#include "pattern.h"
+
+#define PACKETS                  16
+#define DRAIN_TICKS              10
+#define MAX_ROUNDS               1000
+
+typedef struct {
+  const char* Name;
+  uint8_t     Config;
+  uint8_t     Prefill;
+  uint16_t    Ticks;         // Timer 0 overflows per packet
+  bool        Underruns;     // underruns expected while streaming
+} TScenario;
+
+static const TScenario scenarios[] = {
+  { "port_a",    PATTERN_PORT_A,                  128, 32, false },
+  { "ports_ab",  PATTERN_PORT_A | PATTERN_PORT_B, 128, 16, false },
+  { "underrun",  PATTERN_PORT_A,                    0, 96, true  },
+};
+
+typedef struct {
+  bool     Running;
+  uint8_t  Level;
+  uint16_t Underruns;
+  uint32_t Samples;
+} TStatus;
+
+/**
+ * Read TPatternStatus with CMD_PATTERN_STATUS
+ */
+static bool status(TStatus* s) {
+  uint8_t r[64];
+
+  if (sim_vendor_in(CMD_PATTERN_STATUS, 0, 0, r) != 8)
+    return false;
+  s->Running   = r[0];
+  s->Level     = r[1];
+  s->Underruns = r[2] | (r[3] << 8);
+  s->Samples   = r[4] | (r[5] << 8) | (r[6] << 16) | ((uint32_t)r[7] << 24);
+  return true;
+}
+
+/**
+ * Run scenario @a s
+ *
+ * @return true if the outputs and the status match
+ */
+static bool run(const TScenario* s) {
+  uint8_t  response[64];
+  uint8_t  data[PACKETS * 64];
+  int      width   = (s->Config == (PATTERN_PORT_A | PATTERN_PORT_B)) ? 2 : 1;
+  int      samples = sizeof(data) / width;
+  int      sample  = 0;       // next expected sample
+  int      underruns = 0;
+  int      packet  = 0;
+  int      round;
+  int      fed_at_start = -1;
+  uint16_t out, next, last = 0;
+  TStatus  st;
+  unsigned int i, t;
+
+  // consecutive samples differ on Port A
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = (uint8_t)(i * 37 + 11);
+
+  sim_reset();
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_PATTERN, EP2_FLAG_POOL);
+  // 6 cycles = 1 us per sample
+  if ((sim_vendor_in(CMD_PATTERN, (s->Config << 8) | 6, s->Prefill, response) != 1) ||
+      (response[0] != PATTERN_OK))
+    return false;
+
+  for (round = 0; round < MAX_ROUNDS && sample < samples; round++) {
+    if ((packet < PACKETS) && sim_ep2_out(data + packet * 64, 64))
+      packet++;
+    sim_run();
+    for (t = 0; t < s->Ticks; t++) {
+      if (!sim_timer0_tick())
+        break;
+      if (fed_at_start < 0)
+        fed_at_start = packet * 64;
+      out  = (width == 2) ? (OUTA | (OUTB << 8)) : OUTA;
+      next = last;
+      if (sample < samples)
+        next = (width == 2) ? (data[2*sample] | (data[2*sample+1] << 8)) : data[sample];
+      if ((sample < samples) && (out == next)) {
+        sample++;
+        last = out;
+      } else if (out == last) {
+        underruns++;
+      } else {
+        printf("%-10s sample %d: 0x%04x, expected 0x%04x\n", s->Name, sample, out, next);
+        return false;
+      }
+      // refill as fast as the main loop would
+      sim_run();
+    }
+  }
+  if (sample != samples || fed_at_start < s->Prefill)
+    return false;
+  if (!status(&st) || !st.Running || st.Samples != samples || st.Underruns != underruns)
+    return false;
+  if ((underruns != 0) != s->Underruns)
+    return false;
+  printf("%-10s %5d samples, %5d underruns\n", s->Name, samples, underruns);
+
+  // no more data: every overflow is an underrun, the outputs are held
+  for (t = 0; t < DRAIN_TICKS; t++)
+    sim_timer0_tick();
+  if (!status(&st) || st.Underruns != underruns + DRAIN_TICKS || st.Samples != samples)
+    return false;
+  out = (width == 2) ? (OUTA | (OUTB << 8)) : OUTA;
+  return out == last;
+}
+
+int main(void) {
+  unsigned int i;
+  int          status = 0;
+
+  for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    if (!run(&scenarios[i])) {
+      printf("%-10s failed\n", scenarios[i].Name);
+      status = 1;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,181 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Performance counters of CMD_GET_STATUS
+ *
+ * Loops EP2 packets of different lengths back, writes to the EEPROM and to
+ * a missing I2C slave and checks the counters of TGetStatus against the
+ * traffic. Reading with wValue != 0 must clear the counters. The durations
+ * are checked with an EP0 OUT data stage whose copy in the ISR takes time
+ * (sim_xmem_isr_counts()) and with a slow event handler in the main loop,
+ * both across reloads of Timer 2.
+ *
+ * Usage: perfcount
+ */
+
+#include <stddef.h>
+
+#include "sim.h"
+#include "eeprom.h"
+#include "delay.h"
+#include "event.h"
+#include "reg_ezusb.h"
+// TGetStatus is sent as laid out by the firmware build (-fpack-struct)
+#pragma pack(push, 1)
+#include "commands.h"
+#pragma pack(pop)
+
+#define STATUS_SIZE              sizeof(TGetStatus)
+
+#define PACKETS                  20
+
+#define ISR_COUNTS               300    // 50 us
+#define LOOP_COUNTS              15000  // 2.5 ms
+#define LONG_LOOP_COUNTS         66000  // 11 ms, beyond MaxLoopPass
+
+// offsets in TGetStatus
+#define OFS_SETUPS               offsetof(TGetStatus, Setups)
+#define OFS_EP2_IN_PACKETS       offsetof(TGetStatus, Ep2InPackets)
+#define OFS_EP2_OUT_PACKETS      offsetof(TGetStatus, Ep2OutPackets)
+#define OFS_EP2_IN_BYTES         offsetof(TGetStatus, Ep2InBytes)
+#define OFS_EP2_OUT_BYTES        offsetof(TGetStatus, Ep2OutBytes)
+#define OFS_I2C_TRANSFERS        offsetof(TGetStatus, I2CTransfers)
+#define OFS_I2C_NACKS            offsetof(TGetStatus, I2CNacks)
+#define OFS_I2C_BUS_ERRORS       offsetof(TGetStatus, I2CBusErrors)
+#define OFS_LOOP_PASSES          offsetof(TGetStatus, LoopPasses)
+#define OFS_MAX_USB_I2C_ISR      offsetof(TGetStatus, MaxUsbI2cIsr)
+#define OFS_MAX_LOOP_PASS        offsetof(TGetStatus, MaxLoopPass)
+
+
+static uint32_t u16(const uint8_t* r, int ofs) {
+  return r[ofs] | (r[ofs + 1] << 8);
+}
+
+static uint32_t u32(const uint8_t* r, int ofs) {
+  return u16(r, ofs) | (u16(r, ofs + 2) << 16);
+}
+
+static uint32_t loop_counts;   // duration of slow_pass()
+
+/**
+ * Handler of EVENT_IBN which keeps the main loop busy for loop_counts
+ */
+static void slow_pass(void) {
+  sim_elapse(loop_counts);
+}
+
+/**
+ * Let Timer 2 run until it is @a counts before its next reload
+ */
+static void before_reload(uint16_t counts) {
+  uint16_t t;
+
+  t = ((uint16_t)TH2 << 8) | TL2;
+  if (t > 0x10000 - counts)
+    t -= TIMER_COUNTS_PER_MS;
+  sim_elapse(0x10000 - counts - t);
+}
+
+/**
+ * Read the counters with CMD_GET_STATUS, clear them if @a clear
+ *
+ * @return false if the request failed
+ */
+static bool get_status(uint8_t* r, bool clear) {
+  return (sim_request(0xC0, CMD_GET_STATUS, clear, 0, STATUS_SIZE, r) == STATUS_SIZE) && (r[0] == 1);
+}
+
+int main(void) {
+  uint8_t  data[64], r[64];
+  uint32_t bytes = 0;
+  int      i, n;
+  bool     ok;
+
+  sim_reset();
+  ok = get_status(r, true);
+  sim_check(ok && u32(r, OFS_SETUPS) == 1, "own SETUP packet counted");
+  ok = get_status(r, false);
+  sim_check(ok && u32(r, OFS_SETUPS) == 1 && u32(r, OFS_LOOP_PASSES) > 0, "counters cleared");
+
+  // EP2 loopback
+  ok = get_status(r, true) && (sim_request(0x40, CMD_SET_EP2_MODE, EP2_MODE_LOOPBACK, 0, 0, data) == 0);
+  for (i = 0; ok && (i < PACKETS); i++) {
+    n = 1 + i * 3;
+    ok = sim_ep2_out(data, n);
+    sim_run();
+    ok = ok && (sim_ep2_in(data) == n);
+    bytes += n;
+  }
+  ok = ok && get_status(r, false);
+  sim_check(ok && u32(r, OFS_EP2_OUT_PACKETS) == PACKETS && u32(r, OFS_EP2_OUT_BYTES) == bytes,
+            "EP2 OUT packets and bytes");
+  sim_check(ok && u32(r, OFS_EP2_IN_PACKETS) == PACKETS && u32(r, OFS_EP2_IN_BYTES) == bytes,
+            "EP2 IN packets and bytes");
+  sim_check(ok && u32(r, OFS_SETUPS) == 2, "SETUP packets");
+
+  // I2C: acknowledged and not acknowledged write
+  data[0] = 0x01;
+  data[1] = 0x00;
+  for (i = 2; i < 10; i++)
+    data[i] = i;
+  ok = get_status(r, true);
+  ok = ok && (sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 10, data) == 0);
+  ok = ok && (sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR + 1, 0, 10, data) == SIM_STALL);
+  ok = ok && get_status(r, false);
+  sim_check(ok && u16(r, OFS_I2C_TRANSFERS) == 2 && u16(r, OFS_I2C_NACKS) == 1 &&
+            u16(r, OFS_I2C_BUS_ERRORS) == 0, "I2C transactions and NACKs");
+
+  // ISR duration: the copy of the OUT data stage in ep0out_isr()
+  ok = get_status(r, true);
+  sim_xmem_isr_counts(ISR_COUNTS);
+  before_reload(TIMER_COUNTS_PER_MS / 2);
+  ok = ok && (sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 10, data) == 0);
+  sim_xmem_isr_counts(0);
+  ok = ok && get_status(r, false);
+  sim_check(ok && u16(r, OFS_MAX_USB_I2C_ISR) == ISR_COUNTS, "longest ISR");
+  ok = get_status(r, true);
+  sim_xmem_isr_counts(ISR_COUNTS);
+  before_reload(ISR_COUNTS / 2);
+  ok = ok && (sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 10, data) == 0);
+  sim_xmem_isr_counts(0);
+  ok = ok && get_status(r, false);
+  sim_check(ok && u16(r, OFS_MAX_USB_I2C_ISR) == ISR_COUNTS, "longest ISR across a reload");
+
+  // main loop pass: a slow event handler
+  event_register(EVENT_IBN, slow_pass);
+  ok = get_status(r, true);
+  loop_counts = LOOP_COUNTS;
+  before_reload(TIMER_COUNTS_PER_MS / 3);
+  EVENT_POST(ibn);
+  sim_run();
+  ok = ok && get_status(r, false);
+  sim_check(ok && u16(r, OFS_MAX_LOOP_PASS) >= LOOP_COUNTS &&
+            u16(r, OFS_MAX_LOOP_PASS) < LOOP_COUNTS + TIMER_COUNTS_PER_MS / 10,
+            "longest main loop pass across reloads");
+  loop_counts = LONG_LOOP_COUNTS;
+  EVENT_POST(ibn);
+  sim_run();
+  ok = get_status(r, false);
+  sim_check(ok && u16(r, OFS_MAX_LOOP_PASS) == 0xFFFF, "longest main loop pass saturated");
+
+  sim_reset();
+
+  return sim_failures() ? 1 : 0;
+}
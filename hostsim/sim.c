@@ -0,0 +1,755 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#define SIM_DEFINE_REGISTERS
+#include "reg_ezusb.h"
+#include "common.h"
+#include "usb.h"
+#include "delay.h"
+#include "i2c.h"
+#include "eeprom.h"
+#include "spi.h"
+#include "flash.h"
+#include "uart.h"
+#include "notify.h"
+#include "stats.h"
+#include "trace.h"
+#include "event.h"
+#include "commands.h"
+#include "sim.h"
+
+#define SIM_BUSY_WAIT_COUNTS  32     // Timer 2 counts per BUSY_WAIT()
+#define SIM_NO_BC             0xFF   // IN0BC/IN1BC was not written
+
+uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+/*****************************************************************************/
+/***  I2C  *******************************************************************/
+/*****************************************************************************/
+
+static enum { siIdle, siSend, siReceive, siNack } sim_i2c_phase;
+static uint8_t  sim_i2c_count;    // bytes written since the START condition
+static uint16_t sim_i2c_ptr;      // address pointer of the EEPROM
+static bool     sim_i2c_written;  // data was written since the START condition
+
+/*
+ * Bus timing: with sim_i2c_clock(), every step takes its bits (START and
+ * address 10, data byte with ACK 9, STOP 1) on the bus and its effects
+ * including the ISR call happen at the end, driven by Timer 2. After a STOP
+ * which ends a write, the EEPROM doesn't acknowledge its address for the
+ * duration of its internal write cycle. Untimed, the steps are executed
+ * instantly and the EEPROM is always ready.
+ */
+static uint16_t sim_i2c_bit_counts;   // Timer 2 counts per bit, 0: untimed
+static bool     sim_i2c_started;      // the next step is on the bus
+static uint32_t sim_i2c_ready;        // sim_time() at the end of the step
+static uint32_t sim_i2c_busy_counts;  // sum of all steps
+static uint32_t sim_eeprom_ready;     // sim_time() at the end of the write cycle
+
+static uint32_t sim_time_counts;      // Timer 2 counts since sim_reset()
+
+/**
+ * Return the number of bits of the next step, 0 if there is nothing to do
+ */
+static uint8_t sim_i2c_bits(void) {
+  if (I2CS & I2C_STOP)
+    return 1;
+  if (I2CS & I2C_START)
+    return 10;
+  if ((sim_i2c_phase == siSend) || (sim_i2c_phase == siReceive))
+    return 9;
+  return 0;
+}
+
+/**
+ * Put the next step on the bus, if there is one and the bus is timed
+ */
+static void sim_i2c_begin(void) {
+  uint8_t bits = sim_i2c_bits();
+
+  if (!bits || !sim_i2c_bit_counts || sim_i2c_started)
+    return;
+  sim_i2c_started      = true;
+  sim_i2c_ready        = sim_time_counts + (uint32_t)bits * sim_i2c_bit_counts;
+  sim_i2c_busy_counts += (uint32_t)bits * sim_i2c_bit_counts;
+}
+
+/**
+ * Check whether the next step is complete, start it on the bus if not yet
+ * done
+ */
+static bool sim_i2c_due(void) {
+  if (!sim_i2c_bits())
+    return false;
+  if (!sim_i2c_bit_counts)
+    return true;
+  sim_i2c_begin();
+  if (sim_time_counts < sim_i2c_ready)
+    return false;
+  sim_i2c_started = false;
+  return true;
+}
+
+/**
+ * Execute the next step of the I2C master
+ *
+ * The step is derived from the register contents left by the firmware: a
+ * STOP or START request, or (during a transfer) the next byte written to or
+ * read from I2DAT by the ISR.
+ *
+ * @return true if something was done
+ */
+static bool sim_i2c_step(void) {
+  uint8_t b;
+
+  if (!sim_i2c_due())
+    return false;
+  if (I2CS & I2C_STOP) {
+    // STOP condition, no interrupt
+    I2CS &= ~(I2C_STOP | LASTRD | DONE | ACK);
+    if (sim_i2c_written && sim_i2c_bit_counts)
+      sim_eeprom_ready = sim_time_counts + SIM_EEPROM_TWR * TIMER_COUNTS_PER_MS;
+    sim_i2c_phase   = siIdle;
+    sim_i2c_written = false;
+    return true;
+  }
+  if (I2CS & I2C_START) {
+    // (repeated) START condition and address byte
+    b = I2DAT;
+    I2CS &= ~I2C_START;
+    if (((b >> 1) == EEPROM_I2C_ADDR) && (sim_time_counts >= sim_eeprom_ready)) {
+      sim_i2c_phase = (b & 0x01) ? siReceive : siSend;
+      sim_i2c_count = 0;
+      I2CS |= DONE | ACK;
+    }
+    else {
+      sim_i2c_phase = siNack;
+      I2CS = (I2CS & ~ACK) | DONE;
+    }
+    i2c_isr();
+    return true;
+  }
+  switch (sim_i2c_phase) {
+    case siSend:
+      // the ISR has written the next byte to I2DAT
+      b = I2DAT;
+      if (sim_i2c_count == 0)
+        sim_i2c_ptr = (uint16_t)b << 8;
+      else if (sim_i2c_count == 1)
+        sim_i2c_ptr |= b;
+      else {
+        sim_eeprom[sim_i2c_ptr++] = b;
+        sim_i2c_written = true;
+      }
+      if (sim_i2c_count < 2)
+        sim_i2c_count++;
+      I2CS |= DONE | ACK;
+      i2c_isr();
+      return true;
+    case siReceive:
+      // the ISR has read I2DAT, which clocks in the next byte
+      I2DAT = sim_eeprom[sim_i2c_ptr++];
+      I2CS |= DONE | ACK;
+      i2c_isr();
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * Let every I2C step take the bus time at @a khz, 0 executes the steps
+ * instantly (the default after sim_reset())
+ *
+ * Timed, the bus runs in the background of sim_elapse() and BUSY_WAIT(),
+ * and sim_run() returns while a transfer is still on the bus.
+ */
+void sim_i2c_clock(uint16_t khz) {
+  sim_i2c_bit_counts = khz ? TIMER_COUNTS_PER_MS / khz : 0;
+  sim_i2c_started    = false;
+}
+
+/**
+ * Return the Timer 2 counts the I2C bus was busy since sim_reset()
+ */
+uint32_t sim_i2c_busy(void) {
+  return sim_i2c_busy_counts;
+}
+
+/*****************************************************************************/
+/***  Timer 2  ***************************************************************/
+/*****************************************************************************/
+
+/**
+ * Advance Timer 2 by @a counts and generate its interrupt on overflow
+ */
+static void sim_timer_advance(uint16_t counts) {
+  uint32_t t;
+
+  // steps requested by the firmware start on the bus now
+  sim_i2c_begin();
+  sim_time_counts += counts;
+  sim_uart_advance(counts);
+  if (!TR2)
+    return;
+  t = (((uint16_t)TH2 << 8) | TL2) + (uint32_t)counts;
+  if (t > 0xFFFF) {
+    t = ((uint16_t)RCAP2H << 8 | RCAP2L) + (t - 0x10000);
+    TF2 = 1;
+  }
+  TH2 = HI8(t);
+  TL2 = LO8(t);
+  if (TF2 && ET2 && EA)
+    timer2_isr();
+  // the I2C bus runs in the background
+  if (sim_i2c_bit_counts)
+    while (sim_i2c_step())
+      ;
+}
+
+/**
+ * Return the simulated time in Timer 2 counts since sim_reset()
+ */
+uint32_t sim_time(void) {
+  return sim_time_counts;
+}
+
+/*****************************************************************************/
+/***  Timer 0  ***************************************************************/
+/*****************************************************************************/
+
+/**
+ * Let Timer 0 overflow once and generate its interrupt
+ *
+ * The reload value isn't modelled, the caller decides when the overflows
+ * happen relative to the main loop.
+ *
+ * @return false if the timer isn't running
+ */
+bool sim_timer0_tick(void) {
+  if (!TR0)
+    return false;
+  TF0 = 1;
+  if (ET0 && EA) {
+    // cleared by the hardware when the ISR is vectored
+    TF0 = 0;
+    timer0_isr();
+  }
+  return true;
+}
+
+/*****************************************************************************/
+/***  External Interrupts  ***************************************************/
+/*****************************************************************************/
+
+/**
+ * Falling edge at INT0# (@a pin 0, PC2) or INT1# (@a pin 1, PC3)
+ *
+ * The pins are only connected to the interrupt while they are switched to
+ * their alternate function.
+ *
+ * @return true if the ISR was called
+ */
+bool sim_int_edge(uint8_t pin) {
+  if (pin) {
+    if (!(PORTCCFG & INT1) || !IT1)
+      return false;
+    IE1 = 1;
+    if (!EX1 || !EA)
+      return false;
+    // cleared by the hardware when the ISR is vectored
+    IE1 = 0;
+    int1_isr();
+  } else {
+    if (!(PORTCCFG & INT0) || !IT0)
+      return false;
+    IE0 = 1;
+    if (!EX0 || !EA)
+      return false;
+    IE0 = 0;
+    int0_isr();
+  }
+  return true;
+}
+
+/*****************************************************************************/
+/***  Simulation Control  ****************************************************/
+/*****************************************************************************/
+
+static unsigned sim_idle_count;   // CPU_IDLE() calls
+
+/*
+ * EP0 control transfer: the host sends the OUT data stage packet by packet
+ * while EP0 OUT is armed (OUT0BC written), reads every IN packet armed by
+ * the firmware (IN0BC written) until a short packet or wLength bytes, then
+ * polls the status stage and is NAKed until the firmware sets HSNAK (or
+ * stalls EP0). Every step of the simulation is a chance for the host to
+ * proceed. A vendor request must not complete before HandleCmd() has
+ * executed it.
+ */
+static bool     sim_ep0_open;          // status stage still NAKed
+static bool     sim_ep0_in;            // IN data stage not finished
+static bool     sim_ep0_babble;        // IN packet larger than 64 bytes
+static uint16_t sim_ep0_wlength;
+static uint16_t sim_ep0_length;        // bytes of the data stage transferred
+static uint16_t sim_ep0_out_left;      // bytes of the OUT data stage not sent
+static uint8_t  sim_ep0_data[SIM_EP0_MAX];
+static unsigned sim_ep0_packet_count;  // packets of the data stage
+static unsigned sim_ep0_early_count;   // completed before HandleCmd()
+static unsigned sim_ibn_count;         // ibn_isr() calls
+
+static void sim_ep0_poll(void);
+
+/**
+ * Power-on reset of the simulated hardware and initialization of the
+ * firmware like main() (without ReNumeration)
+ */
+void sim_reset(void) {
+  memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+  sim_i2c_phase = siIdle;
+  sim_i2c_written = false;
+  sim_i2c_clock(0);
+  sim_i2c_busy_counts = 0;
+  sim_eeprom_ready    = 0;
+  I2CS = 0;
+  T2CON = TH2 = TL2 = 0;
+  sim_time_counts = 0;
+  EA = ET2 = TR2 = TF2 = false;
+  TMOD = TH0 = TL0 = 0;
+  ET0 = TR0 = TF0 = PT0 = false;
+  EX0 = EX1 = IE0 = IE1 = false;
+  IN1BC = SIM_NO_BC;
+  OEA = OEB = OEC = OUTA = OUTB = OUTC = 0;
+  PINSA = PINSB = PINSC = 0;
+  event_init();
+  stats_reset();
+  sim_idle_count = 0;
+  sim_ep0_open   = false;
+  sim_ep0_early_count = 0;
+  sim_ibn_count = 0;
+  sim_stream_reset();
+  sim_capture_waveform(NULL);
+  sim_spi_wiring(NULL);
+  sim_xmem_isr_counts(0);
+  sim_uart_reset();
+
+  timer_init();
+#ifdef TRACE
+  trace_init();
+#endif
+  EA = true;
+  usb_init();
+  i2c_init();
+  eeprom_init();
+  spi_init();
+  flash_init();
+  uart_init();
+  notify_init();
+  command_init();
+}
+
+/**
+ * Let the firmware and the hardware run until nothing is left to do
+ *
+ * This corresponds to command_loop() with all pending I2C interrupts.
+ */
+void sim_run(void) {
+  bool active;
+
+  do {
+    command_poll();
+    sim_ep0_poll();
+    // transfers queued by the firmware, their completion needs another poll
+    active = sim_uart_step();
+    while (sim_i2c_step()) {
+      active = true;
+      sim_ep0_poll();
+    }
+  } while (active);
+}
+
+/**
+ * Called by BUSY_WAIT() in busy-wait loops of the firmware
+ */
+void sim_busy_wait(void) {
+  sim_i2c_step();
+  sim_ep0_poll();
+  sim_timer_advance(SIM_BUSY_WAIT_COUNTS);
+}
+
+/**
+ * Let @a counts Timer 2 counts pass while the firmware idles
+ *
+ * Timer 2 and the serial ports advance in steps of one BUSY_WAIT(), the
+ * main loop isn't executed.
+ */
+void sim_elapse(uint32_t counts) {
+  uint16_t n;
+
+  while (counts) {
+    n = (counts > SIM_BUSY_WAIT_COUNTS) ? SIM_BUSY_WAIT_COUNTS : counts;
+    // stop exactly at the end of an I2C step
+    if (sim_i2c_started && (sim_i2c_ready > sim_time_counts) &&
+        (sim_i2c_ready - sim_time_counts < n))
+      n = sim_i2c_ready - sim_time_counts;
+    sim_timer_advance(n);
+    counts -= n;
+  }
+}
+
+/**
+ * Called by CPU_IDLE() (see common.h), the next interrupt ends the idle mode
+ */
+void sim_idle(void) {
+  sim_idle_count++;
+  EA = true;
+  sim_busy_wait();
+}
+
+/**
+ * Return the number of CPU_IDLE() calls since sim_reset()
+ */
+unsigned sim_idles(void) {
+  return sim_idle_count;
+}
+
+/*****************************************************************************/
+/***  Endpoints  *************************************************************/
+/*****************************************************************************/
+
+/**
+ * Transfer the data stage and complete the status stage as far as the
+ * firmware allows
+ */
+static void sim_ep0_poll(void) {
+  uint8_t n;
+
+  if (EP0CS & EP0STALL) {
+    sim_ep0_in       = false;
+    sim_ep0_out_left = 0;
+  }
+  // OUT data stage
+  while (sim_ep0_out_left && (OUT0BC == 0)) {
+    n = (sim_ep0_out_left > 64) ? 64 : sim_ep0_out_left;
+    memcpy((uint8_t*)OUT0BUF, sim_ep0_data + sim_ep0_length, n);
+    OUT0BC = n;
+    sim_ep0_length   += n;
+    sim_ep0_out_left -= n;
+    sim_ep0_packet_count++;
+    ep0out_isr();
+  }
+  // IN data stage
+  if (SUDPTRH || SUDPTRL)
+    sim_ep0_in = false;   // sent by the USB core
+  while (sim_ep0_in && (IN0BC != SIM_NO_BC)) {
+    n = IN0BC;
+    if (n > 64) {
+      sim_ep0_babble = true;
+      n = 0;
+    }
+    // the host takes at most wLength bytes
+    if (sim_ep0_length + n > sim_ep0_wlength)
+      n = sim_ep0_wlength - sim_ep0_length;
+    memcpy(sim_ep0_data + sim_ep0_length, (uint8_t*)IN0BUF, n);
+    sim_ep0_length += n;
+    sim_ep0_packet_count++;
+    IN0BC = SIM_NO_BC;
+    if ((n < 64) || (sim_ep0_length == sim_ep0_wlength))
+      sim_ep0_in = false;
+    ep0in_isr();
+  }
+  // status stage
+  if (!sim_ep0_open || sim_ep0_in || sim_ep0_out_left || !(EP0CS & (HSNAK | EP0STALL)))
+    return;
+  sim_ep0_open = false;
+  if (event_command)
+    sim_ep0_early_count++;
+}
+
+/**
+ * Check whether the status stage of the last control transfer is still
+ * NAKed
+ */
+bool sim_ep0_pending(void) {
+  return sim_ep0_open;
+}
+
+/**
+ * Return the number of packets of the last data stage
+ */
+unsigned sim_ep0_packets(void) {
+  return sim_ep0_packet_count;
+}
+
+/**
+ * Return the number of vendor requests whose status stage was released
+ * before the firmware executed them
+ */
+unsigned sim_ep0_early(void) {
+  return sim_ep0_early_count;
+}
+
+/**
+ * Receive a SETUP packet while the main loop of the firmware is busy
+ *
+ * Only sudav_isr() is executed (and the EP0 ISRs as far as the data stage
+ * can proceed), vendor requests are left to sim_run().
+ *
+ * @param setup  8 byte SETUP packet
+ * @param data   OUT data stage of wLength bytes (max. SIM_EP0_MAX), unused
+ *   for device-to-host requests
+ */
+void sim_setup(const uint8_t* setup, const uint8_t* data) {
+  memcpy((uint8_t*)SETUPDAT, setup, 8);
+  // setup_data overlays SETUPDAT on the target
+  memcpy((void*)&setup_data, setup, 8);
+  EP0CS   = 0;
+  IN0BC   = SIM_NO_BC;
+  OUT0BC  = SIM_NO_BC;
+  SUDPTRH = 0;
+  SUDPTRL = 0;
+
+  sim_ep0_open         = true;
+  sim_ep0_babble       = false;
+  sim_ep0_wlength      = setup[6] | (setup[7] << 8);
+  sim_ep0_length       = 0;
+  sim_ep0_packet_count = 0;
+  sim_ep0_in           = false;
+  sim_ep0_out_left     = 0;
+  if (setup[0] & USB_DIR_IN) {
+    sim_ep0_in = (sim_ep0_wlength != 0);
+  } else {
+    sim_ep0_out_left = (sim_ep0_wlength > SIM_EP0_MAX) ? SIM_EP0_MAX : sim_ep0_wlength;
+    if (sim_ep0_out_left)
+      memcpy(sim_ep0_data, data, sim_ep0_out_left);
+  }
+
+  USBIRQ |= SUDAVIR;
+  sudav_isr();
+  sim_ep0_poll();
+}
+
+/**
+ * Execute a control transfer
+ *
+ * @param setup  8 byte SETUP packet
+ * @param data   receives the IN data stage or holds the OUT data stage
+ *   (wLength bytes, max. SIM_EP0_MAX)
+ * @return see sim_ep0_result()
+ */
+int sim_control(const uint8_t* setup, uint8_t* data) {
+  sim_setup(setup, data);
+  sim_run();
+  return sim_ep0_result(data);
+}
+
+/**
+ * Return the response to the last SETUP packet
+ *
+ * @param data   receives the IN data stage (wLength bytes, max. SIM_EP0_MAX)
+ * @return number of bytes in @a data (0 for host-to-device requests),
+ *   SIM_STALL, SIM_DESCRIPTOR, SIM_PENDING or SIM_BABBLE
+ */
+int sim_ep0_result(uint8_t* data) {
+  if (sim_ep0_babble)
+    return SIM_BABBLE;
+  if (sim_ep0_open)
+    return SIM_PENDING;
+  if (EP0CS & EP0STALL)
+    return SIM_STALL;
+  if (SUDPTRH || SUDPTRL)
+    return SIM_DESCRIPTOR;
+  if (!(setup_data.bmRequestType & USB_DIR_IN))
+    return 0;
+  memcpy(data, sim_ep0_data, sim_ep0_length);
+  return sim_ep0_length;
+}
+
+/**
+ * Return the descriptor address written to SUDPTRH/SUDPTRL
+ *
+ * This is the lower 16 bits of the host address.
+ */
+uint16_t sim_sudptr(void) {
+  return ((uint16_t)SUDPTRH << 8) | SUDPTRL;
+}
+
+/**
+ * Send an EP2 OUT packet of 1 to 64 bytes
+ *
+ * @return false if the firmware has no free buffer (NAK)
+ */
+bool sim_ep2_out(const uint8_t* data, uint8_t length) {
+  if (!sim_ep2_burst(data, length))
+    return false;
+  sim_run();
+  return true;
+}
+
+/**
+ * Send an EP2 OUT packet while the main loop of the firmware is busy
+ *
+ * Only ep2out_isr() is executed, the packet stays wherever the ISR put it.
+ *
+ * @return false if the firmware has no free buffer (NAK)
+ */
+bool sim_ep2_burst(const uint8_t* data, uint8_t length) {
+  if (!sim_stream_put(data, length))
+    return false;
+  OUT07IRQ |= OUT2IR;
+  ep2out_isr();
+  return true;
+}
+
+/**
+ * The SIE NAKed an IN token to endpoint @a ep (1 .. 7), because no buffer
+ * was armed: request the IN-Bulk-NAK interrupt
+ *
+ * @return true if ibn_isr() was called
+ */
+bool sim_ibn(uint8_t ep) {
+  uint8_t bit = 1 << ep;
+
+  IBNIRQ |= bit;
+  if (!(IBNIEN & bit) || !(USBIEN & IBNIE) || !EUSB || !EA)
+    return false;
+  USBIRQ |= IBNIR;
+  sim_ibn_count++;
+  ibn_isr();
+  return true;
+}
+
+/**
+ * Return the number of ibn_isr() calls since sim_reset()
+ */
+unsigned sim_ibns(void) {
+  return sim_ibn_count;
+}
+
+/**
+ * Receive an EP1 IN packet (notification records, see notify.h)
+ *
+ * @return number of bytes in @a data or -1 if no packet is armed (NAK)
+ */
+int sim_ep1_in(uint8_t* data) {
+  int length;
+
+  if (IN1BC == SIM_NO_BC) {
+    sim_ibn(1);
+    return -1;
+  }
+  length = (IN1BC > 64) ? 64 : IN1BC;
+  memcpy(data, (uint8_t*)IN1BUF, length);
+  IN1BC = SIM_NO_BC;
+  IN07IRQ |= IN1IR;
+  ep1in_isr();
+  return length;
+}
+
+/**
+ * Receive an EP2 IN packet
+ *
+ * @return number of bytes in @a data or -1 if no packet is available (NAK)
+ */
+int sim_ep2_in(uint8_t* data) {
+  int length;
+
+  length = sim_stream_get(data);
+  if (length < 0) {
+    sim_ibn(2);
+    return length;
+  }
+  IN07IRQ |= IN2IR;
+  ep2in_isr();
+  sim_run();
+  return length;
+}
+
+/*****************************************************************************/
+/***  Test Helpers  **********************************************************/
+/*****************************************************************************/
+
+static unsigned sim_failure_count;
+
+/**
+ * Fill the SETUP packet @a setup
+ */
+void sim_setup_packet(uint8_t* setup, uint8_t type, uint8_t request,
+                      uint16_t value, uint16_t index, uint16_t length) {
+  setup[0] = type;
+  setup[1] = request;
+  setup[2] = value & 0xFF;
+  setup[3] = value >> 8;
+  setup[4] = index & 0xFF;
+  setup[5] = index >> 8;
+  setup[6] = length & 0xFF;
+  setup[7] = length >> 8;
+}
+
+/**
+ * Execute a control transfer
+ *
+ * @param data   receives the IN data stage or holds the OUT data stage
+ *   (@a length bytes), may be NULL with @a length 0
+ * @return see sim_control()
+ */
+int sim_request(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+                uint16_t length, uint8_t* data) {
+  uint8_t setup[8];
+
+  sim_setup_packet(setup, type, request, value, index, length);
+  return sim_control(setup, data);
+}
+
+/**
+ * Execute a vendor request with an IN data stage of up to 64 bytes
+ *
+ * @return see sim_control()
+ */
+int sim_vendor_in(uint8_t request, uint16_t value, uint16_t index, uint8_t* data) {
+  return sim_request(0xC0, request, value, index, 64, data);
+}
+
+/**
+ * Execute a vendor request without data stage
+ *
+ * @return see sim_control()
+ */
+int sim_vendor_out(uint8_t request, uint16_t value, uint16_t index) {
+  return sim_request(0x40, request, value, index, 0, NULL);
+}
+
+/**
+ * Print the result of a test case and count the failures
+ */
+void sim_check(bool ok, const char* what) {
+  printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok)
+    sim_failure_count++;
+}
+
+/**
+ * Return the number of failed sim_check() calls
+ */
+unsigned sim_failures(void) {
+  return sim_failure_count;
+}
@@ -0,0 +1,178 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __SIM_H
+#define __SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file Simulated EZ-USB for the host build of the firmware
+ *
+ * The special function registers are ordinary variables (see
+ * include/mcs51/compiler.h). The simulation injects the interrupts by
+ * calling the ISRs and emulates the side effects of the hardware between
+ * the calls of the firmware:
+ *
+ *  - EP0: SETUP packets are written to SETUPDAT, sudav_isr() is called and
+ *    the response is taken from IN0BUF/IN0BC, EP0CS and SUDPTRH/SUDPTRL.
+ *    Data stages of several packets are passed through OUT0BUF/IN0BUF with
+ *    ep0out_isr()/ep0in_isr(), the status stage completes as soon as the
+ *    firmware sets HSNAK.
+ *  - EP2: modelled at the level of the stream.h API (see sim_stream.c),
+ *    including the paired (double buffered) mode.
+ *  - IN-Bulk-NAK: sim_ep2_in() and sim_uart_in() call ibn_isr() when they
+ *    find no packet armed and the firmware enabled the IBN interrupt.
+ *  - I2C: I2CS and I2DAT are modelled on register level with a 24C512
+ *    EEPROM at EEPROM_I2C_ADDR on the bus, untimed or at the bus clock of
+ *    sim_i2c_clock() including the write cycle of the EEPROM.
+ *  - Timer 2: advanced in every BUSY_WAIT() and CPU_IDLE() (see common.h),
+ *    by sim_elapse() and optionally in xmemcpy_isr() (see
+ *    sim_xmem_isr_counts()).
+ *  - Serial ports and EP4/EP5: TXD looped back to RXD, timed with Timer 2
+ *    (see sim_uart.c).
+ *  - Timer 0: every sim_timer0_tick() is one overflow, the pattern
+ *    generator output is read from OUTA/OUTB.
+ *  - INT0#/INT1#: every sim_int_edge() is one falling edge.
+ *  - EP1 IN: the notification records are read with sim_ep1_in().
+ *  - Port pins: a waveform over the instruction cycles, sampled by the
+ *    logic analyzer model (see sim_capture.c), or an external circuit
+ *    connected to the SPI master (see sim_spi_shift.c), e.g. the SPI
+ *    flash model (see sim_flash.c).
+ *
+ * Everything is executed synchronously, i.e. an ISR never interrupts the
+ * firmware except inside BUSY_WAIT().
+ */
+
+#define SIM_STALL        -1   // EP0 was stalled
+#define SIM_DESCRIPTOR   -2   // data stage from SUDPTRH/SUDPTRL (sim_sudptr())
+#define SIM_PENDING      -3   // status stage still NAKed (HSNAK not set)
+#define SIM_BABBLE       -4   // IN packet larger than 64 bytes
+
+#define SIM_EP0_MAX      256  // max. data stage of sim_control()
+
+#define SIM_EEPROM_SIZE  65536
+#define SIM_EEPROM_TWR   5      // write cycle in ms, only with sim_i2c_clock()
+
+extern uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+// ISRs of the firmware
+void sudav_isr(void);
+void ibn_isr(void);
+void ep0in_isr(void);
+void ep0out_isr(void);
+void ep1in_isr(void);
+void ep2in_isr(void);
+void ep2out_isr(void);
+void ep4in_isr(void);
+void ep4out_isr(void);
+void ep5in_isr(void);
+void ep5out_isr(void);
+void i2c_isr(void);
+void timer2_isr(void);
+void timer0_isr(void);
+void uart0_isr(void);
+void uart1_isr(void);
+void int0_isr(void);
+void int1_isr(void);
+
+void     sim_reset(void);
+void     sim_run(void);
+void     sim_busy_wait(void);
+void     sim_idle(void);
+void     sim_elapse(uint32_t counts);
+uint32_t sim_time(void);
+unsigned sim_idles(void);
+bool     sim_timer0_tick(void);
+bool     sim_int_edge(uint8_t pin);
+void     sim_i2c_clock(uint16_t khz);
+uint32_t sim_i2c_busy(void);
+
+void     sim_setup(const uint8_t* setup, const uint8_t* data);
+int      sim_control(const uint8_t* setup, uint8_t* data);
+int      sim_ep0_result(uint8_t* data);
+uint16_t sim_sudptr(void);
+bool     sim_ep0_pending(void);
+unsigned sim_ep0_packets(void);
+unsigned sim_ep0_early(void);
+
+int      sim_ep1_in(uint8_t* data);
+bool     sim_ep2_out(const uint8_t* data, uint8_t length);
+bool     sim_ep2_burst(const uint8_t* data, uint8_t length);
+int      sim_ep2_in(uint8_t* data);
+bool     sim_ibn(uint8_t ep);
+unsigned sim_ibns(void);
+
+// EP2 model, see sim_stream.c
+void     sim_stream_reset(void);
+bool     sim_stream_put(const uint8_t* data, uint8_t length);
+int      sim_stream_get(uint8_t* data);
+unsigned sim_stream_commits(void);
+uint32_t sim_stream_age(void);
+
+// logic analyzer model, see sim_capture.c
+/// pins of Port A (bits 0..7), B (8..15) and C (16..23) at @a cycle
+typedef uint32_t (*sim_waveform_t)(uint32_t cycle);
+
+void     sim_capture_waveform(sim_waveform_t waveform);
+uint32_t sim_capture_cycle(void);
+
+// SPI shift loop model, see sim_spi_shift.c
+/// updates PINSx after every write of the SPI master to OUTx
+typedef void (*sim_wiring_t)(void);
+
+void     sim_spi_wiring(sim_wiring_t wiring);
+uint32_t sim_spi_cycle(void);
+
+// SPI NOR flash model, see sim_flash.c
+#define SIM_FLASH_SIZE   0x100000
+#define SIM_FLASH_SCK    0x01   // Port A
+#define SIM_FLASH_MOSI   0x02   // Port A
+#define SIM_FLASH_CS     0x04   // Port A
+#define SIM_FLASH_MISO   0x08   // Port B
+
+extern uint8_t sim_flash[SIM_FLASH_SIZE];
+
+void     sim_flash_attach(void);
+unsigned sim_flash_violations(void);
+
+// block moves, see sim_xmem.c
+void     sim_xmem_isr_counts(uint16_t counts);
+
+// serial port and EP4/EP5 model, see sim_uart.c
+void     sim_uart_reset(void);
+void     sim_uart_advance(uint16_t counts);
+bool     sim_uart_step(void);
+bool     sim_uart_out(uint8_t port, const uint8_t* data, uint8_t length);
+int      sim_uart_in(uint8_t port, uint8_t* data);
+unsigned sim_uart_lost(void);
+unsigned sim_uart_violations(void);
+
+// test helpers
+void     sim_setup_packet(uint8_t* setup, uint8_t type, uint8_t request,
+                          uint16_t value, uint16_t index, uint16_t length);
+int      sim_request(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+                     uint16_t length, uint8_t* data);
+int      sim_vendor_in(uint8_t request, uint16_t value, uint16_t index, uint8_t* data);
+int      sim_vendor_out(uint8_t request, uint16_t value, uint16_t index);
+void     sim_check(bool ok, const char* what);
+unsigned sim_failures(void);
+
+#endif  // __SIM_H
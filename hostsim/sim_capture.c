@@ -0,0 +1,157 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "capture.h"
+#include "sim.h"
+
+/**
+ * @file Model of the logic analyzer at the level of the capture.h API
+ *
+ * Replaces src/capture.c in the host build, whose sampling loop is written
+ * in assembler. Time is counted in instruction cycles of the EZ-USB. The
+ * pins are taken from the waveform set with sim_capture_waveform(), by
+ * default the PINSx registers. Every capture_poll() polls the trigger up to
+ * 256 times, 10 cycles apart, the samples are then taken at the cycles of
+ * the assembler loop (see capture.h).
+ */
+
+#define SIM_TRIGGER_POLLS    256
+#define SIM_TRIGGER_CYCLES   10    // cycles per trigger poll
+#define SIM_START_CYCLES     16    // from the trigger to the first sample
+
+static sim_waveform_t sim_waveform;
+static uint32_t       sim_cycle;
+
+static enum { csIdle, csArmed, csDone } capture_state;
+static uint8_t  capture_config;
+static uint8_t  capture_divider;
+static uint8_t  capture_trigger_mask;
+static uint8_t  capture_trigger_value;
+static uint16_t capture_samples;
+static uint16_t capture_bytes;
+
+static uint8_t sim_pins(uint8_t port, uint32_t cycle) {
+  return (sim_waveform(cycle) >> (8 * port)) & 0xFF;
+}
+
+static uint32_t sim_registers(uint32_t cycle) {
+  (void)cycle;
+  return PINSA | ((uint32_t)PINSB << 8) | ((uint32_t)PINSC << 16);
+}
+
+/*****************************************************************************/
+/***  Firmware Side (capture.h)  *********************************************/
+/*****************************************************************************/
+
+bool capture_start(uint8_t config, uint8_t divider,
+                   uint8_t trigger_mask, uint8_t trigger_value) {
+  uint8_t i;
+
+  if ((capture_state != csIdle) || (pool_available() != POOL_COUNT) ||
+      ((config & CAPTURE_PORT_MASK) > CAPTURE_PORT_C))
+    return false;
+  for (i = 0; i < POOL_COUNT; i++)
+    pool_alloc();
+  capture_config        = config;
+  capture_divider       = divider;
+  capture_trigger_mask  = trigger_mask;
+  capture_trigger_value = trigger_value & trigger_mask;
+  capture_samples = CAPTURE_MAX_CYCLES /
+                    (CAPTURE_PERIOD(config & CAPTURE_WIDE, divider) * CAPTURE_UNROLL) *
+                    CAPTURE_UNROLL;
+  if (!capture_samples)
+    capture_samples = CAPTURE_UNROLL;
+  if (capture_samples > ((config & CAPTURE_WIDE) ? CAPTURE_SAMPLES_WIDE : CAPTURE_SAMPLES))
+    capture_samples = (config & CAPTURE_WIDE) ? CAPTURE_SAMPLES_WIDE : CAPTURE_SAMPLES;
+  capture_bytes = capture_samples * ((config & CAPTURE_WIDE) ? 3 : 1);
+  capture_state = csArmed;
+  return true;
+}
+
+uint16_t capture_poll(void) {
+  uint8_t  port = capture_config & CAPTURE_PORT_MASK;
+  uint8_t* dst  = (uint8_t*)pool_data[0];
+  uint32_t period;
+  uint16_t i;
+  uint16_t n;
+
+  if (capture_state != csArmed)
+    return 0;
+  for (n = 0; n < SIM_TRIGGER_POLLS; n++) {
+    sim_cycle += SIM_TRIGGER_CYCLES;
+    if ((sim_pins(port, sim_cycle) & capture_trigger_mask) == capture_trigger_value)
+      break;
+  }
+  if (n == SIM_TRIGGER_POLLS)
+    return 0;
+
+  sim_cycle += SIM_START_CYCLES;
+  if (capture_config & CAPTURE_WIDE) {
+    period = CAPTURE_PERIOD(1, capture_divider);
+    for (i = 0; i < capture_samples; i++, sim_cycle += period) {
+      *dst++ = sim_pins(CAPTURE_PORT_A, sim_cycle);
+      *dst++ = sim_pins(CAPTURE_PORT_B, sim_cycle + 3);
+      *dst++ = sim_pins(CAPTURE_PORT_C, sim_cycle + 6);
+    }
+  } else {
+    period = CAPTURE_PERIOD(0, capture_divider);
+    for (i = 0; i < capture_samples; i++, sim_cycle += period)
+      *dst++ = sim_pins(port, sim_cycle);
+  }
+  capture_state = csDone;
+  return capture_bytes;
+}
+
+__xdata uint8_t* capture_buffer(void) {
+  return pool_data[0];
+}
+
+void capture_stop(void) {
+  uint8_t i;
+
+  if (capture_state == csIdle)
+    return;
+  for (i = 0; i < POOL_COUNT; i++)
+    pool_free(i);
+  capture_state = csIdle;
+}
+
+/*****************************************************************************/
+/***  Host Side  *************************************************************/
+/*****************************************************************************/
+
+/**
+ * Set the pin waveform, NULL to use the PINSx registers
+ *
+ * Also restarts the time at cycle 0 and drops the capture (the pool is
+ * reset by sim_stream_reset()).
+ */
+void sim_capture_waveform(sim_waveform_t waveform) {
+  sim_waveform  = waveform ? waveform : sim_registers;
+  sim_cycle     = 0;
+  capture_state = csIdle;
+}
+
+/**
+ * Return the current time in instruction cycles
+ */
+uint32_t sim_capture_cycle(void) {
+  return sim_cycle;
+}
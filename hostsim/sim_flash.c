@@ -0,0 +1,209 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <string.h>
+
+#include "reg_ezusb.h"
+#include "flash.h"
+#include "sim.h"
+
+/**
+ * @file Model of an SPI NOR flash (W25Q80 like, 1 MiB)
+ *
+ * Connected to the SPI master with sim_flash_attach(): SCK, MOSI and CS on
+ * Port A (SIM_FLASH_SCK, ...), MISO on Port B. Supports SPI mode 0 and 3,
+ * MOSI is sampled at the rising edge of SCK, MISO is shifted at the falling
+ * edge. Commands take effect when CS is deasserted, like in a real device.
+ *
+ * The internal write cycles are timed with sim_spi_cycle(), i.e. the flash
+ * is only busy while the firmware shifts data, e.g. polls the status
+ * register. Program and erase requests without WEL or during a write
+ * cycle, and programming 0 bits to 1 are counted as violations.
+ */
+
+#define SIM_FLASH_PROGRAM_CYCLES   4200     // 0.7 ms at 6 cycles/us
+#define SIM_FLASH_ERASE_CYCLES     270000   // 45 ms
+
+#define SIM_FLASH_CMD_READ         0x03
+
+uint8_t sim_flash[SIM_FLASH_SIZE];
+
+static const uint8_t sim_flash_id[3] = { 0xEF, 0x40, 0x14 };
+
+static uint8_t  sim_flash_last;          // last value of OUTA
+static uint8_t  sim_flash_cmd;
+static uint32_t sim_flash_pos;           // bytes since CS was asserted
+static uint32_t sim_flash_addr;
+static uint8_t  sim_flash_in;            // MOSI shift register
+static uint8_t  sim_flash_out;           // MISO shift register
+static uint8_t  sim_flash_bits;
+static uint8_t  sim_flash_latch[FLASH_PAGE_SIZE];
+static bool     sim_flash_latched[FLASH_PAGE_SIZE];
+static bool     sim_flash_wel;
+static uint32_t sim_flash_wip_end;       // sim_spi_cycle() at the end of WIP
+static unsigned sim_flash_errors;
+
+static bool sim_flash_wip(void) {
+  return sim_spi_cycle() < sim_flash_wip_end;
+}
+
+static uint8_t sim_flash_status(void) {
+  return (sim_flash_wip() ? FLASH_SR_WIP : 0) | (sim_flash_wel ? FLASH_SR_WEL : 0);
+}
+
+/**
+ * Start a program or erase cycle, if allowed
+ */
+static bool sim_flash_write_cycle(uint32_t cycles) {
+  if (!sim_flash_wel || sim_flash_wip()) {
+    sim_flash_errors++;
+    return false;
+  }
+  sim_flash_wel     = false;
+  sim_flash_wip_end = sim_spi_cycle() + cycles;
+  return true;
+}
+
+/**
+ * Handle a received byte and return the next byte to shift out
+ */
+static uint8_t sim_flash_byte(uint8_t in) {
+  uint32_t pos = sim_flash_pos++;
+
+  if (pos == 0) {
+    sim_flash_cmd = in;
+    if (in == FLASH_CMD_PAGE_PROGRAM)
+      memset(sim_flash_latched, 0, sizeof(sim_flash_latched));
+  } else if (pos <= 3) {
+    sim_flash_addr = ((sim_flash_addr << 8) | in) & (SIM_FLASH_SIZE - 1);
+  }
+  // only READ STATUS is accepted during a write cycle
+  if (sim_flash_wip() && (sim_flash_cmd != FLASH_CMD_READ_STATUS))
+    return 0xFF;
+
+  switch (sim_flash_cmd) {
+    case FLASH_CMD_JEDEC_ID:
+      return (pos < 3) ? sim_flash_id[pos] : 0xFF;
+    case FLASH_CMD_READ_STATUS:
+      return sim_flash_status();
+    case FLASH_CMD_PAGE_PROGRAM:
+      if (pos >= 4) {
+        // the address wraps around within the page
+        sim_flash_latch[(sim_flash_addr + pos - 4) % FLASH_PAGE_SIZE] = in;
+        sim_flash_latched[(sim_flash_addr + pos - 4) % FLASH_PAGE_SIZE] = true;
+      }
+      return 0xFF;
+    case FLASH_CMD_FAST_READ:
+    case SIM_FLASH_CMD_READ:
+      // FAST READ has a dummy byte after the address
+      if (pos < ((sim_flash_cmd == FLASH_CMD_FAST_READ) ? 4 : 3))
+        return 0xFF;
+      return sim_flash[sim_flash_addr++ & (SIM_FLASH_SIZE - 1)];
+  }
+  return 0xFF;
+}
+
+/**
+ * Execute the command when CS is deasserted
+ */
+static void sim_flash_deselect(void) {
+  uint32_t page = sim_flash_addr & ~(uint32_t)(FLASH_PAGE_SIZE - 1);
+  int      i;
+
+  switch (sim_flash_cmd) {
+    case FLASH_CMD_WRITE_ENABLE:
+      if (sim_flash_pos == 1 && !sim_flash_wip())
+        sim_flash_wel = true;
+      break;
+    case FLASH_CMD_SECTOR_ERASE:
+      if (sim_flash_pos != 4 || !sim_flash_write_cycle(SIM_FLASH_ERASE_CYCLES))
+        break;
+      memset(sim_flash + (sim_flash_addr & ~(uint32_t)(FLASH_SECTOR_SIZE - 1)),
+             0xFF, FLASH_SECTOR_SIZE);
+      break;
+    case FLASH_CMD_PAGE_PROGRAM:
+      if (sim_flash_pos < 5 || !sim_flash_write_cycle(SIM_FLASH_PROGRAM_CYCLES))
+        break;
+      for (i = 0; i < FLASH_PAGE_SIZE; i++) {
+        if (!sim_flash_latched[i])
+          continue;
+        // programming can only clear bits
+        if (sim_flash_latch[i] & ~sim_flash[page + i])
+          sim_flash_errors++;
+        sim_flash[page + i] &= sim_flash_latch[i];
+      }
+      break;
+  }
+  sim_flash_cmd = 0;
+  sim_flash_pos = 0;
+}
+
+/**
+ * SPI slave, called after every write of OUTA
+ */
+static void sim_flash_wiring(void) {
+  uint8_t changed = OUTA ^ sim_flash_last;
+
+  sim_flash_last = OUTA;
+  if (changed & SIM_FLASH_CS) {
+    if (OUTA & SIM_FLASH_CS) {
+      sim_flash_deselect();
+      return;
+    }
+    sim_flash_bits = 0;
+    sim_flash_out  = 0xFF;
+  }
+  if (OUTA & SIM_FLASH_CS)
+    return;
+  if (changed & SIM_FLASH_SCK) {
+    if (OUTA & SIM_FLASH_SCK) {
+      sim_flash_in = (sim_flash_in << 1) | ((OUTA & SIM_FLASH_MOSI) != 0);
+      if (++sim_flash_bits == 8) {
+        sim_flash_bits = 0;
+        sim_flash_out  = sim_flash_byte(sim_flash_in);
+      }
+      return;
+    }
+  }
+  // falling edge or CS asserted: output the next bit
+  if (changed & (SIM_FLASH_SCK | SIM_FLASH_CS))
+    PINSB = (PINSB & ~SIM_FLASH_MISO) |
+            (((sim_flash_out << sim_flash_bits) & 0x80) ? SIM_FLASH_MISO : 0);
+}
+
+/**
+ * Connect the flash to the SPI master, the contents are kept
+ */
+void sim_flash_attach(void) {
+  sim_flash_last    = OUTA;
+  sim_flash_cmd     = 0;
+  sim_flash_pos     = 0;
+  sim_flash_bits    = 0;
+  sim_flash_wel     = false;
+  sim_flash_wip_end = 0;
+  sim_flash_errors  = 0;
+  sim_spi_wiring(sim_flash_wiring);
+}
+
+/**
+ * Return the number of protocol violations since sim_flash_attach()
+ */
+unsigned sim_flash_violations(void) {
+  return sim_flash_errors;
+}
@@ -0,0 +1,134 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "spi.h"
+#include "sim.h"
+
+/**
+ * @file Model of the SPI shift loops (spi_transfer())
+ *
+ * Replaces src/spi_shift.c in the host build, which is written in
+ * assembler. The port registers are written and read in the same order as
+ * by the assembler loops, after every write to OUTx the wiring set with
+ * sim_spi_wiring() updates the PINSx registers.
+ *
+ * The instruction cycles of the loops are accumulated in sim_spi_cycle(),
+ * the external circuit uses them as time base.
+ */
+
+#define SIM_SPI_CALL_CYCLES   40   // prologue and mode dispatch
+#define SIM_SPI_BYTE_CYCLES   20   // per byte, excluding the bits
+#define SIM_SPI_CPHA0_CYCLES  20   // per bit, +1 for a 1 bit
+#define SIM_SPI_CPHA1_CYCLES  25
+
+static sim_wiring_t sim_wiring;
+static uint32_t     sim_spi_cycles;
+
+/**
+ * Set the model of the external circuit, NULL for none
+ */
+void sim_spi_wiring(sim_wiring_t wiring) {
+  sim_wiring     = wiring;
+  sim_spi_cycles = 0;
+}
+
+/**
+ * Return the instruction cycles spent in spi_transfer() since
+ * sim_spi_wiring()
+ */
+uint32_t sim_spi_cycle(void) {
+  return sim_spi_cycles;
+}
+
+/**
+ * Called by the firmware via PORT_WRITTEN() (see common.h)
+ */
+void sim_port_written(void) {
+  if (sim_wiring)
+    sim_wiring();
+}
+
+static void sim_out(uint8_t value) {
+  switch (spi_out_port) {
+    case 0x96: OUTA = value; break;
+    case 0x97: OUTB = value; break;
+    case 0x98: OUTC = value; break;
+  }
+  if (sim_wiring)
+    sim_wiring();
+}
+
+static uint8_t sim_out_read(void) {
+  switch (spi_out_port) {
+    case 0x96: return OUTA;
+    case 0x97: return OUTB;
+    default:   return OUTC;
+  }
+}
+
+static uint8_t sim_pins(void) {
+  switch (spi_pins_port) {
+    case 0x99: return PINSA;
+    case 0x9A: return PINSB;
+    default:   return PINSC;
+  }
+}
+
+void spi_transfer(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length) {
+  uint8_t low, high, out, tx, rx, bit, miso;
+  int     i;
+
+  if (!length)
+    return;
+  sim_spi_cycles += SIM_SPI_CALL_CYCLES;
+  low  = (sim_out_read() & spi_keep_mask) | spi_sck_idle;
+  high = low | spi_mosi_mask;
+  while (length--) {
+    tx = *src++;
+    rx = 0;
+    sim_spi_cycles += SIM_SPI_BYTE_CYCLES;
+    for (i = 0; i < 8; i++) {
+      if (spi_mode & SPI_LSB_FIRST) {
+        bit = tx & 0x01;
+        tx >>= 1;
+      } else {
+        bit = tx >> 7;
+        tx <<= 1;
+      }
+      out = bit ? high : low;
+      sim_spi_cycles += bit + ((spi_mode & SPI_CPHA) ? SIM_SPI_CPHA1_CYCLES : SIM_SPI_CPHA0_CYCLES);
+      if (spi_mode & SPI_CPHA) {
+        sim_out(out ^ spi_sck_mask);
+        miso = (sim_pins() & spi_miso_mask) != 0;
+        sim_out(out);
+      } else {
+        sim_out(out);
+        sim_out(out ^ spi_sck_mask);
+        miso = (sim_pins() & spi_miso_mask) != 0;
+      }
+      if (spi_mode & SPI_LSB_FIRST)
+        rx = (rx >> 1) | (miso << 7);
+      else
+        rx = (rx << 1) | miso;
+    }
+    *dst++ = rx;
+  }
+  sim_out(low);
+}
@@ -0,0 +1,223 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <string.h>
+
+#include "reg_ezusb.h"
+#include "pool.h"
+#include "stream.h"
+#include "xmem.h"
+#include "stats.h"
+#include "sim.h"
+
+/**
+ * @file Model of the EP2 buffers at the level of the stream.h API
+ *
+ * Replaces src/stream.c in the host build. The buffer handshake of the SIE
+ * (EPBSY, byte count registers) is not observable with plain variables, so
+ * the buffers are managed here. Unpaired, one buffer per direction is
+ * available, paired two of them (EP2 and EP3). The pooled mode uses the
+ * firmware's packet pool (src/pool.c).
+ */
+
+static bool    stream_paired;
+static uint8_t stream_in_head;      // oldest armed IN buffer
+static uint8_t stream_in_count;     // number of armed IN buffers
+static uint8_t stream_in_len[2];
+static uint32_t stream_in_time[2];  // sim_time() of stream_in_commit()
+static unsigned stream_in_commits;  // IN packets since sim_stream_reset()
+static uint32_t stream_in_age;      // of the last packet of sim_stream_get()
+static uint8_t stream_out_head;     // oldest filled OUT buffer
+static uint8_t stream_out_count;    // number of filled OUT buffers
+static uint8_t stream_out_len[2];
+static bool    stream_pooled;
+static uint8_t stream_queue[POOL_COUNT];
+static uint8_t stream_queue_head;
+static uint8_t stream_queue_count;
+
+static __xdata uint8_t* stream_in_buf(uint8_t half) {
+  return half ? IN3BUF : IN2BUF;
+}
+
+static __xdata uint8_t* stream_out_buf(uint8_t half) {
+  return half ? OUT3BUF : OUT2BUF;
+}
+
+static uint8_t stream_capacity(void) {
+  return stream_paired ? 2 : 1;
+}
+
+/*****************************************************************************/
+/***  Firmware Side (stream.h)  **********************************************/
+/*****************************************************************************/
+
+void stream_init(bool double_buffered, bool pooled) {
+  stream_paired = double_buffered;
+  stream_pooled = pooled;
+  sim_stream_reset();
+}
+
+bool stream_in_ready(void) {
+  return stream_in_count < stream_capacity();
+}
+
+__xdata uint8_t* stream_in_buffer(void) {
+  return stream_in_buf((stream_in_head + stream_in_count) % stream_capacity());
+}
+
+void stream_in_commit(uint8_t length) {
+  uint8_t half = (stream_in_head + stream_in_count) % stream_capacity();
+
+  stats_ep2_in(length);
+  stream_in_len[half]  = length;
+  stream_in_time[half] = sim_time();
+  stream_in_count++;
+  stream_in_commits++;
+}
+
+static uint8_t stream_queue_id(void) {
+  return stream_queue[stream_queue_head];
+}
+
+bool stream_out_ready(void) {
+  if (stream_pooled)
+    return stream_queue_count > 0;
+  return stream_out_count > 0;
+}
+
+__xdata uint8_t* stream_out_buffer(void) {
+  if (stream_pooled)
+    return pool_data[stream_queue_id()];
+  return stream_out_buf(stream_out_head);
+}
+
+uint8_t stream_out_length(void) {
+  if (stream_pooled)
+    return pool_length[stream_queue_id()];
+  return stream_out_len[stream_out_head];
+}
+
+static void stream_out_pop(void) {
+  stream_out_head = (stream_out_head + 1) % stream_capacity();
+  stream_out_count--;
+}
+
+/**
+ * Move the filled OUT buffers to the pool as long as it has free buffers
+ */
+static void stream_out_fetch(void) {
+  uint8_t id;
+
+  while (stream_out_count > 0) {
+    id = pool_alloc();
+    if (id == POOL_NONE)
+      return;
+    pool_length[id] = stream_out_len[stream_out_head];
+    xmemcpy_isr(pool_data[id], stream_out_buf(stream_out_head), pool_length[id]);
+    stream_out_pop();
+    stream_queue[(stream_queue_head + stream_queue_count) % POOL_COUNT] = id;
+    stream_queue_count++;
+  }
+}
+
+void stream_out_release(void) {
+  stats_ep2_out(stream_out_length());
+  if (stream_pooled) {
+    pool_free(stream_queue_id());
+    stream_queue_head = (stream_queue_head + 1) % POOL_COUNT;
+    stream_queue_count--;
+    stream_out_fetch();
+    return;
+  }
+  stream_out_pop();
+}
+
+void stream_out_isr(void) {
+  if (stream_pooled)
+    stream_out_fetch();
+}
+
+/*****************************************************************************/
+/***  Host Side  *************************************************************/
+/*****************************************************************************/
+
+/**
+ * Drop all packets
+ */
+void sim_stream_reset(void) {
+  stream_in_head   = 0;
+  stream_in_count  = 0;
+  stream_in_commits = 0;
+  stream_out_head  = 0;
+  stream_out_count = 0;
+  stream_queue_head  = 0;
+  stream_queue_count = 0;
+  pool_init();
+}
+
+/**
+ * Store an OUT packet in the next free buffer
+ *
+ * @return false if no buffer is free
+ */
+bool sim_stream_put(const uint8_t* data, uint8_t length) {
+  uint8_t half;
+
+  if ((length == 0) || (length > 64) || (stream_out_count == stream_capacity()))
+    return false;
+  half = (stream_out_head + stream_out_count) % stream_capacity();
+  memcpy((uint8_t*)stream_out_buf(half), data, length);
+  stream_out_len[half] = length;
+  stream_out_count++;
+  return true;
+}
+
+/**
+ * Fetch the oldest armed IN packet
+ *
+ * @return number of bytes or -1 if no packet is armed
+ */
+int sim_stream_get(uint8_t* data) {
+  uint8_t length;
+
+  if (stream_in_count == 0)
+    return -1;
+  length = stream_in_len[stream_in_head];
+  memcpy(data, (uint8_t*)stream_in_buf(stream_in_head), length);
+  stream_in_age = sim_time() - stream_in_time[stream_in_head];
+  stream_in_head = (stream_in_head + 1) % stream_capacity();
+  stream_in_count--;
+  return length;
+}
+
+/**
+ * Return the number of IN packets armed by the firmware since
+ * sim_stream_reset()
+ */
+unsigned sim_stream_commits(void) {
+  return stream_in_commits;
+}
+
+/**
+ * Return the time between arming and fetching the last packet of
+ * sim_stream_get() in Timer 2 counts
+ */
+uint32_t sim_stream_age(void) {
+  return stream_in_age;
+}
@@ -0,0 +1,238 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <string.h>
+
+#include "reg_ezusb.h"
+#include "uart.h"
+#include "sim.h"
+
+/**
+ * @file Model of the serial ports and the EP4/EP5 endpoints of the UART
+ * bridge
+ *
+ * Both serial ports run in mode 1 with Timer 1 in mode 2 as baud rate
+ * generator, the character time (10 bits) is derived from TH1, T1M and
+ * SMOD0/SMOD1. The time is advanced by sim_uart_advance() in Timer 2
+ * counts (6 MHz). TXD of every port is looped back to its RXD: a byte
+ * written to SBUFx is received one character time later. If RI is still
+ * set at that moment, the byte is lost like in the real UART. Writing SBUFx
+ * during a transmission is counted as violation.
+ *
+ * The serial ISRs are called as long as RI or TI is set (and ESx and EA),
+ * also when the firmware sets TI to start a transmission.
+ *
+ * EP4 OUT and EP5 OUT are armed while OUTxBC is 0, i.e. after the firmware
+ * has written it. An IN packet is armed by writing INxBC, SIM_UART_NO_BC
+ * marks a free IN endpoint.
+ */
+
+#define SIM_UART_NO_BC   0xFF     // INxBC was not written
+
+static uint32_t sim_uart_tx_left[UART_COUNT];   // counts until the stop bit
+static uint32_t sim_uart_tx_late[UART_COUNT];   // counts since the stop bit
+static uint8_t  sim_uart_tx_byte[UART_COUNT];
+static unsigned sim_uart_lost_count;
+static unsigned sim_uart_errors;
+
+/**
+ * Power-on reset of the serial ports and the endpoints
+ */
+void sim_uart_reset(void) {
+  memset(sim_uart_tx_left, 0, sizeof(sim_uart_tx_left));
+  memset(sim_uart_tx_late, 0, sizeof(sim_uart_tx_late));
+  sim_uart_lost_count = 0;
+  sim_uart_errors     = 0;
+  TMOD = TH1 = TL1 = 0;
+  TR1 = ET1 = false;
+  SCON0 = SCON1 = 0;
+  RI_0 = TI_0 = RI_1 = TI_1 = REN_0 = REN_1 = false;
+  ES0 = ES1 = SMOD1 = false;
+  PCON = 0;
+  IN4BC  = IN5BC  = SIM_UART_NO_BC;
+  OUT4BC = OUT5BC = SIM_UART_NO_BC;
+}
+
+/**
+ * Return the character time of @a port in Timer 2 counts, 0 if Timer 1
+ * doesn't generate a baud rate
+ */
+static uint32_t sim_uart_char_counts(uint8_t port) {
+  uint32_t bit;
+  bool     smod = port ? SMOD1 : (PCON & SMOD0);
+
+  if (!TR1 || ((TMOD & (CT1 | M10 | M11)) != M11))
+    return 0;
+  // one bit is 32 (16 with SMOD) Timer 1 overflows
+  bit = (uint32_t)(256 - TH1) * (smod ? 16 : 32);
+  if (!(CKCON & T1M))
+    bit *= 3;   // CLK/12
+  return 10 * bit;
+}
+
+/**
+ * Called by SBUF_WRITTEN() after the firmware has written SBUF0/SBUF1
+ */
+void sim_sbuf_written(uint8_t port) {
+  if (sim_uart_tx_left[port]) {
+    sim_uart_errors++;
+    return;
+  }
+  sim_uart_tx_byte[port] = port ? SBUF1 : SBUF0;
+  sim_uart_tx_left[port] = sim_uart_char_counts(port);
+  if (!sim_uart_tx_left[port]) {
+    sim_uart_errors++;
+    return;
+  }
+  // a byte written by the ISR right after the last one starts when that
+  // one ended, not at the end of the time step
+  if (sim_uart_tx_late[port] < sim_uart_tx_left[port])
+    sim_uart_tx_left[port] -= sim_uart_tx_late[port];
+  else
+    sim_uart_tx_left[port] = 1;
+}
+
+/**
+ * Call the serial ISRs while they have a pending interrupt
+ *
+ * @return true if an ISR was called
+ */
+bool sim_uart_step(void) {
+  bool done = false;
+
+  while (EA && ((ES0 && (RI_0 || TI_0)) || (ES1 && (RI_1 || TI_1)))) {
+    if (ES0 && (RI_0 || TI_0))
+      uart0_isr();
+    if (ES1 && (RI_1 || TI_1))
+      uart1_isr();
+    done = true;
+  }
+  return done;
+}
+
+/**
+ * Let @a counts Timer 2 counts pass on both serial ports
+ */
+void sim_uart_advance(uint16_t counts) {
+  uint8_t port;
+
+  for (port = 0; port < UART_COUNT; port++) {
+    if (!sim_uart_tx_left[port])
+      continue;
+    if (sim_uart_tx_left[port] > counts) {
+      sim_uart_tx_left[port] -= counts;
+      continue;
+    }
+    // stop bit sent, the byte arrives at RXD
+    sim_uart_tx_late[port] = counts - sim_uart_tx_left[port];
+    sim_uart_tx_left[port] = 0;
+    if (port ? REN_1 : REN_0) {
+      if (port ? RI_1 : RI_0) {
+        sim_uart_lost_count++;
+      } else if (port) {
+        SBUF1 = sim_uart_tx_byte[port];
+        RI_1  = true;
+      } else {
+        SBUF0 = sim_uart_tx_byte[port];
+        RI_0  = true;
+      }
+    }
+    if (port)
+      TI_1 = true;
+    else
+      TI_0 = true;
+  }
+  sim_uart_step();
+  memset(sim_uart_tx_late, 0, sizeof(sim_uart_tx_late));
+}
+
+/**
+ * Send an EP4 (port 0) or EP5 (port 1) OUT packet of 1 to 64 bytes
+ *
+ * Only the endpoint ISR is executed, the firmware takes the packet in
+ * sim_run().
+ *
+ * @return false if the endpoint isn't armed (NAK)
+ */
+bool sim_uart_out(uint8_t port, const uint8_t* data, uint8_t length) {
+  if (port) {
+    if (OUT5BC != 0)
+      return false;
+    memcpy((uint8_t*)OUT5BUF, data, length);
+    OUT5BC = length;
+    OUT07IRQ |= OUT5IR;
+    ep5out_isr();
+  } else {
+    if (OUT4BC != 0)
+      return false;
+    memcpy((uint8_t*)OUT4BUF, data, length);
+    OUT4BC = length;
+    OUT07IRQ |= OUT4IR;
+    ep4out_isr();
+  }
+  return true;
+}
+
+/**
+ * Receive an EP4 (port 0) or EP5 (port 1) IN packet
+ *
+ * @return number of bytes in @a data (max. 64) or -1 if no packet is
+ *   available (NAK)
+ */
+int sim_uart_in(uint8_t port, uint8_t* data) {
+  int length;
+
+  if (port) {
+    if (IN5BC == SIM_UART_NO_BC) {
+      sim_ibn(5);
+      return -1;
+    }
+    length = (IN5BC > 64) ? 64 : IN5BC;
+    memcpy(data, (uint8_t*)IN5BUF, length);
+    IN5BC = SIM_UART_NO_BC;
+    IN07IRQ |= IN5IR;
+    ep5in_isr();
+  } else {
+    if (IN4BC == SIM_UART_NO_BC) {
+      sim_ibn(4);
+      return -1;
+    }
+    length = (IN4BC > 64) ? 64 : IN4BC;
+    memcpy(data, (uint8_t*)IN4BUF, length);
+    IN4BC = SIM_UART_NO_BC;
+    IN07IRQ |= IN4IR;
+    ep4in_isr();
+  }
+  return length;
+}
+
+/**
+ * Return the number of bytes lost at RXD because RI was still set
+ */
+unsigned sim_uart_lost(void) {
+  return sim_uart_lost_count;
+}
+
+/**
+ * Return the number of SBUFx writes during a transmission or without a
+ * baud rate
+ */
+unsigned sim_uart_violations(void) {
+  return sim_uart_errors;
+}
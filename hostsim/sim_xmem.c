@@ -0,0 +1,68 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <string.h>
+
+#include "xmem.h"
+#include "sim.h"
+
+/**
+ * @file C versions of the block moves for the host build
+ *
+ * Replace src/xmem.c, which uses the EZ-USB auto-pointer.
+ */
+
+static uint16_t sim_xmem_counts;   // Timer 2 counts of every xmemcpy_isr()
+
+/**
+ * Let @a counts Timer 2 counts pass in every xmemcpy_isr(), 0 to take no
+ * time (default)
+ *
+ * The EP0 ISRs copy the data stage with xmemcpy_isr(), this gives them a
+ * duration for the performance counters (see stats.h).
+ */
+void sim_xmem_isr_counts(uint16_t counts) {
+  sim_xmem_counts = counts;
+}
+
+void xmemcpy(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length) {
+  memcpy(dst, src, length);
+}
+
+void xmemcpy_code(__xdata uint8_t* dst, const __code uint8_t* src, uint8_t length) {
+  memcpy(dst, src, length);
+}
+
+uint8_t xstrcpy_code(__xdata char* dst, const __code char* src) {
+  uint8_t length;
+
+  // like the target version without the terminating zero
+  for (length = 0; (length < 255) && (src[length] != '\0'); length++)
+    dst[length] = src[length];
+  return length;
+}
+
+void xmemset(__xdata uint8_t* dst, uint8_t value, uint8_t length) {
+  memset(dst, value, length);
+}
+
+void xmemcpy_isr(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length) {
+  memcpy(dst, src, length);
+  sim_elapse(sim_xmem_counts);
+}
@@ -0,0 +1,167 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file SPI master loopback test
+ *
+ * SCK, MOSI and CS are on Port A, MISO on Port B, the wiring model ties
+ * MISO to MOSI. Additionally it acts as SPI slave: it checks that SCK only
+ * toggles while CS is asserted and samples MOSI at the edge given by CPHA
+ * with the bit order of the mode, MOSI must not change with that edge. For all 4 modes and both bit orders a 64
+ * byte packet (CS stays asserted) and a short packet (CS is deasserted) are
+ * sent on EP2 OUT. The bytes received on EP2 IN and by the slave must match
+ * the sent bytes.
+ *
+ * Usage: spiloop
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "commands.h"
+#include "spi.h"
+
+#define SCK                      0x01   // Port A
+#define MOSI                     0x02   // Port A
+#define CS                       0x04   // Port A
+#define MISO                     0x08   // Port B
+#define PIN_SCK                  SPI_PIN(SPI_PORT_A, 0)
+#define PIN_MOSI                 SPI_PIN(SPI_PORT_A, 1)
+#define PIN_CS                   SPI_PIN(SPI_PORT_A, 2)
+#define PIN_MISO                 SPI_PIN(SPI_PORT_B, 3)
+
+// see include/reg_ezusb.h, not included as it defines CS as well
+extern volatile uint8_t OUTA, PINSB;
+
+#define MAX_BYTES                128
+
+static uint8_t mode;
+static bool    error;
+static uint8_t last_outa;
+static uint8_t slave_data[MAX_BYTES];
+static int     slave_bits;
+
+/**
+ * MISO = MOSI and SPI slave, called after every write of OUTA
+ */
+static void wiring(void) {
+  uint8_t changed = OUTA ^ last_outa;
+  bool    idle    = ((OUTA & SCK) != 0) == ((mode & SPI_CPOL) != 0);
+  bool    sample;
+  uint8_t bit;
+  int     n;
+
+  PINSB = (OUTA & MOSI) ? MISO : 0;
+  if (changed & SCK) {
+    if (OUTA & CS)
+      error = true;           // clock without CS
+    // CPHA = 0: sample on the leading edge (leaving idle), 1: on the trailing
+    sample = (mode & SPI_CPHA) ? idle : !idle;
+    // MOSI must be stable at the sampling edge
+    if (sample && (changed & MOSI))
+      error = true;
+    if (sample && slave_bits < 8 * MAX_BYTES) {
+      n   = slave_bits / 8;
+      bit = (OUTA & MOSI) != 0;
+      if (mode & SPI_LSB_FIRST)
+        slave_data[n] |= bit << (slave_bits % 8);
+      else
+        slave_data[n] |= bit << (7 - slave_bits % 8);
+      slave_bits++;
+    }
+  }
+  last_outa = OUTA;
+}
+
+/**
+ * Run the loopback test in SPI mode @a m
+ */
+static bool run(uint8_t m) {
+  uint8_t data[MAX_BYTES];
+  uint8_t received[MAX_BYTES];
+  uint8_t response[64];
+  int     length = 0;
+  int     n;
+  int     i;
+
+  for (i = 0; i < MAX_BYTES; i++)
+    data[i] = (uint8_t)(i * 29 + m);
+  sim_reset();
+  mode       = m;
+  error      = false;
+  slave_bits = 0;
+  memset(slave_data, 0, sizeof(slave_data));
+
+  sim_vendor_out(CMD_SET_EP2_MODE, EP2_MODE_SPI, 0);
+  if (sim_vendor_in(CMD_SPI_CONFIG, (PIN_MOSI << 8) | PIN_SCK | m,
+                    (PIN_CS << 8) | PIN_MISO, response) != 1 || response[0] != SPI_OK)
+    return false;
+  // idle levels
+  if (!(OUTA & CS) || (((OUTA & SCK) != 0) != ((m & SPI_CPOL) != 0)))
+    return false;
+  last_outa = OUTA;
+  sim_spi_wiring(wiring);
+
+  // full packet: CS stays asserted, short packet: CS is deasserted
+  if (!sim_ep2_out(data, 64) || (OUTA & CS))
+    return false;
+  while ((n = sim_ep2_in(received + length)) >= 0)
+    length += n;
+  if (!sim_ep2_out(data + 64, 10) || !(OUTA & CS))
+    return false;
+  while ((n = sim_ep2_in(received + length)) >= 0)
+    length += n;
+
+  if (error || length != 74 || slave_bits != 8 * 74)
+    return false;
+  if (memcmp(received, data, 74) || memcmp(slave_data, data, 74))
+    return false;
+  // SCK idle after the transfer
+  return ((OUTA & SCK) != 0) == ((m & SPI_CPOL) != 0);
+}
+
+int main(void) {
+  static const uint8_t modes[] = { 0, SPI_CPHA, SPI_CPOL, SPI_CPOL | SPI_CPHA };
+  uint8_t      response[64];
+  unsigned int i, lsb;
+  uint8_t      m;
+  int          status = 0;
+
+  for (lsb = 0; lsb < 2; lsb++) {
+    for (i = 0; i < sizeof(modes); i++) {
+      m = modes[i] | (lsb ? SPI_LSB_FIRST : 0);
+      if (run(m)) {
+        printf("mode %u %s  74 bytes looped back\n", i, lsb ? "LSB first" : "MSB first");
+      } else {
+        printf("mode %u %s  failed\n", i, lsb ? "LSB first" : "MSB first");
+        status = 1;
+      }
+    }
+  }
+
+  // MOSI on another port than SCK
+  sim_reset();
+  if (sim_vendor_in(CMD_SPI_CONFIG, (0x09 << 8) | PIN_SCK, (PIN_CS << 8) | PIN_MISO, response) != 1 ||
+      response[0] != SPI_INVALID) {
+    printf("invalid pins accepted\n");
+    status = 1;
+  }
+  return status;
+}
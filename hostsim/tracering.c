@@ -0,0 +1,233 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file Binary event trace ring
+ *
+ * Runs control transfers, an EP2 loopback and I2C writes and checks the
+ * records drained with CMD_TRACE_READ: their order, the arguments, the
+ * reconstruction of the time across a TRACE_SYNC record, the overwriting of
+ * the oldest records when the ring is full and the partial reads in the
+ * command stream.
+ *
+ * The responses of CMD_TRACE_READ via EP0 are appended to FILE if given, to
+ * be decoded with "host/tracedump.py --file FILE".
+ *
+ * Usage: tracering [FILE]
+ */
+
+#include <stdio.h>
+
+#include "sim.h"
+#include "commands.h"
+#include "trace.h"
+#include "i2c.h"
+#include "eeprom.h"
+#include "delay.h"
+
+#define HEADER_SIZE              sizeof(TTraceHeader)
+#define PACKETS                  3
+#define GAP_MS                   20
+#define SHORT_COUNTS             (7 * TIMER_COUNTS_PER_MS + TIMER_COUNTS_PER_MS / 2)
+
+typedef struct {
+  uint8_t  Id;
+  uint8_t  Arg;
+  uint16_t Time;
+} TRecord;
+
+static FILE* dump;
+
+static void unpack(const uint8_t* data, int n, TRecord* r) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    r[i].Id   = data[4 * i];
+    r[i].Arg  = data[4 * i + 1];
+    r[i].Time = data[4 * i + 2] | (data[4 * i + 3] << 8);
+  }
+}
+
+/**
+ * Drain the ring with CMD_TRACE_READ via EP0
+ *
+ * @return number of records in @a r or -1 if the request failed
+ */
+static int drain(TRecord* r, uint8_t* lost, uint8_t* left) {
+  uint8_t data[256];
+  int     n;
+
+  n = sim_request(0xC0, CMD_TRACE_READ, 0, 0, sizeof(data), data);
+  if ((n < HEADER_SIZE) || (n != HEADER_SIZE + 4 * data[0]))
+    return -1;
+  if (dump)
+    fwrite(data, 1, n, dump);
+  *lost = data[1];
+  *left = data[2];
+  unpack(data + HEADER_SIZE, data[0], r);
+  return data[0];
+}
+
+/**
+ * Return the index of the first record @a id with @a arg from @a start on
+ * or -1
+ */
+static int find(const TRecord* r, int n, int start, uint8_t id, uint8_t arg) {
+  int i;
+
+  for (i = start; i < n; i++)
+    if ((r[i].Id == id) && (r[i].Arg == arg))
+      return i;
+  return -1;
+}
+
+/**
+ * Time of the records in Timer 2 counts since the first TRACE_SYNC
+ *
+ * This is the algorithm of host/tracedump.py.
+ */
+static void decode(const TRecord* r, int n, int64_t* t) {
+  int64_t tick = -1;
+  int     i;
+
+  for (i = 0; i < n; i++) {
+    if (r[i].Id == TRACE_SYNC) {
+      tick = r[i].Time;
+      t[i] = tick * TIMER_COUNTS_PER_MS;
+    } else if (tick < 0) {
+      t[i] = -1;
+    } else {
+      tick += ((r[i].Time >> 13) - tick) & 7;
+      t[i] = tick * TIMER_COUNTS_PER_MS + (r[i].Time & 0x1FFF);
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint8_t  data[64];
+  TRecord  r[TRACE_RING_SIZE];
+  int64_t  t[TRACE_RING_SIZE];
+  uint8_t  lost, left;
+  int      i, j, n;
+  bool     ok;
+
+  if (argc > 1) {
+    dump = fopen(argv[1], "ab");
+    if (!dump) {
+      perror(argv[1]);
+      return 2;
+    }
+  }
+
+  // the first record is preceded by a TRACE_SYNC record
+  sim_reset();
+  n = drain(r, &lost, &left);
+  sim_check(n == 3 && r[0].Id == TRACE_SYNC && r[1].Id == TRACE_SETUP && r[1].Arg == CMD_TRACE_READ &&
+            r[2].Id == TRACE_COMMAND && r[2].Arg == CMD_TRACE_READ && lost == 0 && left == 0,
+            "SETUP and command of the read");
+
+  // EP2 loopback: every OUT packet is followed by its IN packet
+  ok = sim_request(0x40, CMD_SET_EP2_MODE, EP2_MODE_LOOPBACK, 0, 0, data) == 0;
+  for (i = 0; ok && (i < PACKETS); i++) {
+    ok = sim_ep2_out(data, 10);
+    sim_run();
+    ok = ok && (sim_ep2_in(data) == 10);
+  }
+  n = drain(r, &lost, &left);
+  j = find(r, n, 0, TRACE_COMMAND, CMD_SET_EP2_MODE);
+  for (i = 0; ok && (i < PACKETS); i++) {
+    j = find(r, n, j, TRACE_EP_OUT, 2);
+    ok = (j >= 0) && (find(r, n, j, TRACE_EP_IN, 2) > j);
+    j++;
+  }
+  sim_check(ok && find(r, n, 0, TRACE_SETUP, CMD_SET_EP2_MODE) >= 0, "EP2 OUT and IN ISRs");
+  sim_request(0x40, CMD_SET_EP2_MODE, EP2_MODE_IDLE, 0, 0, data);
+
+  // I2C: acknowledged and not acknowledged write
+  data[0] = 0x01;
+  data[1] = 0x00;
+  for (i = 2; i < 10; i++)
+    data[i] = i;
+  drain(r, &lost, &left);
+  ok = sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR, 0, 10, data) == 0;
+  ok = ok && (sim_request(0x40, CMD_I2C_WRITE, EEPROM_I2C_ADDR + 1, 0, 10, data) == SIM_STALL);
+  n = drain(r, &lost, &left);
+  i = find(r, n, 0, TRACE_I2C_START, EEPROM_I2C_ADDR);
+  j = find(r, n, 0, TRACE_I2C_START, EEPROM_I2C_ADDR + 1);
+  sim_check(ok && i >= 0 && find(r, n, i, TRACE_I2C_DONE, I2C_OK) > i &&
+            j > i && find(r, n, j, TRACE_I2C_DONE, I2C_NACK) > j, "I2C transactions");
+
+  // time across a gap, both SETUP packets follow a TRACE_SYNC record
+  drain(r, &lost, &left);
+  sim_elapse(GAP_MS * TIMER_COUNTS_PER_MS + TIMER_COUNTS_PER_MS / 3);
+  ok = sim_request(0xC0, CMD_GET_STATUS, 0, 0, 1, data) == 1;
+  sim_elapse(GAP_MS * TIMER_COUNTS_PER_MS);
+  ok = ok && (sim_request(0xC0, CMD_GET_STATUS, 0, 0, 1, data) == 1);
+  sim_elapse(SHORT_COUNTS);
+  ok = ok && (sim_request(0xC0, CMD_GET_STATUS, 0, 0, 1, data) == 1);
+  n = drain(r, &lost, &left);
+  decode(r, n, t);
+  i = find(r, n, 0, TRACE_SETUP, CMD_GET_STATUS);
+  j = find(r, n, i + 1, TRACE_SETUP, CMD_GET_STATUS);
+  sim_check(ok && i > 0 && j > i && r[i - 1].Id == TRACE_SYNC && r[j - 1].Id == TRACE_SYNC &&
+            t[j] - t[i] >= GAP_MS * TIMER_COUNTS_PER_MS && t[j] - t[i] < (GAP_MS + 1) * TIMER_COUNTS_PER_MS,
+            "time reconstructed across TRACE_SYNC");
+  printf("  %.1f us between the first two SETUP packets\n", (t[j] - t[i]) / 6.0);
+  i = j;
+  j = find(r, n, i + 1, TRACE_SETUP, CMD_GET_STATUS);
+  sim_check(j > i && find(r, n, i, TRACE_SYNC, 0) < 0 &&
+            t[j] - t[i] >= SHORT_COUNTS && t[j] - t[i] < SHORT_COUNTS + TIMER_COUNTS_PER_MS,
+            "time reconstructed without TRACE_SYNC");
+  printf("  %.1f us between the last two SETUP packets\n", (t[j] - t[i]) / 6.0);
+
+  // full ring: the latest records are kept
+  for (i = 0; i < TRACE_RING_SIZE; i++)
+    sim_request(0xC0, CMD_GET_STATUS, 0, 0, 1, data);
+  n = drain(r, &lost, &left);
+  sim_check(n == TRACE_RING_SIZE && lost > 0 && left == 0 &&
+            r[n - 2].Id == TRACE_SETUP && r[n - 2].Arg == CMD_TRACE_READ &&
+            r[n - 1].Id == TRACE_COMMAND && r[n - 1].Arg == CMD_TRACE_READ,
+            "oldest records overwritten");
+
+  // command stream: partial reads
+  for (i = 0; i < TRACE_RING_SIZE; i++)
+    sim_request(0xC0, CMD_GET_STATUS, 0, 0, 1, data);
+  ok = sim_request(0x40, CMD_SET_EP2_MODE, EP2_MODE_CMDSTREAM, 0, 0, data) == 0;
+  left = 0;
+  for (i = 0; i < 2; i++) {
+    uint8_t rec[6] = { CMD_TRACE_READ, 0, 0, 0, 0, 0 };
+
+    ok = ok && sim_ep2_out(rec, sizeof(rec));
+    sim_run();
+    n = sim_ep2_in(data);
+    ok = ok && (data[0] == CMD_TRACE_READ) && (n == 2 + HEADER_SIZE + 4 * data[2]);
+    if (i == 0) {
+      // the ring is full, the rest is left for the next read
+      ok = ok && (data[2] == TRACE_STREAM_RECORDS) && (data[4] > 0);
+      left = data[4];
+    } else {
+      ok = ok && (data[2] >= left);
+    }
+  }
+  sim_check(ok, "partial reads in the command stream");
+
+  if (dump)
+    fclose(dump);
+  return sim_failures() ? 1 : 0;
+}
@@ -0,0 +1,212 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/**
+ * @file UART bridge throughput test
+ *
+ * Every scenario configures the serial ports with CMD_UART_CONFIG and
+ * streams BYTES bytes through each enabled port: the host sends them on
+ * EP4/EP5 OUT whenever the endpoint is armed, the UART model loops TXD back
+ * to RXD and the host reads them back from EP4/EP5 IN. Every STEP_COUNTS
+ * Timer 2 counts the main loop runs once. The data must arrive unchanged,
+ * without overruns, at LINE_RATE_MIN percent of the line rate and coalesced
+ * into IN packets of at least MIN_PACKET bytes on average. The sustained
+ * bytes per second of every port (from the first to the last IN packet)
+ * are printed.
+ *
+ * The "echo" scenario sends a few bytes and measures the time until they
+ * are returned, i.e. the idle timeout of a partly filled IN packet.
+ *
+ * A CMD_UART_CONFIG with invalid flags for port 1 must change neither the
+ * Timer 1 divisor nor port 0.
+ *
+ * Usage: uartbridge
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "reg_ezusb.h"
+#include "commands.h"
+#include "uart.h"
+
+#define BYTES                    4096
+#define ECHO_BYTES               3
+#define STEP_COUNTS              300       // 50 us
+#define COUNTS_PER_S             6000000
+#define MAX_COUNTS               (10 * COUNTS_PER_S)
+#define LINE_RATE_MIN            95        // percent
+#define MIN_PACKET               48
+
+typedef struct {
+  const char* Name;
+  uint8_t     Divisor;       // Timer 1, always with UART_DOUBLE
+  uint8_t     Ports;         // bit 0: port 0, bit 1: port 1
+  uint16_t    Bytes;         // per port
+} TScenario;
+
+static const TScenario scenarios[] = {
+  { "9615",      39, 0x01, BYTES      },
+  { "37500",     10, 0x03, BYTES      },
+  { "125000",     3, 0x03, BYTES      },
+  { "echo",       3, 0x02, ECHO_BYTES },
+};
+
+/**
+ * Read the overrun count of @a port with CMD_UART_STATUS
+ *
+ * @return -1 if the request failed
+ */
+static int overruns(uint8_t port) {
+  uint8_t r[64];
+
+  if (sim_vendor_in(CMD_UART_STATUS, 0, port, r) != 4)
+    return -1;
+  return r[2] | (r[3] << 8);
+}
+
+/**
+ * Run scenario @a s
+ *
+ * @return true if the data, the rate and the status match
+ */
+static bool run(const TScenario* s) {
+  uint8_t  response[64];
+  uint16_t config = 0;
+  uint8_t  data[BYTES];
+  uint8_t  packet[64];
+  unsigned sent[2]     = { 0, 0 };
+  unsigned received[2] = { 0, 0 };
+  unsigned packets[2]  = { 0, 0 };
+  uint32_t first[2]    = { 0, 0 };   // counts at the first IN packet
+  unsigned first_len[2] = { 0, 0 };
+  uint32_t done[2]     = { 0, 0 };   // counts at the last IN packet
+  uint32_t counts = 0;
+  uint32_t line   = 375000 / s->Divisor / 10;
+  uint32_t rate;
+  uint8_t  port;
+  int      n;
+
+  for (n = 0; n < BYTES; n++)
+    data[n] = (uint8_t)(n * 13 + 5);
+
+  sim_reset();
+  for (port = 0; port < 2; port++)
+    if (s->Ports & (1 << port))
+      config |= (UART_ENABLE | UART_DOUBLE) << (8 * port);
+  if ((sim_vendor_in(CMD_UART_CONFIG, s->Divisor, config, response) != 1) ||
+      (response[0] != UART_OK))
+    return false;
+
+  while (counts < MAX_COUNTS) {
+    for (port = 0; port < 2; port++) {
+      if (!(s->Ports & (1 << port)))
+        continue;
+      n = s->Bytes - sent[port];
+      if (n > 64)
+        n = 64;
+      if (n && sim_uart_out(port, data + sent[port], n))
+        sent[port] += n;
+      while ((n = sim_uart_in(port, packet)) >= 0) {
+        if ((received[port] + n > s->Bytes) ||
+            memcmp(packet, data + received[port], n)) {
+          printf("%-8s port %d: wrong data at byte %u\n", s->Name, port, received[port]);
+          return false;
+        }
+        received[port] += n;
+        packets[port]++;
+        done[port] = counts;
+        if (packets[port] == 1) {
+          first[port]     = counts;
+          first_len[port] = n;
+        }
+      }
+    }
+    if (((s->Ports & 1) && (received[0] < s->Bytes)) ||
+        ((s->Ports & 2) && (received[1] < s->Bytes))) {
+      sim_run();
+      sim_elapse(STEP_COUNTS);
+      counts += STEP_COUNTS;
+      continue;
+    }
+    break;
+  }
+  if ((sim_uart_lost() != 0) || (sim_uart_violations() != 0))
+    return false;
+
+  for (port = 0; port < 2; port++) {
+    if (!(s->Ports & (1 << port)))
+      continue;
+    if ((received[port] != s->Bytes) || (overruns(port) != 0))
+      return false;
+    if (s->Bytes < 64) {
+      // a partial packet waits for the idle timeout
+      printf("%-8s port %d: %u bytes returned after %u us in %u packet(s)\n",
+             s->Name, port, s->Bytes, done[port] / 6, packets[port]);
+      if (packets[port] != 1)
+        return false;
+      continue;
+    }
+    // from the first to the last IN packet, without the latency of the
+    // first one
+    rate = (uint64_t)(received[port] - first_len[port]) * COUNTS_PER_S /
+           (done[port] - first[port]);
+    printf("%-8s port %d: %6u B/s sustained (line rate %6u B/s), %3u IN packets, %4.1f B/packet\n",
+           s->Name, port, rate, line, packets[port], (double)received[port] / packets[port]);
+    if ((rate * 100 < line * LINE_RATE_MIN) || (received[port] < packets[port] * MIN_PACKET))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Configure port 0 and then send a request with invalid flags for port 1
+ *
+ * @return true if the request was rejected without any change
+ */
+static bool invalid(void) {
+  uint8_t r[64];
+
+  sim_reset();
+  if ((sim_vendor_in(CMD_UART_CONFIG, 3, UART_ENABLE, r) != 1) || (r[0] != UART_OK))
+    return false;
+  if ((sim_vendor_in(CMD_UART_CONFIG, 6, UART_DOUBLE | (0x80 << 8), r) != 1) ||
+      (r[0] != UART_INVALID))
+    return false;
+  return (TH1 == (uint8_t)-3) && !(PCON & SMOD0) && REN_0;
+}
+
+int main(void) {
+  unsigned int i;
+  int          status = 0;
+
+  if (!invalid()) {
+    printf("invalid  failed\n");
+    status = 1;
+  }
+  for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    if (!run(&scenarios[i])) {
+      printf("%-8s failed\n", scenarios[i].Name);
+      status = 1;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,73 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdint.h>
+
+/**
+ * Simulator Benchmark Driver
+ *
+ * Compiled with "make BENCH=1" (see "make bench"), main() calls bench_loop()
+ * instead of command_loop(). The simulator has no model of the EZ-USB
+ * peripherals, therefore tools/bench.py stops the simulation in bench_idle(),
+ * writes the next event to bench_mailbox and continues. bench_loop() then
+ * emulates the corresponding hardware event and the measurements are taken
+ * by the profiling instrumentation (see profile.h).
+ */
+
+/// events posted to bench_mailbox.Event
+#define BENCH_NONE        0x00   // nothing to do
+#define BENCH_RESET       0x01   // clear the profiling measurements
+#define BENCH_SETUP       0x02   // Data[0..7]: SETUP packet -> sudav_isr()
+#define BENCH_I2C_START   0x03   // Data[0]: slave address, Data[1..]: bytes
+                                 // to write -> i2c_start_write()
+#define BENCH_I2C         0x04   // Data[0]: I2CS, Data[1]: I2DAT -> i2c_isr()
+#define BENCH_CAPTURE     0x05   // Data[0..3]: config, divider, trigger mask
+                                 // and value -> capture_poll()
+#define BENCH_PATTERN     0x06   // Data[0]: config, Data[1..]: samples
+                                 // -> pattern_put(), timer0_isr()
+#define BENCH_SPI         0x07   // Data[0]: mode flags, Data[1..]: bytes
+                                 // to send -> spi_transfer()
+#define BENCH_JTAG        0x08   // Data[0]: TMS at the last bit, Data[1..]:
+                                 // TDI bytes -> jtag_scan()
+#define BENCH_STREAM      0x09   // Data[0]: EP2_FLAG_*, Data[1]: number of
+                                 // packets -> StreamProduce()
+#define BENCH_COPY        0x0A   // Data[0]: BENCH_COPY_*, Data[1]: length
+                                 // -> copy OUT2BUF to IN2BUF
+#define BENCH_DELAY       0x0B   // Data[0..1]: microseconds (LSB first)
+                                 // -> delay_us()
+
+/// copy methods of BENCH_COPY
+#define BENCH_COPY_LOOP   0x00   // pointer loop through DPTR
+#define BENCH_COPY_XMEM   0x01   // xmemcpy() (see xmem.h)
+
+typedef struct {
+  uint8_t  Event;        // one of the BENCH_* values
+  uint8_t  Length;       // number of valid bytes in Data
+  uint8_t  Data[64];     // event parameters
+} TBenchMailbox;
+
+extern __xdata TBenchMailbox bench_mailbox;
+
+void bench_idle(void);
+void bench_loop(void);
+
+#endif  // __BENCH_H
@@ -0,0 +1,82 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pool.h"
+
+/**
+ * @file Logic analyzer: burst sampling of the port pins
+ *
+ * A capture samples the pins of one port (8 pins) or of Port A, B and C (24
+ * pins) at a fixed rate into the packet pool (see pool.h), which is taken
+ * over as a whole for the duration of the capture. Sampling starts as soon
+ * as (PINSx & trigger mask) == trigger value on the trigger port.
+ *
+ * The sampling loop is written in assembler, reads the PINSx registers with
+ * "movx a,@r0" and stores via the auto-pointer with "movx @r1,a", both with
+ * MPAGE = 0x7F. It is unrolled by CAPTURE_UNROLL samples and padded, so the
+ * loop branch takes the same cycles as the padding and all samples are
+ * equidistant:
+ *
+ *   8 pins:  7 cycles per sample (857 kS/s), 24 pins: 19 cycles (316 kS/s)
+ *
+ * plus 2 + 3 * divider cycles with divider > 0 (cycles of the EZ-USB core,
+ * 6 per microsecond). With 24 pins, Port B and C are read 3 and 6 cycles
+ * after Port A. The first sample is taken 16 to 26 cycles after the trigger
+ * condition was read. Interrupts are disabled while polling the trigger (at
+ * most 256 polls per capture_poll() call) and while sampling.
+ *
+ * To keep the interrupt latency bounded, sampling takes at most
+ * CAPTURE_MAX_CYCLES (1 ms): with a divider, the capture is shortened to
+ * the largest multiple of CAPTURE_UNROLL samples within this time (at least
+ * CAPTURE_UNROLL samples). capture_poll() returns the resulting number of
+ * bytes.
+ */
+
+#define CAPTURE_PORT_A        0x00
+#define CAPTURE_PORT_B        0x01
+#define CAPTURE_PORT_C        0x02
+#define CAPTURE_PORT_MASK     0x03   // 8 pins: sampled port, 24 pins: trigger port
+#define CAPTURE_WIDE          0x04   // sample Port A, B and C
+
+#define CAPTURE_UNROLL        4
+/// number of samples of a capture with 8 and 24 pins
+#define CAPTURE_SAMPLES       (POOL_COUNT * POOL_BUFFER_SIZE)
+#define CAPTURE_SAMPLES_WIDE  ((POOL_COUNT * POOL_BUFFER_SIZE / 3) & ~(CAPTURE_UNROLL-1))
+/// maximum sampling time with interrupts disabled (cycles)
+#define CAPTURE_MAX_CYCLES    6000
+/// cycles per sample of the sampling loops
+#define CAPTURE_PERIOD(wide,divider) \
+  (((wide) ? 19 : 7) + ((divider) ? 2 + 3 * (uint16_t)(divider) : 0))
+
+/// response of CMD_CAPTURE
+#define CAPTURE_OK            0x00
+#define CAPTURE_BUSY          0x01
+
+bool             capture_start(uint8_t config, uint8_t divider,
+                               uint8_t trigger_mask, uint8_t trigger_value);
+uint16_t         capture_poll(void);
+__xdata uint8_t* capture_buffer(void);
+void             capture_stop(void);
+
+#endif  // __CAPTURE_H
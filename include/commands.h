@@ -29,8 +29,32 @@
 #define CMD_GET_VERSION          0x80
 #define CMD_GET_VERSION_STRING   0x81
 #define CMD_GET_STATUS           0x82
+#define CMD_SET_EP2_MODE         0x83
+#define CMD_I2C_WRITE_READ       0x84
+#define CMD_EEPROM_READ          0x85
+#define CMD_EEPROM_WRITE         0x86
+#define CMD_EEPROM_STATUS        0x87
+#define CMD_GET_PROFILE          0x88
+#define CMD_CAPTURE              0x89
+#define CMD_PATTERN              0x8A
+#define CMD_PATTERN_STATUS       0x8B
+#define CMD_SPI_CONFIG           0x8C
+#define CMD_FLASH_ID             0x8D
+#define CMD_FLASH_ERASE          0x8E
+#define CMD_FLASH_READ           0x8F
+#define CMD_FLASH_WRITE          0x90
+#define CMD_FLASH_STATUS         0x91
+#define CMD_JTAG_CONFIG          0x92
+#define CMD_I2C_WRITE            0x93
+#define CMD_UART_CONFIG          0x94
+#define CMD_UART_STATUS          0x95
+#define CMD_GET_NAKS             0x96
+#define CMD_NOTIFY_CONFIG        0x97
+#define CMD_TRACE_READ           0x98
 // ... add further commands here and handlers in HandleCmd() in commands.c ...
 // 0xA0 .. 0xAF are reserved by Anchor / Cypress
+// The commands of the optional features (CAPTURE, PATTERN, SPI, FLASH, JTAG,
+// UART, NOTIFY, see Makefile) are unknown if the feature is not built.
 
 /* Command: GetVersion ******************************************************/
 typedef struct {
@@ -42,14 +66,265 @@ typedef struct {
 #define FIRMWARE_VERSION 0x0001   // 0x00 . 0x01 -> 0.1
 
 /* Command: GetStatus *******************************************************/
+// Return the performance counters (see stats.h)
+// wValue: != 0 to clear the counters after reading them
+// The counters wrap around, the maxima saturate. Durations are Timer 2
+// counts (TIMER_COUNTS_PER_US per us, see delay.h). New fields are only
+// appended, so the offsets stay fixed.
 typedef struct {
-  uint8_t  MyStatus;     // dummy field
-  // ... add further fields with various status information and fill these
-  // fields in GetStatus() in commands.c ...
+  uint8_t  MyStatus;         // always 1
+  uint32_t Setups;           // SETUP packets handled
+  uint32_t Ep2InPackets;     // EP2 IN packets armed
+  uint32_t Ep2OutPackets;    // EP2 OUT packets processed
+  uint32_t Ep2InBytes;
+  uint32_t Ep2OutBytes;
+  uint16_t I2CTransfers;     // I2C transactions finished
+  uint16_t I2CNacks;         // ... of them not acknowledged by the slave
+  uint16_t I2CBusErrors;     // ... of them aborted by a bus error
+  uint32_t LoopPasses;       // main loop passes (command_poll())
+  uint16_t MaxUsbI2cIsr;     // longest USB or I2C ISR, 0 without ISR_STATS
+  uint16_t MaxLoopPass;      // longest main loop pass, 0xFFFF: about 10 ms+
 } TGetStatus;
 
+/* Command: SetEP2Mode *****************************************************/
+// wValue: one of the EP2_MODE_* values
+// wIndex: bitwise or of EP2_FLAG_* values
+#define EP2_MODE_IDLE            0x00   // EP2 OUT data is discarded
+#define EP2_MODE_STREAM          0x01   // EP2 IN: counter pattern, EP2 OUT: sink
+#define EP2_MODE_LOOPBACK        0x02   // EP2 OUT packets are returned on EP2 IN
+#define EP2_MODE_CMDSTREAM       0x03   // EP2 OUT/IN carry TCmdStreamRecord/Reply
+#define EP2_MODE_EEPROM          0x04   // EP2 OUT/IN carry I2C EEPROM contents
+#define EP2_MODE_CAPTURE         0x05   // EP2 IN: logic analyzer samples
+#define EP2_MODE_PATTERN         0x06   // EP2 OUT: pattern generator samples
+#define EP2_MODE_SPI             0x07   // EP2 OUT/IN: SPI transfers (full duplex)
+#define EP2_MODE_FLASH           0x08   // EP2 OUT/IN carry SPI flash contents
+#define EP2_MODE_JTAG            0x09   // EP2 OUT: JTAG records, EP2 IN: TDO
+// the modes of optional features which are not built behave like EP2_MODE_IDLE
+
+#define EP2_FLAG_DOUBLE_BUFFER   0x01   // pair EP2 with EP3 (ping-pong buffers)
+#define EP2_FLAG_POOL            0x02   // queue EP2 OUT packets in the packet pool
+#define EP2_FLAG_LAZY            0x04   // EP2_MODE_STREAM: produce when polled
+
+/* Command: I2CWriteRead ***************************************************/
+// Read registers of an I2C slave with a write-then-read transfer
+// wValue: LO8: 7 bit slave address, | CMD_I2C_REG16 for a 16 bit register
+//              address (sent MSB first)
+//         HI8: number of bytes to read (max. CMD_I2C_MAX_DATA)
+// wIndex: register address
+// Response: status (I2C_Status) followed by the data bytes
+// The vendor request completes when the I2C transfer has finished, the main
+// loop keeps running meanwhile.
+#define CMD_I2C_REG16            0x80
+#define CMD_I2C_MAX_DATA         32
+
+/* Command: I2CWrite *******************************************************/
+// Write the data stage (e.g. a register address followed by the data, up to
+// USB_EP0_BUFFER_SIZE bytes) to an I2C slave
+// wValue: 7 bit slave address
+// The vendor request completes when the I2C transfer has finished, EP0 is
+// stalled if it failed. The data is sent from the EP0 buffer, therefore
+// all vendor requests are stalled until the transfer has finished, also if
+// the host aborted the request. Within the command stream, the record
+// payload is written and the response is the status (I2C_Status).
+
+/* Command: EEPROMRead, EEPROMWrite ****************************************/
+// Read/write the I2C EEPROM via EP2 (requires EP2_MODE_EEPROM)
+// wValue: start address
+// wIndex: number of bytes (0 = 64 KiB)
+// Response: I2C_OK if the transfer was started, I2C_BUSY otherwise
+// The data is streamed on EP2 IN (read) or expected on EP2 OUT (write).
+
+/* Command: EEPROMStatus ****************************************************/
+typedef struct {
+  uint8_t  Busy;         // != 0 while a read or write operation is active
+  uint8_t  Status;       // I2C_Status of the last failed transfer or I2C_OK
+  uint16_t Remaining;    // bytes not yet read/written (0 also for 64 KiB)
+} TEEPROMStatus;
+
+/* Command: GetProfile *****************************************************/
+// Return the profiling measurements (only with "make PROFILE=1")
+// wValue: != 0 to clear the measurements after reading them
+// Response: TProfileEntry[PROFILE_COUNT] (see profile.h), empty without
+//           PROFILE. This is larger than an EP2 packet, therefore it is
+//           only available as vendor request.
+
+/* Command: Capture ********************************************************/
+// Arm the logic analyzer (requires EP2_MODE_CAPTURE, see capture.h)
+// wValue: LO8: divider (0 = maximum rate)
+//         HI8: CAPTURE_PORT_* | CAPTURE_WIDE
+// wIndex: LO8: trigger mask, HI8: trigger value (0/0: start immediately)
+// Response: CAPTURE_OK if the capture was armed, CAPTURE_BUSY otherwise
+// The samples (CAPTURE_SAMPLES bytes, CAPTURE_SAMPLES_WIDE * 3 bytes with
+// CAPTURE_WIDE, fewer with a divider, see CAPTURE_MAX_CYCLES) are streamed
+// on EP2 IN after the trigger.
+
+/* Command: Pattern ********************************************************/
+// Start or stop the pattern generator (requires EP2_MODE_PATTERN, see
+// pattern.h)
+// wValue: LO8: sample period in Timer 0 counts (0 = 256)
+//         HI8: PATTERN_PORT_* | PATTERN_CLK12, 0 stops the generator
+// wIndex: LO8: bytes to prefill before the first sample
+// Response: PATTERN_OK if the generator was started (or stopped),
+//           PATTERN_BUSY otherwise
+// The samples (1 byte per port, Port A first) are expected on EP2 OUT.
+
+/* Command: PatternStatus ***************************************************/
+typedef struct {
+  uint8_t  Running;      // != 0 while the timer is running
+  uint8_t  Level;        // bytes in the FIFO
+  uint16_t Underruns;    // timer overflows without data (saturates)
+  uint32_t Samples;      // samples written to the ports
+} TPatternStatus;
+
+/* Command: SPIConfig ******************************************************/
+// Configure the SPI master (see spi.h)
+// wValue: LO8: SCK pin (SPI_PIN()) | SPI_CPHA | SPI_CPOL | SPI_LSB_FIRST
+//         HI8: MOSI pin
+// wIndex: LO8: MISO pin, HI8: CS pin
+// Response: SPI_OK or SPI_INVALID
+// In EP2_MODE_SPI every EP2 OUT packet is sent on MOSI and the bytes
+// received on MISO are returned in an EP2 IN packet of the same length. CS
+// is asserted from the first packet of a USB transfer to its short (or zero
+// length) packet.
+
+/* Command: FlashID *******************************************************/
+// Read the JEDEC ID of the SPI flash (see flash.h, requires CMD_SPI_CONFIG)
+// Response: Flash_Status, then manufacturer, memory type and capacity
+
+/* Command: FlashErase *****************************************************/
+// Erase the 4 KiB sector containing page wValue (address = wValue * 256),
+// requires EP2_MODE_FLASH
+// wIndex: CMD_FLASH_ERASE_WAIT: complete the vendor request only when the
+//         erase has finished
+// Response: FLASH_OK if the erase was started, FLASH_BUSY otherwise
+// Poll CMD_FLASH_STATUS for the completion. With CMD_FLASH_ERASE_WAIT the
+// response is the result of the erase instead (Flash_Status).
+#define CMD_FLASH_ERASE_WAIT     0x0001
+
+/* Command: FlashRead, FlashWrite ******************************************/
+// Read/write the SPI flash via EP2 (requires EP2_MODE_FLASH)
+// wValue: start page (address = wValue * 256)
+// wIndex: number of pages (0 = 65536)
+// Response: FLASH_OK if the transfer was started, FLASH_BUSY otherwise
+// The data is streamed on EP2 IN (read) or expected on EP2 OUT (write). The
+// pages must have been erased before writing.
+
+/* Command: FlashStatus *****************************************************/
+typedef struct {
+  uint8_t  Busy;         // != 0 while an operation is active
+  uint8_t  Status;       // Flash_Status of the last erase or write
+  uint32_t Remaining;    // bytes not yet read/written
+} TFlashStatus;
+
+/* Command: JTAGConfig *****************************************************/
+// Configure the JTAG master (see jtag.h)
+// wValue: LO8: TCK pin (SPI_PIN()), HI8: TMS pin
+// wIndex: LO8: TDI pin, HI8: TDO pin
+// Response: JTAG_OK or JTAG_INVALID
+
+/* JTAG Records (EP2_MODE_JTAG) *********************************************/
+// Every EP2 OUT packet carries back-to-back records, so a batch of TAP moves
+// and scans needs a single USB transfer. A record must not cross a packet
+// boundary, truncated records and unknown commands drop the rest of the
+// packet. The TDO data of all JTAG_SCAN_IN records is coalesced into EP2 IN
+// packets, a partly filled packet is sent when all received EP2 OUT packets
+// were processed.
+//
+// JTAG_TMS:    Command, Count (1..8), TMS bits (LSB first), TDI is low
+// JTAG_CLOCK:  Command, Count (uint16_t), TCK cycles with TMS and TDI low
+// JTAG_SCAN:   TJtagScan followed by (Bits + 7) / 8 TDI bytes if
+//              JTAG_SCAN_OUT is set (TDI is low otherwise), TDO is returned
+//              if JTAG_SCAN_IN is set
+//
+// A scan first clocks the TmsStart sequence, e.g. from Run-Test/Idle to
+// Shift-DR, then shifts the data. The first TmsEnd bit is clocked with the
+// last data bit, the remaining ones afterwards. Longer scans are split into
+// records with an empty TmsEnd (the TAP stays in Shift-DR/IR) and a final
+// one, which leaves the shift state.
+#define JTAG_TMS                 0x01
+#define JTAG_CLOCK               0x02
+#define JTAG_SCAN                0x03
+#define JTAG_SCAN_IN             0x40   // flags, combined with JTAG_SCAN
+#define JTAG_SCAN_OUT            0x80
+#define JTAG_CMD_MASK            0x0F
+
+typedef struct {
+  uint8_t  Command;      // JTAG_SCAN | JTAG_SCAN_IN | JTAG_SCAN_OUT
+  uint16_t Bits;         // number of data bits (1 ..)
+  uint8_t  TmsStart;     // TMS sequence before the data, LSB first
+  uint8_t  TmsEnd;       // TMS sequence from the last data bit on
+  uint8_t  TmsCount;     // HI4: bits of TmsStart, LO4: bits of TmsEnd (0..8)
+} TJtagScan;
+
+/* Command: UARTConfig *****************************************************/
+// Configure the USB-to-UART bridge (see uart.h)
+// wValue: LO8: Timer 1 divisor of both ports (0 = 256, see UART_DIVISOR())
+// wIndex: LO8: UART_ENABLE | UART_DOUBLE of port 0 (EP4 IN/OUT)
+//         HI8: UART_ENABLE | UART_DOUBLE of port 1 (EP5 IN/OUT)
+// Response: UART_OK or UART_INVALID
+// The rings of both ports are emptied.
+
+/* Command: UARTStatus *****************************************************/
+// wIndex: port (0 or 1)
+typedef struct {
+  uint8_t  RxLevel;      // bytes received, not yet sent on EP4/EP5 IN
+  uint8_t  TxLevel;      // bytes from EP4/EP5 OUT, not yet sent
+  uint16_t Overruns;     // bytes lost because the RX ring was full
+} TUARTStatus;
+
+/* Command: GetNAKs ********************************************************/
+// Return how often the host found IN1 .. IN6 empty (see ibn_isr() in usb.c)
+// wValue: != 0 to clear the counts after reading them
+// Response: uint16_t[USB_IBN_COUNT] NAK counts of IN1 .. IN6, every packet
+//           is counted at most once
+
+/* Command: NotifyConfig ***************************************************/
+// Select the sources of the event records on EP1 IN (see notify.h)
+// wValue: LO8: NOTIFY_ENABLE() of the record types (NOTIFY_ALL: all)
+// wIndex: ms between two NOTIFY_TIMER records (0 = none)
+// Response: NOTIFY_OK or NOTIFY_INVALID
+
+/* Command: TraceRead ******************************************************/
+// Move the oldest records out of the trace ring (see trace.h), only built
+// with "make TRACE=1"
+// wIndex: maximum number of records (0 = as many as fit)
+// Response: TTraceHeader followed by Count TTraceRecord. The whole ring
+//           (16 records) fits into the EP0 data stage, a command stream
+//           reply holds up to 14 records.
+
+/* Command Stream (EP2_MODE_CMDSTREAM) *************************************/
+// Every EP2 OUT packet carries back-to-back records, each consisting of a
+// TCmdStreamRecord header and Length payload bytes. Command, Value and Index
+// have the same meaning as bRequest, wValue and wIndex of the vendor request.
+// Every record produces a TCmdStreamReply followed by Length response bytes.
+// The replies are coalesced into EP2 IN packets. CMD_SET_EP2_MODE and
+// CMD_GET_PROFILE are ignored within the command stream.
+typedef struct {
+  uint8_t  Command;      // one of the CMD_* values
+  uint8_t  Length;       // number of payload bytes following this header
+  uint16_t Value;        // same as wValue of the vendor request
+  uint16_t Index;        // same as wIndex of the vendor request
+} TCmdStreamRecord;
+
+typedef struct {
+  uint8_t  Command;      // copied from the record
+  uint8_t  Length;       // number of response bytes following this header
+} TCmdStreamReply;
+
+// records of a TraceRead reply in the command stream (see trace.h)
+#define TRACE_STREAM_RECORDS  ((64 - sizeof(TCmdStreamReply) - sizeof(TTraceHeader)) / \
+                               sizeof(TTraceRecord))
+
 /* Common *******************************************************************/
 
+// Returned by a command handler instead of the response length if it
+// completes the vendor request later with usb_ep0_complete()
+#define CMD_DEFERRED             0xFF
+
+void HandleCmd(void);
+bool StreamProduce(void);
+void command_init(void);
+void command_poll(void);
 void command_loop(void);
 
 #endif  // __COMMANDS_H
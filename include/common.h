@@ -24,11 +24,76 @@
 
 #include <stdint.h>
 
-#define NULL        (void*)0;
+#ifndef NULL
+#define NULL        (void*)0
+#endif
+
+/* Functions called from ISRs
+ *
+ * SDCC allocates the parameters and locals of non-reentrant functions
+ * statically. Those of functions which don't call others are placed in the
+ * overlay segment, which is shared among all of them. A function called
+ * from an ISR and from the main loop would overwrite the variables of the
+ * interrupted function, therefore it is compiled with
+ *   #pragma save
+ *   #pragma nooverlay
+ *   ...
+ *   #pragma restore
+ * and must only call functions which follow the same rule. If it is also
+ * called from the main loop, it runs with interrupts disabled (__critical),
+ * so an ISR can't overwrite its own variables either. */
 
 /* High and Low byte of a word (uint16_t) */
 #define HI8(word)   (uint8_t)(((uint16_t)word >> 8) & 0xff)
 #define LO8(word)   (uint8_t)((uint16_t)word & 0xff)
 
+/* Body of busy-wait loops. The host build (see hostsim/) advances the
+ * simulated hardware here, on the target it is empty. */
+#ifdef HOSTSIM
+void sim_busy_wait(void);
+#define BUSY_WAIT() sim_busy_wait()
+#else
+#define BUSY_WAIT()
+#endif
+
+/* Written after the port output registers (OUTx) were changed, so the host
+ * build can update the simulated external circuit. */
+#ifdef HOSTSIM
+void sim_port_written(void);
+#define PORT_WRITTEN() sim_port_written()
+#else
+#define PORT_WRITTEN()
+#endif
+
+/* Written after a byte was written to SBUF0 (port 0) or SBUF1 (port 1), so
+ * the host build can start its transmission. */
+#ifdef HOSTSIM
+void sim_sbuf_written(uint8_t port);
+#define SBUF_WRITTEN(port) sim_sbuf_written(port)
+#else
+#define SBUF_WRITTEN(port)
+#endif
+
+/* Clear the interrupt request @a bits of a register where writing 1 clears
+ * a bit (e.g. IBNIRQ). The registers of the host build are plain
+ * variables, which need the bits cleared explicitly. */
+#ifdef HOSTSIM
+#define IRQ_CLEAR(reg, bits) ((reg) &= (uint8_t)~(bits))
+#else
+#define IRQ_CLEAR(reg, bits) ((reg) = (bits))
+#endif
+
+/* Enable the interrupts and enter the idle mode of the CPU until the next
+ * interrupt. Must be called with EA = 0. After "setb EA" one more
+ * instruction is executed before an interrupt is serviced, so an interrupt
+ * which became pending before doesn't get lost, it ends the idle mode right
+ * away. */
+#ifdef HOSTSIM
+void sim_idle(void);
+#define CPU_IDLE() sim_idle()
+#else
+#define CPU_IDLE() do { EA = 1; PCON |= IDLE; } while (0)
+#endif
+
 
 #endif  // __COMMON_H
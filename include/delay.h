@@ -23,6 +23,34 @@
 #define __DELAY_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Timebase
+ *
+ * Timer 2 runs in 16 bit auto-reload mode from CLK/4 (6 MHz) and generates
+ * an interrupt every millisecond. Timer 0 is used by the pattern generator
+ * (see pattern.h), Timer 1 by the UARTs (see uart.h).
+ *
+ * The delay_*() functions busy-wait on Timer 2, delays below 20 us use a
+ * loop of fixed instruction cycles. They also work with interrupts
+ * disabled.
+ */
+#define TIMER_COUNTS_PER_US  6                          // CLK/4 = 6 MHz
+#define TIMER_COUNTS_PER_MS  (1000 * TIMER_COUNTS_PER_US)
+#define TIMER2_RELOAD        ((uint16_t)(65536 - TIMER_COUNTS_PER_MS))
+
+typedef uint16_t deadline_t;
+
+// only read directly with interrupts disabled, otherwise use timer_ticks()
+extern volatile uint16_t timer_tick;
+
+void timer_init(void);
+uint16_t timer_ticks(void);
+uint16_t timer_fine(void);
+
+deadline_t deadline_set(uint16_t ms);
+bool deadline_expired(deadline_t deadline);
 
 void delay_5us(void);
 void delay_1ms(void);
@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __EEPROM_H
+#define __EEPROM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "i2c.h"
+
+/**
+ * @file Driver for 24Cxx I2C EEPROMs with 16 bit addressing (24C32 ... 24C512)
+ *
+ * Writes are collected into a page buffer and programmed one page at a time.
+ * Before each page the EEPROM is ACK polled, i.e. the internal write cycle
+ * of the previous page overlaps the collection of the next page.
+ */
+
+#define EEPROM_I2C_ADDR     0x50   // 7 bit slave address
+#define EEPROM_PAGE_SIZE    64     // 24C32/64: 32, 24C128/256: 64, 24C512: 128
+#define EEPROM_POLL_MAX     1000   // max. number of ACK polls per write cycle
+
+void eeprom_init();
+I2C_Status eeprom_wait_ready();
+bool eeprom_start_read(uint16_t addr, uint8_t length, __xdata uint8_t* ptr,
+                       I2C_Callback callback);
+
+void eeprom_write_begin(uint16_t addr);
+uint8_t eeprom_write_put(__xdata uint8_t* src, uint8_t length);
+void eeprom_write_flush();
+bool eeprom_write_busy();
+I2C_Status eeprom_write_status();
+
+#endif  // __EEPROM_H
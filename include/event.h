@@ -0,0 +1,63 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __EVENT_H
+#define __EVENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file Event scheduler of the main loop
+ *
+ * ISRs post events with EVENT_POST(), command_poll() dispatches them to the
+ * registered handlers in priority order: after every handler the search
+ * starts again at the highest priority, so EP2 data is never kept waiting
+ * behind more than one vendor request. When nothing is pending,
+ * command_loop() puts the CPU into idle mode until the next interrupt.
+ *
+ * Every event is a __bit in the bit-addressable memory. Posting and
+ * clearing are single setb/clr instructions, so neither the ISRs nor the
+ * main loop need a critical section.
+ */
+
+/// events, in priority order (highest first)
+#define EVENT_EP2_OUT     0   // EP2 OUT packet received
+#define EVENT_EP2_IN      1   // EP2 IN packet sent
+#define EVENT_IBN         2   // IN endpoint with producer NAKed (see usb.c)
+#define EVENT_COMMAND     3   // vendor request received on EP0
+#define EVENT_COUNT       4
+
+/// post an event from an ISR, e.g. EVENT_POST(ep2_out)
+#define EVENT_POST(name)  (event_##name = 1)
+
+typedef void (*event_handler_t)(void);
+
+extern volatile __bit event_ep2_out;
+extern volatile __bit event_ep2_in;
+extern volatile __bit event_ibn;
+extern volatile __bit event_command;
+
+void event_init(void);
+void event_register(uint8_t event, event_handler_t handler);
+bool event_pending(void);
+bool event_dispatch(void);
+void event_idle(void);
+
+#endif  // __EVENT_H
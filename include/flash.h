@@ -0,0 +1,80 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __FLASH_H
+#define __FLASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file Driver for SPI NOR flash (25 series, 3 byte addresses)
+ *
+ * Uses the SPI master (see spi.h), which must be configured for SPI mode 0
+ * or 3, MSB first.
+ *
+ * Writes are collected into two page buffers. While one page is programmed
+ * and the WIP bit of the flash is polled by flash_poll(), the other buffer
+ * accepts the next page, so the USB transfer of a page overlaps the
+ * programming of the previous one. Sector erases also run in the
+ * background of flash_poll().
+ *
+ * Reads use FAST READ and keep CS asserted between the flash_read() calls,
+ * so a read of any length needs only one command header.
+ */
+
+#define FLASH_PAGE_SIZE          256
+#define FLASH_SECTOR_SIZE        4096
+
+/// SPI commands
+#define FLASH_CMD_WRITE_ENABLE   0x06
+#define FLASH_CMD_READ_STATUS    0x05
+#define FLASH_CMD_PAGE_PROGRAM   0x02
+#define FLASH_CMD_FAST_READ      0x0B
+#define FLASH_CMD_SECTOR_ERASE   0x20   // 4 KiB
+#define FLASH_CMD_JEDEC_ID       0x9F
+
+/// bits of the status register
+#define FLASH_SR_WIP             0x01   // write in progress
+#define FLASH_SR_WEL             0x02   // write enable latch
+
+/// maximum duration of the internal write cycles
+#define FLASH_PROGRAM_TIMEOUT    10     // ms
+#define FLASH_ERASE_TIMEOUT      1000   // ms
+
+typedef enum {FLASH_OK,FLASH_BUSY,FLASH_TIMEOUT} Flash_Status;
+
+void         flash_init(void);
+void         flash_read_id(__xdata uint8_t* id);
+uint8_t      flash_read_status(void);
+
+void         flash_read_begin(uint32_t addr);
+void         flash_read(__xdata uint8_t* dst, uint8_t length);
+void         flash_read_end(void);
+
+bool         flash_erase(uint32_t addr);
+void         flash_write_begin(uint32_t addr);
+uint8_t      flash_write_put(__xdata uint8_t* src, uint8_t length);
+void         flash_write_flush(void);
+
+void         flash_poll(void);
+bool         flash_busy(void);
+Flash_Status flash_result(void);
+
+#endif  // __FLASH_H
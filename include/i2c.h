@@ -21,14 +21,61 @@
 #define __I2C_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
-typedef enum {I2C_OK,I2C_BUSY,I2C_BERROR,I2C_NACK} I2C_Status;
+typedef enum {I2C_OK,I2C_BUSY,I2C_BERROR,I2C_NACK,I2C_PENDING} I2C_Status;
+
+/**
+ * I2C transaction queue
+ *
+ * Transactions are executed by the I2C ISR. The next one is started by
+ * i2c_submit() or i2c_poll() as soon as the STOP condition of the previous
+ * one is done, so the ISR never waits for the bus. Completed transactions
+ * are reported by i2c_poll(), which calls the callback of each transaction
+ * (in the context of the caller of i2c_poll(), i.e. the main loop). Then
+ * the queue entry is freed.
+ *
+ * A read of 0 bytes completes with I2C_OK without accessing the bus, an
+ * I2C_WRITE_READ transaction without bytes to read is a plain write.
+ */
+#define I2C_QUEUE_SIZE   8      // must be a power of 2
+
+// Flags of a transaction
+#define I2C_WRITE        0x00
+#define I2C_READ         0x01
+#define I2C_WRITE_READ   0x02   // write, then repeated START and read
+
+struct I2C_Transaction;
+// SDCC can pass only one parameter to a function called via pointer
+typedef void (*I2C_Callback)(__xdata struct I2C_Transaction* t);
+
+typedef struct I2C_Transaction {
+  uint8_t           Addr;      // 7 bit slave address
+  uint8_t           Flags;     // I2C_WRITE, I2C_READ or I2C_WRITE_READ
+  uint8_t           Length;    // number of bytes to transfer
+  __xdata uint8_t*  Ptr;       // data buffer
+  uint8_t           RdLength;  // I2C_WRITE_READ: number of bytes to read
+  __xdata uint8_t*  RdPtr;     // I2C_WRITE_READ: buffer for read data
+  I2C_Callback      Callback;  // called by i2c_poll() on completion, may be NULL
+  uint8_t           Tag;       // free for use by the caller
+  I2C_Status        Status;    // I2C_PENDING until completion
+} I2C_Transaction;
 
 void i2c_init();
+__xdata I2C_Transaction* i2c_alloc();
+void i2c_submit();
+void i2c_poll();
+bool i2c_stop_pending();
+uint8_t i2c_queue_depth();
+
 I2C_Status i2c_start_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr);
 I2C_Status i2c_start_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr);
 I2C_Status i2c_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr);
 I2C_Status i2c_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr);
+I2C_Status i2c_start_write_read(uint8_t addr, uint8_t wlength, __xdata uint8_t* wptr,
+                                uint8_t rlength, __xdata uint8_t* rptr);
+I2C_Status i2c_write_read(uint8_t addr, uint8_t wlength, __xdata uint8_t* wptr,
+                          uint8_t rlength, __xdata uint8_t* rptr);
 
 #endif  // __I2C_H
 
@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __JTAG_H
+#define __JTAG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file JTAG master, bit-banged on Port A/B/C
+ *
+ * TCK, TMS and TDI are outputs of one port, TDO is an input of any port.
+ * The pins are given as SPI_PIN(port, bit) (see spi.h).
+ *
+ * Shifting JTAG data is SPI mode 0 with LSB first: TDI changes while TCK is
+ * low, the TAP samples TDI and TMS at the rising edge and changes TDO at
+ * the falling edge. Therefore the full bytes of a scan are shifted by
+ * spi_transfer() (about 184 cycles per byte), only the last up to 8 bits
+ * and the TMS sequences are clocked bit by bit in C. The JTAG pins are
+ * kept separately, jtag_scan() lends them to spi_transfer() (TCK as SCK,
+ * TDI as MOSI, TDO as MISO) and restores the SPI configuration afterwards.
+ * CMD_SPI_CONFIG and CMD_JTAG_CONFIG therefore don't affect each other, and
+ * deselecting the SPI slave never touches TMS.
+ *
+ * The firmware doesn't track the TAP state, the host supplies the TMS
+ * sequences between the stable states (see EP2_MODE_JTAG in commands.h).
+ * TCK idles low between all functions.
+ */
+
+/// response of CMD_JTAG_CONFIG
+#define JTAG_OK           0x00
+#define JTAG_INVALID      0x01
+
+bool jtag_config(uint8_t tck, uint8_t tms, uint8_t tdi, uint8_t tdo);
+void jtag_tms(uint8_t tms, uint8_t count);
+void jtag_clock(uint16_t count);
+void jtag_scan(__xdata uint8_t* dst, __xdata uint8_t* src, uint16_t bits, bool exit);
+
+#endif  // __JTAG_H
@@ -0,0 +1,91 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __NOTIFY_H
+#define __NOTIFY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file Event notification on the EP1 IN interrupt endpoint
+ *
+ * Instead of polling CMD_GET_STATUS, the host reads EP1 IN, which carries
+ * back-to-back TNotifyRecord of the enabled sources (see
+ * CMD_NOTIFY_CONFIG). A record is armed as soon as the main loop has seen
+ * its event, records produced while the previous packet wasn't read yet
+ * are sent together in the next packet. So the host waits for events with
+ * the latency of the endpoint's bInterval (1 ms), without any transfer
+ * while nothing happens.
+ *
+ * The sources are checked by notify_service() from the main loop, every
+ * source produces at most one record per main loop iteration. Overruns of
+ * a buffer are merged into its record as long as that wasn't sent, so a
+ * burst costs about one record per EP1 IN packet. If the host doesn't read
+ * EP1 IN, the records queue up in a ring of NOTIFY_RING_SIZE records.
+ * Records that don't fit are counted and reported with a NOTIFY_LOST record
+ * when space is available again.
+ *
+ * The ring is located in the buffer of the unused endpoint EP1 OUT
+ * (OUT1BUF), which is ordinary XDATA memory as long as EP1 OUT is not
+ * valid.
+ *
+ * The pin sources are the falling edges of INT0# (PC2) and INT1# (PC3),
+ * these pins are switched to their alternate function while enabled.
+ *
+ * notify_post() must only be called from the main loop, ISRs set a flag or
+ * counter which notify_service() turns into a record (like the pin edges).
+ */
+
+/// Record types, also the bit number of the source in the enable mask
+#define NOTIFY_LOST         0   // records lost, Arg: count (max. 255)
+#define NOTIFY_I2C          1   // I2C vendor request done, Arg: I2C_Status
+#define NOTIFY_OVERRUN      2   // Arg: NOTIFY_OVERRUN_* of the buffer
+#define NOTIFY_PIN          3   // Arg: bit 0: INT0# (PC2), bit 1: INT1# (PC3)
+#define NOTIFY_TIMER        4   // Arg: expirations (max. 255)
+
+#define NOTIFY_ENABLE(type) (1 << (type))
+#define NOTIFY_ALL          0x1E
+
+/// Arg of NOTIFY_OVERRUN
+#define NOTIFY_OVERRUN_UART0    0   // RX ring of serial port 0
+#define NOTIFY_OVERRUN_UART1    1   // RX ring of serial port 1
+#define NOTIFY_OVERRUN_PATTERN  2   // pattern generator FIFO (underrun)
+
+/// response of CMD_NOTIFY_CONFIG
+#define NOTIFY_OK           0x00
+#define NOTIFY_INVALID      0x01
+
+#define NOTIFY_RING_SIZE    16      // records, power of 2, fills OUT1BUF
+
+typedef struct {
+  uint8_t  Type;         // NOTIFY_*
+  uint8_t  Arg;          // depends on Type
+  uint16_t Time;         // timer_ticks() when the record was produced
+} TNotifyRecord;
+
+void     notify_init(void);
+bool     notify_config(uint8_t sources, uint16_t period);
+void     notify_post(uint8_t type, uint8_t arg);
+void     notify_service(void);
+
+void     notify_in_isr(void);
+void     notify_usb_reset(void);
+
+#endif  // __NOTIFY_H
@@ -0,0 +1,72 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PATTERN_H
+#define __PATTERN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file Pattern generator: timer paced output of EP2 OUT data on Port A/B
+ *
+ * The main loop moves the data received on EP2 OUT into a FIFO with
+ * pattern_put(), the Timer 0 ISR writes one sample per timer overflow from
+ * the FIFO to OUTA and/or OUTB. With both ports, every sample consists of
+ * the bytes for Port A and B, OUTB is written a few cycles after OUTA.
+ *
+ * Timer 0 runs in mode 2 (8 bit auto-reload) with CLK/4 (6 MHz) or, with
+ * PATTERN_CLK12, CLK/12 (2 MHz), so the sample period is 1..256 timer
+ * counts. Its interrupt has high priority, therefore the other ISRs don't
+ * delay the samples. The timer is started as soon as the FIFO holds the
+ * requested number of prefill bytes.
+ *
+ * If the FIFO doesn't hold a complete sample at a timer overflow, the
+ * outputs keep their levels and the overflow is counted as underrun. After
+ * the last sample every further overflow is an underrun, the host compares
+ * pattern_samples() with the number of samples it has sent instead.
+ *
+ * Every sample costs the cycles of the ISR plus its share of the FIFO
+ * filling in the main loop, "make bench" prints the resulting maximum
+ * sustained sample rate. Shorter sample periods lose timer overflows
+ * unnoticed.
+ * EP2_FLAG_POOL is recommended, so up to POOL_COUNT packets are prefetched
+ * in addition to the FIFO.
+ */
+
+#define PATTERN_PORT_A      0x01   // drive Port A
+#define PATTERN_PORT_B      0x02   // drive Port B
+#define PATTERN_CLK12       0x04   // Timer 0 clock CLK/12 instead of CLK/4
+
+#define PATTERN_FIFO_SIZE   256    // holds up to PATTERN_FIFO_SIZE-1 bytes
+
+/// response of CMD_PATTERN
+#define PATTERN_OK          0x00
+#define PATTERN_BUSY        0x01
+
+bool     pattern_start(uint8_t config, uint8_t period, uint8_t prefill);
+uint8_t  pattern_put(__xdata uint8_t* src, uint8_t length);
+void     pattern_stop(void);
+
+bool     pattern_running(void);
+uint8_t  pattern_level(void);
+uint32_t pattern_samples(void);
+uint16_t pattern_underruns(void);
+
+#endif  // __PATTERN_H
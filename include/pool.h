@@ -0,0 +1,47 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stdint.h>
+
+/**
+ * @file Pool of packet buffers in XDATA
+ *
+ * POOL_COUNT buffers of POOL_BUFFER_SIZE bytes each, identified by their
+ * index. pool_alloc() and pool_free() take O(1) time and are critical, so
+ * they can be used from ISRs and the main loop. A buffer belongs to whoever
+ * allocated it until it is passed on (e.g. through a queue of indices) or
+ * freed.
+ */
+
+#define POOL_COUNT        8      // must be a power of 2 (see queue users)
+#define POOL_BUFFER_SIZE  64     // size of a full speed bulk packet
+#define POOL_NONE         0xFF   // returned by pool_alloc() if exhausted
+
+extern __xdata uint8_t pool_data[POOL_COUNT][POOL_BUFFER_SIZE];
+extern __xdata uint8_t pool_length[POOL_COUNT];
+
+void    pool_init(void);
+uint8_t pool_alloc(void) __critical;
+void    pool_free(uint8_t id) __critical;
+uint8_t pool_available(void);
+
+#endif  // __POOL_H
@@ -0,0 +1,78 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdint.h>
+
+/**
+ * Profiling
+ *
+ * When compiled with -DPROFILE ("make PROFILE=1"), the latency critical
+ * paths are instrumented with PROFILE_ENTER() and PROFILE_EXIT(). These read
+ * the count register of Timer 2 (see delay.h), which is incremented every
+ * instruction cycle, and accumulate the elapsed cycles in profile_table[].
+ * The table can be read with CMD_GET_PROFILE or by the simulator benchmark
+ * (see tools/bench.py).
+ *
+ * A measured section must be shorter than 1 ms. The cycles spent in the
+ * instrumentation itself are measured in PROFILE_OVERHEAD.
+ *
+ * Without PROFILE all macros expand to nothing.
+ */
+
+/// instrumented code sections
+#define PROFILE_OVERHEAD       0   // empty PROFILE_ENTER()/PROFILE_EXIT() pair
+#define PROFILE_SUDAV_ISR      1   // sudav_isr()
+#define PROFILE_SETUP_DATA     2   // usb_handle_setup_data()
+#define PROFILE_HANDLE_CMD     3   // HandleCmd()
+#define PROFILE_I2C_ISR        4   // i2c_isr()
+#define PROFILE_SUDAV_LATENCY  5   // bench.c: call of sudav_isr() incl. prologue
+#define PROFILE_I2C_LATENCY    6   // bench.c: call of i2c_isr() incl. prologue
+#define PROFILE_BENCH          7   // bench.c: event of a bench.py scenario
+#define PROFILE_EP0_ISR        8   // ep0in_isr() and ep0out_isr()
+#define PROFILE_COUNT          9   // sizeof(profile_table) <= USB_EP0_BUFFER_SIZE
+
+typedef struct {
+  uint16_t Calls;   // number of measurements
+  uint16_t Max;     // maximum cycles
+  uint32_t Total;   // sum of all measurements
+} TProfileEntry;
+
+#ifdef PROFILE
+
+extern __xdata TProfileEntry profile_table[PROFILE_COUNT];
+extern __xdata uint16_t      profile_start[PROFILE_COUNT];
+
+void     profile_reset(void);
+uint16_t profile_now(void) __critical;
+void     profile_record(uint8_t id) __critical;
+
+#define PROFILE_ENTER(id)  profile_start[id] = profile_now()
+#define PROFILE_EXIT(id)   profile_record(id)
+
+#else
+
+#define PROFILE_ENTER(id)
+#define PROFILE_EXIT(id)
+
+#endif  // PROFILE
+
+#endif  // __PROFILE_H
@@ -525,7 +525,7 @@ SFRX(USBIRQ,        0x7FAB);
   #define SUTOKIR   bmBit2
   #define SUSPIR    bmBit3
   #define URESIR    bmBit4
-  // Bit 5 unused
+  #define IBNIR     bmBit5
   // Bit 6 unused
   // Bit 7 unused
 
@@ -555,7 +555,7 @@ SFRX(USBIEN,        0x7FAE);
   #define SUTOKIE   bmBit2
   #define SUSPIE    bmBit3
   #define URESIE    bmBit4
-  // Bit 5 unused
+  #define IBNIE     bmBit5
   // Bit 6 unused
   // Bit 7 unused
 
@@ -569,8 +569,19 @@ SFRX(USBBAV,        0x7FAF);
   // Bit 6 unused
   // Bit 7 unused
 
-// 0x7FB0 reserved
-// 0x7FB1 reserved
+/* IN-Bulk-NAK interrupt request and enable. The bits of IBNIEN are the same
+ * as of IBNIRQ */
+SFRX(IBNIRQ,        0x7FB0);
+  #define IN0IBN    bmBit0
+  #define IN1IBN    bmBit1
+  #define IN2IBN    bmBit2
+  #define IN3IBN    bmBit3
+  #define IN4IBN    bmBit4
+  #define IN5IBN    bmBit5
+  #define IN6IBN    bmBit6
+  // Bit 7 unused
+
+SFRX(IBNIEN,        0x7FB1);
 SFRX(BPADDRH,       0x7FB2);
 SFRX(BPADDRL,       0x7FB3);
 
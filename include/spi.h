@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __SPI_H
+#define __SPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file SPI master, bit-banged on Port A/B/C
+ *
+ * SCK, MOSI and CS are outputs of one port, MISO is an input of any port.
+ * The pins are given as SPI_PIN(port, bit). All 4 SPI modes (CPOL, CPHA) and
+ * both bit orders are supported.
+ *
+ * spi_transfer() is written in assembler (spi_shift.c). Every bit writes
+ * OUTx twice with "movx @r0,a" (MOSI, then the SCK edge) and reads PINSx
+ * with "movx a,@r1", the 8 bits of a byte are unrolled. The source is read
+ * with DPTR and the destination written via the auto-pointer, so a transfer
+ * can go straight from OUT2BUF to IN2BUF. A byte takes about 184
+ * instruction cycles with CPHA = 0 (260 kbit/s) and 224 with CPHA = 1
+ * (215 kbit/s), "make bench" prints the measured rate of every mode.
+ *
+ * MISO is read right after the leading SCK edge with CPHA = 0, and 3
+ * cycles after the leading and 5 cycles before the trailing edge with
+ * CPHA = 1. OUTx is read once per spi_transfer(), pins of the SPI port
+ * changed by ISRs during a transfer are overwritten.
+ */
+
+#define SPI_PORT_A        0
+#define SPI_PORT_B        1
+#define SPI_PORT_C        2
+#define SPI_PIN(port, bit)  (((port) << 3) | (bit))
+#define SPI_PIN_MASK      0x1F
+
+/// mode flags, combined with the SCK pin
+#define SPI_CPHA          0x20   // sample on the trailing SCK edge
+#define SPI_CPOL          0x40   // SCK idles high
+#define SPI_LSB_FIRST     0x80
+#define SPI_MODE_0        0x00
+#define SPI_MODE_1        SPI_CPHA
+#define SPI_MODE_2        SPI_CPOL
+#define SPI_MODE_3        (SPI_CPOL | SPI_CPHA)
+
+/// response of CMD_SPI_CONFIG
+#define SPI_OK            0x00
+#define SPI_INVALID       0x01
+
+void spi_init(void);
+bool spi_config(uint8_t sck_mode, uint8_t mosi, uint8_t miso, uint8_t cs);
+void spi_select(bool select);
+void spi_transfer(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length);
+
+// port access by SPI_PORT_*, also used by the JTAG master
+bool    spi_pins_valid(uint8_t sck, uint8_t mosi, uint8_t miso, uint8_t cs);
+void    spi_port_output(uint8_t port, uint8_t outputs, uint8_t inputs);
+void    spi_port_write(uint8_t port, uint8_t clear, uint8_t set);
+uint8_t spi_port_read(uint8_t port);
+uint8_t spi_pins_read(uint8_t port);
+
+/// LO8 of the addresses of OUTA and PINSA, Port B and C follow
+#define SPI_OUTA          0x96
+#define SPI_PINSA         0x99
+
+/*
+ * Internal: parameters of spi_transfer(), set by spi_config(). These are
+ * accessed from assembler and therefore must be in DATA memory.
+ */
+extern __data uint8_t spi_mode;        // SPI_CPHA | SPI_CPOL | SPI_LSB_FIRST
+extern __data uint8_t spi_out_port;    // LO8 of OUTx
+extern __data uint8_t spi_pins_port;   // LO8 of PINSx of MISO
+extern __data uint8_t spi_keep_mask;   // OUTx bits kept, ~(SCK | MOSI)
+extern __data uint8_t spi_sck_idle;    // SCK mask if SPI_CPOL, 0 otherwise
+extern __data uint8_t spi_sck_mask;
+extern __data uint8_t spi_mosi_mask;
+extern __data uint8_t spi_miso_mask;
+
+#endif  // __SPI_H
@@ -0,0 +1,78 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+
+#include "commands.h"
+
+/**
+ * @file Performance counters
+ *
+ * The counters are always maintained, they are read and cleared with
+ * CMD_GET_STATUS (TGetStatus). Every event costs one increment in XDATA:
+ *
+ *  - SETUP packets in sudav_isr(),
+ *  - EP2 packets and bytes in stream_in_commit() and stream_out_release()
+ *    with stats_ep2_in() and stats_ep2_out(),
+ *  - I2C transactions by their status when i2c_isr() finishes them,
+ *  - main loop passes in command_poll().
+ *
+ * The durations are measured with the count register of Timer 2 (see
+ * delay.h). The main loop pass is measured by command_poll(), including
+ * the interrupts during the pass.
+ *
+ * The ISR durations (TGetStatus.MaxUsbI2cIsr) are only measured by
+ * "make ISR_STATS=1", otherwise they stay 0: the calls of stats_isr_enter()
+ * and stats_isr_exit() make SDCC save all registers on the entry of every
+ * USB and I2C ISR. STATS_ISR_ENTER() and STATS_ISR_EXIT() enclose these
+ * ISRs only. They have the same (low) priority and don't nest, so a single
+ * start time suffices. An ISR must be shorter than 1 ms. The other ISRs are
+ * not measured: the Timer 0 ISR of the pattern generator has the high
+ * priority and would nest, the short Timer 2, serial port and INT0/INT1
+ * ISRs call no functions, so SDCC doesn't save all registers on their
+ * entry.
+ */
+
+extern __xdata TGetStatus stats;
+
+void     stats_reset(void);
+void     stats_loop_enter(void);
+void     stats_loop_exit(void);
+void     stats_ep2_in(uint8_t length);
+void     stats_ep2_out(uint8_t length);
+
+#ifdef ISR_STATS
+
+void     stats_isr_enter(void);
+void     stats_isr_exit(void);
+
+#define STATS_ISR_ENTER()  stats_isr_enter()
+#define STATS_ISR_EXIT()   stats_isr_exit()
+
+#else
+
+#define STATS_ISR_ENTER()
+#define STATS_ISR_EXIT()
+
+#endif  // ISR_STATS
+
+#endif  // __STATS_H
@@ -0,0 +1,57 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __STREAM_H
+#define __STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file EP2 bulk streaming engine
+ *
+ * EP2 IN and OUT can either use a single 64 byte buffer each, or be paired
+ * with EP3 via USBPAIR. When paired, the SIE ping-pongs between IN2BUF/IN3BUF
+ * (OUT2BUF/OUT3BUF) while the 8051 accesses only the EP2 registers. This
+ * keeps the bus busy while the CPU fills (or empties) the other half.
+ *
+ * EP3 must not be used as an own endpoint while double-buffering is active.
+ *
+ * In pooled mode, stream_out_isr() moves every EP2 OUT packet from the
+ * endpoint buffer into a buffer of the packet pool (see pool.h) and re-arms
+ * the endpoint immediately. The stream_out_*() functions then operate on a
+ * queue of pool buffers, so up to POOL_COUNT packets (plus the endpoint
+ * buffers) are absorbed while the main loop is busy, instead of being NAKed.
+ * This costs one copy per packet in the ISR, because the SIE only writes to
+ * the fixed endpoint buffers.
+ */
+
+void stream_init(bool double_buffered, bool pooled);
+void stream_out_isr(void);
+
+bool stream_in_ready(void);
+__xdata uint8_t* stream_in_buffer(void);
+void stream_in_commit(uint8_t length);
+
+bool stream_out_ready(void);
+__xdata uint8_t* stream_out_buffer(void);
+uint8_t stream_out_length(void);
+void stream_out_release(void);
+
+#endif  // __STREAM_H
@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+/**
+ * @file Binary event trace
+ *
+ * The ISRs and the main loop write TTraceRecord into a ring of
+ * TRACE_RING_SIZE records in XDATA, which is drained with CMD_TRACE_READ.
+ * This preserves the recent history of a device which stalled in the
+ * field. When the ring is full, the oldest record is overwritten and
+ * counted as lost, so the ring always holds the latest records.
+ *
+ * Time holds the lowest 3 bits of timer_ticks() and the Timer 2 counts
+ * within this millisecond (TIMER_COUNTS_PER_US per us, see delay.h), so it
+ * wraps around after 8 ms. If TRACE_SYNC_MS or more passed since the
+ * previous record, a TRACE_SYNC record with the full timer_ticks() is
+ * inserted first. So the decoder (host/tracedump.py) reconstructs the time
+ * of every record from the difference to its predecessor.
+ *
+ * A record costs a call of trace_post() with interrupts disabled, i.e.
+ * reading the timebase and four bytes written to XDATA. Also, every ISR
+ * with a TRACE_POST() saves all registers on its entry, therefore the trace
+ * is only built by "make TRACE=1". Otherwise TRACE_POST() is empty and
+ * CMD_TRACE_READ is an unknown command.
+ *
+ * The ring is kept small (64 bytes), XDATA is almost used up and all
+ * endpoint buffers are in use, so it can't be placed in one of them.
+ */
+
+/// Record ids
+#define TRACE_SYNC          0   // Time: timer_ticks(), Arg: 0
+#define TRACE_SETUP         1   // sudav_isr(), Arg: bRequest
+#define TRACE_EP_IN         2   // IN endpoint ISR, Arg: endpoint number
+#define TRACE_EP_OUT        3   // OUT endpoint ISR, Arg: endpoint number
+#define TRACE_I2C_START     4   // I2C transaction started, Arg: slave address
+#define TRACE_I2C_DONE      5   // finished by i2c_isr(), Arg: I2C_Status
+#define TRACE_COMMAND       6   // command executed, Arg: CMD_*
+
+#define TRACE_RING_SIZE     16      // records, power of 2, with TTraceHeader
+                                    // <= USB_EP0_BUFFER_SIZE
+#define TRACE_SYNC_MS       8       // wrap around of TTraceRecord.Time
+
+/// TTraceRecord.Time
+#define TRACE_TIME_TICK(t)  ((t) >> 13)          // timer_ticks() & 7
+#define TRACE_TIME_COUNT(t) ((t) & 0x1FFF)       // Timer 2 counts in the ms
+
+typedef struct {
+  uint8_t  Id;           // TRACE_*
+  uint8_t  Arg;          // depends on Id
+  uint16_t Time;         // see TRACE_TIME_*, TRACE_SYNC: timer_ticks()
+} TTraceRecord;
+
+/// Response header of CMD_TRACE_READ, followed by Count records
+typedef struct {
+  uint8_t  Count;        // records following, oldest first
+  uint8_t  Lost;         // records overwritten since the last read (max. 255)
+  uint8_t  Left;         // records still in the ring
+} TTraceHeader;
+
+#ifdef TRACE
+
+void     trace_init(void);
+void     trace_post(uint8_t id, uint8_t arg) __critical;
+uint8_t  trace_read(__xdata uint8_t* buf, uint8_t max);
+
+#define TRACE_POST(id, arg)  trace_post(id, arg)
+
+#else
+
+#define TRACE_POST(id, arg)
+
+#endif  // TRACE
+
+#endif  // __TRACE_H
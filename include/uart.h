@@ -0,0 +1,92 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __UART_H
+#define __UART_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file USB-to-UART bridge on serial port 0 and 1
+ *
+ * Every serial port is bridged to its own pair of bulk endpoints: serial
+ * port 0 to EP4 IN/OUT, serial port 1 to EP5 IN/OUT. Both run in mode 1
+ * (8 data bits, no parity, 1 stop bit) and share Timer 1 as baud rate
+ * generator (mode 2, 8 bit auto-reload, CLK/4):
+ *
+ *   baud rate = 187500 / divisor, doubled with UART_DOUBLE
+ *
+ * e.g. 125000 (divisor 3, UART_DOUBLE), 37500 (10, UART_DOUBLE, 2.3 % slower
+ * than 38400) or 9615 (39, UART_DOUBLE). Timer 2 is the timebase and
+ * can't generate baud rates.
+ *
+ * The serial ISRs move the received bytes into an RX ring and take the
+ * bytes to send from a TX ring, one ring of UART_RING_SIZE bytes per port
+ * and direction. The main loop (uart_service()) exchanges the data between
+ * the rings and the endpoint buffers:
+ *
+ *  - An EP4/EP5 OUT packet is copied into the TX ring as space becomes
+ *    free, the endpoint is re-armed when the whole packet was taken. The
+ *    host is NAKed while the UART is behind.
+ *  - The RX ring is sent as IN packet when it holds a full packet, or when
+ *    no byte was received for UART_IDLE_MS. So a continuous stream costs one
+ *    USB transaction per 64 bytes, but a single keystroke is not delayed
+ *    for long. There is no flow control towards the UART, bytes received
+ *    while the RX ring is full are counted as overruns.
+ *
+ * The rings are located in the buffers of the unused endpoints EP6 and EP7
+ * (OUT7BUF .. IN6BUF), which are ordinary XDATA memory as long as these
+ * endpoints are not valid. The 2 KiB of the isochronous buffers are
+ * already taken.
+ *
+ * The pins RXD0/TXD0 (Port C) and RXD1/TXD1 (Port B) are switched to their
+ * alternate function when the port is enabled.
+ */
+
+#define UART_COUNT          2
+#define UART_RING_SIZE      64     // power of 2, equal to the packet size
+#define UART_IDLE_MS        2      // send a partial IN packet after this gap
+
+/// Timer 1 divisor of @a baud with UART_DOUBLE (rounded)
+#define UART_DIVISOR(baud)  ((uint8_t)((375000UL + (baud) / 2) / (baud)))
+
+/// flags of a port, see uart_config()
+#define UART_ENABLE         0x01   // receive and transmit
+#define UART_DOUBLE         0x02   // double baud rate (SMOD)
+#define UART_FLAGS          (UART_ENABLE | UART_DOUBLE)
+
+/// response of CMD_UART_CONFIG
+#define UART_OK             0x00
+#define UART_INVALID        0x01
+
+void     uart_init(void);
+void     uart_divisor(uint8_t divisor);
+bool     uart_config(uint8_t port, uint8_t flags);
+void     uart_service(void);
+
+void     uart_in_isr(uint8_t port);
+void     uart_out_isr(uint8_t port);
+void     uart_usb_reset(void);
+
+uint8_t  uart_rx_level(uint8_t port);
+uint8_t  uart_tx_level(uint8_t port);
+uint16_t uart_overruns(uint8_t port);
+
+#endif  // __UART_H
@@ -86,6 +86,10 @@
 
 #define STR_DESCR(len,...) { len*2+2, USB_DESCRIPTOR_TYPE_STRING, { __VA_ARGS__ } }
 
+/* Type of a string descriptor with len characters, e.g. to embed it into a
+ * struct */
+#define STR_DESCR_T(len) struct { uint8_t bLength; uint8_t bDescriptorType; uint16_t bString[len]; }
+
 /** USB Device Descriptor. See USB 1.1 spec, pp. 196 - 198 */
 struct usb_device_descriptor {
   uint8_t  bLength;            ///< Size of this descriptor in bytes.
@@ -166,9 +170,6 @@ struct setup_data {
 
 /* External declarations for variables that need to be accessed outside of
  * the USB module */
-extern volatile bool Semaphore_Command;
-extern volatile bool Semaphore_EP2_out;
-extern volatile bool Semaphore_EP2_in;
 extern volatile __xdata __at 0x7FE8 struct setup_data setup_data;
 
 /*
@@ -293,5 +294,27 @@ enum usb_isr {
 /*************************** Function Prototypes ***************************/
 
 void usb_init(void);
+void usb_connect(void);
+
+/* Data stage of vendor requests, see usb_ep0_complete() */
+#define USB_EP0_BUFFER_SIZE  192
+
+extern __xdata uint8_t usb_ep0_buffer[USB_EP0_BUFFER_SIZE];
+
+uint8_t usb_ep0_tag(void);
+uint8_t usb_ep0_received(void);
+void    usb_ep0_lock(bool lock);
+bool    usb_ep0_complete(uint8_t tag, __xdata uint8_t* data, uint8_t length);
+bool    usb_ep0_stall(uint8_t tag);
+
+/* IN-Bulk-NAK notification of IN1 .. IN6, see ibn_isr() */
+#define USB_IBN_COUNT  6
+
+/** Fills and arms the IN buffer, returns false if it had nothing to send */
+typedef bool (*usb_ibn_producer_t)(void);
+
+void     usb_ibn_register(uint8_t ep, usb_ibn_producer_t producer);
+uint16_t usb_ibn_naks(uint8_t ep);
+void     usb_ibn_clear(void);
 
 #endif
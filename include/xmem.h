@@ -0,0 +1,47 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __XMEM_H
+#define __XMEM_H
+
+#include <stdint.h>
+
+/**
+ * @file Fast block moves in XDATA memory
+ *
+ * These functions use the EZ-USB auto-pointer (AUTOPTRH/AUTOPTRL/AUTODATA)
+ * for one side of the transfer and DPTR for the other one. AUTODATA is
+ * accessed with "movx @r0" and MPAGE = 0x7F, therefore the second data
+ * pointer (DPL1/DPS) is not needed and the inner loops take 4 instructions
+ * per byte.
+ *
+ * The auto-pointer and MPAGE are not saved by ISRs, therefore these
+ * functions must not be used from interrupt service routines. The only
+ * exception is xmemcpy_isr(), which restores both. Since it shares its
+ * parameter variables with all other callers, it must only be called from
+ * ISRs or with interrupts disabled.
+ */
+
+void    xmemcpy     (__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length);
+void    xmemcpy_code(__xdata uint8_t* dst, const __code uint8_t* src, uint8_t length);
+uint8_t xstrcpy_code(__xdata char*    dst, const __code char* src);
+void    xmemset     (__xdata uint8_t* dst, uint8_t value, uint8_t length);
+void    xmemcpy_isr (__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length);
+
+#endif  // __XMEM_H
@@ -0,0 +1,190 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "usb.h"
+#include "i2c.h"
+#include "commands.h"
+#include "stream.h"
+#include "xmem.h"
+#include "delay.h"
+#include "capture.h"
+#include "pattern.h"
+#include "spi.h"
+#include "jtag.h"
+#include "event.h"
+#include "profile.h"
+#include "bench.h"
+
+__xdata TBenchMailbox bench_mailbox;
+
+/**
+ * Breakpoint for tools/bench.py
+ *
+ * The simulator stops here whenever bench_loop() is ready for the next
+ * event.
+ */
+void bench_idle(void) {
+}
+
+/**
+ * Plain pointer loop as reference for xmemcpy()
+ */
+static void bench_copy_loop(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length) {
+  while (length--)
+    *dst++ = *src++;
+}
+
+/**
+ * Benchmark loop
+ *
+ * This function has an infinite loop and does not return.
+ *
+ * The events are executed with interrupts disabled to get reproducible cycle
+ * counts. ISRs are called with "lcall", their "reti" then behaves like
+ * "ret". The cycles for the interrupt vectoring and the autovector jump
+ * table are not included. Note that the simulator doesn't implement the
+ * auto-pointer, so the data copied by xmem.c is wrong, but its timing is
+ * right.
+ */
+void bench_loop(void) {
+  uint8_t i;
+  uint8_t n;
+
+  command_init();
+  OUT2CS = EPBSY;     // the simulator never receives an EP2 OUT packet
+  profile_reset();
+
+  while (true) {
+    bench_mailbox.Event = BENCH_NONE;
+    bench_idle();
+
+    EA = 0;
+    switch (bench_mailbox.Event) {
+      case BENCH_RESET:
+        profile_reset();
+        break;
+      case BENCH_SETUP:
+        for (i = 0; i < 8; i++)
+          SETUPDAT[i] = bench_mailbox.Data[i];
+        PROFILE_ENTER(PROFILE_SUDAV_LATENCY);
+        __asm
+          lcall _sudav_isr
+        __endasm;
+        PROFILE_EXIT(PROFILE_SUDAV_LATENCY);
+        // vendor requests are executed in command_loop()
+        if (event_command) {
+          event_command = 0;
+          HandleCmd();
+        }
+        break;
+      case BENCH_I2C_START:
+        I2CS = 0;           // no STOP condition pending
+        i2c_start_write(bench_mailbox.Data[0], bench_mailbox.Length - 1,
+                        bench_mailbox.Data + 1);
+        break;
+      case BENCH_I2C:
+        I2CS  = bench_mailbox.Data[0];
+        I2DAT = bench_mailbox.Data[1];
+        PROFILE_ENTER(PROFILE_I2C_LATENCY);
+        __asm
+          lcall _i2c_isr
+        __endasm;
+        PROFILE_EXIT(PROFILE_I2C_LATENCY);
+        i2c_poll();
+        break;
+      case BENCH_CAPTURE:
+        // the pins (PINSA..PINSC) are set by the simulator
+        capture_start(bench_mailbox.Data[0], bench_mailbox.Data[1],
+                      bench_mailbox.Data[2], bench_mailbox.Data[3]);
+        PROFILE_ENTER(PROFILE_BENCH);
+        capture_poll();
+        PROFILE_EXIT(PROFILE_BENCH);
+        capture_stop();
+        break;
+      case BENCH_PATTERN:
+        // move one packet through the FIFO to the ports, one ISR call per
+        // sample
+        n = bench_mailbox.Length - 1;
+        if ((bench_mailbox.Data[0] & PATTERN_PORT_A) && (bench_mailbox.Data[0] & PATTERN_PORT_B))
+          n /= 2;
+        pattern_start(bench_mailbox.Data[0], 0, 0);
+        PROFILE_ENTER(PROFILE_BENCH);
+        pattern_put(bench_mailbox.Data + 1, bench_mailbox.Length - 1);
+        for (i = 0; i < n; i++) {
+          __asm
+            lcall _timer0_isr
+          __endasm;
+        }
+        PROFILE_EXIT(PROFILE_BENCH);
+        pattern_stop();
+        break;
+      case BENCH_SPI:
+        // SCK, MOSI, CS on Port A, MISO on Port B
+        spi_config(SPI_PIN(SPI_PORT_A, 0) | bench_mailbox.Data[0],
+                   SPI_PIN(SPI_PORT_A, 1), SPI_PIN(SPI_PORT_B, 0),
+                   SPI_PIN(SPI_PORT_A, 2));
+        spi_select(true);
+        PROFILE_ENTER(PROFILE_BENCH);
+        spi_transfer(IN2BUF, bench_mailbox.Data + 1, bench_mailbox.Length - 1);
+        PROFILE_EXIT(PROFILE_BENCH);
+        spi_select(false);
+        break;
+      case BENCH_JTAG:
+        // TCK, TMS, TDI on Port A, TDO on Port B
+        jtag_config(SPI_PIN(SPI_PORT_A, 0), SPI_PIN(SPI_PORT_A, 2),
+                    SPI_PIN(SPI_PORT_A, 1), SPI_PIN(SPI_PORT_B, 0));
+        PROFILE_ENTER(PROFILE_BENCH);
+        jtag_scan(IN2BUF, bench_mailbox.Data + 1, 8 * (bench_mailbox.Length - 1),
+                  bench_mailbox.Data[0]);
+        PROFILE_EXIT(PROFILE_BENCH);
+        break;
+      case BENCH_STREAM:
+        // fill EP2 IN packets in EP2_MODE_STREAM, the SIE is assumed to have
+        // sent every packet before the next one is produced
+        stream_init(bench_mailbox.Data[0] & EP2_FLAG_DOUBLE_BUFFER, false);
+        n = bench_mailbox.Data[1];
+        PROFILE_ENTER(PROFILE_BENCH);
+        for (i = 0; i < n; i++) {
+          IN2CS = 0;
+          StreamProduce();
+        }
+        PROFILE_EXIT(PROFILE_BENCH);
+        break;
+      case BENCH_COPY:
+        PROFILE_ENTER(PROFILE_BENCH);
+        if (bench_mailbox.Data[0] == BENCH_COPY_XMEM)
+          xmemcpy(IN2BUF, OUT2BUF, bench_mailbox.Data[1]);
+        else
+          bench_copy_loop(IN2BUF, OUT2BUF, bench_mailbox.Data[1]);
+        PROFILE_EXIT(PROFILE_BENCH);
+        break;
+      case BENCH_DELAY:
+        PROFILE_ENTER(PROFILE_BENCH);
+        delay_us(((uint16_t)bench_mailbox.Data[1] << 8) | bench_mailbox.Data[0]);
+        PROFILE_EXIT(PROFILE_BENCH);
+        break;
+    }
+    EA = 1;
+  }
+}
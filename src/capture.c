@@ -0,0 +1,304 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "capture.h"
+
+/**
+ * Sampling loops, selected by capture_mode
+ */
+#define CAPTURE_MODE_NARROW        0   // 8 pins, maximum rate
+#define CAPTURE_MODE_NARROW_DELAY  1   // 8 pins, with divider
+#define CAPTURE_MODE_WIDE          2   // 24 pins, maximum rate
+#define CAPTURE_MODE_WIDE_DELAY    3   // 24 pins, with divider
+
+/// LO8 of the address of PINSA (0x7F99), followed by PINSB and PINSC
+#define CAPTURE_PINSA  0x99
+
+/**
+ * Parameters of the armed capture, used by capture_run()
+ *
+ * These are accessed from assembler and therefore must be in DATA memory.
+ */
+static __data uint8_t capture_mode;
+static __data uint8_t capture_port;            // LO8 of the first PINSx register
+static __data uint8_t capture_groups;          // samples / CAPTURE_UNROLL
+static __data uint8_t capture_divider;
+static __data uint8_t capture_trigger_port;    // LO8 of the PINSx register
+static __data uint8_t capture_trigger_mask;
+static __data uint8_t capture_trigger_value;
+
+static enum { csIdle, csArmed, csDone } capture_state;
+static uint16_t capture_bytes;
+
+/*****************************************************************************/
+/***  Sampling Loop  *********************************************************/
+/*****************************************************************************/
+
+/*
+ * The loop body of every mode is repeated CAPTURE_UNROLL - 1 times with
+ * "sjmp .+2" (a jump to the next instruction) as padding, the last copy has
+ * the loop branch "djnz r7" instead, which takes the same cycles.
+ */
+
+/**
+ * Wait for the trigger and sample
+ *
+ * Must be called with interrupts disabled.
+ *
+ * @return 1 if the samples were taken, 0 if the trigger condition wasn't
+ *   met within 256 polls
+ */
+static uint8_t capture_run(void) __naked {
+  __asm
+    mov   _MPAGE,#0x7F          ; movx @r0/@r1 access 0x7Fxx
+    mov   r0,#0xE3              ; AUTOPTRH = HI8(pool_data)
+    mov   a,#(_pool_data >> 8)
+    movx  @r0,a
+    inc   r0                    ; AUTOPTRL = LO8(pool_data)
+    mov   a,#_pool_data
+    movx  @r0,a
+    mov   r1,#0xE5              ; r1 -> AUTODATA
+    mov   r0,_capture_trigger_port
+    mov   r2,_capture_trigger_mask
+    mov   r3,_capture_trigger_value
+    mov   r7,#0                 ; 256 polls
+00001$:
+    movx  a,@r0                 ; (PINSx & mask) == value?
+    anl   a,r2
+    xrl   a,r3
+    jz    00002$
+    djnz  r7,00001$
+    mov   dpl,#0                ; not triggered
+    ret
+00002$:
+    mov   r0,_capture_port
+    mov   r7,_capture_groups
+    mov   a,_capture_mode
+    jnz   00003$
+    ljmp  00010$
+00003$:
+    dec   a
+    jnz   00004$
+    ljmp  00020$
+00004$:
+    dec   a
+    jnz   00005$
+    ljmp  00030$
+00005$:
+    ljmp  00040$
+
+    ; CAPTURE_MODE_NARROW: 7 cycles per sample
+00010$:
+    .rept 3
+    movx  a,@r0
+    movx  @r1,a
+    sjmp  .+2
+    .endm
+    movx  a,@r0
+    movx  @r1,a
+    djnz  r7,00010$
+    mov   dpl,#1
+    ret
+
+    ; CAPTURE_MODE_NARROW_DELAY: 9 + 3 * divider cycles per sample
+00020$:
+    .rept 3
+    movx  a,@r0
+    movx  @r1,a
+    mov   r6,_capture_divider
+    djnz  r6,.
+    sjmp  .+2
+    .endm
+    movx  a,@r0
+    movx  @r1,a
+    mov   r6,_capture_divider
+    djnz  r6,.
+    djnz  r7,00020$
+    mov   dpl,#1
+    ret
+
+    ; CAPTURE_MODE_WIDE: 19 cycles per sample
+00030$:
+    .rept 3
+    mov   r0,#0x99              ; r0 -> PINSA
+    movx  a,@r0
+    movx  @r1,a
+    inc   r0
+    movx  a,@r0
+    movx  @r1,a
+    inc   r0
+    movx  a,@r0
+    movx  @r1,a
+    sjmp  .+2
+    .endm
+    mov   r0,#0x99              ; r0 -> PINSA
+    movx  a,@r0
+    movx  @r1,a
+    inc   r0
+    movx  a,@r0
+    movx  @r1,a
+    inc   r0
+    movx  a,@r0
+    movx  @r1,a
+    djnz  r7,00030$
+    mov   dpl,#1
+    ret
+
+    ; CAPTURE_MODE_WIDE_DELAY: 21 + 3 * divider cycles per sample
+00040$:
+    .rept 3
+    mov   r0,#0x99              ; r0 -> PINSA
+    movx  a,@r0
+    movx  @r1,a
+    inc   r0
+    movx  a,@r0
+    movx  @r1,a
+    inc   r0
+    movx  a,@r0
+    movx  @r1,a
+    mov   r6,_capture_divider
+    djnz  r6,.
+    sjmp  .+2
+    .endm
+    mov   r0,#0x99              ; r0 -> PINSA
+    movx  a,@r0
+    movx  @r1,a
+    inc   r0
+    movx  a,@r0
+    movx  @r1,a
+    inc   r0
+    movx  a,@r0
+    movx  @r1,a
+    mov   r6,_capture_divider
+    djnz  r6,.
+    djnz  r7,00040$
+    mov   dpl,#1
+    ret
+  __endasm;
+}
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Arm a capture
+ *
+ * Takes over all buffers of the packet pool until capture_stop().
+ *
+ * @param config   CAPTURE_PORT_* of the sampled (8 pins) or trigger (24
+ *                 pins, with CAPTURE_WIDE) port
+ * @param divider  0 for the maximum rate, otherwise additional delay per
+ *                 sample (see capture.h), which may shorten the capture
+ * @param trigger_mask   pins of the trigger port compared with
+ * @param trigger_value  (0/0 starts immediately)
+ * @return false if a capture is active, the pool is in use or @a config is
+ *   invalid
+ */
+bool capture_start(uint8_t config, uint8_t divider,
+                   uint8_t trigger_mask, uint8_t trigger_value) {
+  uint8_t  i;
+  uint16_t groups;
+
+  if ((capture_state != csIdle) || (pool_available() != POOL_COUNT) ||
+      ((config & CAPTURE_PORT_MASK) > CAPTURE_PORT_C)) {
+    return false;
+  }
+  // pool_data is one block of all pool buffers
+  for (i = 0; i < POOL_COUNT; i++) {
+    pool_alloc();
+  }
+
+  capture_trigger_port  = CAPTURE_PINSA + (config & CAPTURE_PORT_MASK);
+  capture_trigger_mask  = trigger_mask;
+  capture_trigger_value = trigger_value & trigger_mask;
+  capture_divider       = divider;
+  // shorten slow captures to CAPTURE_MAX_CYCLES (see capture.h)
+  groups = CAPTURE_MAX_CYCLES /
+           (CAPTURE_PERIOD(config & CAPTURE_WIDE, divider) * CAPTURE_UNROLL);
+  if (!groups)
+    groups = 1;
+  if (config & CAPTURE_WIDE) {
+    if (groups > CAPTURE_SAMPLES_WIDE / CAPTURE_UNROLL)
+      groups = CAPTURE_SAMPLES_WIDE / CAPTURE_UNROLL;
+    capture_mode   = CAPTURE_MODE_WIDE;
+    capture_port   = CAPTURE_PINSA;
+    capture_bytes  = groups * CAPTURE_UNROLL * 3;
+  } else {
+    if (groups > CAPTURE_SAMPLES / CAPTURE_UNROLL)
+      groups = CAPTURE_SAMPLES / CAPTURE_UNROLL;
+    capture_mode   = CAPTURE_MODE_NARROW;
+    capture_port   = capture_trigger_port;
+    capture_bytes  = groups * CAPTURE_UNROLL;
+  }
+  capture_groups = groups;
+  if (divider)
+    capture_mode++;       // *_DELAY
+  capture_state = csArmed;
+  return true;
+}
+
+/**
+ * Poll the trigger of the armed capture and sample if it is met
+ *
+ * This blocks interrupts for at most 256 trigger polls plus the sampling
+ * time (at most CAPTURE_MAX_CYCLES), so call it repeatedly from the main
+ * loop.
+ *
+ * @return number of bytes in capture_buffer() when the capture has just
+ *   finished, 0 otherwise
+ */
+uint16_t capture_poll(void) {
+  uint8_t done;
+
+  if (capture_state != csArmed)
+    return 0;
+  __critical {
+    done = capture_run();
+  }
+  if (!done)
+    return 0;
+  capture_state = csDone;
+  return capture_bytes;
+}
+
+/**
+ * Return the samples of the finished capture
+ *
+ * With 24 pins, every sample consists of the bytes of Port A, B and C.
+ */
+__xdata uint8_t* capture_buffer(void) {
+  return pool_data[0];
+}
+
+/**
+ * Abort or finish the capture and return the pool buffers
+ */
+void capture_stop(void) {
+  uint8_t i;
+
+  if (capture_state == csIdle)
+    return;
+  for (i = 0; i < POOL_COUNT; i++) {
+    pool_free(i);
+  }
+  capture_state = csIdle;
+}
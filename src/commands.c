@@ -24,34 +24,53 @@
 #include "common.h"
 #include "usb.h"
 #include "i2c.h"
+#include "eeprom.h"
+#include "capture.h"
+#include "pattern.h"
+#include "spi.h"
+#include "flash.h"
+#include "jtag.h"
+#include "uart.h"
+#include "notify.h"
+#include "stats.h"
+#include "trace.h"
 #include "io.h"
+#include "stream.h"
+#include "event.h"
+#include "xmem.h"
+#include "profile.h"
 
-// local copy of the information we got in the SETUPDAT packet
+// local copy of the information we got in the SETUPDAT packet (or in the
+// command stream record)
 volatile uint8_t  Command;
 volatile uint16_t CmdIndex;
 volatile uint16_t CmdValue;
+__xdata uint8_t*  CmdData;   // OUT data stage or record payload
+uint8_t           CmdLength; // number of bytes at CmdData
+
+// set while a vendor request is executed, its handler may then return
+// CMD_DEFERRED and complete the request later (see usb_ep0_complete())
+bool    CmdAsync;
+uint8_t CmdTag;              // usb_ep0_tag() of the vendor request
 
 /****************************************************************************/
 /***  GetVersion  ***********************************************************/
 /****************************************************************************/
 
-/**
- * Alias IN0BUF to variable Version
- */
-volatile __xdata __at 0x7F00 /*IN0BUF*/ TGetVersion Version;
-
 /**
  * Command: GetVersion
  *
  * Return firmware version, ...
  *
- * Fills IN0BUF and arms EP0IN.
+ * Fills Buf and returns the number of bytes.
  */
-void GetVersion() {
+uint8_t GetVersion(__xdata uint8_t* Buf) {
+  __xdata TGetVersion* Version = (__xdata TGetVersion*)Buf;
+
   // fill Version
-  Version.Firmware = FIRMWARE_VERSION;
+  Version->Firmware = FIRMWARE_VERSION;
   // ... fill other fields as declared in TGetVersion in commands.h ...
-  IN0BC = sizeof(Version);
+  return sizeof(TGetVersion);
 }
 
 /****************************************************************************/
@@ -65,23 +84,11 @@ const char __code const * VersionString = "EZ-USB Firmware 0.1";
  *
  * Return firmware version string
  *
- * Fills IN0BUF and arms EP0IN.
+ * Fills Buf and returns the number of bytes.
  */
-void GetVersionString() {
-  uint8_t b;
-  __code char* Src;
-  __xdata char* Dst;
-
+uint8_t GetVersionString(__xdata uint8_t* Buf) {
   // copy version string
-  Src = VersionString;
-  Dst = IN0BUF;
-  b = 0;
-  while (*Src) {
-    *Dst++ = *Src++;
-    b++;
-  }
-  // arm endpoint
-  IN0BC = b;
+  return xstrcpy_code((__xdata char*)Buf, VersionString);
 }
 
 /****************************************************************************/
@@ -89,83 +96,1378 @@ void GetVersionString() {
 /****************************************************************************/
 
 /**
- * Alias IN0BUF to variable Status
+ * Command: GetStatus
+ *
+ * Return the performance counters and clear them if CmdValue is not 0.
+ *
+ * Fills Buf and returns the number of bytes.
+ */
+uint8_t GetStatus(__xdata uint8_t* Buf) {
+  // the ISRs must not update the counters between copying and clearing
+  __critical {
+    xmemcpy(Buf, (__xdata uint8_t*)&stats, sizeof(TGetStatus));
+    if (CmdValue)
+      stats_reset();
+  }
+  return sizeof(TGetStatus);
+}
+
+/****************************************************************************/
+/***  I2CWriteRead  *********************************************************/
+/****************************************************************************/
+
+/**
+ * State of a deferred I2CWriteRead
  */
-volatile __xdata __at 0x7F00 /*IN0BUF*/ TGetStatus Status;
+__xdata uint8_t I2CBuf[1 + CMD_I2C_MAX_DATA];   // status, then address/data
+bool            I2CPending;  // the transfer is queued
 
 /**
- * Command: GetStatus
+ * Completion of a deferred I2CWriteRead
+ *
+ * Called by i2c_poll() from the main loop.
+ */
+void I2CWriteReadDone(__xdata I2C_Transaction* t) {
+  I2CPending = false;
+  I2CBuf[0]  = t->Status;
+#ifdef NOTIFY
+  notify_post(NOTIFY_I2C, t->Status);
+#endif
+  usb_ep0_complete(t->Tag, I2CBuf, 1 + t->RdLength);
+}
+
+/**
+ * Command: I2CWriteRead
+ *
+ * Write the 8 or 16 bit register address given in CmdIndex to the I2C slave
+ * and read the register contents after a repeated START condition.
+ *
+ * Fills Buf with the status followed by the data and returns the number of
+ * bytes. As a vendor request, the transfer is queued and the request is
+ * completed by I2CWriteReadDone() instead.
+ */
+uint8_t I2CWriteRead(__xdata uint8_t* Buf) {
+  __xdata I2C_Transaction* t;
+  __xdata uint8_t*         Data;
+  uint8_t Count;
+  uint8_t RegLength;
+
+  Count = HI8(CmdValue);
+  if (Count > CMD_I2C_MAX_DATA)
+    Count = CMD_I2C_MAX_DATA;
+  t = NULL;
+  Data = Buf;
+  if (CmdAsync) {
+    // the previous deferred transfer still uses I2CBuf
+    if (!I2CPending)
+      t = i2c_alloc();
+    if (!t) {
+      Buf[0] = I2C_BUSY;
+      return 1;
+    }
+    Data = I2CBuf;
+  }
+  // register address is sent from Data[1..] and then overwritten with the data
+  if (LO8(CmdValue) & CMD_I2C_REG16) {
+    Data[1] = HI8(CmdIndex);
+    Data[2] = LO8(CmdIndex);
+    RegLength = 2;
+  } else {
+    Data[1] = LO8(CmdIndex);
+    RegLength = 1;
+  }
+  if (t) {
+    t->Addr     = LO8(CmdValue) & 0x7F;
+    t->Flags    = I2C_WRITE_READ;
+    t->Length   = RegLength;
+    t->Ptr      = I2CBuf + 1;
+    t->RdLength = Count;
+    t->RdPtr    = I2CBuf + 1;
+    t->Callback = I2CWriteReadDone;
+    t->Tag      = CmdTag;
+    I2CPending  = true;
+    i2c_submit();
+    return CMD_DEFERRED;
+  }
+  Buf[0] = i2c_write_read(LO8(CmdValue) & 0x7F, RegLength, Buf+1, Count, Buf+1);
+  return 1 + Count;
+}
+
+/****************************************************************************/
+/***  I2CWrite  *************************************************************/
+/****************************************************************************/
+
+/**
+ * Completion of a deferred I2CWrite
+ *
+ * Called by i2c_poll() from the main loop.
+ */
+void I2CWriteDone(__xdata I2C_Transaction* t) {
+  usb_ep0_lock(false);
+#ifdef NOTIFY
+  notify_post(NOTIFY_I2C, t->Status);
+#endif
+  if (t->Status == I2C_OK)
+    usb_ep0_complete(t->Tag, NULL, 0);
+  else
+    usb_ep0_stall(t->Tag);
+}
+
+/**
+ * Command: I2CWrite
+ *
+ * Write CmdData to the I2C slave.
+ *
+ * Fills Buf with the status and returns the number of bytes. As a vendor
+ * request, the transfer is queued and the request is completed by
+ * I2CWriteDone() instead. An OUT request has no response, so EP0 is
+ * stalled if the I2C queue is full. The data is sent from the EP0 buffer,
+ * which stays locked until the transfer has finished.
+ */
+uint8_t I2CWrite(__xdata uint8_t* Buf) {
+  __xdata I2C_Transaction* t;
+
+  if (!CmdAsync) {
+    Buf[0] = i2c_write(LO8(CmdValue) & 0x7F, CmdLength, CmdData);
+    return 1;
+  }
+  t = i2c_alloc();
+  if (!t) {
+    usb_ep0_stall(CmdTag);
+    return CMD_DEFERRED;
+  }
+  t->Addr     = LO8(CmdValue) & 0x7F;
+  t->Flags    = I2C_WRITE;
+  t->Length   = CmdLength;
+  t->Ptr      = CmdData;
+  t->Callback = I2CWriteDone;
+  t->Tag      = CmdTag;
+  usb_ep0_lock(true);
+  i2c_submit();
+  return CMD_DEFERRED;
+}
+
+/****************************************************************************/
+/***  SetEP2Mode  ***********************************************************/
+/****************************************************************************/
+
+/**
+ * Current usage of EP2, one of the EP2_MODE_* values
+ */
+uint8_t Ep2Mode;
+
+/**
+ * Counter used as data pattern in EP2_MODE_STREAM
+ */
+uint8_t StreamPattern;
+
+/**
+ * EP2_MODE_STREAM with EP2_FLAG_LAZY: StreamProduce() runs when EP2 IN is
+ * polled instead of StreamFill() keeping the buffers filled
+ */
+bool StreamLazy;
+
+/**
+ * State of EP2_MODE_CMDSTREAM
+ */
+uint8_t CmdStreamPos;       // read position in the current EP2 OUT packet
+uint8_t CmdStreamFill;      // number of bytes in the current EP2 IN buffer
+uint8_t CmdStreamReplyLen;  // size of the pending reply, 0 if none
+
+/**
+ * Reply of the last command executed from the command stream
+ */
+__xdata uint8_t CmdStreamReply[64];
+
+/**
+ * State of EP2_MODE_EEPROM
+ */
+uint32_t   EepromRemaining;    // bytes not yet read/written
+uint16_t   EepromAddr;         // next EEPROM address to read
+uint8_t    EepromPos;          // read position in the current EP2 OUT packet
+bool       EepromReading;      // true: EEPROMRead, false: EEPROMWrite
+bool       EepromReadPending;  // a read into an EP2 IN buffer is queued
+I2C_Status EepromStatus;       // status of the last failed transfer
+
+#ifdef CAPTURE
+/**
+ * State of EP2_MODE_CAPTURE
+ */
+uint16_t CaptureRemaining;   // bytes not yet sent
+uint16_t CapturePos;         // read position in capture_buffer()
+#endif  // CAPTURE
+
+#ifdef PATTERN
+/**
+ * State of EP2_MODE_PATTERN
+ */
+uint8_t PatternPos;          // read position in the current EP2 OUT packet
+#endif  // PATTERN
+
+#ifdef FLASH
+/**
+ * State of EP2_MODE_FLASH
+ */
+uint32_t     FlashRemaining;    // bytes not yet read/written
+uint8_t      FlashPos;          // read position in the current EP2 OUT packet
+bool         FlashReading;      // true: FlashRead, false: FlashWrite
+Flash_Status FlashStatus;       // status of the last failed write
+bool         FlashEraseWait;    // FlashErase with CMD_FLASH_ERASE_WAIT active
+uint8_t      FlashEraseTag;     // usb_ep0_tag() of that FlashErase
+__xdata uint8_t FlashEraseResult;  // response of that FlashErase
+#endif  // FLASH
+
+#ifdef JTAG
+/**
+ * State of EP2_MODE_JTAG
+ */
+uint8_t JtagPos;             // read position in the current EP2 OUT packet
+uint8_t JtagFill;            // number of TDO bytes in the current EP2 IN buffer
+#endif  // JTAG
+
+/**
+ * Command: SetEP2Mode
+ *
+ * Select the usage of EP2 and (re-)initialize its buffers. The modes of
+ * features which are not built behave like EP2_MODE_IDLE.
+ *
+ * No data stage.
+ */
+uint8_t SetEP2Mode() {
+  Ep2Mode = LO8(CmdValue);
+  StreamPattern     = 0;
+  CmdStreamPos      = 0;
+  CmdStreamFill     = 0;
+  CmdStreamReplyLen = 0;
+  EepromRemaining   = 0;
+#ifdef CAPTURE
+  CaptureRemaining  = 0;
+  capture_stop();
+#endif
+#ifdef PATTERN
+  PatternPos        = 0;
+  pattern_stop();
+#endif
+#ifdef FLASH
+  FlashRemaining    = 0;
+  FlashPos          = 0;
+  FlashEraseWait    = false;
+#endif
+#ifdef JTAG
+  JtagPos           = 0;
+  JtagFill          = 0;
+#endif
+#ifdef SPI
+  spi_select(false);
+#endif
+  stream_init(CmdIndex & EP2_FLAG_DOUBLE_BUFFER, CmdIndex & EP2_FLAG_POOL);
+  StreamLazy = (Ep2Mode == EP2_MODE_STREAM) && (CmdIndex & EP2_FLAG_LAZY);
+  usb_ibn_register(2, StreamLazy ? StreamProduce : NULL);
+  return 0;
+}
+
+/****************************************************************************/
+/***  EEPROMRead, EEPROMWrite, EEPROMStatus  ********************************/
+/****************************************************************************/
+
+/**
+ * Check whether an EEPROM read or write operation is active
+ */
+bool EepromBusy() {
+  return EepromRemaining || EepromReadPending || eeprom_write_busy();
+}
+
+/**
+ * Command: EEPROMRead and EEPROMWrite
+ *
+ * Start streaming the EEPROM contents to EP2 IN or from EP2 OUT.
+ *
+ * Fills Buf with the status and returns the number of bytes.
+ */
+uint8_t EEPROMStart(__xdata uint8_t* Buf, bool Reading) {
+  if ((Ep2Mode != EP2_MODE_EEPROM) || EepromBusy()) {
+    Buf[0] = I2C_BUSY;
+    return 1;
+  }
+  EepromReading   = Reading;
+  EepromAddr      = CmdValue;
+  EepromRemaining = CmdIndex ? CmdIndex : 0x10000;
+  EepromPos       = 0;
+  EepromStatus    = I2C_OK;
+  if (Reading) {
+    // wait until a previous write cycle has finished
+    EepromStatus = eeprom_wait_ready();
+    if (EepromStatus != I2C_OK)
+      EepromRemaining = 0;
+  } else {
+    eeprom_write_begin(CmdValue);
+  }
+  Buf[0] = EepromStatus;
+  return 1;
+}
+
+/**
+ * Command: EEPROMStatus
+ *
+ * Fills Buf and returns the number of bytes.
+ */
+uint8_t EEPROMStatus(__xdata uint8_t* Buf) {
+  __xdata TEEPROMStatus* Status = (__xdata TEEPROMStatus*)Buf;
+
+  Status->Busy      = EepromBusy();
+  Status->Status    = EepromStatus;
+  Status->Remaining = EepromRemaining;
+  return sizeof(TEEPROMStatus);
+}
+
+/**
+ * An EEPROM read into an EP2 IN buffer has finished: send it
+ */
+void EepromReadDone(__xdata I2C_Transaction* t) {
+  EepromReadPending = false;
+  if (t->Status != I2C_OK) {
+    EepromStatus    = t->Status;
+    EepromRemaining = 0;
+    return;
+  }
+  stream_in_commit(t->RdLength);
+  EepromRemaining -= t->RdLength;
+}
+
+/**
+ * Advance the current EEPROM operation
+ *
+ * This is executed from command_loop() in EP2_MODE_EEPROM. Reads go
+ * directly from the EEPROM into the free EP2 IN buffer. Writes consume EP2
+ * OUT data as long as the EEPROM page buffer accepts it, otherwise the
+ * packet stays in its buffer (the host is NAKed).
+ */
+void EepromService() {
+  uint8_t Length;
+
+  if (EepromReading) {
+    if (EepromReadPending || !EepromRemaining || !stream_in_ready())
+      return;
+    Length = (EepromRemaining > 64) ? 64 : EepromRemaining;
+    if (eeprom_start_read(EepromAddr, Length, stream_in_buffer(), EepromReadDone)) {
+      EepromReadPending = true;
+      EepromAddr += Length;
+    }
+    return;
+  }
+
+  if (eeprom_write_status() != I2C_OK) {
+    EepromStatus    = eeprom_write_status();
+    EepromRemaining = 0;
+  }
+  while (stream_out_ready()) {
+    Length = stream_out_length() - EepromPos;
+    // data beyond the requested number of bytes is dropped
+    if (Length > EepromRemaining)
+      Length = EepromRemaining;
+    if (Length) {
+      Length = eeprom_write_put(stream_out_buffer() + EepromPos, Length);
+      if (!Length)
+        return;   // page buffer busy
+      EepromPos       += Length;
+      EepromRemaining -= Length;
+      if (EepromRemaining && (EepromPos < stream_out_length()))
+        continue;
+    }
+    EepromPos = 0;
+    stream_out_release();
+  }
+  // program the last (partial) page
+  if (!EepromRemaining && !eeprom_write_busy())
+    eeprom_write_flush();
+}
+
+/****************************************************************************/
+/***  Capture  **************************************************************/
+/****************************************************************************/
+
+#ifdef CAPTURE
+/**
+ * Command: Capture
+ *
+ * Arm the logic analyzer.
+ *
+ * Fills Buf with the status and returns the number of bytes.
+ */
+uint8_t CaptureStart(__xdata uint8_t* Buf) {
+  Buf[0] = CAPTURE_OK;
+  if ((Ep2Mode != EP2_MODE_CAPTURE) || CaptureRemaining ||
+      !capture_start(HI8(CmdValue), LO8(CmdValue), LO8(CmdIndex), HI8(CmdIndex))) {
+    Buf[0] = CAPTURE_BUSY;
+  }
+  return 1;
+}
+
+/**
+ * Advance the current capture
+ *
+ * This is executed from command_loop() in EP2_MODE_CAPTURE. Polls the
+ * trigger of an armed capture and streams the samples to EP2 IN. The pool
+ * buffers are returned after the last packet.
+ */
+void CaptureService() {
+  uint8_t Length;
+
+  if (!CaptureRemaining) {
+    CaptureRemaining = capture_poll();
+    CapturePos       = 0;
+  }
+  while (CaptureRemaining && stream_in_ready()) {
+    Length = (CaptureRemaining > 64) ? 64 : CaptureRemaining;
+    xmemcpy(stream_in_buffer(), capture_buffer() + CapturePos, Length);
+    stream_in_commit(Length);
+    CapturePos       += Length;
+    CaptureRemaining -= Length;
+    if (!CaptureRemaining)
+      capture_stop();
+  }
+}
+#endif  // CAPTURE
+
+/****************************************************************************/
+/***  Pattern, PatternStatus  ***********************************************/
+/****************************************************************************/
+
+#ifdef PATTERN
+/**
+ * Command: Pattern
+ *
+ * Start or stop the pattern generator.
+ *
+ * Fills Buf with the status and returns the number of bytes.
+ */
+uint8_t PatternStart(__xdata uint8_t* Buf) {
+  Buf[0] = PATTERN_OK;
+  if (!HI8(CmdValue)) {
+    pattern_stop();
+  } else if ((Ep2Mode != EP2_MODE_PATTERN) ||
+             !pattern_start(HI8(CmdValue), LO8(CmdValue), LO8(CmdIndex))) {
+    Buf[0] = PATTERN_BUSY;
+  }
+  return 1;
+}
+
+/**
+ * Command: PatternStatus
+ *
+ * Fills Buf and returns the number of bytes.
+ */
+uint8_t PatternStatus(__xdata uint8_t* Buf) {
+  __xdata TPatternStatus* Status = (__xdata TPatternStatus*)Buf;
+
+  Status->Running   = pattern_running();
+  Status->Level     = pattern_level();
+  Status->Underruns = pattern_underruns();
+  Status->Samples   = pattern_samples();
+  return sizeof(TPatternStatus);
+}
+
+/**
+ * Move EP2 OUT data into the pattern generator FIFO
+ *
+ * This is executed from command_loop() in EP2_MODE_PATTERN. A packet is
+ * released when it was completely taken by the FIFO, otherwise the rest is
+ * put when the ISR has made room. While the generator is stopped, the data
+ * stays in the EP2 OUT buffers (the host is NAKed when they are full).
+ */
+void PatternService() {
+  uint8_t Length;
+  uint8_t Taken;
+
+  while (stream_out_ready()) {
+    Length = stream_out_length() - PatternPos;
+    Taken  = pattern_put(stream_out_buffer() + PatternPos, Length);
+    if (Taken < Length) {
+      PatternPos += Taken;
+      return;
+    }
+    PatternPos = 0;
+    stream_out_release();
+  }
+}
+#endif  // PATTERN
+
+/****************************************************************************/
+/***  SPIConfig  ************************************************************/
+/****************************************************************************/
+
+#ifdef SPI
+/**
+ * Command: SPIConfig
+ *
+ * Configure the pins and the mode of the SPI master.
+ *
+ * Fills Buf with the status and returns the number of bytes.
+ */
+uint8_t SPIConfig(__xdata uint8_t* Buf) {
+  if (spi_config(LO8(CmdValue), HI8(CmdValue), LO8(CmdIndex), HI8(CmdIndex)))
+    Buf[0] = SPI_OK;
+  else
+    Buf[0] = SPI_INVALID;
+  return 1;
+}
+
+/**
+ * Execute SPI transfers from EP2 OUT to EP2 IN
+ *
+ * This is executed from HandleEP2Out() in EP2_MODE_SPI. The bytes are sent
+ * directly from the EP2 OUT buffer, the received bytes are written directly
+ * to the EP2 IN buffer. CS is deasserted after a short packet, which ends
+ * the USB transfer. A packet is left in its OUT buffer until an IN buffer is
+ * free.
+ */
+void SpiService() {
+  uint8_t Length;
+
+  while (stream_out_ready() && stream_in_ready()) {
+    Length = stream_out_length();
+    spi_select(true);
+    spi_transfer(stream_in_buffer(), stream_out_buffer(), Length);
+    if (Length < 64)
+      spi_select(false);
+    stream_in_commit(Length);
+    stream_out_release();
+  }
+}
+#endif  // SPI
+
+/****************************************************************************/
+/***  JTAGConfig  ***********************************************************/
+/****************************************************************************/
+
+#ifdef JTAG
+/**
+ * Command: JTAGConfig
+ *
+ * Configure the pins of the JTAG master.
+ *
+ * Fills Buf with the status and returns the number of bytes.
+ */
+uint8_t JTAGConfig(__xdata uint8_t* Buf) {
+  if (jtag_config(LO8(CmdValue), HI8(CmdValue), LO8(CmdIndex), HI8(CmdIndex)))
+    Buf[0] = JTAG_OK;
+  else
+    Buf[0] = JTAG_INVALID;
+  return 1;
+}
+
+/// return value of JtagExecute() if it has to wait for an EP2 IN buffer
+#define JTAG_WAIT_IN  0xFF
+
+/**
+ * Execute one JTAG record
+ *
+ * @param Rec    record in the EP2 OUT buffer
+ * @param Avail  bytes from Rec to the end of the packet
+ * @return size of the record, 0 if it is truncated or invalid, or
+ *         JTAG_WAIT_IN if no EP2 IN buffer is free (the record was not
+ *         executed)
+ */
+uint8_t JtagExecute(__xdata uint8_t* Rec, uint8_t Avail) {
+  __xdata TJtagScan* Scan = (__xdata TJtagScan*)Rec;
+  __xdata uint8_t*   Src;
+  __xdata uint8_t*   Dst;
+  uint8_t            Bytes;
+  uint8_t            Size;
+  uint8_t            EndCount;
+
+  switch (Rec[0] & JTAG_CMD_MASK) {
+    case JTAG_TMS:
+      if ((Avail < 3) || (Rec[1] > 8))
+        return 0;
+      jtag_tms(Rec[2], Rec[1]);
+      return 3;
+    case JTAG_CLOCK:
+      if (Avail < 3)
+        return 0;
+      jtag_clock(Rec[1] | ((uint16_t)Rec[2] << 8));
+      return 3;
+    case JTAG_SCAN:
+      break;
+    default:
+      return 0;
+  }
+
+  if ((Avail < sizeof(TJtagScan)) || !Scan->Bits || (Scan->Bits > 8 * 64))
+    return 0;
+  Bytes = (Scan->Bits + 7) >> 3;
+  Size  = sizeof(TJtagScan);
+  Src   = Rec + sizeof(TJtagScan);
+  Dst   = Src;     // TDO of output-only scans overwrites the TDI bytes
+  if (Rec[0] & JTAG_SCAN_OUT)
+    Size += Bytes;
+  if (Size > Avail)
+    return 0;
+  // TDO is shifted directly into the EP2 IN buffer, which also provides the
+  // TDI zeros of input-only scans
+  if ((Rec[0] & (JTAG_SCAN_IN | JTAG_SCAN_OUT)) != JTAG_SCAN_OUT) {
+    if (JtagFill && (JtagFill + Bytes > 64)) {
+      stream_in_commit(JtagFill);
+      JtagFill = 0;
+    }
+    if (!stream_in_ready())
+      return JTAG_WAIT_IN;
+    Dst = stream_in_buffer() + JtagFill;
+    if (!(Rec[0] & JTAG_SCAN_OUT)) {
+      xmemset(Dst, 0, Bytes);
+      Src = Dst;
+    }
+  }
+
+  EndCount = Scan->TmsCount & 0x0F;
+  jtag_tms(Scan->TmsStart, Scan->TmsCount >> 4);
+  jtag_scan(Dst, Src, Scan->Bits, EndCount && (Scan->TmsEnd & 0x01));
+  if (EndCount > 1)
+    jtag_tms(Scan->TmsEnd >> 1, EndCount - 1);
+  if (Rec[0] & JTAG_SCAN_IN)
+    JtagFill += Bytes;
+  return Size;
+}
+
+/**
+ * Execute all JTAG records of all EP2 OUT packets received so far
+ *
+ * This is executed from HandleEP2Out() in EP2_MODE_JTAG. If a scan needs an
+ * EP2 IN buffer and none is free, processing stops and is resumed after the
+ * next EP2 IN packet was sent. Each record is executed exactly once.
+ */
+void JtagProcess() {
+  uint8_t Length;
+  uint8_t Size;
+
+  while (stream_out_ready()) {
+    Length = stream_out_length();
+    while (JtagPos < Length) {
+      Size = JtagExecute(stream_out_buffer() + JtagPos, Length - JtagPos);
+      if (Size == JTAG_WAIT_IN)
+        return;
+      // drop truncated and invalid records
+      if (!Size)
+        break;
+      JtagPos += Size;
+    }
+    // packet done
+    JtagPos = 0;
+    stream_out_release();
+  }
+
+  // send coalesced TDO data
+  if (JtagFill) {
+    stream_in_commit(JtagFill);
+    JtagFill = 0;
+  }
+}
+#endif  // JTAG
+
+/****************************************************************************/
+/***  FlashID, FlashErase, FlashRead, FlashWrite, FlashStatus  **************/
+/****************************************************************************/
+
+#ifdef FLASH
+/**
+ * Check whether a flash operation is active
+ */
+bool FlashBusy() {
+  return FlashRemaining || flash_busy();
+}
+
+/**
+ * Command: FlashID
+ *
+ * Fills Buf with the status and the JEDEC ID and returns the number of
+ * bytes.
+ */
+uint8_t FlashID(__xdata uint8_t* Buf) {
+  if (FlashBusy()) {
+    Buf[0] = FLASH_BUSY;
+    return 1;
+  }
+  Buf[0] = FLASH_OK;
+  flash_read_id(Buf + 1);
+  return 4;
+}
+
+/**
+ * Command: FlashErase
+ *
+ * Fills Buf with the status and returns the number of bytes. With
+ * CMD_FLASH_ERASE_WAIT, the vendor request is completed by FlashService()
+ * when the erase has finished. The erase is only advanced by FlashService(),
+ * therefore it requires EP2_MODE_FLASH.
+ */
+uint8_t FlashErase(__xdata uint8_t* Buf) {
+  if ((Ep2Mode != EP2_MODE_FLASH) || FlashBusy() ||
+      !flash_erase((uint32_t)CmdValue << 8)) {
+    Buf[0] = FLASH_BUSY;
+    return 1;
+  }
+  if (CmdAsync && (CmdIndex & CMD_FLASH_ERASE_WAIT)) {
+    FlashEraseWait = true;
+    FlashEraseTag  = CmdTag;
+    return CMD_DEFERRED;
+  }
+  Buf[0] = FLASH_OK;
+  return 1;
+}
+
+/**
+ * Command: FlashRead and FlashWrite
+ *
+ * Start streaming the flash contents to EP2 IN or from EP2 OUT.
+ *
+ * Fills Buf with the status and returns the number of bytes.
+ */
+uint8_t FlashStart(__xdata uint8_t* Buf, bool Reading) {
+  if ((Ep2Mode != EP2_MODE_FLASH) || FlashBusy()) {
+    Buf[0] = FLASH_BUSY;
+    return 1;
+  }
+  FlashReading   = Reading;
+  FlashRemaining = (uint32_t)(CmdIndex ? CmdIndex : 0x10000) * FLASH_PAGE_SIZE;
+  FlashPos       = 0;
+  FlashStatus    = FLASH_OK;
+  if (Reading)
+    flash_read_begin((uint32_t)CmdValue << 8);
+  else
+    flash_write_begin((uint32_t)CmdValue << 8);
+  Buf[0] = FLASH_OK;
+  return 1;
+}
+
+/**
+ * Command: FlashStatus
+ *
+ * Fills Buf and returns the number of bytes.
+ */
+uint8_t FlashStatusCmd(__xdata uint8_t* Buf) {
+  __xdata TFlashStatus* Status = (__xdata TFlashStatus*)Buf;
+
+  Status->Busy      = FlashBusy();
+  Status->Status    = (FlashStatus != FLASH_OK) ? FlashStatus : flash_result();
+  Status->Remaining = FlashRemaining;
+  return sizeof(TFlashStatus);
+}
+
+/**
+ * Advance the current flash operation
+ *
+ * This is executed from command_loop() in EP2_MODE_FLASH. Reads go directly
+ * from the flash into the free EP2 IN buffers. Writes consume EP2 OUT data
+ * as long as a page buffer is free, otherwise the packet stays in its
+ * buffer (the host is NAKed). Programming and erasing are advanced by
+ * flash_poll().
+ */
+void FlashService() {
+  uint8_t Length;
+
+  if (FlashReading && FlashRemaining) {
+    while (FlashRemaining && stream_in_ready()) {
+      Length = (FlashRemaining > 64) ? 64 : FlashRemaining;
+      flash_read(stream_in_buffer(), Length);
+      stream_in_commit(Length);
+      FlashRemaining -= Length;
+      if (!FlashRemaining)
+        flash_read_end();
+    }
+    return;
+  }
+
+  flash_poll();
+  if (flash_result() != FLASH_OK) {
+    FlashStatus    = flash_result();
+    FlashRemaining = 0;
+  }
+  if (FlashEraseWait && !flash_busy()) {
+    FlashEraseWait   = false;
+    FlashEraseResult = flash_result();
+    usb_ep0_complete(FlashEraseTag, &FlashEraseResult, 1);
+  }
+  while (stream_out_ready()) {
+    Length = stream_out_length() - FlashPos;
+    // data beyond the requested number of bytes is dropped
+    if (Length > FlashRemaining)
+      Length = FlashRemaining;
+    if (Length) {
+      Length = flash_write_put(stream_out_buffer() + FlashPos, Length);
+      if (!Length)
+        return;   // both page buffers busy
+      FlashPos       += Length;
+      FlashRemaining -= Length;
+      if (FlashRemaining && (FlashPos < stream_out_length()))
+        continue;
+    }
+    FlashPos = 0;
+    stream_out_release();
+  }
+  // program the last (partial) page
+  if (!FlashRemaining)
+    flash_write_flush();
+}
+#endif  // FLASH
+
+/****************************************************************************/
+/***  UARTConfig, UARTStatus  ***********************************************/
+/****************************************************************************/
+
+#ifdef UART
+/**
+ * Command: UARTConfig
+ *
+ * Set the baud rate and enable or disable both serial ports.
+ *
+ * Both ports are validated first, an invalid request changes neither the
+ * shared Timer 1 divisor nor a port.
  *
- * Return status of EndCount input and the current value of ReadCount.
+ * Fills Buf with the status and returns the number of bytes.
+ */
+uint8_t UARTConfig(__xdata uint8_t* Buf) {
+  if ((LO8(CmdIndex) | HI8(CmdIndex)) & ~UART_FLAGS) {
+    Buf[0] = UART_INVALID;
+    return 1;
+  }
+  uart_divisor(LO8(CmdValue));
+  uart_config(0, LO8(CmdIndex));
+  uart_config(1, HI8(CmdIndex));
+  Buf[0] = UART_OK;
+  return 1;
+}
+
+/**
+ * Command: UARTStatus
  *
- * Fills IN0BUF and arms EP0IN.
+ * Fills Buf and returns the number of bytes, 0 for an invalid port.
  */
-void GetStatus() {
-  // fill Status
-  Status.MyStatus = 1;
-  // ... fill other fields as declared in TGetStatus in commands.h ...
-  IN0BC = sizeof(Status);
+uint8_t UARTStatus(__xdata uint8_t* Buf) {
+  __xdata TUARTStatus* Status = (__xdata TUARTStatus*)Buf;
+  uint8_t Port = LO8(CmdIndex);
+
+  if (Port >= UART_COUNT)
+    return 0;
+  Status->RxLevel  = uart_rx_level(Port);
+  Status->TxLevel  = uart_tx_level(Port);
+  Status->Overruns = uart_overruns(Port);
+  return sizeof(TUARTStatus);
 }
+#endif  // UART
+
+/****************************************************************************/
+/***  NotifyConfig  *********************************************************/
+/****************************************************************************/
+
+#ifdef NOTIFY
+/**
+ * Command: NotifyConfig
+ *
+ * Select the sources of the EP1 IN event records.
+ *
+ * Fills Buf with the status and returns the number of bytes.
+ */
+uint8_t NotifyConfig(__xdata uint8_t* Buf) {
+  Buf[0] = notify_config(LO8(CmdValue), CmdIndex) ? NOTIFY_OK : NOTIFY_INVALID;
+  return 1;
+}
+#endif  // NOTIFY
+
+/****************************************************************************/
+/***  GetNAKs  **************************************************************/
+/****************************************************************************/
+
+/**
+ * Command: GetNAKs
+ *
+ * Return the NAK counts of IN1 .. IN6 and clear them if CmdValue is not 0.
+ *
+ * Fills Buf and returns the number of bytes.
+ */
+uint8_t GetNAKs(__xdata uint8_t* Buf) {
+  __xdata uint16_t* Naks = (__xdata uint16_t*)Buf;
+  uint8_t i;
+
+  for (i = 0; i < USB_IBN_COUNT; i++)
+    Naks[i] = usb_ibn_naks(i + 1);
+  if (CmdValue)
+    usb_ibn_clear();
+  return USB_IBN_COUNT * sizeof(uint16_t);
+}
+
+/****************************************************************************/
+/***  TraceRead  ************************************************************/
+/****************************************************************************/
+
+#ifdef TRACE
+/**
+ * Command: TraceRead
+ *
+ * Move up to CmdIndex records (0: as many as fit) out of the trace ring.
+ *
+ * Fills Buf and returns the number of bytes.
+ */
+uint8_t TraceRead(__xdata uint8_t* Buf) {
+  uint8_t Max;
+
+  // the EP0 buffer holds the whole ring
+  Max = CmdAsync ? TRACE_RING_SIZE : TRACE_STREAM_RECORDS;
+  if (CmdIndex && (CmdIndex < Max))
+    Max = CmdIndex;
+  return trace_read(Buf, Max);
+}
+#endif  // TRACE
+
+/****************************************************************************/
+/***  GetProfile  ***********************************************************/
+/****************************************************************************/
+
+#ifdef PROFILE
+/**
+ * Command: GetProfile
+ *
+ * Return the profiling measurements and clear them if CmdValue is not 0.
+ *
+ * Fills Buf and returns the number of bytes.
+ */
+uint8_t GetProfile(__xdata uint8_t* Buf) {
+  xmemcpy(Buf, (__xdata uint8_t*)profile_table, sizeof(profile_table));
+  if (CmdValue)
+    profile_reset();
+  return sizeof(profile_table);
+}
+#endif  // PROFILE
 
 /****************************************************************************/
 /***  Command Handler  ******************************************************/
 /****************************************************************************/
 
 /**
- * Command Handler
+ * Execute a command
+ *
+ * The command and its parameters are taken from Command, CmdValue and
+ * CmdIndex. The response is written to Buf.
  *
- * This function is executed from command_loop() if its semaphore is set.
+ * @return number of response bytes
  */
-void HandleCmd() {
-  // save command
-  Command  = setup_data.bRequest;
-  CmdIndex = setup_data.wIndex;
-  CmdValue = setup_data.wValue;
+uint8_t ExecuteCmd(__xdata uint8_t* Buf) {
+  TRACE_POST(TRACE_COMMAND, Command);
   switch (Command) {
     case CMD_GET_VERSION: { // Get Version ////////////////////////////////////
-      GetVersion();
-      break;
+      return GetVersion(Buf);
     }
     case CMD_GET_VERSION_STRING: { // Get Version String //////////////////////
-      GetVersionString();
-      break;
+      return GetVersionString(Buf);
     }
     case CMD_GET_STATUS: {  // return current status //////////////////////////
-      GetStatus();
-      break;
+      return GetStatus(Buf);
+    }
+    case CMD_SET_EP2_MODE: {  // select EP2 usage /////////////////////////////
+      return SetEP2Mode();
+    }
+    case CMD_I2C_WRITE_READ: {  // read I2C slave registers ///////////////////
+      return I2CWriteRead(Buf);
+    }
+    case CMD_EEPROM_READ: {  // stream EEPROM to EP2 IN ///////////////////////
+      return EEPROMStart(Buf, true);
+    }
+    case CMD_EEPROM_WRITE: {  // stream EP2 OUT to EEPROM /////////////////////
+      return EEPROMStart(Buf, false);
+    }
+    case CMD_EEPROM_STATUS: {  // EEPROM operation status /////////////////////
+      return EEPROMStatus(Buf);
+    }
+#ifdef CAPTURE
+    case CMD_CAPTURE: {  // arm the logic analyzer ////////////////////////////
+      return CaptureStart(Buf);
+    }
+#endif  // CAPTURE
+#ifdef PATTERN
+    case CMD_PATTERN: {  // start/stop the pattern generator //////////////////
+      return PatternStart(Buf);
+    }
+    case CMD_PATTERN_STATUS: {  // pattern generator status ///////////////////
+      return PatternStatus(Buf);
     }
+#endif  // PATTERN
+#ifdef SPI
+    case CMD_SPI_CONFIG: {  // configure the SPI master ///////////////////////
+      return SPIConfig(Buf);
+    }
+#endif  // SPI
+#ifdef FLASH
+    case CMD_FLASH_ID: {  // read SPI flash JEDEC ID //////////////////////////
+      return FlashID(Buf);
+    }
+    case CMD_FLASH_ERASE: {  // erase SPI flash sector ////////////////////////
+      return FlashErase(Buf);
+    }
+    case CMD_FLASH_READ: {  // stream SPI flash to EP2 IN /////////////////////
+      return FlashStart(Buf, true);
+    }
+    case CMD_FLASH_WRITE: {  // stream EP2 OUT to SPI flash ///////////////////
+      return FlashStart(Buf, false);
+    }
+    case CMD_FLASH_STATUS: {  // SPI flash operation status ///////////////////
+      return FlashStatusCmd(Buf);
+    }
+#endif  // FLASH
+#ifdef JTAG
+    case CMD_JTAG_CONFIG: {  // configure the JTAG master /////////////////////
+      return JTAGConfig(Buf);
+    }
+#endif  // JTAG
+    case CMD_I2C_WRITE: {  // write to an I2C slave ///////////////////////////
+      return I2CWrite(Buf);
+    }
+#ifdef UART
+    case CMD_UART_CONFIG: {  // configure the UART bridge /////////////////////
+      return UARTConfig(Buf);
+    }
+    case CMD_UART_STATUS: {  // UART bridge status ////////////////////////////
+      return UARTStatus(Buf);
+    }
+#endif  // UART
+    case CMD_GET_NAKS: {  // IN endpoint NAK counts ///////////////////////////
+      return GetNAKs(Buf);
+    }
+#ifdef NOTIFY
+    case CMD_NOTIFY_CONFIG: {  // select the EP1 IN event sources /////////////
+      return NotifyConfig(Buf);
+    }
+#endif  // NOTIFY
+#ifdef TRACE
+    case CMD_TRACE_READ: {  // drain the trace ring ///////////////////////////
+      return TraceRead(Buf);
+    }
+#endif  // TRACE
+#ifdef PROFILE
+    case CMD_GET_PROFILE: {  // profiling measurements ////////////////////////
+      return GetProfile(Buf);
+    }
+#endif  // PROFILE
     // ... add further commands here ...
     default: {
-      break;
+      return 0;
+    }
+  }
+}
+
+/**
+ * Command Handler
+ *
+ * This function is the handler of EVENT_COMMAND (see command_init()).
+ * The OUT data stage is in usb_ep0_buffer, which is also filled with the
+ * response. Then the vendor request is completed, unless the command
+ * deferred it (CMD_DEFERRED).
+ */
+void HandleCmd() {
+  uint8_t Length;
+
+  PROFILE_ENTER(PROFILE_HANDLE_CMD);
+  // save command
+  Command  = setup_data.bRequest;
+  CmdIndex = setup_data.wIndex;
+  CmdValue = setup_data.wValue;
+  CmdData  = usb_ep0_buffer;
+  CmdLength = usb_ep0_received();
+  CmdTag   = usb_ep0_tag();
+  CmdAsync = true;
+  Length = ExecuteCmd(usb_ep0_buffer);
+  CmdAsync = false;
+  if (Length != CMD_DEFERRED)
+    usb_ep0_complete(CmdTag, NULL, Length);
+  PROFILE_EXIT(PROFILE_HANDLE_CMD);
+}
+
+/****************************************************************************/
+/***  Command Stream  *******************************************************/
+/****************************************************************************/
+
+/**
+ * Append the pending reply to the current EP2 IN buffer
+ *
+ * If the reply doesn't fit, the current EP2 IN buffer is sent first.
+ *
+ * @return true if the reply was stored, false if no EP2 IN buffer is free
+ *   (the reply stays pending)
+ */
+bool CmdStreamPutReply() {
+  if (CmdStreamReplyLen == 0)
+    return true;
+  if (!stream_in_ready())
+    return false;
+  if (CmdStreamFill + CmdStreamReplyLen > 64) {
+    stream_in_commit(CmdStreamFill);
+    CmdStreamFill = 0;
+    if (!stream_in_ready())
+      return false;
+  }
+  xmemcpy(stream_in_buffer() + CmdStreamFill, CmdStreamReply, CmdStreamReplyLen);
+  CmdStreamFill    += CmdStreamReplyLen;
+  CmdStreamReplyLen = 0;
+  return true;
+}
+
+/**
+ * Execute all records of all EP2 OUT packets received so far
+ *
+ * This is executed from HandleEP2Out() in EP2_MODE_CMDSTREAM. Each EP2 OUT
+ * packet holds back-to-back TCmdStreamRecord headers followed by their
+ * payload. The replies (TCmdStreamReply followed by the response bytes) are
+ * coalesced into EP2 IN packets. A partly filled EP2 IN packet is sent when
+ * all received EP2 OUT packets were processed.
+ *
+ * If no EP2 IN buffer is free, processing stops and is resumed after the
+ * next EP2 IN packet was sent. Each record is executed exactly once.
+ */
+void CmdStreamProcess() {
+  __xdata TCmdStreamRecord* Rec;
+  uint8_t Length;
+
+  // store reply left over from the last call
+  if (!CmdStreamPutReply())
+    return;
+
+  while (stream_out_ready()) {
+    Length = stream_out_length();
+    while (CmdStreamPos + sizeof(TCmdStreamRecord) <= Length) {
+      Rec = (__xdata TCmdStreamRecord*)(stream_out_buffer() + CmdStreamPos);
+      // drop truncated records
+      if (CmdStreamPos + sizeof(TCmdStreamRecord) + Rec->Length > Length)
+        break;
+      CmdStreamPos += sizeof(TCmdStreamRecord) + Rec->Length;
+      // execute command, changing the EP2 mode is only allowed via EP0 and
+      // the profiling measurements don't fit into a reply
+      Command   = Rec->Command;
+      CmdValue  = Rec->Value;
+      CmdIndex  = Rec->Index;
+      CmdData   = (__xdata uint8_t*)(Rec + 1);
+      CmdLength = Rec->Length;
+      CmdStreamReply[0] = Command;
+      CmdStreamReply[1] = 0;
+      if ((Command != CMD_SET_EP2_MODE) && (Command != CMD_GET_PROFILE))
+        CmdStreamReply[1] = ExecuteCmd(CmdStreamReply + sizeof(TCmdStreamReply));
+      CmdStreamReplyLen = sizeof(TCmdStreamReply) + CmdStreamReply[1];
+      if (!CmdStreamPutReply())
+        return;
     }
+    // packet done
+    CmdStreamPos = 0;
+    stream_out_release();
+  }
+
+  // send coalesced replies
+  if (CmdStreamFill) {
+    stream_in_commit(CmdStreamFill);
+    CmdStreamFill = 0;
   }
 }
 
+/****************************************************************************/
+/***  EP2 Handler  **********************************************************/
+/****************************************************************************/
+
+/**
+ * Fill and send one EP2 IN packet of the counter pattern
+ */
+void StreamPacket() {
+  uint8_t i;
+  __xdata uint8_t* Dst;
+
+  Dst = stream_in_buffer();
+  for (i = 0; i < 64; i++) {
+    *Dst++ = StreamPattern++;
+  }
+  stream_in_commit(64);
+}
+
+/**
+ * Fill all free EP2 IN buffers
+ *
+ * This is executed from command_loop() in EP2_MODE_STREAM. With
+ * double-buffering, the SIE sends one half while this function fills the
+ * other one.
+ */
+void StreamFill() {
+  while (stream_in_ready())
+    StreamPacket();
+}
+
+/**
+ * Produce one EP2 IN packet when the host found EP2 IN empty
+ *
+ * This is the IBN producer of EP2 with EP2_FLAG_LAZY (see
+ * usb_ibn_register()). The data is as fresh as possible when the host reads
+ * it, and nothing is produced while the host doesn't poll.
+ */
+bool StreamProduce(void) {
+  if (stream_in_ready())
+    StreamPacket();
+  return true;
+}
+
+/**
+ * Return all EP2 OUT packets to the host via EP2 IN
+ *
+ * This is executed from HandleEP2Out() in EP2_MODE_LOOPBACK. A packet is
+ * left in its OUT buffer until an IN buffer is free, this is retried after
+ * the next EP2 IN packet was sent.
+ */
+void Loopback() {
+  uint8_t Length;
+
+  while (stream_out_ready() && stream_in_ready()) {
+    Length = stream_out_length();
+    xmemcpy(stream_in_buffer(), stream_out_buffer(), Length);
+    stream_in_commit(Length);
+    stream_out_release();
+  }
+}
+
+/**
+ * Consume EP2 OUT packets received from the host
+ *
+ * This is the handler of EVENT_EP2_OUT and EVENT_EP2_IN (see
+ * command_init()). Modes without EP2 OUT usage discard the data.
+ */
+void HandleEP2Out() {
+  switch (Ep2Mode) {
+    case EP2_MODE_LOOPBACK:
+      Loopback();
+      break;
+    case EP2_MODE_CMDSTREAM:
+      CmdStreamProcess();
+      break;
+    case EP2_MODE_EEPROM:
+      EepromService();
+      break;
+#ifdef PATTERN
+    case EP2_MODE_PATTERN:
+      PatternService();
+      break;
+#endif
+#ifdef SPI
+    case EP2_MODE_SPI:
+      SpiService();
+      break;
+#endif
+#ifdef FLASH
+    case EP2_MODE_FLASH:
+      // FlashService() runs in every pass of command_poll()
+      break;
+#endif
+#ifdef JTAG
+    case EP2_MODE_JTAG:
+      JtagProcess();
+      break;
+#endif
+    default:
+      while (stream_out_ready()) {
+        stream_out_release();
+      }
+      break;
+  }
+}
+
+/**
+ * Initialize the command handler
+ */
+void command_init(void) {
+  // arm EP2OUT for the first time so we are ready for data
+  Ep2Mode = EP2_MODE_IDLE;
+  stream_init(false, false);
+  event_register(EVENT_EP2_OUT, HandleEP2Out);
+  // a free IN buffer lets pending OUT packets proceed
+  event_register(EVENT_EP2_IN,  HandleEP2Out);
+  event_register(EVENT_COMMAND, HandleCmd);
+  // completions of deferred vendor requests are lost with the I2C queue
+  I2CPending     = false;
+#ifdef FLASH
+  FlashEraseWait = false;
+#endif
+}
+
+/**
+ * Check whether a service polls hardware without an interrupt
+ *
+ * The logic analyzer polls its trigger, the SPI flash driver the WIP bit
+ * and the I2C driver the end of a STOP condition before the next queued
+ * transaction. All other services wait for interrupts (EP1, EP2, EP4/EP5,
+ * I2C, serial ports, INT0/INT1, Timer 0/2).
+ */
+bool CommandBusy() {
+#ifdef CAPTURE
+  if (Ep2Mode == EP2_MODE_CAPTURE)
+    return true;
+#endif
+#ifdef FLASH
+  if ((Ep2Mode == EP2_MODE_FLASH) && FlashBusy())
+    return true;
+#endif
+  return i2c_stop_pending();
+}
+
+/**
+ * One iteration of the command loop
+ *
+ * Handles all pending events in priority order and returns.
+ */
+void command_poll(void) {
+  stats_loop_enter();
+  while (event_dispatch())
+    ;
+  // keep the EP2 IN buffers filled, unless StreamProduce() does it on demand
+  if ((Ep2Mode == EP2_MODE_STREAM) && !StreamLazy) {
+    StreamFill();
+  }
+  // advance EEPROM read/write operations
+  if (Ep2Mode == EP2_MODE_EEPROM) {
+    EepromService();
+  }
+#ifdef CAPTURE
+  // trigger the logic analyzer and send its samples
+  if (Ep2Mode == EP2_MODE_CAPTURE) {
+    CaptureService();
+  }
+#endif
+#ifdef PATTERN
+  // refill the pattern generator FIFO as the ISR drains it
+  if (Ep2Mode == EP2_MODE_PATTERN) {
+    PatternService();
+  }
+#endif
+#ifdef FLASH
+  // advance SPI flash read/write operations and erases
+  if (Ep2Mode == EP2_MODE_FLASH) {
+    FlashService();
+  }
+#endif
+  // report completed I2C transactions
+  i2c_poll();
+#ifdef UART
+  // exchange the UART data with EP4/EP5
+  uart_service();
+#endif
+#ifdef NOTIFY
+  // send the event records of this iteration on EP1 IN
+  notify_service();
+#endif
+  stats_loop_exit();
+}
+
 /**
  * Main command loop
  *
  * This function has an infinite loop and does not return.
  *
+ * The CPU idles while no event is pending and no service polls hardware.
  */
 void command_loop(void) {
-  // arm EP2OUT for the first time so we are ready for JTAG commands
-  OUT2BC = 0;
-  // command loop
+  command_init();
   while (true) {
-    // got a command packet?
-    if (Semaphore_Command) {
-      HandleCmd();
-      Semaphore_Command = false;
-    }
-    // got an EP2 IN interrupt?
-    if (Semaphore_EP2_in) {
-      // ... handle ...
-      Semaphore_EP2_in = false;
-    }
-    // got an EP2 OUT interrupt?
-    if (Semaphore_EP2_out) {
-      // ... handle ...
-      Semaphore_EP2_out = false;
-    }
+    command_poll();
+    if (!CommandBusy())
+      event_idle();
   }
 }
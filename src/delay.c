@@ -19,27 +19,184 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include "reg_ezusb.h"
+#include "common.h"
 #include "delay.h"
 
-#define NOP {__asm nop __endasm;}
+/**
+ * Millisecond counter, incremented by timer2_isr()
+ */
+volatile uint16_t timer_tick;
+
+/*****************************************************************************/
+/***  Timebase  **************************************************************/
+/*****************************************************************************/
+
+/**
+ * Initialize Timer 2 as 1 ms timebase
+ *
+ * Must be called after io_init(), which overwrites CKCON.
+ */
+void timer_init(void) {
+  timer_tick = 0;
+
+  T2CON  = 0;               // 16 bit auto-reload, timer stopped
+  CKCON |= T2M;             // Timer 2 clock = CLK/4
+  RCAP2H = HI8(TIMER2_RELOAD);
+  RCAP2L = LO8(TIMER2_RELOAD);
+  TH2    = HI8(TIMER2_RELOAD);
+  TL2    = LO8(TIMER2_RELOAD);
+
+  ET2 = 1;                  // enable Timer 2 interrupt
+  TR2 = 1;                  // start Timer 2
+}
+
+/**
+ * Return the number of milliseconds since timer_init()
+ *
+ * The counter wraps around after 65.5 s.
+ */
+uint16_t timer_ticks(void) {
+  uint16_t t;
+
+  // the ISR might change the counter between reading its two bytes
+  do {
+    t = timer_tick;
+  } while (t != timer_tick);
+  return t;
+}
+
+/**
+ * Return a free running counter with a resolution of TIMER_COUNTS_PER_US
+ * counts per microsecond
+ *
+ * The counter wraps around after 10.9 ms, therefore it is only useful to
+ * measure short intervals by subtracting two values.
+ */
+uint16_t timer_fine(void) {
+  uint16_t t;
+  uint16_t c;
+  uint8_t  h, l;
+
+  __critical {
+    h = TH2;
+    l = TL2;
+    // TL2 overflowed into TH2 between the two reads
+    if (h != TH2) {
+      h = TH2;
+      l = TL2;
+    }
+    t = timer_tick;
+    c = ((uint16_t)h << 8) | l;
+    // Timer 2 was reloaded, but the ISR didn't run yet
+    if (TF2 && (c < TIMER2_RELOAD + TIMER_COUNTS_PER_MS/2))
+      t++;
+  }
+  return t * TIMER_COUNTS_PER_MS + (c - TIMER2_RELOAD);
+}
+
+/**
+ * Return a deadline @a ms milliseconds from now
+ *
+ * Since the current millisecond is already partly elapsed, the deadline
+ * expires after at least @a ms and at most @a ms + 1 milliseconds. @a ms must
+ * be less than 32768.
+ */
+deadline_t deadline_set(uint16_t ms) {
+  return timer_ticks() + ms + 1;
+}
+
+/**
+ * Check whether @a deadline has passed
+ *
+ * This doesn't block, so it can be used to time out operations from the
+ * main loop.
+ */
+bool deadline_expired(deadline_t deadline) {
+  return (int16_t)(timer_ticks() - deadline) >= 0;
+}
+
+/*****************************************************************************/
+/***  Delay Functions  *******************************************************/
+/*****************************************************************************/
+
+/*
+ * The delay functions block the CPU. Delays of at least DELAY_LOOP_MAX_US
+ * are based on the timebase and are therefore independent of compiler
+ * output. Shorter ones use a loop of fixed instruction cycles, because a
+ * single timer_fine() call already takes several microseconds.
+ */
+
+#define DELAY_LOOP_MAX_US  20
+
+/**
+ * Wait for @a counts timer counts (max. 10.9 ms)
+ *
+ * With interrupts disabled, timer2_isr() doesn't run, so the loop counts
+ * the Timer 2 overflows itself. Otherwise timer_fine() would wrap after
+ * 2 ms and the loop would never end.
+ */
+static void delay_counts(uint16_t counts) {
+  uint16_t start;
+
+  start = timer_fine();
+  while ((uint16_t)(timer_fine() - start) < counts) {
+    if (TF2 && !(EA && ET2)) {
+      TF2 = 0;
+      timer_tick++;
+    }
+    BUSY_WAIT();
+  }
+}
+
+/**
+ * Wait for @a us microseconds in a loop of 6 instruction cycles (1 us) per
+ * iteration
+ *
+ * The calls add about 1 us. Interrupts extend the delay. The host build
+ * has no instruction timing, it just busy-waits once.
+ */
+#ifdef HOSTSIM
+static void delay_loop(uint8_t us) {
+  (void)us;
+  BUSY_WAIT();
+}
+#else
+static void delay_loop(uint8_t us) __naked {
+  __asm
+    mov   a,dpl               ; us, nothing to do for 0
+    jz    00002$
+    mov   r7,a
+00001$:
+    nop                       ; 3 cycles
+    nop
+    nop
+    djnz  r7,00001$           ; 3 cycles
+00002$:
+    ret
+  __endasm;
+}
+#endif
 
 void delay_5us(void) {
-  NOP;
+  delay_loop(5);
 }
 
 void delay_1ms(void) {
-  uint16_t i;
-
-  for (i = 0; i < 598; i++);
+  delay_counts(TIMER_COUNTS_PER_MS);
 }
 
 void delay_us(uint16_t delay) {
-  uint16_t i;
-  uint16_t maxcount = (delay / 5);
-
-  for (i = 0; i < maxcount; i++) {
-    delay_5us();
+  if (delay < DELAY_LOOP_MAX_US) {
+    delay_loop(delay);
+    return;
   }
+  // keep each interval far from the 10.9 ms wrap around of timer_fine()
+  while (delay > 1000) {
+    delay_counts(TIMER_COUNTS_PER_MS);
+    delay -= 1000;
+  }
+  delay_counts(delay * TIMER_COUNTS_PER_US);
 }
 
 void delay_ms(uint16_t delay) {
@@ -49,3 +206,18 @@ void delay_ms(uint16_t delay) {
     delay_1ms();
   }
 }
+
+/*****************************************************************************/
+/***  Interrupt Service Routine  *********************************************/
+/*****************************************************************************/
+
+/**
+ * Timer 2 Interrupt Service Routine
+ *
+ * Timer 2 reloads itself from RCAP2H/RCAP2L, the overflow flag has to be
+ * cleared by software.
+ */
+void timer2_isr(void)   __interrupt TF2_VECTOR {
+  TF2 = 0;
+  timer_tick++;
+}
@@ -0,0 +1,237 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "eeprom.h"
+#include "xmem.h"
+
+/**
+ * State of the page writer
+ */
+typedef enum {
+  esCollecting,   // page buffer accepts data
+  esPolling,      // ACK polling before the page is written
+  esWriting,      // page is transfered to the EEPROM
+  esError         // a transfer failed, see eeprom_result
+} EEPROM_State;
+
+volatile static EEPROM_State eeprom_state;
+static I2C_Status            eeprom_result;
+static uint16_t              eeprom_polls;
+
+/**
+ * Page buffer: 2 address bytes (MSB first) followed by the page data
+ */
+static __xdata uint8_t       eeprom_page[2 + EEPROM_PAGE_SIZE];
+static uint16_t              eeprom_addr;   // EEPROM address of the page data
+static uint8_t               eeprom_fill;   // number of data bytes in eeprom_page
+
+/**
+ * Address bytes of the read transfer
+ */
+static __xdata uint8_t       eeprom_rdaddr[2];
+
+// Forward Declarations
+
+static bool eeprom_submit_poll();
+static void eeprom_poll_done(__xdata I2C_Transaction* t);
+static void eeprom_write_done(__xdata I2C_Transaction* t);
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Initialize EEPROM driver
+ */
+void eeprom_init() {
+  eeprom_state  = esCollecting;
+  eeprom_result = I2C_OK;
+  eeprom_addr   = 0;
+  eeprom_fill   = 0;
+}
+
+/**
+ * Wait until the EEPROM has finished its internal write cycle
+ *
+ * The EEPROM doesn't acknowledge its address while it is busy.
+ */
+I2C_Status eeprom_wait_ready() {
+  uint16_t i;
+  I2C_Status Status;
+
+  for (i = 0; i < EEPROM_POLL_MAX; i++) {
+    Status = i2c_write(EEPROM_I2C_ADDR, 0, NULL);
+    if (Status != I2C_NACK)
+      return Status;
+  }
+  return I2C_NACK;
+}
+
+/**
+ * Queue a read transfer of @a length bytes from EEPROM address @a addr
+ *
+ * The data is written directly to @a ptr (e.g. an EP2 IN buffer). Only one
+ * read transfer may be queued at a time. @a callback is executed from
+ * i2c_poll() on completion.
+ *
+ * @return false if the I2C queue is full
+ */
+bool eeprom_start_read(uint16_t addr, uint8_t length, __xdata uint8_t* ptr,
+                       I2C_Callback callback) {
+  __xdata I2C_Transaction* t;
+
+  t = i2c_alloc();
+  if (!t)
+    return false;
+  eeprom_rdaddr[0] = HI8(addr);
+  eeprom_rdaddr[1] = LO8(addr);
+  t->Addr     = EEPROM_I2C_ADDR;
+  t->Flags    = I2C_WRITE_READ;
+  t->Length   = 2;
+  t->Ptr      = eeprom_rdaddr;
+  t->RdLength = length;
+  t->RdPtr    = ptr;
+  t->Callback = callback;
+  i2c_submit();
+  return true;
+}
+
+/**
+ * Start writing at EEPROM address @a addr
+ */
+void eeprom_write_begin(uint16_t addr) {
+  eeprom_state  = esCollecting;
+  eeprom_result = I2C_OK;
+  eeprom_addr   = addr;
+  eeprom_fill   = 0;
+}
+
+/**
+ * Append data to the page buffer
+ *
+ * At most up to the end of the current EEPROM page is consumed. When the
+ * page is complete, it is programmed in the background.
+ *
+ * @return number of bytes consumed, 0 if the page buffer is busy
+ */
+uint8_t eeprom_write_put(__xdata uint8_t* src, uint8_t length) {
+  uint8_t Room;
+
+  if (eeprom_state != esCollecting)
+    return 0;
+  Room = EEPROM_PAGE_SIZE - (LO8(eeprom_addr) & (EEPROM_PAGE_SIZE - 1)) - eeprom_fill;
+  if (length > Room)
+    length = Room;
+  xmemcpy(eeprom_page + 2 + eeprom_fill, src, length);
+  eeprom_fill += length;
+  if (length == Room)
+    eeprom_write_flush();
+  return length;
+}
+
+/**
+ * Program the (partly) filled page buffer
+ */
+void eeprom_write_flush() {
+  if ((eeprom_state != esCollecting) || (eeprom_fill == 0))
+    return;
+  eeprom_page[0] = HI8(eeprom_addr);
+  eeprom_page[1] = LO8(eeprom_addr);
+  eeprom_polls   = 0;
+  eeprom_state   = esPolling;
+  if (!eeprom_submit_poll())
+    eeprom_state = esCollecting;   // I2C queue full, retried on next flush
+}
+
+/**
+ * Check whether the page buffer is being programmed
+ */
+bool eeprom_write_busy() {
+  return (eeprom_state == esPolling) || (eeprom_state == esWriting);
+}
+
+/**
+ * Return the status of the write operation
+ */
+I2C_Status eeprom_write_status() {
+  return eeprom_result;
+}
+
+/*****************************************************************************/
+/***  Internal Functions  ****************************************************/
+/*****************************************************************************/
+
+/**
+ * Queue an ACK poll (address only write transfer)
+ */
+static bool eeprom_submit_poll() {
+  __xdata I2C_Transaction* t;
+
+  t = i2c_alloc();
+  if (!t)
+    return false;
+  t->Addr     = EEPROM_I2C_ADDR;
+  t->Flags    = I2C_WRITE;
+  t->Length   = 0;
+  t->Callback = eeprom_poll_done;
+  i2c_submit();
+  return true;
+}
+
+/**
+ * ACK poll finished: poll again or transfer the page
+ */
+static void eeprom_poll_done(__xdata I2C_Transaction* t) {
+  if (t->Status == I2C_NACK) {
+    // EEPROM still busy with the previous write cycle
+    if ((++eeprom_polls < EEPROM_POLL_MAX) && eeprom_submit_poll())
+      return;
+  } else if (t->Status == I2C_OK) {
+    t = i2c_alloc();
+    if (t) {
+      t->Addr     = EEPROM_I2C_ADDR;
+      t->Flags    = I2C_WRITE;
+      t->Length   = 2 + eeprom_fill;
+      t->Ptr      = eeprom_page;
+      t->Callback = eeprom_write_done;
+      i2c_submit();
+      eeprom_state = esWriting;
+      return;
+    }
+  }
+  eeprom_result = t ? t->Status : I2C_BUSY;
+  eeprom_state  = esError;
+}
+
+/**
+ * Page transfered: the buffer accepts data again while the EEPROM performs
+ * its internal write cycle
+ */
+static void eeprom_write_done(__xdata I2C_Transaction* t) {
+  if (t->Status != I2C_OK) {
+    eeprom_result = t->Status;
+    eeprom_state  = esError;
+    return;
+  }
+  eeprom_addr += eeprom_fill;
+  eeprom_fill  = 0;
+  eeprom_state = esCollecting;
+}
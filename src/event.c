@@ -0,0 +1,102 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "event.h"
+
+volatile __bit event_ep2_out;
+volatile __bit event_ep2_in;
+volatile __bit event_ibn;
+volatile __bit event_command;
+
+static event_handler_t event_handler[EVENT_COUNT];
+
+/**
+ * Clear all events and handlers
+ *
+ * Must be called before the interrupts which post events are enabled.
+ */
+void event_init(void) {
+  uint8_t i;
+
+  event_ep2_out = 0;
+  event_ep2_in  = 0;
+  event_ibn     = 0;
+  event_command = 0;
+  for (i = 0; i < EVENT_COUNT; i++)
+    event_handler[i] = NULL;
+}
+
+/**
+ * Set the handler of @a event, NULL to ignore it
+ */
+void event_register(uint8_t event, event_handler_t handler) {
+  event_handler[event] = handler;
+}
+
+/**
+ * Check whether any event is pending
+ */
+bool event_pending(void) {
+  return event_ep2_out || event_ep2_in || event_ibn || event_command;
+}
+
+/**
+ * Clear the highest priority pending event and call its handler
+ *
+ * @return false if no event was pending
+ */
+bool event_dispatch(void) {
+  uint8_t event;
+
+  if (event_ep2_out) {
+    event_ep2_out = 0;
+    event = EVENT_EP2_OUT;
+  } else if (event_ep2_in) {
+    event_ep2_in = 0;
+    event = EVENT_EP2_IN;
+  } else if (event_ibn) {
+    event_ibn = 0;
+    event = EVENT_IBN;
+  } else if (event_command) {
+    event_command = 0;
+    event = EVENT_COMMAND;
+  } else {
+    return false;
+  }
+  if (event_handler[event])
+    event_handler[event]();
+  return true;
+}
+
+/**
+ * Enter the idle mode until the next interrupt, unless an event is pending
+ *
+ * Every interrupt ends the idle mode, also those which don't post an event
+ * (e.g. the 1 ms tick of Timer 2).
+ */
+void event_idle(void) {
+  EA = 0;
+  if (event_pending()) {
+    EA = 1;
+    return;
+  }
+  CPU_IDLE();
+}
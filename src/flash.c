@@ -0,0 +1,264 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "delay.h"
+#include "spi.h"
+#include "xmem.h"
+#include "flash.h"
+
+/**
+ * Page buffers
+ *
+ * flash_collect is filled by flash_write_put(), flash_program is the next
+ * buffer to be programmed. A buffer with flash_length != 0 waits for
+ * programming and doesn't accept data.
+ */
+static __xdata uint8_t flash_page[2][FLASH_PAGE_SIZE];
+static uint16_t        flash_length[2];
+static uint8_t         flash_collect;
+static uint8_t         flash_program;
+static uint16_t        flash_fill;       // bytes in flash_page[flash_collect]
+static uint32_t        flash_addr;       // flash address of flash_page[flash_program]
+
+/**
+ * Internal write cycle (page program or sector erase) of the flash
+ */
+static bool            flash_wip;
+static deadline_t      flash_deadline;
+static Flash_Status    flash_status;
+
+/**
+ * Command header: command byte, 3 address bytes (MSB first), dummy byte
+ */
+static __xdata uint8_t flash_cmd[5];
+
+/*****************************************************************************/
+/***  Internal Functions  ****************************************************/
+/*****************************************************************************/
+
+/**
+ * Send a command with @a length header bytes (without address: 1, with
+ * address: 4, FAST READ: 5) and leave CS asserted
+ */
+static void flash_command(uint8_t cmd, uint32_t addr, uint8_t length) {
+  flash_cmd[0] = cmd;
+  flash_cmd[1] = (uint8_t)(addr >> 16);
+  flash_cmd[2] = HI8(addr);
+  flash_cmd[3] = LO8(addr);
+  spi_select(true);
+  spi_transfer(flash_cmd, flash_cmd, length);
+}
+
+/**
+ * Set the write enable latch, required before every program or erase
+ */
+static void flash_write_enable(void) {
+  flash_command(FLASH_CMD_WRITE_ENABLE, 0, 1);
+  spi_select(false);
+}
+
+/**
+ * Start the internal write cycle timeout
+ */
+static void flash_start_wip(uint16_t timeout) {
+  flash_wip      = true;
+  flash_deadline = deadline_set(timeout);
+}
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Initialize the flash driver
+ */
+void flash_init(void) {
+  flash_length[0] = 0;
+  flash_length[1] = 0;
+  flash_collect   = 0;
+  flash_program   = 0;
+  flash_fill      = 0;
+  flash_addr      = 0;
+  flash_wip       = false;
+  flash_status    = FLASH_OK;
+}
+
+/**
+ * Read the 3 bytes JEDEC ID (manufacturer, memory type, capacity) to @a id
+ */
+void flash_read_id(__xdata uint8_t* id) {
+  flash_command(FLASH_CMD_JEDEC_ID, 0, 1);
+  spi_transfer(id, id, 3);
+  spi_select(false);
+}
+
+/**
+ * Read the status register
+ */
+uint8_t flash_read_status(void) {
+  flash_command(FLASH_CMD_READ_STATUS, 0, 2);
+  spi_select(false);
+  return flash_cmd[1];
+}
+
+/**
+ * Start reading at @a addr, CS stays asserted until flash_read_end()
+ */
+void flash_read_begin(uint32_t addr) {
+  flash_command(FLASH_CMD_FAST_READ, addr, 5);
+}
+
+/**
+ * Read the next @a length bytes to @a dst
+ */
+void flash_read(__xdata uint8_t* dst, uint8_t length) {
+  // the flash ignores MOSI, so the old contents of dst are sent
+  spi_transfer(dst, dst, length);
+}
+
+/**
+ * Finish reading
+ */
+void flash_read_end(void) {
+  spi_select(false);
+}
+
+/**
+ * Start erasing the sector at @a addr
+ *
+ * @return false if a write cycle is active or pages wait for programming
+ */
+bool flash_erase(uint32_t addr) {
+  if (flash_busy())
+    return false;
+  flash_status = FLASH_OK;
+  flash_write_enable();
+  flash_command(FLASH_CMD_SECTOR_ERASE, addr, 4);
+  spi_select(false);
+  flash_start_wip(FLASH_ERASE_TIMEOUT);
+  return true;
+}
+
+/**
+ * Start writing at @a addr, which should be page aligned
+ *
+ * Must only be called while flash_busy() is false.
+ */
+void flash_write_begin(uint32_t addr) {
+  flash_init();
+  flash_addr = addr;
+}
+
+/**
+ * Append data to the page buffer
+ *
+ * At most up to the end of the current page is consumed. When the page is
+ * complete, it is programmed by flash_poll().
+ *
+ * @return number of bytes consumed, 0 if both page buffers are busy
+ */
+uint8_t flash_write_put(__xdata uint8_t* src, uint8_t length) {
+  uint16_t Room;
+
+  if (flash_length[flash_collect] || (flash_status != FLASH_OK))
+    return 0;
+  Room = FLASH_PAGE_SIZE - flash_fill;
+  if (length > Room)
+    length = Room;
+  xmemcpy(flash_page[flash_collect] + flash_fill, src, length);
+  flash_fill += length;
+  if (flash_fill == FLASH_PAGE_SIZE)
+    flash_write_flush();
+  return length;
+}
+
+/**
+ * Queue the (partly) filled page buffer for programming
+ */
+void flash_write_flush(void) {
+  if (!flash_fill || flash_length[flash_collect])
+    return;
+  flash_length[flash_collect] = flash_fill;
+  flash_collect ^= 1;
+  flash_fill     = 0;
+}
+
+/**
+ * Advance the background operations
+ *
+ * Polls the WIP bit while a write cycle is active, then programs the next
+ * queued page. The page data is shifted out in this call, i.e. it blocks
+ * for the SPI transfer of one page.
+ */
+void flash_poll(void) {
+  __xdata uint8_t* Page;
+  uint16_t         Length;
+
+  if (flash_wip) {
+    if (!(flash_read_status() & FLASH_SR_WIP)) {
+      flash_wip = false;
+    } else if (deadline_expired(flash_deadline)) {
+      // give up, the queued pages are dropped
+      flash_wip       = false;
+      flash_status    = FLASH_TIMEOUT;
+      flash_length[0] = 0;
+      flash_length[1] = 0;
+      return;
+    } else {
+      return;
+    }
+  }
+
+  Length = flash_length[flash_program];
+  if (!Length)
+    return;
+  Page = flash_page[flash_program];
+  flash_write_enable();
+  flash_command(FLASH_CMD_PAGE_PROGRAM, flash_addr, 4);
+  // spi_transfer() handles at most 255 bytes, the received bytes overwrite
+  // the page buffer, which is free afterwards anyway
+  if (Length > FLASH_PAGE_SIZE / 2) {
+    spi_transfer(Page, Page, FLASH_PAGE_SIZE / 2);
+    Page   += FLASH_PAGE_SIZE / 2;
+    Length -= FLASH_PAGE_SIZE / 2;
+  }
+  spi_transfer(Page, Page, Length);
+  spi_select(false);
+  flash_start_wip(FLASH_PROGRAM_TIMEOUT);
+
+  flash_addr += flash_length[flash_program];
+  flash_length[flash_program] = 0;
+  flash_program ^= 1;
+}
+
+/**
+ * Check whether a write cycle is active or pages wait for programming
+ */
+bool flash_busy(void) {
+  return flash_wip || flash_length[0] || flash_length[1];
+}
+
+/**
+ * Return the status of the last erase or write operation
+ */
+Flash_Status flash_result(void) {
+  return flash_status;
+}
@@ -19,7 +19,11 @@
 
 #include <stdbool.h>
 #include "reg_ezusb.h"
+#include "common.h"
 #include "i2c.h"
+#include "profile.h"
+#include "stats.h"
+#include "trace.h"
 
 /**
  * State of the I2C driver
@@ -29,20 +33,47 @@ typedef enum {
   stRecvFirst,
   stReceiving,
   stSending,
-  stStop,
-  stBusError,
-  stNAck
+  stRestart,
+  stStop
 } I2C_State;
 
 volatile static I2C_State        i2c_state;
+volatile static uint8_t          i2c_addr;
 volatile static uint8_t          i2c_length;
 volatile static __xdata uint8_t* i2c_ptr;
 volatile static uint8_t          i2c_count;
 
+/**
+ * Transaction queue
+ *
+ * Entries from i2c_done to i2c_active-1 are completed but not yet reported
+ * by i2c_poll(), i2c_active is the transaction currently executed by the
+ * ISR, entries up to i2c_free-1 are waiting. The queue is empty if
+ * i2c_done == i2c_free.
+ */
+static __xdata I2C_Transaction i2c_queue[I2C_QUEUE_SIZE];
+volatile static uint8_t          i2c_done;
+volatile static uint8_t          i2c_active;
+volatile static uint8_t          i2c_free;
+
+#define I2C_NEXT(index)  (((index) + 1) & (I2C_QUEUE_SIZE - 1))
+
+/**
+ * Completion of i2c_read() and i2c_write()
+ */
+volatile static bool             i2c_sync_pending;
+static I2C_Status                i2c_sync_status;
+
 // Forward Declarations
 
-static void i2c_wait_stop();
-static I2C_Status i2c_wait_finished();
+static void i2c_start_next();
+static void i2c_start_active();
+static void i2c_finish(I2C_Status status);
+static __xdata I2C_Transaction* i2c_prepare(uint8_t addr, uint8_t flags,
+                                            uint8_t length, __xdata uint8_t* ptr,
+                                            I2C_Callback callback);
+static void i2c_sync_done(__xdata I2C_Transaction* t);
+static I2C_Status i2c_sync_wait();
 
 /*****************************************************************************/
 /***  Driver Functions  ******************************************************/
@@ -53,80 +84,167 @@ static I2C_Status i2c_wait_finished();
  */
 void i2c_init() {
   // initialize internal variables
-  i2c_state = stIdle;
+  i2c_state  = stIdle;
+  i2c_done   = 0;
+  i2c_active = 0;
+  i2c_free   = 0;
 
   // enable I2C interrupt
   EI2C = 1;
 }
 
 /**
- * Initiate an I2C read transfer
+ * Get a free queue entry
  *
+ * The caller fills all fields except Status and then calls i2c_submit().
  *
+ * @return pointer to the queue entry or NULL if the queue is full
+ */
+__xdata I2C_Transaction* i2c_alloc() {
+  if (I2C_NEXT(i2c_free) == i2c_done)
+    return NULL;
+  return &i2c_queue[i2c_free];
+}
+
+/**
+ * Append the transaction returned by i2c_alloc() to the queue
+ *
+ * This function returns immediately. If the I2C bus is idle, the
+ * transaction is started at once, otherwise i2c_poll() starts it after all
+ * previous transactions.
+ */
+void i2c_submit() {
+  i2c_queue[i2c_free].Status = I2C_PENDING;
+  __critical {
+    i2c_free = I2C_NEXT(i2c_free);
+    i2c_start_next();
+  }
+}
+
+/**
+ * Start the next transaction and report completed transactions
+ *
+ * Calls the callback of every completed transaction and frees its queue
+ * entry. This is executed from command_loop().
+ */
+void i2c_poll() {
+  __xdata I2C_Transaction* t;
+
+  __critical {
+    i2c_start_next();
+  }
+  while (i2c_done != i2c_active) {
+    t = &i2c_queue[i2c_done];
+    if (t->Callback)
+      t->Callback(t);
+    i2c_done = I2C_NEXT(i2c_done);
+  }
+}
+
+/**
+ * Check whether a queued transaction waits for the STOP condition of the
+ * previous one
+ *
+ * The I2C controller has no interrupt at the end of the STOP condition, so
+ * the main loop must keep calling i2c_poll() instead of idling.
+ */
+bool i2c_stop_pending() {
+  return (i2c_state == stIdle) && (i2c_active != i2c_free);
+}
+
+/**
+ * Return the number of queued transactions (including the active one and
+ * those not yet reported by i2c_poll())
+ */
+uint8_t i2c_queue_depth() {
+  return (i2c_free - i2c_done) & (I2C_QUEUE_SIZE - 1);
+}
+
+/**
+ * Initiate an I2C read transfer
+ *
+ * The transfer is queued, its completion is not reported.
  */
 I2C_Status i2c_start_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
-  // wait previous transfer to finish
-  i2c_wait_stop();
-  // return if a transfer is still active
-  if (i2c_state != stIdle)
+  if (!i2c_prepare(addr, I2C_READ, length, ptr, NULL))
     return I2C_BUSY;
-
-  // set the start bit and send address byte
-  I2CS  = I2C_START;
-  I2DAT = (addr << 1) | 0x01;   // LSB=1 -> read transfer
-  // store information about the transfer
-  i2c_state  = stRecvFirst;
-  i2c_length = length;
-  i2c_ptr    = ptr;
-  i2c_count  = 0;
-  
+  i2c_submit();
   return I2C_OK;
 }
 
 /**
  * Initiate an I2C write transfer
  *
- *
+ * The transfer is queued, its completion is not reported.
  */
 I2C_Status i2c_start_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
-  // wait previous transfer to finish
-  i2c_wait_stop();
-  // return if a transfer is still active
-  if (i2c_state != stIdle)
+  if (!i2c_prepare(addr, I2C_WRITE, length, ptr, NULL))
     return I2C_BUSY;
+  i2c_submit();
+  return I2C_OK;
+}
 
-  // set the start bit and send address byte
-  I2CS  = I2C_START;
-  I2DAT = (addr << 1) | 0x00;   // LSB=0 -> write transfer
-  // store information about the transfer
-  i2c_state  = stSending;
-  i2c_length = length;
-  i2c_ptr    = ptr;
-  i2c_count  = 0;
-  
+/**
+ * Initiate a combined I2C write-then-read transfer
+ *
+ * Writes @a wlength bytes (e.g. a register address), then issues a repeated
+ * START condition and reads @a rlength bytes. The transfer is queued, its
+ * completion is not reported.
+ */
+I2C_Status i2c_start_write_read(uint8_t addr, uint8_t wlength, __xdata uint8_t* wptr,
+                                uint8_t rlength, __xdata uint8_t* rptr) {
+  __xdata I2C_Transaction* t;
+
+  t = i2c_prepare(addr, I2C_WRITE_READ, wlength, wptr, NULL);
+  if (!t)
+    return I2C_BUSY;
+  t->RdLength = rlength;
+  t->RdPtr    = rptr;
+  i2c_submit();
   return I2C_OK;
 }
 
 /**
  * Perform an I2C read transfer
  *
- * This function initiates an I2C read transfer and waits until it has
- * finished.
+ * This function queues an I2C read transfer and waits until it has
+ * finished. It must not be used from a transaction callback.
  */
 I2C_Status i2c_read (uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
-  i2c_start_read(addr,length,ptr);
-  return i2c_wait_finished();
+  if (!i2c_prepare(addr, I2C_READ, length, ptr, i2c_sync_done))
+    return I2C_BUSY;
+  return i2c_sync_wait();
 }
 
 /**
  * Perform an I2C write transfer
  *
- * This function initiates an I2C write transfer and waits until it has
- * finished.
+ * This function queues an I2C write transfer and waits until it has
+ * finished. It must not be used from a transaction callback.
  */
 I2C_Status i2c_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
-  i2c_start_write(addr,length,ptr);
-  return i2c_wait_finished();
+  if (!i2c_prepare(addr, I2C_WRITE, length, ptr, i2c_sync_done))
+    return I2C_BUSY;
+  return i2c_sync_wait();
+}
+
+/**
+ * Perform a combined I2C write-then-read transfer
+ *
+ * This function queues an I2C write-then-read transfer (see
+ * i2c_start_write_read()) and waits until it has finished. It must not be
+ * used from a transaction callback.
+ */
+I2C_Status i2c_write_read(uint8_t addr, uint8_t wlength, __xdata uint8_t* wptr,
+                          uint8_t rlength, __xdata uint8_t* rptr) {
+  __xdata I2C_Transaction* t;
+
+  t = i2c_prepare(addr, I2C_WRITE_READ, wlength, wptr, i2c_sync_done);
+  if (!t)
+    return I2C_BUSY;
+  t->RdLength = rlength;
+  t->RdPtr    = rptr;
+  return i2c_sync_wait();
 }
 
 /*****************************************************************************/
@@ -134,34 +252,121 @@ I2C_Status i2c_write(uint8_t addr, uint8_t length, __xdata uint8_t* ptr) {
 /*****************************************************************************/
 
 /**
- * Wait until the current transfer is finished.
+ * Start the transaction i2c_active if the bus is free
+ *
+ * A new START must not be requested before the I2C core has finished the
+ * STOP condition of the previous transfer. Instead of waiting for it, the
+ * transaction is left to the next call. This is called with interrupts
+ * disabled.
+ */
+static void i2c_start_next() {
+  __xdata I2C_Transaction* t;
+
+  while ((i2c_state == stIdle) && (i2c_active != i2c_free) && !(I2CS & I2C_STOP)) {
+    t = &i2c_queue[i2c_active];
+    // a read of 0 bytes can't be terminated on the bus, it succeeds at once
+    if (((t->Flags & I2C_READ) && !t->Length) ||
+        ((t->Flags & I2C_WRITE_READ) && !t->Length && !t->RdLength))
+      i2c_finish(I2C_OK);
+    else
+      i2c_start_active();
+  }
+}
+
+/**
+ * Start the transaction i2c_active
+ *
+ * This is called with interrupts disabled when the bus is free.
+ */
+static void i2c_start_active() {
+  __xdata I2C_Transaction* t = &i2c_queue[i2c_active];
+
+  // store information about the transfer
+  i2c_addr   = t->Addr;
+  i2c_length = t->Length;
+  i2c_ptr    = t->Ptr;
+  i2c_count  = 0;
+  TRACE_POST(TRACE_I2C_START, t->Addr);
+  // a write-then-read without bytes to write is a plain read
+  if ((t->Flags & I2C_WRITE_READ) && !i2c_length) {
+    i2c_length = t->RdLength;
+    i2c_ptr    = t->RdPtr;
+  }
+  // set the start bit and send address byte
+  I2CS  = I2C_START;
+  if ((t->Flags & I2C_READ) || ((t->Flags & I2C_WRITE_READ) && !t->Length)) {
+    i2c_state = stRecvFirst;
+    I2DAT = (t->Addr << 1) | 0x01;   // LSB=1 -> read transfer
+  } else {
+    // without data (e.g. ACK polling) the stop condition follows the address
+    i2c_state = (i2c_length ? stSending : stStop);
+    I2DAT = (t->Addr << 1) | 0x00;   // LSB=0 -> write transfer
+  }
+}
+
+/**
+ * Finish the transaction i2c_active
+ *
+ * This is called from the ISR after the stop condition was requested. The
+ * next transaction is started by i2c_poll() when the STOP condition is done.
+ */
+static void i2c_finish(I2C_Status status) {
+  i2c_queue[i2c_active].Status = status;
+  TRACE_POST(TRACE_I2C_DONE, status);
+  stats.I2CTransfers++;
+  if (status == I2C_NACK)
+    stats.I2CNacks++;
+  else if (status == I2C_BERROR)
+    stats.I2CBusErrors++;
+  i2c_active = I2C_NEXT(i2c_active);
+  i2c_state  = stIdle;
+}
+
+/**
+ * Allocate and fill a queue entry
  *
- * This function assumes that currently the last byte is transfered and the
- * I2C core will generate an I2C Stop condition after that byte. It waits until
- * the I2C core signals that the stop condition is done.
+ * The caller fills further fields and calls i2c_submit(). If @a callback is
+ * i2c_sync_done, the completion is awaited by i2c_sync_wait(), which also
+ * submits the transaction.
+ *
+ * @return pointer to the queue entry or NULL if the queue is full
+ */
+static __xdata I2C_Transaction* i2c_prepare(uint8_t addr, uint8_t flags,
+                                            uint8_t length, __xdata uint8_t* ptr,
+                                            I2C_Callback callback) {
+  __xdata I2C_Transaction* t;
+
+  t = i2c_alloc();
+  if (!t)
+    return NULL;
+  t->Addr     = addr;
+  t->Flags    = flags;
+  t->Length   = length;
+  t->Ptr      = ptr;
+  t->Callback = callback;
+  return t;
+}
+
+/**
+ * Callback of i2c_read() and i2c_write()
  */
-static void i2c_wait_stop() {
-  while (I2CS & I2C_STOP) ;
+static void i2c_sync_done(__xdata I2C_Transaction* t) {
+  i2c_sync_status  = t->Status;
+  i2c_sync_pending = false;
 }
 
 /**
- * Wait until the current transfer is finished and return its status
+ * Submit the transfer of i2c_read(), i2c_write() or i2c_write_read(), wait
+ * until it is finished and return its status
  */
-static I2C_Status i2c_wait_finished() {
-  while (true) {
-    switch (i2c_state) {
-      case stIdle:
-        return I2C_OK;
-      case stBusError:
-        i2c_state = stIdle;
-        return I2C_BERROR;
-      case stNAck:
-        i2c_state = stIdle;
-        return I2C_NACK;
-      default:
-        // do nothing, just continue waiting
-    }
+static I2C_Status i2c_sync_wait() {
+  i2c_sync_pending = true;
+  i2c_submit();
+  while (i2c_sync_pending) {
+    BUSY_WAIT();
+    i2c_poll();
   }
+  return i2c_sync_status;
 }
 
 /*****************************************************************************/
@@ -174,18 +379,20 @@ static I2C_Status i2c_wait_finished() {
  * see EZ-USB Technical Reference Manual v1.10 p. 4-10.
  */
 void i2c_isr(void)      __interrupt I2C_VECTOR {
+  PROFILE_ENTER(PROFILE_I2C_ISR);
+  STATS_ISR_ENTER();
   // check for bus error
   if (I2CS & BERR) {
-    i2c_state = stBusError;
     // terminate transfer
     I2CS |= I2C_STOP;
+    i2c_finish(I2C_BERROR);
     goto isr_done;
   }
   // check for missing NACK
   if ((i2c_state != stReceiving) && (!(I2CS & ACK))) {
-    i2c_state = stNAck;
     // terminate transfer
     I2CS |= I2C_STOP;
+    i2c_finish(I2C_NACK);
     goto isr_done;
   }
   // I2C state machine
@@ -208,7 +415,10 @@ void i2c_isr(void)      __interrupt I2C_VECTOR {
       // after it was received
       if (i2c_count == i2c_length-1) {
         I2CS |= I2C_STOP;
-        i2c_state = stIdle;
+        // store the received byte
+        i2c_ptr[i2c_count++] = I2DAT;
+        i2c_finish(I2C_OK);
+        break;
       }
       // store the received byte
       i2c_ptr[i2c_count++] = I2DAT;
@@ -216,17 +426,32 @@ void i2c_isr(void)      __interrupt I2C_VECTOR {
     case stSending:
       // send next byte
       I2DAT = i2c_ptr[i2c_count++];
-      // if last byte was sent, next state is stop
-      if (i2c_count == i2c_length)
-        i2c_state = stStop;
+      // if last byte was sent, next state is stop (or repeated start)
+      if (i2c_count == i2c_length) {
+        if ((i2c_queue[i2c_active].Flags & I2C_WRITE_READ) && i2c_queue[i2c_active].RdLength)
+          i2c_state = stRestart;
+        else
+          i2c_state = stStop;
+      }
+      break;
+    case stRestart:
+      // switch to the read phase of a write-then-read transfer
+      i2c_length = i2c_queue[i2c_active].RdLength;
+      i2c_ptr    = i2c_queue[i2c_active].RdPtr;
+      i2c_count  = 0;
+      i2c_state  = stRecvFirst;
+      // generate a repeated start condition and send address byte
+      I2CS |= I2C_START;
+      I2DAT = (i2c_addr << 1) | 0x01;   // LSB=1 -> read transfer
       break;
     case stStop:
       // tell I2C master to generate I2C stop condition
       I2CS |= I2C_STOP;
-      i2c_state = stIdle;
+      i2c_finish(I2C_OK);
       break;
   }
 isr_done:
   EXIF &= ~I2CINT;  // clear interrupt flag
+  STATS_ISR_EXIT();
+  PROFILE_EXIT(PROFILE_I2C_ISR);
 }
-
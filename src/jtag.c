@@ -0,0 +1,166 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "spi.h"
+#include "jtag.h"
+
+/*
+ * The JTAG pins are kept apart from the configuration of the SPI master, so
+ * CMD_SPI_CONFIG and CMD_JTAG_CONFIG don't disturb each other.
+ */
+static uint8_t jtag_port;        // SPI_PORT_* of TCK, TMS and TDI
+static uint8_t jtag_tdo_port;    // SPI_PORT_* of TDO
+static uint8_t jtag_tck_mask;
+static uint8_t jtag_tms_mask;
+static uint8_t jtag_tdi_mask;
+static uint8_t jtag_tdo_mask;
+
+/*****************************************************************************/
+/***  Port Access  ***********************************************************/
+/*****************************************************************************/
+
+/**
+ * Clock one bit and return TDO
+ *
+ * TDO is read after the rising edge, it is valid from the preceding falling
+ * edge on. TCK, TMS and TDI are low afterwards.
+ */
+static bool jtag_bit(bool tms, bool tdi) {
+  uint8_t out = 0;
+  bool    tdo;
+
+  if (tms)
+    out |= jtag_tms_mask;
+  if (tdi)
+    out |= jtag_tdi_mask;
+  spi_port_write(jtag_port, jtag_tck_mask | jtag_tms_mask | jtag_tdi_mask, out);
+  spi_port_write(jtag_port, 0, jtag_tck_mask);
+  tdo = (spi_pins_read(jtag_tdo_port) & jtag_tdo_mask) != 0;
+  spi_port_write(jtag_port, jtag_tck_mask | jtag_tms_mask | jtag_tdi_mask, 0);
+  return tdo;
+}
+
+/*
+ * spi_transfer() takes its pins from the spi_* variables (see spi.h).
+ * jtag_scan() loads the JTAG pins for the transfer of the full bytes and
+ * restores the configuration of the SPI master afterwards.
+ */
+static uint8_t jtag_spi_saved[8];
+
+static void jtag_spi_load(void) {
+  jtag_spi_saved[0] = spi_mode;      spi_mode      = SPI_MODE_0 | SPI_LSB_FIRST;
+  jtag_spi_saved[1] = spi_out_port;  spi_out_port  = SPI_OUTA + jtag_port;
+  jtag_spi_saved[2] = spi_pins_port; spi_pins_port = SPI_PINSA + jtag_tdo_port;
+  jtag_spi_saved[3] = spi_keep_mask; spi_keep_mask = ~(jtag_tck_mask | jtag_tdi_mask);
+  jtag_spi_saved[4] = spi_sck_idle;  spi_sck_idle  = 0;
+  jtag_spi_saved[5] = spi_sck_mask;  spi_sck_mask  = jtag_tck_mask;
+  jtag_spi_saved[6] = spi_mosi_mask; spi_mosi_mask = jtag_tdi_mask;
+  jtag_spi_saved[7] = spi_miso_mask; spi_miso_mask = jtag_tdo_mask;
+}
+
+static void jtag_spi_restore(void) {
+  spi_mode      = jtag_spi_saved[0];
+  spi_out_port  = jtag_spi_saved[1];
+  spi_pins_port = jtag_spi_saved[2];
+  spi_keep_mask = jtag_spi_saved[3];
+  spi_sck_idle  = jtag_spi_saved[4];
+  spi_sck_mask  = jtag_spi_saved[5];
+  spi_mosi_mask = jtag_spi_saved[6];
+  spi_miso_mask = jtag_spi_saved[7];
+}
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Configure the pins and drive TCK, TMS and TDI low
+ *
+ * The configuration of the SPI master is not changed.
+ *
+ * @param tck  TCK pin (SPI_PIN())
+ * @param tms  TMS pin, same port as TCK
+ * @param tdi  TDI pin, same port as TCK
+ * @param tdo  TDO pin
+ * @return false if the pins are invalid, the configuration is unchanged
+ */
+bool jtag_config(uint8_t tck, uint8_t tms, uint8_t tdi, uint8_t tdo) {
+  if ((tck & ~SPI_PIN_MASK) || !spi_pins_valid(tck, tdi, tdo, tms))
+    return false;
+  jtag_port     = tck >> 3;
+  jtag_tdo_port = tdo >> 3;
+  jtag_tck_mask = 1 << (tck & 0x07);
+  jtag_tms_mask = 1 << (tms & 0x07);
+  jtag_tdi_mask = 1 << (tdi & 0x07);
+  jtag_tdo_mask = 1 << (tdo & 0x07);
+
+  // idle levels first, then enable the drivers
+  spi_port_write(jtag_port, jtag_tck_mask | jtag_tms_mask | jtag_tdi_mask, 0);
+  spi_port_output(jtag_port, jtag_tck_mask | jtag_tms_mask | jtag_tdi_mask, 0);
+  spi_port_output(jtag_tdo_port, 0, jtag_tdo_mask);
+  return true;
+}
+
+/**
+ * Clock @a count (max. 8) bits of @a tms, LSB first, with TDI low
+ */
+void jtag_tms(uint8_t tms, uint8_t count) {
+  while (count--) {
+    jtag_bit(tms & 0x01, false);
+    tms >>= 1;
+  }
+}
+
+/**
+ * Clock @a count TCK cycles with TMS and TDI low, e.g. in Run-Test/Idle
+ */
+void jtag_clock(uint16_t count) {
+  while (count--)
+    jtag_bit(false, false);
+}
+
+/**
+ * Shift @a bits bits from @a src to TDI and store TDO at @a dst
+ *
+ * Both are LSB first, the unused bits of the last byte of @a dst are 0.
+ * @a src and @a dst may be the same buffer. TMS is low except for the last
+ * bit, where it is @a exit (leaving Shift-DR/IR to Exit1). @a bits is 1 to
+ * 2040.
+ */
+void jtag_scan(__xdata uint8_t* dst, __xdata uint8_t* src, uint16_t bits, bool exit) {
+  uint8_t bytes = (bits - 1) >> 3;
+  uint8_t rest  = bits - ((uint16_t)bytes << 3);
+  uint8_t tdi;
+  uint8_t tdo = 0;
+  uint8_t i;
+
+  // TMS stays low from the previous jtag_bit()
+  jtag_spi_load();
+  spi_transfer(dst, src, bytes);
+  jtag_spi_restore();
+  tdi = src[bytes];
+  for (i = 0; i < rest; i++) {
+    if (jtag_bit(exit && (i == rest - 1), tdi & 0x01))
+      tdo |= 1 << i;
+    tdi >>= 1;
+  }
+  dst[bytes] = tdo;
+}
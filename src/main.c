@@ -21,8 +21,20 @@
 
 #include "io.h"
 #include "usb.h"
+#include "delay.h"
 #include "i2c.h"
+#include "eeprom.h"
+#include "spi.h"
+#include "flash.h"
+#include "event.h"
+#include "uart.h"
+#include "notify.h"
+#include "stats.h"
+#include "trace.h"
 #include "commands.h"
+#ifdef BENCH
+#include "bench.h"
+#endif
 
 /**
  * Interrupt Vectors
@@ -42,9 +54,27 @@
  * libfloat). These would be placed to some free space which is incidentially
  * exactly where the 8051 interrupt vector table is. Therefore we use _one_
  * ISR vector (here 13) to "reserve" that space.
+ *
+ * The ISRs of optional features are only declared if they are built.
  */
+#ifdef PATTERN
+// Timer 0
+extern void timer0_isr(void)   __interrupt TF0_VECTOR;
+#endif
+// Timer 2
+extern void timer2_isr(void)   __interrupt TF2_VECTOR;
 // I2C
-//extern void i2c_isr(void)      __interrupt I2C_VECTOR;
+extern void i2c_isr(void)      __interrupt I2C_VECTOR;
+#ifdef UART
+// Serial ports
+extern void uart0_isr(void)    __interrupt SI0_VECTOR;
+extern void uart1_isr(void)    __interrupt SI1_VECTOR;
+#endif
+#ifdef NOTIFY
+// External interrupts
+extern void int0_isr(void)     __interrupt IE0_VECTOR;
+extern void int1_isr(void)     __interrupt IE1_VECTOR;
+#endif
 // USB
 extern void sudav_isr(void)    __interrupt SUDAV_ISR;
 extern void sof_isr(void)      __interrupt;
@@ -100,14 +130,42 @@ static void io_init(void) {
 
 int main(void) {
   io_init();
+  event_init();
+  stats_reset();
+  timer_init();
+#ifdef TRACE
+  trace_init();
+#endif
+
+  /* Globally enable interrupts, the timebase is required by usb_init() */
+  EA = 1;
+
   usb_init();
   i2c_init();
+  eeprom_init();
+#ifdef SPI
+  spi_init();
+#endif
+#ifdef FLASH
+  flash_init();
+#endif
+#ifdef UART
+  uart_init();
+#endif
+#ifdef NOTIFY
+  notify_init();
+#endif
 
-  /* Globally enable interrupts */
-  EA = 1;
+  /* Finish ReNumeration after the remaining initialization */
+  usb_connect();
 
+#ifdef BENCH
+  /* Execute events posted by the simulator. This function never returns. */
+  bench_loop();
+#else
   /* Begin executing command(s). This function never returns. */
   command_loop();
+#endif
 
   /* Never reached, but SDCC complains about missing return statement */
   return 0;
@@ -0,0 +1,277 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "delay.h"
+#include "xmem.h"
+#include "uart.h"
+#include "pattern.h"
+#include "notify.h"
+
+/**
+ * Ring of records in OUT1BUF (see notify.h)
+ *
+ * The head and tail indices run freely from 0 to 255, the position within
+ * the ring is index & NOTIFY_RING_MASK. Both are only advanced by the main
+ * loop.
+ */
+#define NOTIFY_RING_MASK  (NOTIFY_RING_SIZE - 1)
+#define notify_ring       ((__xdata TNotifyRecord*)OUT1BUF)
+
+static uint8_t notify_head;
+static uint8_t notify_tail;
+static uint8_t notify_lost;          // records which didn't fit into the ring
+
+#define NOTIFY_LEVEL      ((uint8_t)(notify_head - notify_tail))
+
+/**
+ * State of the sources
+ */
+#define NOTIFY_OVERRUN_COUNT  3
+
+static uint8_t           notify_sources;     // NOTIFY_ENABLE() bits
+static volatile uint8_t  notify_in_busy;     // EP1 IN packet not sent
+static volatile uint8_t  notify_pin_edges;   // set by int0_isr(), int1_isr()
+static uint16_t          notify_overruns[NOTIFY_OVERRUN_COUNT];  // reported
+static uint8_t           notify_overrun_queued;  // bit i: record in the ring
+static uint16_t          notify_period;      // ms between NOTIFY_TIMER, 0: off
+static deadline_t        notify_deadline;
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Initialize the notification with all sources disabled
+ */
+void notify_init(void) {
+  notify_head = 0;
+  notify_tail = 0;
+  notify_lost = 0;
+  notify_config(0, 0);
+  notify_usb_reset();
+}
+
+/**
+ * Return the current count of the buffer @a i (NOTIFY_OVERRUN_*)
+ */
+static uint16_t notify_overrun_count(uint8_t i) {
+#ifdef PATTERN
+  if (i == NOTIFY_OVERRUN_PATTERN)
+    return pattern_underruns();
+#endif
+#ifdef UART
+  if (i != NOTIFY_OVERRUN_PATTERN)
+    return uart_overruns(i);
+#endif
+  return 0;
+}
+
+/**
+ * Select the sources of the records
+ *
+ * Records already queued are still sent, events which happened before are
+ * not reported.
+ *
+ * @param sources  NOTIFY_ENABLE() of the record types
+ * @param period   ms between two NOTIFY_TIMER records
+ * @return false if @a sources is invalid
+ */
+bool notify_config(uint8_t sources, uint16_t period) {
+  uint8_t i;
+
+  if (sources & ~NOTIFY_ALL)
+    return false;
+  notify_sources = sources;
+
+  /* INT0# and INT1#: falling edge */
+  EX0 = 0;
+  EX1 = 0;
+  notify_pin_edges = 0;
+  if (sources & NOTIFY_ENABLE(NOTIFY_PIN)) {
+    PORTCCFG |= INT0 | INT1;
+    IT0 = 1;
+    IT1 = 1;
+    IE0 = 0;
+    IE1 = 0;
+    EX0 = 1;
+    EX1 = 1;
+  } else {
+    PORTCCFG &= ~(INT0 | INT1);
+  }
+
+  for (i = 0; i < NOTIFY_OVERRUN_COUNT; i++)
+    notify_overruns[i] = notify_overrun_count(i);
+  notify_overrun_queued = 0;
+
+  notify_period = (sources & NOTIFY_ENABLE(NOTIFY_TIMER)) ? period : 0;
+  notify_deadline = deadline_set(notify_period);
+  return true;
+}
+
+/**
+ * Append a record to the ring
+ */
+static void notify_put(uint8_t type, uint8_t arg) {
+  __xdata TNotifyRecord* r = &notify_ring[notify_head & NOTIFY_RING_MASK];
+
+  r->Type = type;
+  r->Arg  = arg;
+  r->Time = timer_ticks();
+  notify_head++;
+}
+
+/**
+ * Queue a record of source @a type (NOTIFY_*) if this source is enabled
+ *
+ * Not reentrant, must only be called from the main loop. The record is sent
+ * by the next notify_service().
+ */
+void notify_post(uint8_t type, uint8_t arg) {
+  if (!(notify_sources & NOTIFY_ENABLE(type)))
+    return;
+  // report lost records first, this needs room for both
+  if (notify_lost && (NOTIFY_LEVEL <= NOTIFY_RING_SIZE - 2)) {
+    notify_put(NOTIFY_LOST, notify_lost);
+    notify_lost = 0;
+  }
+  if (notify_lost || (NOTIFY_LEVEL == NOTIFY_RING_SIZE)) {
+    if (notify_lost != 0xFF)
+      notify_lost++;
+    return;
+  }
+  notify_put(type, arg);
+}
+
+/**
+ * Send all queued records in one EP1 IN packet, if the previous one was
+ * read
+ */
+static void notify_send(void) {
+  uint8_t n;
+  uint8_t first;
+  uint8_t pos;
+
+  n = NOTIFY_LEVEL;
+  if (notify_in_busy || !n)
+    return;
+  pos   = notify_tail & NOTIFY_RING_MASK;
+  first = NOTIFY_RING_SIZE - pos;
+  if (first > n)
+    first = n;
+  xmemcpy(IN1BUF, (__xdata uint8_t*)&notify_ring[pos], first * sizeof(TNotifyRecord));
+  if (n > first)
+    xmemcpy(IN1BUF + first * sizeof(TNotifyRecord), (__xdata uint8_t*)notify_ring,
+            (n - first) * sizeof(TNotifyRecord));
+  notify_tail   += n;
+  notify_in_busy = 1;
+  notify_overrun_queued = 0;
+  IN1BC = n * sizeof(TNotifyRecord);
+}
+
+/**
+ * Produce the records of the sources and send them
+ *
+ * This is executed from command_poll() after all other services, so the
+ * records of their events go out in the same main loop iteration. It
+ * doesn't need an event of its own, the pin, the endpoint and the Timer 2
+ * interrupts end the idle mode of command_loop().
+ */
+void notify_service(void) {
+  uint8_t  edges;
+  uint8_t  n;
+  uint8_t  i;
+  uint16_t count;
+
+  if (notify_sources & NOTIFY_ENABLE(NOTIFY_OVERRUN)) {
+    for (i = 0; i < NOTIFY_OVERRUN_COUNT; i++) {
+      count = notify_overrun_count(i);
+      if (count != notify_overruns[i]) {
+        // the counters restart at 0 when their buffer is reconfigured,
+        // further overruns are merged into a record not yet sent
+        if ((count > notify_overruns[i]) && !(notify_overrun_queued & (1 << i))) {
+          notify_post(NOTIFY_OVERRUN, i);
+          notify_overrun_queued |= 1 << i;
+        }
+        notify_overruns[i] = count;
+      }
+    }
+  }
+
+  if (notify_pin_edges) {
+    __critical {
+      edges = notify_pin_edges;
+      notify_pin_edges = 0;
+    }
+    notify_post(NOTIFY_PIN, edges);
+  }
+
+  if (notify_period && deadline_expired(notify_deadline)) {
+    // a late main loop reports all expirations in one record
+    n = 0;
+    do {
+      notify_deadline += notify_period;
+      if (n != 0xFF)
+        n++;
+    } while (deadline_expired(notify_deadline));
+    notify_post(NOTIFY_TIMER, n);
+  }
+
+  notify_send();
+}
+
+/*****************************************************************************/
+/***  Endpoint Handlers  *****************************************************/
+/*****************************************************************************/
+
+/**
+ * EP1 IN packet was read by the host
+ *
+ * Called by ep1in_isr().
+ */
+void notify_in_isr(void) {
+  notify_in_busy = 0;
+}
+
+/**
+ * Forget the EP1 IN packet in flight after the endpoint was reset
+ *
+ * Called on SET_INTERFACE. The records of that packet are lost, the queued
+ * ones are sent by the next notify_service().
+ */
+void notify_usb_reset(void) {
+  notify_in_busy = 0;
+}
+
+/*****************************************************************************/
+/***  Interrupt Service Routines  ********************************************/
+/*****************************************************************************/
+
+/*
+ * External interrupts 0 and 1: falling edge on INT0# (PC2) or INT1# (PC3).
+ * IE0 and IE1 are cleared by the hardware when the ISR is vectored.
+ */
+void int0_isr(void)     __interrupt IE0_VECTOR {
+  notify_pin_edges |= 0x01;
+}
+
+void int1_isr(void)     __interrupt IE1_VECTOR {
+  notify_pin_edges |= 0x02;
+}
@@ -0,0 +1,206 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "io.h"
+#include "xmem.h"
+#include "pattern.h"
+
+/**
+ * FIFO of the output data
+ *
+ * pattern_head is only advanced by the main loop (pattern_put()),
+ * pattern_tail only by the ISR. Both are 8 bit indices, which wrap around at
+ * PATTERN_FIFO_SIZE by themselves. The FIFO is full at
+ * PATTERN_FIFO_SIZE - 1 bytes, because head == tail means empty.
+ */
+static __xdata uint8_t           pattern_fifo[PATTERN_FIFO_SIZE];
+static volatile __data uint8_t   pattern_head;
+static volatile __data uint8_t   pattern_tail;
+
+/**
+ * Parameters of the active pattern, used by timer0_isr()
+ */
+static __data uint8_t            pattern_ports;    // PATTERN_PORT_*, 0 if stopped
+static __data uint8_t            pattern_width;    // bytes per sample
+static volatile __data uint16_t  pattern_underrun_count;
+
+static uint8_t  pattern_prefill;   // bytes in the FIFO before the timer starts
+static uint32_t pattern_bytes;     // bytes put into the FIFO
+
+#define PATTERN_LEVEL  ((uint8_t)(pattern_head - pattern_tail))
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Start the pattern generator
+ *
+ * The selected ports are switched to outputs, Timer 0 is configured and
+ * started as soon as @a prefill bytes were put into the FIFO.
+ *
+ * @param config   PATTERN_PORT_A and/or PATTERN_PORT_B, optionally
+ *                 PATTERN_CLK12
+ * @param period   timer counts per sample (0 = 256)
+ * @param prefill  bytes in the FIFO before the first sample is written
+ *                 (max. PATTERN_FIFO_SIZE - 1)
+ * @return false if the generator is active or @a config selects no port
+ */
+bool pattern_start(uint8_t config, uint8_t period, uint8_t prefill) {
+  if (pattern_ports || !(config & (PATTERN_PORT_A | PATTERN_PORT_B)))
+    return false;
+
+  pattern_head           = 0;
+  pattern_tail           = 0;
+  pattern_bytes          = 0;
+  pattern_underrun_count = 0;
+  pattern_prefill        = (prefill < PATTERN_FIFO_SIZE - 1) ? prefill : PATTERN_FIFO_SIZE - 1;
+  pattern_width          = 0;
+  if (config & PATTERN_PORT_A) {
+    OEA = 0xFF;
+    pattern_width++;
+  }
+  if (config & PATTERN_PORT_B) {
+    OEB = 0xFF;
+    pattern_width++;
+  }
+
+  /* Timer 0: mode 2, 8 bit auto-reload from TH0 */
+  TR0  = 0;
+  TMOD = (TMOD & ~(GATE0 | CT0 | M00 | M01)) | M01;
+  if (config & PATTERN_CLK12)
+    CKCON &= ~T0M;
+  else
+    CKCON |= T0M;
+  TH0  = (uint8_t)(0 - period);
+  TL0  = (uint8_t)(0 - period);
+  TF0  = 0;
+  PT0  = 1;        // samples must not wait for other ISRs
+  ET0  = 1;
+
+  pattern_ports = config & (PATTERN_PORT_A | PATTERN_PORT_B);
+  if (!pattern_prefill)
+    TR0 = 1;
+  return true;
+}
+
+/**
+ * Append up to @a length bytes to the FIFO
+ *
+ * Starts the timer when the prefill level is reached.
+ *
+ * @return number of bytes taken, less than @a length if the FIFO is full
+ */
+uint8_t pattern_put(__xdata uint8_t* src, uint8_t length) {
+  uint8_t head  = pattern_head;
+  uint8_t space = (PATTERN_FIFO_SIZE - 1) - PATTERN_LEVEL;
+  uint8_t first;
+
+  if (!pattern_ports)
+    return 0;
+  if (length > space)
+    length = space;
+  // copy in up to two parts around the wrap around
+  first = length;
+  if ((uint16_t)head + length > PATTERN_FIFO_SIZE)
+    first = PATTERN_FIFO_SIZE - head;
+  xmemcpy(pattern_fifo + head, src, first);
+  xmemcpy(pattern_fifo, src + first, length - first);
+  // the ISR must not see the new head before the data
+  pattern_head   = head + length;
+  pattern_bytes += length;
+
+  if (!TR0 && (PATTERN_LEVEL >= pattern_prefill))
+    TR0 = 1;
+  return length;
+}
+
+/**
+ * Stop the pattern generator
+ *
+ * The outputs keep their levels, the ports stay outputs. The FIFO contents
+ * are dropped, the statistics are kept until the next pattern_start().
+ */
+void pattern_stop(void) {
+  TR0 = 0;
+  ET0 = 0;
+  TF0 = 0;
+  pattern_ports = 0;
+}
+
+/**
+ * Check whether the generator is started and its timer is running
+ */
+bool pattern_running(void) {
+  return pattern_ports && TR0;
+}
+
+/**
+ * Return the number of bytes in the FIFO
+ */
+uint8_t pattern_level(void) {
+  return PATTERN_LEVEL;
+}
+
+/**
+ * Return the number of samples written to the ports since pattern_start()
+ */
+uint32_t pattern_samples(void) {
+  uint32_t n = pattern_bytes - PATTERN_LEVEL;
+
+  // avoid the long division, a sample has 1 or 2 bytes
+  return (pattern_width == 2) ? n >> 1 : n;
+}
+
+/**
+ * Return the number of timer overflows without a complete sample in the
+ * FIFO since pattern_start() (saturates at 0xFFFF)
+ */
+uint16_t pattern_underruns(void) {
+  uint16_t n;
+
+  __critical {
+    n = pattern_underrun_count;
+  }
+  return n;
+}
+
+/*****************************************************************************/
+/***  Interrupt Service Routine  *********************************************/
+/*****************************************************************************/
+
+/**
+ * Timer 0 Interrupt Service Routine
+ *
+ * Writes the next sample from the FIFO to the ports. The overflow flag is
+ * cleared by the hardware.
+ */
+void timer0_isr(void)   __interrupt TF0_VECTOR {
+  if (PATTERN_LEVEL < pattern_width) {
+    if (pattern_underrun_count != 0xFFFF)
+      pattern_underrun_count++;
+    return;
+  }
+  if (pattern_ports & PATTERN_PORT_A)
+    OUTA = pattern_fifo[pattern_tail++];
+  if (pattern_ports & PATTERN_PORT_B)
+    OUTB = pattern_fifo[pattern_tail++];
+}
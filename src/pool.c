@@ -0,0 +1,71 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "pool.h"
+
+/*****************************************************************************/
+/***  Packet Buffer Pool  ****************************************************/
+/*****************************************************************************/
+
+__xdata uint8_t pool_data[POOL_COUNT][POOL_BUFFER_SIZE];
+__xdata uint8_t pool_length[POOL_COUNT];   // free for use by the owner
+
+/**
+ * Stack of free buffer indices, pool_free_stack[0 .. pool_free_top-1]
+ */
+static __xdata uint8_t pool_free_stack[POOL_COUNT];
+static uint8_t pool_free_top;
+
+/**
+ * Mark all buffers as free
+ */
+void pool_init(void) {
+  uint8_t i;
+
+  for (i = 0; i < POOL_COUNT; i++) {
+    pool_free_stack[i] = i;
+  }
+  pool_free_top = POOL_COUNT;
+}
+
+/**
+ * Allocate a buffer
+ *
+ * @return buffer index or POOL_NONE if all buffers are in use
+ */
+uint8_t pool_alloc(void) __critical {
+  if (!pool_free_top)
+    return POOL_NONE;
+  return pool_free_stack[--pool_free_top];
+}
+
+/**
+ * Return buffer @a id to the pool
+ */
+void pool_free(uint8_t id) __critical {
+  pool_free_stack[pool_free_top++] = id;
+}
+
+/**
+ * Return the number of free buffers
+ */
+uint8_t pool_available(void) {
+  return pool_free_top;
+}
@@ -0,0 +1,83 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "delay.h"
+#include "profile.h"
+
+/*****************************************************************************/
+/***  Profiling  *************************************************************/
+/*****************************************************************************/
+
+__xdata TProfileEntry profile_table[PROFILE_COUNT];
+__xdata uint16_t      profile_start[PROFILE_COUNT];
+
+/**
+ * Clear all measurements
+ */
+void profile_reset(void) {
+  uint8_t i;
+
+  for (i = 0; i < PROFILE_COUNT; i++) {
+    profile_table[i].Calls = 0;
+    profile_table[i].Max   = 0;
+    profile_table[i].Total = 0;
+  }
+  // measure the instrumentation overhead
+  PROFILE_ENTER(PROFILE_OVERHEAD);
+  PROFILE_EXIT(PROFILE_OVERHEAD);
+}
+
+/**
+ * Read the count register of Timer 2
+ *
+ * Used from interrupt and main context (see "Functions called from ISRs"
+ * in common.h).
+ */
+#pragma save
+#pragma nooverlay
+uint16_t profile_now(void) __critical {
+  uint8_t h, l;
+
+  do {
+    h = TH2;
+    l = TL2;
+  } while (h != TH2);    // TL2 overflowed into TH2 between the two reads
+  return ((uint16_t)h << 8) | l;
+}
+#pragma restore
+
+/**
+ * Store the cycles elapsed since PROFILE_ENTER(@a id) in profile_table[@a id]
+ */
+void profile_record(uint8_t id) __critical {
+  __xdata TProfileEntry* Entry;
+  uint16_t Cycles;
+
+  Cycles = profile_now() - profile_start[id];
+  // Timer 2 was reloaded in between
+  if (Cycles >= TIMER_COUNTS_PER_MS)
+    Cycles += TIMER_COUNTS_PER_MS;
+
+  Entry = &profile_table[id];
+  Entry->Calls++;
+  Entry->Total += Cycles;
+  if (Cycles > Entry->Max)
+    Entry->Max = Cycles;
+}
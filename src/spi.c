@@ -0,0 +1,179 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "spi.h"
+
+__data uint8_t spi_mode;
+__data uint8_t spi_out_port;
+__data uint8_t spi_pins_port;
+__data uint8_t spi_keep_mask;
+__data uint8_t spi_sck_idle;
+__data uint8_t spi_sck_mask;
+__data uint8_t spi_mosi_mask;
+__data uint8_t spi_miso_mask;
+
+static uint8_t spi_cs_mask;
+
+/*****************************************************************************/
+/***  Port Access  ***********************************************************/
+/*****************************************************************************/
+
+/*
+ * The port registers are accessed by their name, so the host build (see
+ * hostsim/) doesn't rely on their addresses. The functions are also used
+ * by the JTAG master (see jtag.c).
+ */
+
+/**
+ * Switch the @a outputs pins of @a port (SPI_PORT_*) to outputs and the
+ * @a inputs pins to inputs
+ */
+void spi_port_output(uint8_t port, uint8_t outputs, uint8_t inputs) {
+  switch (port) {
+    case SPI_PORT_A: OEA = (OEA | outputs) & ~inputs; break;
+    case SPI_PORT_B: OEB = (OEB | outputs) & ~inputs; break;
+    case SPI_PORT_C: OEC = (OEC | outputs) & ~inputs; break;
+  }
+}
+
+/**
+ * Clear the @a clear bits and set the @a set bits of OUTx of @a port
+ */
+void spi_port_write(uint8_t port, uint8_t clear, uint8_t set) {
+  switch (port) {
+    case SPI_PORT_A: OUTA = (OUTA & ~clear) | set; break;
+    case SPI_PORT_B: OUTB = (OUTB & ~clear) | set; break;
+    case SPI_PORT_C: OUTC = (OUTC & ~clear) | set; break;
+  }
+  PORT_WRITTEN();
+}
+
+/**
+ * Return OUTx of @a port
+ */
+uint8_t spi_port_read(uint8_t port) {
+  switch (port) {
+    case SPI_PORT_A: return OUTA;
+    case SPI_PORT_B: return OUTB;
+    default:         return OUTC;
+  }
+}
+
+/**
+ * Return PINSx of @a port
+ */
+uint8_t spi_pins_read(uint8_t port) {
+  switch (port) {
+    case SPI_PORT_A: return PINSA;
+    case SPI_PORT_B: return PINSB;
+    default:         return PINSC;
+  }
+}
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Reset the SPI master to "not configured"
+ *
+ * Until spi_config() was called, spi_transfer() doesn't touch any pin and
+ * receives 0x00 bytes.
+ */
+void spi_init(void) {
+  spi_mode      = 0;
+  spi_out_port  = SPI_OUTA;
+  spi_pins_port = SPI_PINSA;
+  spi_keep_mask = 0xFF;
+  spi_sck_idle  = 0;
+  spi_sck_mask  = 0;
+  spi_mosi_mask = 0;
+  spi_miso_mask = 0;
+  spi_cs_mask   = 0;
+}
+
+/**
+ * Check the pins of a bit-banged master
+ *
+ * @a sck, @a mosi and @a cs must be different pins of one port, @a miso any
+ * other pin.
+ */
+bool spi_pins_valid(uint8_t sck, uint8_t mosi, uint8_t miso, uint8_t cs) {
+  uint8_t port = sck >> 3;
+  uint8_t sc   = 1 << (sck & 0x07);
+  uint8_t mo   = 1 << (mosi & 0x07);
+  uint8_t mi   = 1 << (miso & 0x07);
+  uint8_t ss   = 1 << (cs & 0x07);
+
+  return (port <= SPI_PORT_C) && ((mosi >> 3) == port) && ((cs >> 3) == port) &&
+         ((miso >> 3) <= SPI_PORT_C) && !(sc & mo) && !(sc & ss) && !(mo & ss) &&
+         (((miso >> 3) != port) || !(mi & (sc | mo | ss)));
+}
+
+/**
+ * Configure the pins and the mode, and drive the idle levels
+ *
+ * SCK, MOSI and CS are switched to outputs, MISO to an input. CS is
+ * deasserted (high), SCK is set to its idle level and MOSI to low.
+ *
+ * @param sck_mode  SCK pin | SPI_CPHA | SPI_CPOL | SPI_LSB_FIRST
+ * @param mosi      MOSI pin, same port as SCK
+ * @param miso      MISO pin
+ * @param cs        CS pin (active low), same port as SCK
+ * @return false if the pins are invalid, the configuration is unchanged
+ */
+bool spi_config(uint8_t sck_mode, uint8_t mosi, uint8_t miso, uint8_t cs) {
+  uint8_t port = (sck_mode & SPI_PIN_MASK) >> 3;
+  uint8_t sck  = 1 << (sck_mode & 0x07);
+  uint8_t mo   = 1 << (mosi & 0x07);
+  uint8_t mi   = 1 << (miso & 0x07);
+  uint8_t ss   = 1 << (cs & 0x07);
+
+  if (!spi_pins_valid(sck_mode & SPI_PIN_MASK, mosi, miso, cs))
+    return false;
+
+  spi_init();
+  spi_mode      = sck_mode & (SPI_CPHA | SPI_CPOL | SPI_LSB_FIRST);
+  spi_out_port  = SPI_OUTA + port;
+  spi_pins_port = SPI_PINSA + (miso >> 3);
+  spi_keep_mask = ~(sck | mo);
+  spi_sck_idle  = (sck_mode & SPI_CPOL) ? sck : 0;
+  spi_sck_mask  = sck;
+  spi_mosi_mask = mo;
+  spi_miso_mask = mi;
+  spi_cs_mask   = ss;
+
+  // idle levels first, then enable the drivers
+  spi_port_write(port, sck | mo, spi_sck_idle | ss);
+  spi_port_output(port, sck | mo | ss, 0);
+  spi_port_output(miso >> 3, 0, mi);
+  return true;
+}
+
+/**
+ * Assert (low) or deassert (high) CS
+ */
+void spi_select(bool select) {
+  if (select)
+    spi_port_write(spi_out_port - SPI_OUTA, spi_cs_mask, 0);
+  else
+    spi_port_write(spi_out_port - SPI_OUTA, 0, spi_cs_mask);
+}
@@ -0,0 +1,217 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "spi.h"
+
+/*
+ * The SPI shift loops are in their own module, because the host build (see
+ * hostsim/) replaces them by a C model.
+ *
+ * Registers within the loops:
+ *   r0: LO8 of OUTx            r4: SCK mask
+ *   r1: LO8 of PINSx of MISO   r5: MISO mask
+ *   r2: OUTx with MOSI low     r6: received byte
+ *   r3: OUTx with MOSI high    r7: byte to send
+ * r2 and r3 hold SCK at its idle level and all other pins of the port as
+ * read from OUTx at the start. MISO is moved into C with "add a,#0xFF" and
+ * shifted into r6 with the same rotation as the output byte, so the bit
+ * order is selected by rlc (MSB first) or rrc (LSB first).
+ *
+ * The unrolled loops are longer than a relative branch can reach, so every
+ * loop ends with djnz to an ljmp back. Together with storing the received
+ * byte this costs 20 cycles per byte.
+ */
+
+/**
+ * Send @a length bytes from @a src and store the received bytes at @a dst
+ *
+ * @a src and @a dst may be the same buffer. CS is not changed (see
+ * spi_select()).
+ */
+void spi_transfer(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length) __naked {
+  __asm
+    mov   a,_spi_transfer_PARM_3 ; nothing to do for length == 0
+    jnz   00001$
+    ret
+00001$:
+    mov   _MPAGE,#0x7F          ; movx @r0/@r1 access 0x7Fxx
+    mov   r0,#0xE3              ; AUTOPTRH/L = dst
+    mov   a,dph
+    movx  @r0,a
+    inc   r0
+    mov   a,dpl
+    movx  @r0,a
+    mov   dpl,_spi_transfer_PARM_2
+    mov   dph,(_spi_transfer_PARM_2 + 1)
+    mov   r0,_spi_out_port
+    mov   r1,_spi_pins_port
+    movx  a,@r0                 ; r2/r3 = OUTx with SCK idle, MOSI low/high
+    anl   a,_spi_keep_mask
+    orl   a,_spi_sck_idle
+    mov   r2,a
+    orl   a,_spi_mosi_mask
+    mov   r3,a
+    mov   r4,_spi_sck_mask
+    mov   r5,_spi_miso_mask
+    mov   a,_spi_mode
+    jb    acc.7,00003$          ; SPI_LSB_FIRST
+    jb    acc.5,00002$          ; SPI_CPHA
+    ljmp  00010$
+00002$:
+    ljmp  00011$
+00003$:
+    jb    acc.5,00004$
+    ljmp  00020$
+00004$:
+    ljmp  00021$
+
+    ; MSB first, CPHA = 0: 20 cycles per bit (+1 if it is 1)
+00010$:
+    movx  a,@dptr               ; output byte
+    inc   dptr
+    mov   r7,a
+    .rept 8
+    mov   a,r7                  ; next bit of the output byte -> C
+    rlc   a
+    mov   r7,a
+    mov   a,r2                  ; MOSI, SCK idle
+    jnc   .+3
+    mov   a,r3
+    movx  @r0,a
+    xrl   a,r4                  ; leading SCK edge
+    movx  @r0,a
+    movx  a,@r1                 ; MISO -> C
+    anl   a,r5
+    add   a,#0xFF
+    mov   a,r6
+    rlc   a
+    mov   r6,a
+    .endm
+    mov   r1,#0xE5              ; AUTODATA = received byte
+    movx  @r1,a
+    mov   r1,_spi_pins_port
+    djnz  _spi_transfer_PARM_3,00015$
+    ljmp  00090$
+00015$:
+    ljmp  00010$
+
+    ; MSB first, CPHA = 1: 25 cycles per bit (+1 if it is 1)
+00011$:
+    movx  a,@dptr               ; output byte
+    inc   dptr
+    mov   r7,a
+    .rept 8
+    mov   a,r7                  ; next bit of the output byte -> C
+    rlc   a
+    mov   r7,a
+    mov   a,r2                  ; MOSI, SCK idle
+    jnc   .+3
+    mov   a,r3
+    xrl   a,r4                  ; leading SCK edge
+    movx  @r0,a
+    xrl   a,r4
+    mov   b,a
+    movx  a,@r1                 ; MISO -> C
+    anl   a,r5
+    add   a,#0xFF
+    mov   a,b                   ; trailing SCK edge
+    movx  @r0,a
+    mov   a,r6
+    rlc   a
+    mov   r6,a
+    .endm
+    mov   r1,#0xE5              ; AUTODATA = received byte
+    movx  @r1,a
+    mov   r1,_spi_pins_port
+    djnz  _spi_transfer_PARM_3,00016$
+    ljmp  00090$
+00016$:
+    ljmp  00011$
+
+    ; LSB first, CPHA = 0
+00020$:
+    movx  a,@dptr               ; output byte
+    inc   dptr
+    mov   r7,a
+    .rept 8
+    mov   a,r7                  ; next bit of the output byte -> C
+    rrc   a
+    mov   r7,a
+    mov   a,r2                  ; MOSI, SCK idle
+    jnc   .+3
+    mov   a,r3
+    movx  @r0,a
+    xrl   a,r4                  ; leading SCK edge
+    movx  @r0,a
+    movx  a,@r1                 ; MISO -> C
+    anl   a,r5
+    add   a,#0xFF
+    mov   a,r6
+    rrc   a
+    mov   r6,a
+    .endm
+    mov   r1,#0xE5              ; AUTODATA = received byte
+    movx  @r1,a
+    mov   r1,_spi_pins_port
+    djnz  _spi_transfer_PARM_3,00025$
+    ljmp  00090$
+00025$:
+    ljmp  00020$
+
+    ; LSB first, CPHA = 1
+00021$:
+    movx  a,@dptr               ; output byte
+    inc   dptr
+    mov   r7,a
+    .rept 8
+    mov   a,r7                  ; next bit of the output byte -> C
+    rrc   a
+    mov   r7,a
+    mov   a,r2                  ; MOSI, SCK idle
+    jnc   .+3
+    mov   a,r3
+    xrl   a,r4                  ; leading SCK edge
+    movx  @r0,a
+    xrl   a,r4
+    mov   b,a
+    movx  a,@r1                 ; MISO -> C
+    anl   a,r5
+    add   a,#0xFF
+    mov   a,b                   ; trailing SCK edge
+    movx  @r0,a
+    mov   a,r6
+    rrc   a
+    mov   r6,a
+    .endm
+    mov   r1,#0xE5              ; AUTODATA = received byte
+    movx  @r1,a
+    mov   r1,_spi_pins_port
+    djnz  _spi_transfer_PARM_3,00026$
+    ljmp  00090$
+00026$:
+    ljmp  00021$
+
+    ; SCK back to its idle level (trailing edge of the last bit, CPHA = 0)
+00090$:
+    mov   a,r2
+    movx  @r0,a
+    ret
+  __endasm;
+}
@@ -0,0 +1,170 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "delay.h"
+#include "xmem.h"
+#include "stats.h"
+
+/*****************************************************************************/
+/***  Performance Counters  **************************************************/
+/*****************************************************************************/
+
+__xdata TGetStatus stats;
+
+#ifdef ISR_STATS
+static uint16_t   stats_isr_start;     // Timer 2 count at stats_isr_enter()
+#endif
+static uint16_t   stats_loop_start;    // Timer 2 count at stats_loop_enter()
+static uint16_t   stats_loop_tick;     // timer_tick at stats_loop_enter()
+static uint16_t   stats_loop_now_tick; // timer_tick of stats_loop_now()
+
+/*
+ * stats_timer2(), stats_isr_enter() and stats_isr_exit() are called from
+ * ISRs, see "Functions called from ISRs" in common.h.
+ */
+
+/**
+ * Clear all counters
+ */
+void stats_reset(void) {
+  __critical {
+    xmemset((__xdata uint8_t*)&stats, 0, sizeof(stats));
+    stats.MyStatus = 1;
+  }
+}
+
+/**
+ * Read the count register of Timer 2
+ *
+ * Not reentrant, the main loop calls it with interrupts disabled.
+ */
+#pragma save
+#pragma nooverlay
+static uint16_t stats_timer2(void) {
+  uint8_t h, l;
+
+  do {
+    h = TH2;
+    l = TL2;
+  } while (h != TH2);    // TL2 overflowed into TH2 between the two reads
+  return ((uint16_t)h << 8) | l;
+}
+#pragma restore
+
+#ifdef ISR_STATS
+
+/**
+ * Start measuring an ISR, called at its beginning
+ */
+#pragma save
+#pragma nooverlay
+void stats_isr_enter(void) {
+  stats_isr_start = stats_timer2();
+}
+#pragma restore
+
+/**
+ * Update the longest ISR duration, called at the end of the ISR
+ */
+#pragma save
+#pragma nooverlay
+void stats_isr_exit(void) {
+  uint16_t counts;
+
+  counts = stats_timer2() - stats_isr_start;
+  // Timer 2 was reloaded in between
+  if (counts >= TIMER_COUNTS_PER_MS)
+    counts += TIMER_COUNTS_PER_MS;
+  if (counts > stats.MaxUsbI2cIsr)
+    stats.MaxUsbI2cIsr = counts;
+}
+#pragma restore
+
+#endif  // ISR_STATS
+
+/**
+ * Read the count register of Timer 2 and the millisecond tick it belongs to
+ * (to stats_loop_now_tick) from the main loop
+ *
+ * Unlike timer_fine(), this doesn't scale the tick with a multiplication.
+ */
+static uint16_t stats_loop_now(void) {
+  uint16_t c;
+
+  __critical {
+    c = stats_timer2();
+    stats_loop_now_tick = timer_tick;
+    // Timer 2 was reloaded, but the ISR didn't run yet
+    if (TF2 && (c < TIMER2_RELOAD + TIMER_COUNTS_PER_MS/2))
+      stats_loop_now_tick++;
+  }
+  return c;
+}
+
+/**
+ * Start measuring a main loop pass
+ */
+void stats_loop_enter(void) {
+  stats_loop_start = stats_loop_now();
+  stats_loop_tick  = stats_loop_now_tick;
+}
+
+/**
+ * Count the main loop pass and update the longest one
+ *
+ * The difference of the Timer 2 counts is corrected by one period per
+ * reload in between. Passes of more than 9 reloads saturate at 0xFFFF.
+ */
+void stats_loop_exit(void) {
+  uint16_t counts;
+  uint16_t ticks;
+
+  counts = stats_loop_now() - stats_loop_start;
+  ticks  = stats_loop_now_tick - stats_loop_tick;
+  if (ticks >= 10) {
+    counts = 0xFFFF;
+  } else {
+    while (ticks--)
+      counts += TIMER_COUNTS_PER_MS;
+  }
+  stats.LoopPasses++;
+  if (counts > stats.MaxLoopPass)
+    stats.MaxLoopPass = counts;
+}
+
+/**
+ * Count an EP2 IN packet of @a length bytes
+ *
+ * Called by stream_in_commit(). The 32 bit additions in XDATA are not
+ * expanded in the stream functions to save code space.
+ */
+void stats_ep2_in(uint8_t length) {
+  stats.Ep2InPackets++;
+  stats.Ep2InBytes += length;
+}
+
+/**
+ * Count an EP2 OUT packet of @a length bytes
+ */
+void stats_ep2_out(uint8_t length) {
+  stats.Ep2OutPackets++;
+  stats.Ep2OutBytes += length;
+}
@@ -0,0 +1,201 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "pool.h"
+#include "xmem.h"
+#include "stream.h"
+#include "stats.h"
+
+/**
+ * State of the streaming engine
+ *
+ * In single-buffered mode only half 0 (IN2BUF/OUT2BUF) is used. In
+ * double-buffered mode the halves are used alternately in the same order as
+ * the SIE uses them.
+ */
+static bool    stream_paired;
+static uint8_t stream_in_half;
+static uint8_t stream_out_half;
+
+/**
+ * Queue of pool buffers holding EP2 OUT packets (pooled mode only)
+ *
+ * stream_queue_tail is only advanced by stream_out_fetch(), which runs in the
+ * ISR or with interrupts disabled, stream_queue_head only by the main loop.
+ * Both count freely, the index into stream_queue is taken modulo POOL_COUNT.
+ * Since there are only POOL_COUNT pool buffers, the queue can't overflow.
+ */
+static bool             stream_pooled;
+static __xdata uint8_t  stream_queue[POOL_COUNT];
+static volatile uint8_t stream_queue_head;
+static volatile uint8_t stream_queue_tail;
+
+#define STREAM_QUEUE_HEAD_ID  stream_queue[stream_queue_head & (POOL_COUNT-1)]
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Initialize the EP2 streaming engine
+ *
+ * Aborts all pending EP2 transfers, (un)pairs EP2 with EP3 and arms all EP2
+ * OUT buffers. With @a pooled, EP2 OUT packets are queued in the packet pool.
+ * Call this only while no EP2 transfer is expected by the host.
+ */
+void stream_init(bool double_buffered, bool pooled) {
+  __critical {
+    stream_paired     = double_buffered;
+    stream_pooled     = pooled;
+    stream_in_half    = 0;
+    stream_out_half   = 0;
+    stream_queue_head = 0;
+    stream_queue_tail = 0;
+    pool_init();
+  }
+
+  /* Pair EP2 and EP3 for both directions (see EZ-USB TRM, 6.8) */
+  if (double_buffered)
+    USBPAIR = PR2IN | PR2OUT;
+  else
+    USBPAIR = 0;
+
+  /* Clear busy flag of EP2 IN, i.e. drop all packets not yet sent */
+  IN2CS = EPBSY;
+
+  /* Unstall EP2 OUT and arm its buffer(s) */
+  OUT2CS = 0;
+  OUT2BC = 0;
+  if (double_buffered)
+    OUT2BC = 0;
+}
+
+/**
+ * Check whether an EP2 IN buffer is free to be filled
+ *
+ * When paired, IN2CS.EPBSY is only set when both halves are loaded.
+ */
+bool stream_in_ready(void) {
+  return !(IN2CS & EPBSY);
+}
+
+/**
+ * Return the EP2 IN buffer to be filled next
+ */
+__xdata uint8_t* stream_in_buffer(void) {
+  return stream_in_half ? IN3BUF : IN2BUF;
+}
+
+/**
+ * Arm the EP2 IN buffer returned by stream_in_buffer() with @a length bytes
+ */
+void stream_in_commit(uint8_t length) {
+  stats_ep2_in(length);
+  IN2BC = length;
+  if (stream_paired)
+    stream_in_half ^= 1;
+}
+
+/**
+ * Check whether an EP2 OUT buffer holds data from the host
+ */
+bool stream_out_ready(void) {
+  if (stream_pooled)
+    return stream_queue_head != stream_queue_tail;
+  return !(OUT2CS & EPBSY);
+}
+
+/**
+ * Return the EP2 OUT buffer holding the oldest packet from the host
+ */
+__xdata uint8_t* stream_out_buffer(void) {
+  if (stream_pooled)
+    return pool_data[STREAM_QUEUE_HEAD_ID];
+  return stream_out_half ? OUT3BUF : OUT2BUF;
+}
+
+/**
+ * Return the number of bytes in the EP2 OUT buffer returned by
+ * stream_out_buffer()
+ */
+uint8_t stream_out_length(void) {
+  if (stream_pooled)
+    return pool_length[STREAM_QUEUE_HEAD_ID];
+  return OUT2BC;
+}
+
+/**
+ * Move all EP2 OUT packets from the endpoint buffers to the packet pool
+ *
+ * Stops when the pool is exhausted, the remaining packets stay in the
+ * endpoint buffers (and further packets are NAKed) until
+ * stream_out_release() frees a pool buffer. Must be called from the ISR or
+ * with interrupts disabled.
+ */
+static void stream_out_fetch(void) {
+  uint8_t id;
+
+  while (!(OUT2CS & EPBSY)) {
+    id = pool_alloc();
+    if (id == POOL_NONE)
+      return;
+    pool_length[id] = OUT2BC;
+    xmemcpy_isr(pool_data[id], stream_out_half ? OUT3BUF : OUT2BUF, OUT2BC);
+    OUT2BC = 0;
+    if (stream_paired)
+      stream_out_half ^= 1;
+    stream_queue[stream_queue_tail & (POOL_COUNT-1)] = id;
+    stream_queue_tail++;
+  }
+}
+
+/**
+ * Hand the EP2 OUT buffer returned by stream_out_buffer() back to the SIE
+ * (or to the packet pool)
+ */
+void stream_out_release(void) {
+  stats_ep2_out(stream_out_length());
+  if (stream_pooled) {
+    pool_free(STREAM_QUEUE_HEAD_ID);
+    stream_queue_head++;
+    // pick up packets left in the endpoint buffers while the pool was empty
+    __critical {
+      stream_out_fetch();
+    }
+    return;
+  }
+  OUT2BC = 0;
+  if (stream_paired)
+    stream_out_half ^= 1;
+}
+
+/*****************************************************************************/
+/***  Interrupt Service Routine  *********************************************/
+/*****************************************************************************/
+
+/**
+ * Queue received EP2 OUT packets in pooled mode
+ *
+ * Called by ep2out_isr().
+ */
+void stream_out_isr(void) {
+  if (stream_pooled)
+    stream_out_fetch();
+}
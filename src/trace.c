@@ -0,0 +1,154 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "delay.h"
+#include "xmem.h"
+#include "trace.h"
+
+/**
+ * Ring of records (see trace.h)
+ *
+ * trace_head is the position of the next record, trace_count the number of
+ * records in the ring, the oldest is at trace_head - trace_count. All are
+ * changed with interrupts disabled.
+ */
+#define TRACE_RING_MASK   (TRACE_RING_SIZE - 1)
+
+static __xdata TTraceRecord trace_ring[TRACE_RING_SIZE];
+
+static uint8_t  trace_head;
+static uint8_t  trace_count;
+static uint8_t  trace_lost;          // records overwritten since last read
+static uint16_t trace_tick;          // timer_tick of the previous record
+
+/**
+ * Advance trace_head after a record was written, overwrite the oldest record
+ * if the ring is full
+ */
+#define TRACE_ADVANCE()                              \
+  do {                                               \
+    trace_head = (trace_head + 1) & TRACE_RING_MASK; \
+    if (trace_count < TRACE_RING_SIZE)               \
+      trace_count++;                                 \
+    else if (trace_lost < 255)                       \
+      trace_lost++;                                  \
+  } while (0)
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Empty the ring
+ *
+ * The first record is preceded by a TRACE_SYNC record. Must be called after
+ * timer_init() and before any interrupt is enabled.
+ */
+void trace_init(void) {
+  trace_head  = 0;
+  trace_count = 0;
+  trace_lost  = 0;
+  trace_tick  = timer_ticks() - TRACE_SYNC_MS;
+}
+
+/**
+ * Write a record with the current time
+ *
+ * This can be called from ISRs and from the main loop (see "Functions
+ * called from ISRs" in common.h). Neither timer_fine() nor a
+ * multiplication is used, both aren't reentrant.
+ *
+ * @param id   TRACE_*
+ * @param arg  depends on @a id
+ */
+#pragma save
+#pragma nooverlay
+void trace_post(uint8_t id, uint8_t arg) __critical {
+  __xdata TTraceRecord* r;
+  uint16_t tick;
+  uint16_t count;
+  uint8_t  h, l;
+
+  h = TH2;
+  l = TL2;
+  // TL2 overflowed into TH2 between the two reads
+  if (h != TH2) {
+    h = TH2;
+    l = TL2;
+  }
+  tick  = timer_tick;
+  count = (((uint16_t)h << 8) | l) - TIMER2_RELOAD;
+  // Timer 2 was reloaded, but the ISR didn't run yet
+  if (TF2 && (count < TIMER_COUNTS_PER_MS/2))
+    tick++;
+
+  // the low bits of the tick don't tell how many ms passed
+  if ((uint16_t)(tick - trace_tick) >= TRACE_SYNC_MS) {
+    r = &trace_ring[trace_head];
+    r->Id   = TRACE_SYNC;
+    r->Arg  = 0;
+    r->Time = tick;
+    TRACE_ADVANCE();
+  }
+  trace_tick = tick;
+
+  r = &trace_ring[trace_head];
+  r->Id   = id;
+  r->Arg  = arg;
+  r->Time = (tick << 13) | count;
+  TRACE_ADVANCE();
+}
+#pragma restore
+
+/**
+ * Move the oldest records to @a buf
+ *
+ * @a buf is filled with TTraceHeader followed by the records. These are
+ * removed from the ring, the remaining ones are returned by the next call.
+ *
+ * @param max  maximum number of records
+ * @return number of bytes written to @a buf
+ */
+uint8_t trace_read(__xdata uint8_t* buf, uint8_t max) {
+  __xdata TTraceHeader* h = (__xdata TTraceHeader*)buf;
+  __xdata uint8_t* dst = buf + sizeof(TTraceHeader);
+  uint8_t pos;
+  uint8_t first;
+  uint8_t n;
+
+  // ISRs must not overwrite the records while they are copied
+  __critical {
+    n = (trace_count < max) ? trace_count : max;
+    pos = (trace_head - trace_count) & TRACE_RING_MASK;
+    first = TRACE_RING_SIZE - pos;
+    if (first > n)
+      first = n;
+    xmemcpy(dst, (__xdata uint8_t*)&trace_ring[pos], first * sizeof(TTraceRecord));
+    xmemcpy(dst + first * sizeof(TTraceRecord), (__xdata uint8_t*)trace_ring,
+            (n - first) * sizeof(TTraceRecord));
+    trace_count -= n;
+    h->Count = n;
+    h->Lost  = trace_lost;
+    h->Left  = trace_count;
+    trace_lost = 0;
+  }
+  return sizeof(TTraceHeader) + n * sizeof(TTraceRecord);
+}
@@ -0,0 +1,383 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "common.h"
+#include "delay.h"
+#include "xmem.h"
+#include "uart.h"
+
+/**
+ * Rings, indexed by UART_RX(port) and UART_TX(port)
+ *
+ * The head and tail indices run freely from 0 to 255, the position within
+ * the ring is index & UART_RING_MASK. So head - tail is the level, a full
+ * ring holds UART_RING_SIZE bytes. The RX heads and TX tails are only
+ * advanced by the ISRs, the RX tails and TX heads only by the main loop.
+ *
+ * OUT7BUF, IN7BUF, OUT6BUF and IN6BUF are contiguous (see uart.h).
+ */
+#define UART_RING_MASK   (UART_RING_SIZE - 1)
+#define UART_RX(port)    (port)
+#define UART_TX(port)    (UART_COUNT + (port))
+
+static __xdata __at 0x7B40 uint8_t uart_ring[2 * UART_COUNT][UART_RING_SIZE];
+static volatile __data uint8_t    uart_head[2 * UART_COUNT];
+static volatile __data uint8_t    uart_tail[2 * UART_COUNT];
+
+#define UART_LEVEL(ring)  ((uint8_t)(uart_head[ring] - uart_tail[ring]))
+
+/**
+ * State of the serial ports, used by the ISRs
+ */
+static volatile __data uint8_t    uart_tx_busy[UART_COUNT];   // TI pending
+static volatile __data uint16_t   uart_overrun_count[UART_COUNT];
+
+/**
+ * State of the endpoints, used by uart_service()
+ */
+static uint8_t           uart_flags[UART_COUNT];        // UART_ENABLE, ...
+static volatile uint8_t  uart_in_busy[UART_COUNT];      // IN packet not sent
+static volatile uint8_t  uart_out_length[UART_COUNT];   // OUT packet received
+static uint8_t           uart_out_pos[UART_COUNT];      // bytes taken from it
+static uint8_t           uart_rx_seen[UART_COUNT];      // RX level at the last
+static deadline_t        uart_rx_idle[UART_COUNT];      // change and its timeout
+
+/// Endpoint buffers and byte count registers, EP4 for port 0, EP5 for port 1
+static __xdata uint8_t* __code uart_in_buf[UART_COUNT]  = { IN4BUF,  IN5BUF  };
+static __xdata uint8_t* __code uart_out_buf[UART_COUNT] = { OUT4BUF, OUT5BUF };
+static __xdata uint8_t* __code uart_in_bc[UART_COUNT]   = { &IN4BC,  &IN5BC  };
+static __xdata uint8_t* __code uart_out_bc[UART_COUNT]  = { &OUT4BC, &OUT5BC };
+
+/*****************************************************************************/
+/***  Driver Functions  ******************************************************/
+/*****************************************************************************/
+
+/**
+ * Initialize both UARTs (disabled) and arm EP4 OUT and EP5 OUT
+ *
+ * Must be called after io_init(), which overwrites CKCON.
+ */
+void uart_init(void) {
+  uint8_t port;
+
+  uart_divisor(UART_DIVISOR(9600));
+  for (port = 0; port < UART_COUNT; port++)
+    uart_config(port, 0);
+  uart_usb_reset();
+}
+
+/**
+ * Set the Timer 1 divisor of both ports (0 = 256)
+ *
+ * Bytes currently sent or received are garbled.
+ */
+void uart_divisor(uint8_t divisor) {
+  /* Timer 1: mode 2, 8 bit auto-reload from TH1, no interrupt */
+  TR1   = 0;
+  ET1   = 0;
+  TMOD  = (TMOD & ~(GATE1 | CT1 | M10 | M11)) | M11;
+  CKCON |= T1M;
+  TH1   = (uint8_t)(0 - divisor);
+  TL1   = (uint8_t)(0 - divisor);
+  TR1   = 1;
+}
+
+/**
+ * Enable or disable a port
+ *
+ * The contents of its rings are dropped and the overrun counter is
+ * cleared. A disabled port discards the OUT packets and its pins are
+ * standard I/O.
+ *
+ * @param port   0 or 1
+ * @param flags  UART_ENABLE, UART_DOUBLE
+ * @return false if @a port or @a flags are invalid
+ */
+bool uart_config(uint8_t port, uint8_t flags) {
+  if ((port >= UART_COUNT) || (flags & ~UART_FLAGS))
+    return false;
+
+  /* stop the port, select mode 1 */
+  if (port) {
+    ES1   = 0;
+    REN_1 = 0;
+    RI_1  = 0;
+    TI_1  = 0;
+    SM0_1 = 0;
+    SM1_1 = 1;
+    SMOD1 = (flags & UART_DOUBLE) ? 1 : 0;
+  } else {
+    ES0   = 0;
+    REN_0 = 0;
+    RI_0  = 0;
+    TI_0  = 0;
+    SM0_0 = 0;
+    SM1_0 = 1;
+    if (flags & UART_DOUBLE)
+      PCON |= SMOD0;
+    else
+      PCON &= ~SMOD0;
+  }
+  uart_head[UART_RX(port)]  = 0;
+  uart_tail[UART_RX(port)]  = 0;
+  uart_head[UART_TX(port)]  = 0;
+  uart_tail[UART_TX(port)]  = 0;
+  uart_tx_busy[port]        = 0;
+  uart_overrun_count[port]  = 0;
+  uart_rx_seen[port]        = 0;
+  uart_flags[port]          = flags;
+
+  if (port) {
+    if (flags & UART_ENABLE) {
+      PORTBCFG |= RXD1 | TXD1;
+      REN_1 = 1;
+      ES1   = 1;
+    } else {
+      PORTBCFG &= ~(RXD1 | TXD1);
+    }
+  } else {
+    if (flags & UART_ENABLE) {
+      PORTCCFG |= RXD0 | TXD0;
+      REN_0 = 1;
+      ES0   = 1;
+    } else {
+      PORTCCFG &= ~(RXD0 | TXD0);
+    }
+  }
+  return true;
+}
+
+/**
+ * Copy @a length bytes from the RX ring of @a port into its EP IN buffer
+ */
+static void uart_ring_read(uint8_t port, uint8_t length) {
+  __xdata uint8_t* ring = uart_ring[UART_RX(port)];
+  uint8_t tail  = uart_tail[UART_RX(port)] & UART_RING_MASK;
+  uint8_t first = UART_RING_SIZE - tail;
+
+  // copy in up to two parts around the wrap around
+  if (first > length)
+    first = length;
+  xmemcpy(uart_in_buf[port], ring + tail, first);
+  xmemcpy(uart_in_buf[port] + first, ring, length - first);
+}
+
+/**
+ * Copy @a length bytes from the EP OUT buffer of @a port into its TX ring
+ */
+static void uart_ring_write(uint8_t port, uint8_t length) {
+  __xdata uint8_t* ring = uart_ring[UART_TX(port)];
+  __xdata uint8_t* src  = uart_out_buf[port] + uart_out_pos[port];
+  uint8_t head  = uart_head[UART_TX(port)] & UART_RING_MASK;
+  uint8_t first = UART_RING_SIZE - head;
+
+  if (first > length)
+    first = length;
+  xmemcpy(ring + head, src, first);
+  xmemcpy(ring, src + first, length - first);
+}
+
+/**
+ * Send the RX ring of @a port as IN packet when it is full or idle
+ */
+static void uart_receive(uint8_t port) {
+  uint8_t level = UART_LEVEL(UART_RX(port));
+
+  // every received byte restarts the idle timeout
+  if (level != uart_rx_seen[port]) {
+    uart_rx_seen[port] = level;
+    uart_rx_idle[port] = deadline_set(UART_IDLE_MS);
+  }
+  if (!level || uart_in_busy[port])
+    return;
+  if ((level < UART_RING_SIZE) && !deadline_expired(uart_rx_idle[port]))
+    return;
+
+  uart_ring_read(port, level);
+  // the ISR must not see the free space before the data was copied
+  uart_tail[UART_RX(port)] += level;
+  uart_rx_seen[port] = 0;
+  uart_in_busy[port] = 1;
+  *uart_in_bc[port]  = level;
+}
+
+/**
+ * Move the OUT packet of @a port into its TX ring and start the
+ * transmission
+ */
+static void uart_transmit(uint8_t port) {
+  uint8_t length = uart_out_length[port];
+  uint8_t n;
+
+  if (length) {
+    n = length - uart_out_pos[port];
+    if (n > UART_RING_SIZE - UART_LEVEL(UART_TX(port)))
+      n = UART_RING_SIZE - UART_LEVEL(UART_TX(port));
+    uart_ring_write(port, n);
+    uart_head[UART_TX(port)] += n;
+    uart_out_pos[port]       += n;
+    if (uart_out_pos[port] == length) {
+      // the whole packet was taken, re-arm the endpoint
+      uart_out_pos[port]    = 0;
+      uart_out_length[port] = 0;
+      *uart_out_bc[port]    = 0;
+    }
+  }
+  // the ISR sends the first byte, it clears uart_tx_busy when the ring
+  // runs empty
+  if (!uart_tx_busy[port] && UART_LEVEL(UART_TX(port))) {
+    uart_tx_busy[port] = 1;
+    if (port)
+      TI_1 = 1;
+    else
+      TI_0 = 1;
+  }
+}
+
+/**
+ * Exchange the data between the rings and the endpoints of both ports
+ *
+ * This is executed from command_poll(). It doesn't need an event of its
+ * own, because the serial, the endpoint and the Timer 2 interrupts all end
+ * the idle mode of command_loop().
+ */
+void uart_service(void) {
+  uint8_t port;
+
+  for (port = 0; port < UART_COUNT; port++) {
+    if (uart_flags[port] & UART_ENABLE) {
+      uart_receive(port);
+      uart_transmit(port);
+    } else if (uart_out_length[port]) {
+      uart_out_pos[port]    = 0;
+      uart_out_length[port] = 0;
+      *uart_out_bc[port]    = 0;
+    }
+  }
+}
+
+/**
+ * Return the number of bytes in the RX ring of @a port
+ */
+uint8_t uart_rx_level(uint8_t port) {
+  return UART_LEVEL(UART_RX(port));
+}
+
+/**
+ * Return the number of bytes in the TX ring of @a port
+ */
+uint8_t uart_tx_level(uint8_t port) {
+  return UART_LEVEL(UART_TX(port));
+}
+
+/**
+ * Return the number of bytes lost because the RX ring of @a port was full
+ * since uart_config() (saturates at 0xFFFF)
+ */
+uint16_t uart_overruns(uint8_t port) {
+  uint16_t n;
+
+  __critical {
+    n = uart_overrun_count[port];
+  }
+  return n;
+}
+
+/*****************************************************************************/
+/***  Endpoint Handlers  *****************************************************/
+/*****************************************************************************/
+
+/**
+ * EP4/EP5 IN packet of @a port was sent
+ *
+ * Called by ep4in_isr() and ep5in_isr().
+ */
+void uart_in_isr(uint8_t port) {
+  uart_in_busy[port] = 0;
+}
+
+/**
+ * EP4/EP5 OUT packet of @a port was received
+ *
+ * Called by ep4out_isr() and ep5out_isr(). The packet stays in the endpoint
+ * buffer until uart_service() has taken it, a zero length packet is
+ * dropped right away.
+ */
+void uart_out_isr(uint8_t port) {
+  uint8_t length = *uart_out_bc[port];
+
+  if (length)
+    uart_out_length[port] = length;
+  else
+    *uart_out_bc[port] = 0;
+}
+
+/**
+ * Forget the packets in the endpoints, after they were reset (and the OUT
+ * endpoints re-armed) by a SET_INTERFACE request, or arm them initially
+ */
+void uart_usb_reset(void) {
+  uint8_t port;
+
+  for (port = 0; port < UART_COUNT; port++) {
+    uart_in_busy[port]    = 0;
+    uart_out_length[port] = 0;
+    uart_out_pos[port]    = 0;
+    *uart_out_bc[port]    = 0;
+  }
+}
+
+/*****************************************************************************/
+/***  Interrupt Service Routines  ********************************************/
+/*****************************************************************************/
+
+/*
+ * Serial port ISR: a received byte is put into the RX ring or counted as
+ * overrun, after a sent byte (or when uart_transmit() sets TI) the next
+ * one is taken from the TX ring. RI and TI are cleared by software.
+ */
+#define UART_ISR(name, vector, port, RI, TI, SBUF)                    \
+  void name(void) __interrupt vector {                                \
+    uint8_t i;                                                        \
+    if (RI) {                                                         \
+      RI = 0;                                                         \
+      i  = uart_head[UART_RX(port)];                                  \
+      if ((uint8_t)(i - uart_tail[UART_RX(port)]) < UART_RING_SIZE) { \
+        uart_ring[UART_RX(port)][i & UART_RING_MASK] = SBUF;          \
+        uart_head[UART_RX(port)] = i + 1;                             \
+      } else if (uart_overrun_count[port] != 0xFFFF) {                \
+        uart_overrun_count[port]++;                                   \
+      }                                                               \
+    }                                                                 \
+    if (TI) {                                                         \
+      TI = 0;                                                         \
+      i  = uart_tail[UART_TX(port)];                                  \
+      if (i != uart_head[UART_TX(port)]) {                            \
+        SBUF = uart_ring[UART_TX(port)][i & UART_RING_MASK];          \
+        SBUF_WRITTEN(port);                                           \
+        uart_tail[UART_TX(port)] = i + 1;                             \
+      } else {                                                        \
+        uart_tx_busy[port] = 0;                                       \
+      }                                                               \
+    }                                                                 \
+  }
+
+UART_ISR(uart0_isr, SI0_VECTOR, 0, RI_0, TI_0, SBUF0)
+UART_ISR(uart1_isr, SI1_VECTOR, 1, RI_1, TI_1, SBUF1)
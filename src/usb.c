@@ -28,10 +28,20 @@
  * Therefore, we do not have to support the Set Configuration USB request.
  */
 
+#include <stddef.h>
+
 #include "usb.h"
 #include "common.h"
 #include "delay.h"
 #include "io.h"
+#include "profile.h"
+#include "stream.h"
+#include "event.h"
+#include "xmem.h"
+#include "uart.h"
+#include "notify.h"
+#include "stats.h"
+#include "trace.h"
 
 /// USB idVendor value
 #define ID_VENDOR   0xFFF0
@@ -42,17 +52,75 @@
 
 /* Also update external declarations in "include/usb.h" if making changes to
  * these variables! */
-volatile bool Semaphore_Command = 0;
-volatile bool Semaphore_EP2_out = 0;
-volatile bool Semaphore_EP2_in  = 0;
-
 volatile __xdata __at 0x7FE8 struct setup_data setup_data;
 
-/* Define number of endpoints (except Control Endpoint 0) in a central place.
- * Be sure to include the neccessary endpoint descriptors! */
-#define NUM_ENDPOINTS  2
+/*
+ * Endpoint table
+ *
+ * Every endpoint except EP0 is listed exactly once as
+ *
+ *   EP(arg, number, direction, type, wMaxPacketSize, bInterval, handler)
+ *
+ * with direction IN or OUT and type BULK or INTERRUPT. The handler is called
+ * from the endpoint's ISR when a transfer has finished. The endpoint
+ * descriptors, the valid and interrupt enable masks, the CS register lookup,
+ * the ISRs, the SET_INTERFACE reset and the IN-Bulk-NAK notification are
+ * all generated from this table.
+ * arg is passed through to EP() by the generators.
+ *
+ * EP3 must not be listed, because EP2 is paired with it for
+ * double-buffering (see stream.h). EP6 and EP7 must not be listed, because
+ * their buffers hold the UART rings (see uart.h). EP1 OUT must not be
+ * listed, because its buffer holds the notification ring (see notify.h).
+ * EP1 IN is only listed with NOTIFY, EP4 and EP5 only with UART.
+ */
+#ifdef NOTIFY
+#define USB_NOTIFY_ENDPOINTS(EP, arg)                    \
+  EP(arg, 1, IN,  INTERRUPT, 64, 1, usb_ep1in_handler)
+#else
+#define USB_NOTIFY_ENDPOINTS(EP, arg)
+#endif
+
+#ifdef UART
+#define USB_UART_ENDPOINTS(EP, arg)                      \
+  EP(arg, 4, IN,  BULK, 64, 0, usb_ep4in_handler)        \
+  EP(arg, 4, OUT, BULK, 64, 0, usb_ep4out_handler)       \
+  EP(arg, 5, IN,  BULK, 64, 0, usb_ep5in_handler)        \
+  EP(arg, 5, OUT, BULK, 64, 0, usb_ep5out_handler)
+#else
+#define USB_UART_ENDPOINTS(EP, arg)
+#endif
+
+#define USB_ENDPOINTS(EP, arg)                           \
+  USB_NOTIFY_ENDPOINTS(EP, arg)                          \
+  EP(arg, 2, IN,  BULK, 64, 0, usb_ep2in_handler)        \
+  EP(arg, 2, OUT, BULK, 64, 0, usb_ep2out_handler)       \
+  USB_UART_ENDPOINTS(EP, arg)
+
+/* Number of endpoints (except Control Endpoint 0) */
+#define EP_COUNT(arg, num, dir, type, size, interval, handler)  + 1
+#define NUM_ENDPOINTS  (0 USB_ENDPOINTS(EP_COUNT, 0))
+
+/* Bit masks of the listed endpoints for IN07VAL/IN07IEN and
+ * OUT07VAL/OUT07IEN */
+#define EP_BIT(dirsel, num, dir, type, size, interval, handler) \
+  | ((USB_DIR_##dir == (dirsel)) ? bmBit##num : 0)
+#define USB_IN_ENDPOINTS   (0 USB_ENDPOINTS(EP_BIT, USB_DIR_IN))
+#define USB_OUT_ENDPOINTS  (0 USB_ENDPOINTS(EP_BIT, USB_DIR_OUT))
+#define EP_VALID(num, dir) (USB_##dir##_ENDPOINTS & bmBit##num)
+
+/* Define number of string descriptors in a central place. Be sure to include
+ * the neccessary descriptors in struct usb_descriptors! */
+#define NUM_STRINGS    5
 
 /*
+ * All descriptors are stored in one contiguous block (struct usb_descriptors)
+ * in CODE memory. usb_descriptor_offsets[] holds the offset of every
+ * descriptor within this block, so a GET_DESCRIPTOR request is served with a
+ * single table lookup. The configuration descriptor is directly followed by
+ * its interface and endpoint descriptors (struct usb_config1), therefore
+ * wTotalLength is simply the size of that struct.
+ *
  * Normally, we would initialize the descriptor structures in C99 style:
  *
  * __code usb_device_descriptor_t device_descriptor = {
@@ -66,148 +134,477 @@ volatile __xdata __at 0x7FE8 struct setup_data setup_data;
  * old-fashioned way...
  */
 
-__code struct usb_device_descriptor device_descriptor = {
-  /* .bLength = */             sizeof(struct usb_device_descriptor),
-  /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_DEVICE,
-  /* .bcdUSB = */              0x0110, /* BCD: 01.10 (Version 1.1 USB spec) */
-  /* .bDeviceClass = */        USB_CLASS_VENDOR_SPEC,
-  /* .bDeviceSubClass = */     USB_CLASS_VENDOR_SPEC,
-  /* .bDeviceProtocol = */     USB_PROTOCOL_VENDOR_SPEC,
-  /* .bMaxPacketSize0 = */     64,
-  /* .idVendor = */            ID_VENDOR,
-  /* .idProduct = */           ID_PRODUCT,
-  /* .bcdDevice = */           BCD_DEVICE,
-  /* .iManufacturer = */       1,
-  /* .iProduct = */            2,
-  /* .iSerialNumber = */       3,
-  /* .bNumConfigurations = */  1
-};
-
-/* WARNING: ALL config, interface and endpoint descriptors MUST be adjacent! */
-
-__code struct usb_config_descriptor config_descriptor = {
-  /* .bLength = */             sizeof(struct usb_config_descriptor),
-  /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_CONFIGURATION,
-  /* .wTotalLength = */        sizeof(struct usb_config_descriptor) +
-                               sizeof(struct usb_interface_descriptor) +
-                               (NUM_ENDPOINTS *
-                               sizeof(struct usb_endpoint_descriptor)),
-  /* .bNumInterfaces = */      1,
-  /* .bConfigurationValue = */ 1,
-  /* .iConfiguration = */      4,     /* String describing this configuration */
-  /* .bmAttributes = */        USB_CONFIG_ATTRIB_RESERVED,  /* Only MSB set according to USB spec */
-  /* .MaxPower = */            50     /* 50*2 = 100 mA */
+/** Configuration 1 with all its interface and endpoint descriptors */
+struct usb_config1 {
+  struct usb_config_descriptor    config;
+  struct usb_interface_descriptor interface00;
+  struct usb_endpoint_descriptor  endpoints[NUM_ENDPOINTS];
 };
 
-__code struct usb_interface_descriptor interface_descriptor00 = {
-  /* .bLength = */             sizeof(struct usb_interface_descriptor),
-  /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_INTERFACE,
-  /* .bInterfaceNumber = */    0,
-  /* .bAlternateSetting = */   0,
-  /* .bNumEndpoints = */       NUM_ENDPOINTS,
-  /* .bInterfaceClass = */     USB_CLASS_VENDOR_SPEC,
-  /* .bInterfaceSubclass = */  USB_CLASS_VENDOR_SPEC,
-  /* .bInterfaceProtocol = */  USB_PROTOCOL_VENDOR_SPEC,
-  /* .iInterface = */          5
+/** All descriptors of this device */
+struct usb_descriptors {
+  struct usb_device_descriptor    device;
+  struct usb_config1              config1;
+  STR_DESCR_T( 1)                 language;
+  STR_DESCR_T(13)                 strManufacturer;
+  STR_DESCR_T(15)                 strProduct;
+  STR_DESCR_T( 6)                 strSerialNumber;
+  STR_DESCR_T( 8)                 strConfigDescr;
+  STR_DESCR_T(11)                 strInterface;
 };
 
-__code struct usb_endpoint_descriptor Bulk_EP2_IN_Endpoint_Descriptor = {
-  /* .bLength = */             sizeof(struct usb_endpoint_descriptor),
-  /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_ENDPOINT,
-  /* .bEndpointAddress = */    2 | USB_DIR_IN,
-  /* .bmAttributes = */        USB_ENDPOINT_TYPE_BULK,
-  /* .wMaxPacketSize = */      64,
-  /* .bInterval = */           0
+/* Endpoint descriptor of one entry of USB_ENDPOINTS */
+#define EP_DESCRIPTOR(arg, num, dir, type, size, interval, handler) \
+  {                                                                 \
+    /* .bLength = */             sizeof(struct usb_endpoint_descriptor), \
+    /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_ENDPOINT,     \
+    /* .bEndpointAddress = */    (num) | USB_DIR_##dir,            \
+    /* .bmAttributes = */        USB_ENDPOINT_TYPE_##type,         \
+    /* .wMaxPacketSize = */      (size),                           \
+    /* .bInterval = */           (interval)                        \
+  },
+
+__code struct usb_descriptors usb_descriptors = {
+  /* .device = */ {
+    /* .bLength = */             sizeof(struct usb_device_descriptor),
+    /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_DEVICE,
+    /* .bcdUSB = */              0x0110, /* BCD: 01.10 (Version 1.1 USB spec) */
+    /* .bDeviceClass = */        USB_CLASS_VENDOR_SPEC,
+    /* .bDeviceSubClass = */     USB_CLASS_VENDOR_SPEC,
+    /* .bDeviceProtocol = */     USB_PROTOCOL_VENDOR_SPEC,
+    /* .bMaxPacketSize0 = */     64,
+    /* .idVendor = */            ID_VENDOR,
+    /* .idProduct = */           ID_PRODUCT,
+    /* .bcdDevice = */           BCD_DEVICE,
+    /* .iManufacturer = */       1,
+    /* .iProduct = */            2,
+    /* .iSerialNumber = */       3,
+    /* .bNumConfigurations = */  1
+  },
+  /* .config1 = */ {
+    /* .config = */ {
+      /* .bLength = */             sizeof(struct usb_config_descriptor),
+      /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_CONFIGURATION,
+      /* .wTotalLength = */        sizeof(struct usb_config1),
+      /* .bNumInterfaces = */      1,
+      /* .bConfigurationValue = */ 1,
+      /* .iConfiguration = */      4,     /* String describing this configuration */
+      /* .bmAttributes = */        USB_CONFIG_ATTRIB_RESERVED,  /* Only MSB set according to USB spec */
+      /* .MaxPower = */            50     /* 50*2 = 100 mA */
+    },
+    /* .interface00 = */ {
+      /* .bLength = */             sizeof(struct usb_interface_descriptor),
+      /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_INTERFACE,
+      /* .bInterfaceNumber = */    0,
+      /* .bAlternateSetting = */   0,
+      /* .bNumEndpoints = */       NUM_ENDPOINTS,
+      /* .bInterfaceClass = */     USB_CLASS_VENDOR_SPEC,
+      /* .bInterfaceSubclass = */  USB_CLASS_VENDOR_SPEC,
+      /* .bInterfaceProtocol = */  USB_PROTOCOL_VENDOR_SPEC,
+      /* .iInterface = */          5
+    },
+    /* .endpoints = */ {
+      USB_ENDPOINTS(EP_DESCRIPTOR, 0)
+    }
+  },
+  /* String Descriptors, index 0 is the list of supported languages */
+  /* .language = */        STR_DESCR( 1, USB_LANG_ENGLISH_US),
+  /* .strManufacturer = */ STR_DESCR(13, 'J','o','h','a','n','n',' ','G','l','a','s','e','r'),
+  /* .strProduct = */      STR_DESCR(15, 'E','Z','-','U','S','B',' ','F','i','r','m','w','a','r','e'),
+  /* .strSerialNumber = */ STR_DESCR( 6, '0','0','0','0','0','1'),
+  /* .strConfigDescr = */  STR_DESCR( 8, 'M','y','C','o','n','f','i','g'),
+  /* .strInterface = */    STR_DESCR(11, 'M','y','I','n','t','e','r','f','a','c','e')
 };
 
-__code struct usb_endpoint_descriptor Bulk_EP2_OUT_Endpoint_Descriptor = {
-  /* .bLength = */             sizeof(struct usb_endpoint_descriptor),
-  /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_ENDPOINT,
-  /* .bEndpointAddress = */    2 | USB_DIR_OUT,
-  /* .bmAttributes = */        USB_ENDPOINT_TYPE_BULK,
-  /* .wMaxPacketSize = */      64,
-  /* .bInterval = */           0
+/* The offsets in usb_descriptor_offsets[] are 8 bit values */
+typedef char usb_descriptors_too_large[(sizeof(struct usb_descriptors) <= 256) ? 1 : -1];
+
+#define DESCR_OFFSET(field)   offsetof(struct usb_descriptors, field)
+
+/* Offsets of all descriptors within usb_descriptors */
+static __code uint8_t usb_descriptor_offsets[] = {
+  DESCR_OFFSET(device),
+  DESCR_OFFSET(config1),
+  DESCR_OFFSET(language),
+  DESCR_OFFSET(strManufacturer),
+  DESCR_OFFSET(strProduct),
+  DESCR_OFFSET(strSerialNumber),
+  DESCR_OFFSET(strConfigDescr),
+  DESCR_OFFSET(strInterface)
 };
 
-__code struct usb_language_descriptor language_descriptor = {
-  /* .bLength =  */            4,
-  /* .bDescriptorType = */     USB_DESCRIPTOR_TYPE_STRING,
-  /* .wLANGID = */             {USB_LANG_ENGLISH_US}
+/* First entry in usb_descriptor_offsets[] and number of descriptors for
+ * every descriptor type (starting with USB_DESCRIPTOR_TYPE_DEVICE) */
+static __code struct {
+  uint8_t first;
+  uint8_t count;
+} usb_descriptor_types[] = {
+  { 0, 1 },                 /* USB_DESCRIPTOR_TYPE_DEVICE */
+  { 1, 1 },                 /* USB_DESCRIPTOR_TYPE_CONFIGURATION */
+  { 2, NUM_STRINGS + 1 }    /* USB_DESCRIPTOR_TYPE_STRING */
 };
 
-/* String Descriptors */
-
-__code struct usb_string_descriptor strManufacturer  = STR_DESCR(13, 'J','o','h','a','n','n',' ','G','l','a','s','e','r');
-
-__code struct usb_string_descriptor strProduct       = STR_DESCR(15, 'E','Z','-','U','S','B',' ','F','i','r','m','w','a','r','e');
-
-__code struct usb_string_descriptor strSerialNumber  = STR_DESCR( 6, '0','0','0','0','0','1');
-
-__code struct usb_string_descriptor strConfigDescr   = STR_DESCR( 8, 'M','y','C','o','n','f','i','g');
-
-__code struct usb_string_descriptor strInterface     = STR_DESCR(11, 'M','y','I','n','t','e','r','f','a','c','e');
+/**
+ * Control transfers of vendor requests
+ *
+ * Vendor requests are executed by the main loop (see HandleCmd()), so
+ * sudav_isr() leaves their status stage NAKed (HSNAK) until
+ * usb_ep0_complete() releases it. Otherwise the host would see e.g. an OUT
+ * request as finished before the firmware has even looked at it. Every
+ * SETUP packet gets a new tag, a completion with the tag of a transfer
+ * aborted by the host (by a new SETUP packet) is dropped.
+ *
+ * The data stage of up to USB_EP0_BUFFER_SIZE bytes is passed through
+ * usb_ep0_buffer: ep0out_isr() collects the OUT packets before
+ * EVENT_COMMAND is posted, ep0in_isr() sends the IN response packet by
+ * packet and releases the status stage after the last one. A deferred
+ * request which still reads its data from usb_ep0_buffer locks it with
+ * usb_ep0_lock(), further vendor requests are stalled until then, even if
+ * the host has aborted the deferred one.
+ */
+__xdata uint8_t usb_ep0_buffer[USB_EP0_BUFFER_SIZE];
 
-/* Table containing pointers to string descriptors */
-__code struct usb_string_descriptor* __code en_string_descriptors[5] = {
-  &strManufacturer,
-  &strProduct,
-  &strSerialNumber,
-  &strConfigDescr,
-  &strInterface
+enum {
+  USB_EP0_IDLE,       // standard request or status stage released
+  USB_EP0_RECEIVE,    // OUT data stage into usb_ep0_buffer
+  USB_EP0_EXECUTE,    // waiting for usb_ep0_complete()
+  USB_EP0_SEND        // IN data stage from usb_ep0_ptr
 };
 
+static volatile uint8_t usb_ep0_setups;      // tag of the current transfer
+static volatile uint8_t usb_ep0_state;
+static __xdata uint8_t* usb_ep0_ptr;         // next byte to send/receive
+static uint8_t          usb_ep0_remaining;   // bytes left in the data stage
+static __bit            usb_ep0_zlp;         // end a full last IN packet with
+                                             // a zero length packet
+static volatile __bit   usb_ep0_locked;      // usb_ep0_buffer still in use
+
 static void usb_handle_setup_data(void);
 
 void sudav_isr(void) __interrupt SUDAV_ISR {
+  PROFILE_ENTER(PROFILE_SUDAV_ISR);
+  STATS_ISR_ENTER();
   CLEAR_IRQ();
 
+  usb_ep0_setups++;
+  stats.Setups++;
+  TRACE_POST(TRACE_SETUP, setup_data.bRequest);
+  usb_ep0_state = USB_EP0_IDLE;
   usb_handle_setup_data();
 
   USBIRQ = SUDAVIR;
-  EP0CS |= HSNAK;
+  if (usb_ep0_state == USB_EP0_IDLE)
+    EP0CS |= HSNAK;
+  STATS_ISR_EXIT();
+  PROFILE_EXIT(PROFILE_SUDAV_ISR);
 }
 
 void sof_isr(void)      __interrupt SOF_ISR      { }
 void sutok_isr(void)    __interrupt SUTOK_ISR    { }
 void suspend_isr(void)  __interrupt SUSPEND_ISR  { }
 void usbreset_isr(void) __interrupt USBRESET_ISR { }
-void ibn_isr(void)      __interrupt IBN_ISR      { }
 
-void ep0in_isr(void)    __interrupt EP0IN_ISR    { }
-void ep0out_isr(void)   __interrupt EP0OUT_ISR   { }
-void ep1in_isr(void)    __interrupt EP1IN_ISR    { }
-void ep1out_isr(void)   __interrupt EP1OUT_ISR   { }
+/*****************************************************************************/
+/***  IN-Bulk-NAK  ***********************************************************/
+/*****************************************************************************/
+
+/*
+ * The SIE requests the IBN interrupt when it NAKs an IN token because the
+ * endpoint has no armed buffer, i.e. the host polled an empty endpoint.
+ * ibn_isr() counts this per endpoint and disables the endpoint's IBN
+ * interrupt until its next packet was sent (see USB_EP_ISR()). A host
+ * polling an idle endpoint therefore costs one interrupt per packet instead
+ * of one per IN token, and the counts tell how often the host was waiting
+ * for the device.
+ *
+ * An endpoint with a producer (usb_ibn_register()) generates its data
+ * lazily: EVENT_IBN calls the producer from the main loop when the host
+ * asks, which fills and arms the IN buffer just in time instead of keeping
+ * it filled ahead. If the producer had nothing to send, the next NAK calls
+ * it again.
+ */
+
+/* IN endpoints of USB_ENDPOINTS with IBN notification (IN1 .. IN6) */
+#define USB_IBN_ENDPOINTS  (USB_IN_ENDPOINTS & 0x7E)
+
+/* Watch for the next NAK of the IN endpoint(s) @a bits */
+#define USB_IBN_WATCH(bits)  do { IRQ_CLEAR(IBNIRQ, bits); IBNIEN |= (bits); } while (0)
+
+static __xdata uint16_t           usb_ibn_count[USB_IBN_COUNT];
+static __xdata usb_ibn_producer_t usb_ibn_producer[USB_IBN_COUNT];
+static volatile uint8_t           usb_ibn_lazy;     // endpoints with producer
+static volatile uint8_t           usb_ibn_pending;  // producers to call
+
+void ibn_isr(void)      __interrupt IBN_ISR {
+  uint8_t naks;
+  uint8_t i;
+
+  STATS_ISR_ENTER();
+  CLEAR_IRQ();
+  naks    = IBNIRQ & IBNIEN;
+  IBNIEN &= ~naks;
+  IRQ_CLEAR(IBNIRQ, naks);
+  USBIRQ  = IBNIR;
+
+  for (i = 0; i < USB_IBN_COUNT; i++)
+    if ((naks & (IN1IBN << i)) && (usb_ibn_count[i] != 0xFFFF))
+      usb_ibn_count[i]++;
+
+  naks &= usb_ibn_lazy;
+  if (naks) {
+    usb_ibn_pending |= naks;
+    EVENT_POST(ibn);
+  }
+  STATS_ISR_EXIT();
+}
 
 /**
- * EP2 IN: called after the transfer from uC->Host has finished: we sent data
+ * Call the producers of the NAKed endpoints
+ *
+ * This function is the handler of EVENT_IBN (see usb_init()).
+ */
+static void usb_ibn_service(void) {
+  uint8_t pending;
+  uint8_t i;
+
+  __critical {
+    pending = usb_ibn_pending;
+    usb_ibn_pending = 0;
+  }
+  for (i = 0; i < USB_IBN_COUNT; i++) {
+    if (!(pending & (IN1IBN << i)) || !usb_ibn_producer[i])
+      continue;
+    if (!usb_ibn_producer[i]()) {
+      __critical {
+        USB_IBN_WATCH(IN1IBN << i);
+      }
+    }
+  }
+}
+
+/**
+ * Produce the data of IN endpoint @a ep (1 .. 6) on demand
+ *
+ * @a producer is called from the main loop when the host found the endpoint
+ * empty, it has to fill and arm the IN buffer. NULL returns the endpoint to
+ * plain NAK counting. The NAK notification is enabled again, so this is
+ * also the way to restart it after the endpoint's buffers were reset.
+ */
+void usb_ibn_register(uint8_t ep, usb_ibn_producer_t producer) {
+  uint8_t bit = IN1IBN << (ep - 1);
+
+  __critical {
+    usb_ibn_producer[ep - 1] = producer;
+    if (producer)
+      usb_ibn_lazy |= bit;
+    else
+      usb_ibn_lazy &= ~bit;
+    usb_ibn_pending &= ~bit;
+    USB_IBN_WATCH(bit & USB_IBN_ENDPOINTS);
+  }
+}
+
+/**
+ * Return how often IN endpoint @a ep (1 .. 6) was found empty by the host
+ *
+ * Each packet is counted at most once, the count saturates at 65535.
+ */
+uint16_t usb_ibn_naks(uint8_t ep) {
+  uint16_t n;
+
+  __critical {
+    n = usb_ibn_count[ep - 1];
+  }
+  return n;
+}
+
+/**
+ * Reset the NAK counts of all endpoints
+ */
+void usb_ibn_clear(void) {
+  uint8_t i;
+
+  __critical {
+    for (i = 0; i < USB_IBN_COUNT; i++)
+      usb_ibn_count[i] = 0;
+  }
+}
+
+/**
+ * Arm the next packet of the IN data stage
+ *
+ * Releases the status stage after the last packet. Called with interrupts
+ * disabled.
+ */
+static void usb_ep0_send(void) {
+  uint8_t n;
+
+  n = (usb_ep0_remaining > 64) ? 64 : usb_ep0_remaining;
+  xmemcpy_isr(IN0BUF, usb_ep0_ptr, n);
+  IN0BC = n;
+  usb_ep0_ptr       += n;
+  usb_ep0_remaining -= n;
+  // the host ends the data stage after wLength bytes or a short packet
+  if (!usb_ep0_remaining && ((n < 64) || !usb_ep0_zlp)) {
+    usb_ep0_state = USB_EP0_IDLE;
+    EP0CS |= HSNAK;
+  }
+}
+
+/**
+ * EP0 IN: the host has read a packet of the data stage
  */
-void ep2in_isr(void)    __interrupt EP2IN_ISR { 
-  Semaphore_EP2_in = 1;
+void ep0in_isr(void)    __interrupt EP0IN_ISR {
+  PROFILE_ENTER(PROFILE_EP0_ISR);
+  STATS_ISR_ENTER();
+  TRACE_POST(TRACE_EP_IN, 0);
+  if (usb_ep0_state == USB_EP0_SEND)
+    usb_ep0_send();
+  CLEAR_IRQ();
+  IN07IRQ = bmBit0;
+  STATS_ISR_EXIT();
+  PROFILE_EXIT(PROFILE_EP0_ISR);
+}
 
+/**
+ * EP0 OUT: a packet of the data stage was received
+ *
+ * The request is executed when wLength bytes or a short packet arrived.
+ */
+void ep0out_isr(void)   __interrupt EP0OUT_ISR {
+  uint8_t n;
+
+  PROFILE_ENTER(PROFILE_EP0_ISR);
+  STATS_ISR_ENTER();
+  TRACE_POST(TRACE_EP_OUT, 0);
+  if (usb_ep0_state == USB_EP0_RECEIVE) {
+    n = OUT0BC;
+    if (n > usb_ep0_remaining)
+      n = usb_ep0_remaining;
+    xmemcpy_isr(usb_ep0_ptr, OUT0BUF, n);
+    usb_ep0_ptr       += n;
+    usb_ep0_remaining -= n;
+    if (usb_ep0_remaining && (n == 64)) {
+      OUT0BC = 0;             // arm EP0 OUT for the next packet
+    } else {
+      usb_ep0_state = USB_EP0_EXECUTE;
+      EVENT_POST(command);
+    }
+  }
   CLEAR_IRQ();
-  IN07IRQ = IN2IR;     // Clear OUT2 IRQ
+  OUT07IRQ = bmBit0;
+  STATS_ISR_EXIT();
+  PROFILE_EXIT(PROFILE_EP0_ISR);
+}
+
+/*****************************************************************************/
+/***  Endpoint ISRs  *********************************************************/
+/*****************************************************************************/
+
+#ifdef NOTIFY
+/**
+ * EP1 IN: the host has read a packet of notification records (see notify.h)
+ */
+static void usb_ep1in_handler(void) {
+  notify_in_isr();
+}
+#endif
+
+/**
+ * EP2 IN: called after the transfer from uC->Host has finished: we sent data
+ */
+static void usb_ep2in_handler(void) {
+  EVENT_POST(ep2_in);
 }
 
 /**
  * EP2 OUT: called after the transfer from Host->uC has finished: we got data
  */
-void ep2out_isr(void)   __interrupt EP2OUT_ISR {
-  Semaphore_EP2_out = 1;
+static void usb_ep2out_handler(void) {
+  stream_out_isr();
+  EVENT_POST(ep2_out);
+}
 
-  CLEAR_IRQ();
-  OUT07IRQ = OUT2IR;    // Clear OUT2 IRQ
+#ifdef UART
+/**
+ * EP4/EP5 IN and OUT: bridge to serial port 0/1 (see uart.h)
+ */
+static void usb_ep4in_handler(void) {
+  uart_in_isr(0);
 }
 
-void ep3in_isr(void)    __interrupt EP3IN_ISR    { }
-void ep3out_isr(void)   __interrupt EP3OUT_ISR   { }
-void ep4in_isr(void)    __interrupt EP4IN_ISR    { }
-void ep4out_isr(void)   __interrupt EP4OUT_ISR   { }
-void ep5in_isr(void)    __interrupt EP5IN_ISR    { }
-void ep5out_isr(void)   __interrupt EP5OUT_ISR   { }
-void ep6in_isr(void)    __interrupt EP6IN_ISR    { }
-void ep6out_isr(void)   __interrupt EP6OUT_ISR   { }
-void ep7in_isr(void)    __interrupt EP7IN_ISR    { }
-void ep7out_isr(void)   __interrupt EP7OUT_ISR   { }
+static void usb_ep4out_handler(void) {
+  uart_out_isr(0);
+}
+
+static void usb_ep5in_handler(void) {
+  uart_in_isr(1);
+}
+
+static void usb_ep5out_handler(void) {
+  uart_out_isr(1);
+}
+#endif
+
+typedef void (*usb_ep_handler_t)(void);
+
+/* Index of an endpoint in 16 entry tables: OUT0..OUT7, IN0..IN7 */
+#define EP_SLOT(num, dirbits)  ((num) | ((dirbits) >> 4))
+
+/* Handler of the endpoint in slot @a slot, evaluated at compile time to a
+ * conditional expression "slot == 2 ? usb_ep2in_handler : ... : NULL" */
+#define EP_SELECT(slot, num, dir, type, size, interval, handler) \
+  (EP_SLOT(num, USB_DIR_##dir) == (slot)) ? handler :
+#define EP_HANDLER(slot)  (USB_ENDPOINTS(EP_SELECT, slot) (usb_ep_handler_t)NULL)
+
+/* After an IN packet was sent, watch for the host finding the endpoint
+ * empty again (see ibn_isr()) */
+#define EP_SENT_IN(num)   if (USB_IBN_ENDPOINTS & bmBit##num) \
+                            USB_IBN_WATCH(bmBit##num)
+#define EP_SENT_OUT(num)
+
+/*
+ * Every slot of the autovector jump table (USBJmpTb.a51) needs an ISR. The
+ * ISR of a listed endpoint calls its handler directly, all other ISRs only
+ * clear their (never enabled) interrupt request.
+ */
+#define USB_EP_ISR(name, num, dir)                     \
+  void name(void) __interrupt {                        \
+    STATS_ISR_ENTER();                                 \
+    TRACE_POST(TRACE_EP_##dir, num);                   \
+    if (EP_VALID(num, dir))                            \
+      EP_HANDLER(EP_SLOT(num, USB_DIR_##dir))();       \
+    EP_SENT_##dir(num);                                \
+    CLEAR_IRQ();                                       \
+    dir##07IRQ = bmBit##num;                           \
+    STATS_ISR_EXIT();                                  \
+  }
+
+USB_EP_ISR(ep1in_isr,  1, IN)
+USB_EP_ISR(ep1out_isr, 1, OUT)
+USB_EP_ISR(ep2in_isr,  2, IN)
+USB_EP_ISR(ep2out_isr, 2, OUT)
+USB_EP_ISR(ep3in_isr,  3, IN)
+USB_EP_ISR(ep3out_isr, 3, OUT)
+USB_EP_ISR(ep4in_isr,  4, IN)
+USB_EP_ISR(ep4out_isr, 4, OUT)
+USB_EP_ISR(ep5in_isr,  5, IN)
+USB_EP_ISR(ep5out_isr, 5, OUT)
+USB_EP_ISR(ep6in_isr,  6, IN)
+USB_EP_ISR(ep6out_isr, 6, OUT)
+USB_EP_ISR(ep7in_isr,  7, IN)
+USB_EP_ISR(ep7out_isr, 7, OUT)
+
+/* Control/status register of an endpoint, NULL if it is not listed */
+#define EP_CS(num, dir)  (EP_VALID(num, dir) ? &dir##num##CS : NULL)
+
+/* Control/status registers of all endpoints, indexed by EP_SLOT() */
+static __xdata uint8_t* __code usb_endpoint_cs[16] = {
+  &EP0CS,       EP_CS(1, OUT), EP_CS(2, OUT), EP_CS(3, OUT),
+  EP_CS(4, OUT), EP_CS(5, OUT), EP_CS(6, OUT), EP_CS(7, OUT),
+  &EP0CS,       EP_CS(1, IN),  EP_CS(2, IN),  EP_CS(3, IN),
+  EP_CS(4, IN),  EP_CS(5, IN),  EP_CS(6, IN),  EP_CS(7, IN)
+};
 
 /**
  * Return the control/status register for an endpoint
@@ -218,37 +615,11 @@ void ep7out_isr(void)   __interrupt EP7OUT_ISR   { }
  * @return on failure: NULL
  */
 static __xdata uint8_t* usb_get_endpoint_cs_reg(uint8_t ep) {
-  /* Mask direction bit */
-  uint8_t ep_num = ep & USB_ENDPOINT_ADDRESS_MASK;
-
-  switch (ep_num) {
-  case 0:
-    return &EP0CS;
-    break;
-  case 1:
-    return ep & USB_ENDPOINT_DIR_MASK ? &IN1CS : &OUT1CS;
-    break;
-  case 2:
-    return ep & USB_ENDPOINT_DIR_MASK ? &IN2CS : &OUT2CS;
-    break;
-  case 3:
-    return ep & USB_ENDPOINT_DIR_MASK ? &IN3CS : &OUT3CS;
-    break;
-  case 4:
-    return ep & USB_ENDPOINT_DIR_MASK ? &IN4CS : &OUT4CS;
-    break;
-  case 5:
-    return ep & USB_ENDPOINT_DIR_MASK ? &IN5CS : &OUT5CS;
-    break;
-  case 6:
-    return ep & USB_ENDPOINT_DIR_MASK ? &IN6CS : &OUT6CS;
-    break;
-  case 7:
-    return ep & USB_ENDPOINT_DIR_MASK ? &IN7CS : &OUT7CS;
-    break;
-  }
+  /* Only endpoint numbers 0..7 exist */
+  if (ep & (USB_ENDPOINT_ADDRESS_MASK & ~0x07))
+    return NULL;
 
-  return NULL;
+  return usb_endpoint_cs[EP_SLOT(ep & 0x07, ep & USB_ENDPOINT_DIR_MASK)];
 }
 
 static void usb_reset_data_toggle(uint8_t ep) {
@@ -261,7 +632,7 @@ static void usb_reset_data_toggle(uint8_t ep) {
      to the IO bit and the endpoint number to the EP2..EP0 bits. Then, in a
      separate write cycle, the R bit needs to be set.
   */
-  uint8_t togctl_value = (ep & 0x80 >> 3) | (ep & 0x7);
+  uint8_t togctl_value = ((ep & 0x80) >> 3) | (ep & 0x7);
 
   /* First step: Write EP number and direction bit */
   TOGCTL = togctl_value;
@@ -301,6 +672,9 @@ static bool usb_handle_get_status(void) {
   case USB_RECIP_GS_ENDPOINT:
     /* Get stall bit for endpoint specified in low byte of wIndex */
     ep_cs = usb_get_endpoint_cs_reg(setup_data.wIndex & 0xff);
+    if (!ep_cs) {
+      return false;
+    }
 
     if (*ep_cs & EPSTALL) {
       IN0BUF[0] = 0x01;
@@ -402,65 +776,54 @@ static bool usb_handle_set_feature(void) {
  * @return on failure: false
  */
 static bool usb_handle_get_descriptor(void) {
-  __xdata uint8_t descriptor_type;
-  __xdata uint8_t descriptor_index;
+  uint8_t type;
+  uint8_t index;
+  __code uint8_t* descriptor;
 
-  descriptor_type = (setup_data.wValue & 0xff00) >> 8;
-  descriptor_index = setup_data.wValue & 0x00ff;
+  type  = HI8(setup_data.wValue) - USB_DESCRIPTOR_TYPE_DEVICE;
+  index = LO8(setup_data.wValue);
 
-  switch (descriptor_type) {
-  case USB_DESCRIPTOR_TYPE_DEVICE:
-    SUDPTRH = HI8(&device_descriptor);
-    SUDPTRL = LO8(&device_descriptor);
-    break;
-  case USB_DESCRIPTOR_TYPE_CONFIGURATION:
-    SUDPTRH = HI8(&config_descriptor);
-    SUDPTRL = LO8(&config_descriptor);
-    break;
-  case USB_DESCRIPTOR_TYPE_STRING:
-    if (setup_data.wIndex == 0) {
-      /* Supply language descriptor */
-      SUDPTRH = HI8(&language_descriptor);
-      SUDPTRL = LO8(&language_descriptor);
-    }
-    else if (setup_data.wIndex == USB_LANG_ENGLISH_US) {
-      /* Supply string descriptor */
-      SUDPTRH = HI8(en_string_descriptors[descriptor_index - 1]);
-      SUDPTRL = LO8(en_string_descriptors[descriptor_index - 1]);
-    }
-    else {
-      return false;
-    }
-    break;
-  default:
-    /* Unsupported descriptor type */
+  /* Unsupported descriptor type or index */
+  if ((type >= sizeof(usb_descriptor_types) / sizeof(usb_descriptor_types[0])) ||
+      (index >= usb_descriptor_types[type].count)) {
     return false;
-    break;
   }
 
+  descriptor = (__code uint8_t*)&usb_descriptors +
+               usb_descriptor_offsets[usb_descriptor_types[type].first + index];
+  SUDPTRH = HI8(descriptor);
+  SUDPTRL = LO8(descriptor);
+
   return true;
 }
 
+/* Reset data toggle, unstall and clear busy flag (IN) or re-arm (OUT) one
+ * entry of USB_ENDPOINTS */
+#define EP_RESET(arg, num, dir, type, size, interval, handler) \
+  usb_reset_data_toggle(USB_DIR_##dir | (num));                \
+  EP_RESET_##dir(num);
+#define EP_RESET_IN(num)   IN##num##CS = EPBSY
+#define EP_RESET_OUT(num)  OUT##num##CS = 0; OUT##num##BC = 0
+
 /**
  * Handle SET_INTERFACE request.
  */
 static void usb_handle_set_interface(void) {
-  /* Reset Data Toggle */
-  usb_reset_data_toggle(USB_DIR_IN  | 2);
-  usb_reset_data_toggle(USB_DIR_OUT | 2);
-
-  /* Unstall & clear busy flag of all valid IN endpoints */
-  IN2CS = 0 | EPBSY;
-  
-  /* Unstall all valid OUT endpoints, reset bytecounts */
-  OUT2CS = 0;
-  OUT2BC = 0;
+  USB_ENDPOINTS(EP_RESET, 0)
+#ifdef UART
+  uart_usb_reset();
+#endif
+#ifdef NOTIFY
+  notify_usb_reset();
+#endif
+  USB_IBN_WATCH(USB_IBN_ENDPOINTS);
 }
 
 /**
  * Handle the arrival of a USB Control Setup Packet.
  */
 static void usb_handle_setup_data(void) {
+  PROFILE_ENTER(PROFILE_SETUP_DATA);
   switch (setup_data.bRequest) {
     case USB_REQ_GET_STATUS:
       if (!usb_handle_get_status()) {
@@ -495,7 +858,7 @@ static void usb_handle_setup_data(void) {
       break;
     case USB_REQ_GET_CONFIGURATION:
       /* we have only one configuration, return its index */
-      IN0BUF[0] = config_descriptor.bConfigurationValue;
+      IN0BUF[0] = usb_descriptors.config1.config.bConfigurationValue;
       IN0BC = 1;
       break;
     case USB_REQ_SET_CONFIGURATION:
@@ -503,7 +866,7 @@ static void usb_handle_setup_data(void) {
       break;
     case USB_REQ_GET_INTERFACE:
       /* we have only one interface, return its number */
-      IN0BUF[0] = interface_descriptor00.bInterfaceNumber;
+      IN0BUF[0] = usb_descriptors.config1.interface00.bInterfaceNumber;
       IN0BC = 1;
       break;
     case USB_REQ_SET_INTERFACE:
@@ -513,20 +876,126 @@ static void usb_handle_setup_data(void) {
       /* Isochronous endpoints not used -> nothing to do */
       break;
     default:
-      /* Any other requests: notify listener */
-      Semaphore_Command = 1;
+      /* Any other requests: notify listener, which completes the transfer */
+      usb_ep0_ptr = usb_ep0_buffer;
+      if (usb_ep0_locked) {
+        /* usb_ep0_buffer is still used by a deferred request */
+        STALL_EP0();
+      } else if ((setup_data.bmRequestType & USB_DIR_IN) || !setup_data.wLength) {
+        usb_ep0_state = USB_EP0_EXECUTE;
+        EVENT_POST(command);
+      } else if (setup_data.wLength <= USB_EP0_BUFFER_SIZE) {
+        /* receive the OUT data stage first */
+        usb_ep0_state     = USB_EP0_RECEIVE;
+        usb_ep0_remaining = setup_data.wLength;
+        OUT0BC = 0;
+      } else {
+        STALL_EP0();
+      }
       break;
   }
+  PROFILE_EXIT(PROFILE_SETUP_DATA);
+}
+
+/**
+ * Return the tag of the current control transfer
+ *
+ * A vendor request handler which can't respond at once stores the tag and
+ * later passes it to usb_ep0_complete().
+ */
+uint8_t usb_ep0_tag(void) {
+  return usb_ep0_setups;
+}
+
+/**
+ * Return the number of bytes received in the OUT data stage of the current
+ * vendor request (in usb_ep0_buffer)
+ */
+uint8_t usb_ep0_received(void) {
+  return usb_ep0_ptr - usb_ep0_buffer;
 }
 
 /**
- * USB initialization. Configures USB interrupts, endpoints and performs
- * ReNumeration.
+ * Lock usb_ep0_buffer while a deferred vendor request still reads its OUT
+ * data stage from it, or unlock it
+ *
+ * While it is locked, new vendor requests are stalled. Must be unlocked
+ * before the request is completed.
+ */
+void usb_ep0_lock(bool lock) {
+  usb_ep0_locked = lock;
+}
+
+/**
+ * Complete a vendor request
+ *
+ * For device-to-host requests, @a length bytes (at most wLength) from
+ * @a data are sent in the data stage (@a data == NULL: the response is in
+ * usb_ep0_buffer), @a data must stay valid until it is sent. Then the
+ * status stage is released. This must be called exactly once for every
+ * vendor request, but may be called long after the handler returned, e.g.
+ * from an I2C callback. Until then the host is NAKed in the data or status
+ * stage, which is no error and needs no retries on its side.
+ *
+ * @return false if the transfer with @a tag was aborted by the host
+ */
+bool usb_ep0_complete(uint8_t tag, __xdata uint8_t* data, uint8_t length) {
+  bool ok;
+
+  __critical {
+    ok = (usb_ep0_state == USB_EP0_EXECUTE) && (tag == usb_ep0_setups);
+    if (ok) {
+      if (setup_data.bmRequestType & USB_DIR_IN) {
+        usb_ep0_ptr = data ? data : usb_ep0_buffer;
+        usb_ep0_zlp = (length < setup_data.wLength);
+        if (!usb_ep0_zlp)
+          length = setup_data.wLength;
+        usb_ep0_remaining = length;
+        usb_ep0_state     = USB_EP0_SEND;
+        usb_ep0_send();
+      } else {
+        usb_ep0_state = USB_EP0_IDLE;
+        EP0CS |= HSNAK;
+      }
+    }
+  }
+  return ok;
+}
+
+/**
+ * Fail a vendor request by stalling EP0
+ *
+ * Like usb_ep0_complete(), but the host gets a STALL handshake.
+ *
+ * @return false if the transfer with @a tag was aborted by the host
+ */
+bool usb_ep0_stall(uint8_t tag) {
+  bool ok;
+
+  __critical {
+    ok = (usb_ep0_state == USB_EP0_EXECUTE) && (tag == usb_ep0_setups);
+    if (ok) {
+      usb_ep0_state = USB_EP0_IDLE;
+      STALL_EP0();
+      EP0CS |= HSNAK;
+    }
+  }
+  return ok;
+}
+
+/// end of the disconnect period of the ReNumeration
+static deadline_t renum_deadline;
+
+/**
+ * USB initialization. Configures USB interrupts, endpoints and starts
+ * ReNumeration by disconnecting from the bus. The remaining initialization
+ * can be done while the device is disconnected, usb_connect() finally
+ * reconnects it.
  */
 void usb_init(void) {
-  /* Mark endpoint 2 IN & OUT as valid */
-  IN07VAL  = IN2VAL;
-  OUT07VAL = OUT2VAL;
+  /* Mark all endpoints of USB_ENDPOINTS as valid */
+  IN07VAL  = USB_IN_ENDPOINTS;
+  OUT07VAL = USB_OUT_ENDPOINTS;
 
   /* Make sure no isochronous endpoints are marked valid */
   INISOVAL  = 0;
@@ -539,19 +1008,39 @@ void usb_init(void) {
   /* Enable USB Autovectoring */
   USBBAV |= AVEN;
   
-  /* Enable SUDAV interrupt */
-  USBIEN |= SUDAVIE;
+  usb_ep0_locked = 0;
+
+  /* Count NAKed IN tokens of all IN endpoints of USB_ENDPOINTS */
+  usb_ibn_clear();
+  usb_ibn_lazy    = 0;
+  usb_ibn_pending = 0;
+  IRQ_CLEAR(IBNIRQ, 0xFF);
+  IBNIEN = USB_IBN_ENDPOINTS;
+  event_register(EVENT_IBN, usb_ibn_service);
 
-  /* Enable EP2 OUT & IN interrupts */
-  OUT07IEN = OUT2IEN;
-  IN07IEN  = IN2IEN;
+  /* Enable SUDAV and IBN interrupts */
+  USBIEN |= SUDAVIE | IBNIE;
+
+  /* Enable interrupts of EP0 (data stages) and all endpoints of
+   * USB_ENDPOINTS */
+  OUT07IEN = USB_OUT_ENDPOINTS | bmBit0;
+  IN07IEN  = USB_IN_ENDPOINTS  | bmBit0;
 
   /* Enable USB interrupt (EIE register) */
   EUSB = 1;
 
-  /* Perform ReNumeration */
+  /* Start ReNumeration */
   USBCS = DISCON | RENUM;
-  delay_ms(200);
+  renum_deadline = deadline_set(200);
+}
+
+/**
+ * Finish ReNumeration: wait until the device was disconnected for at least
+ * 200 ms, then reconnect it to the bus.
+ */
+void usb_connect(void) {
+  while (!deadline_expired(renum_deadline))
+    BUSY_WAIT();
   USBCS = DISCOE | RENUM;
 }
 
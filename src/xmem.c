@@ -0,0 +1,183 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "reg_ezusb.h"
+#include "xmem.h"
+
+/*
+ * All functions are written in assembler. SDCC passes the first parameter in
+ * DPL/DPH, all further parameters in the _<function>_PARM_<n> variables.
+ *
+ * The auto-pointer registers AUTOPTRH (0x7FE3), AUTOPTRL (0x7FE4) and
+ * AUTODATA (0x7FE5) are accessed via "movx @r0" with MPAGE = 0x7F.
+ */
+
+/**
+ * Copy @a length bytes from @a src to @a dst (both in XDATA)
+ *
+ * The source is read via the auto-pointer, the destination is written via
+ * DPTR.
+ */
+void xmemcpy(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length) __naked {
+  __asm
+    mov   a,_xmemcpy_PARM_3     ; nothing to do for length == 0
+    jz    00002$
+    mov   r7,a
+    mov   _MPAGE,#0x7F          ; movx @r0 accesses 0x7Fxx
+    mov   r0,#0xE3              ; AUTOPTRH = HI8(src)
+    mov   a,(_xmemcpy_PARM_2 + 1)
+    movx  @r0,a
+    inc   r0                    ; AUTOPTRL = LO8(src)
+    mov   a,_xmemcpy_PARM_2
+    movx  @r0,a
+    inc   r0                    ; r0 -> AUTODATA
+00001$:
+    movx  a,@r0                 ; a = *src++
+    movx  @dptr,a               ; *dst++ = a
+    inc   dptr
+    djnz  r7,00001$
+00002$:
+    ret
+  __endasm;
+}
+
+/**
+ * Copy @a length bytes from @a src in CODE memory to @a dst in XDATA
+ *
+ * The source is read via DPTR (movc), the destination is written via the
+ * auto-pointer.
+ */
+void xmemcpy_code(__xdata uint8_t* dst, const __code uint8_t* src, uint8_t length) __naked {
+  __asm
+    mov   a,_xmemcpy_code_PARM_3 ; nothing to do for length == 0
+    jz    00002$
+    mov   r7,a
+    mov   _MPAGE,#0x7F          ; movx @r0 accesses 0x7Fxx
+    mov   r0,#0xE3              ; AUTOPTRH = HI8(dst)
+    mov   a,dph
+    movx  @r0,a
+    inc   r0                    ; AUTOPTRL = LO8(dst)
+    mov   a,dpl
+    movx  @r0,a
+    inc   r0                    ; r0 -> AUTODATA
+    mov   dpl,_xmemcpy_code_PARM_2
+    mov   dph,(_xmemcpy_code_PARM_2 + 1)
+00001$:
+    clr   a                     ; a = *src++
+    movc  a,@a+dptr
+    inc   dptr
+    movx  @r0,a                 ; *dst++ = a
+    djnz  r7,00001$
+00002$:
+    ret
+  __endasm;
+}
+
+/**
+ * Copy the zero-terminated string @a src in CODE memory to @a dst in XDATA
+ *
+ * The terminating zero is not copied. At most 255 characters are copied.
+ *
+ * @return number of characters copied
+ */
+uint8_t xstrcpy_code(__xdata char* dst, const __code char* src) __naked {
+  __asm
+    mov   _MPAGE,#0x7F          ; movx @r0 accesses 0x7Fxx
+    mov   r0,#0xE3              ; AUTOPTRH = HI8(dst)
+    mov   a,dph
+    movx  @r0,a
+    inc   r0                    ; AUTOPTRL = LO8(dst)
+    mov   a,dpl
+    movx  @r0,a
+    inc   r0                    ; r0 -> AUTODATA
+    mov   dpl,_xstrcpy_code_PARM_2
+    mov   dph,(_xstrcpy_code_PARM_2 + 1)
+    mov   r7,#0                 ; character counter
+00001$:
+    clr   a                     ; a = *src++
+    movc  a,@a+dptr
+    jz    00002$                ; stop at terminating zero
+    inc   dptr
+    movx  @r0,a                 ; *dst++ = a
+    inc   r7
+    cjne  r7,#0xFF,00001$       ; stop after 255 characters
+00002$:
+    mov   dpl,r7                ; return value
+    ret
+  __endasm;
+}
+
+/**
+ * Fill @a length bytes at @a dst in XDATA with @a value
+ */
+void xmemset(__xdata uint8_t* dst, uint8_t value, uint8_t length) __naked {
+  __asm
+    mov   a,_xmemset_PARM_3     ; nothing to do for length == 0
+    jz    00002$
+    mov   r7,a
+    mov   a,_xmemset_PARM_2
+00001$:
+    movx  @dptr,a               ; *dst++ = value
+    inc   dptr
+    djnz  r7,00001$
+00002$:
+    ret
+  __endasm;
+}
+
+/**
+ * Copy @a length bytes from @a src to @a dst (both in XDATA) from an ISR
+ *
+ * Like xmemcpy(), but MPAGE and the auto-pointer are saved on the stack and
+ * restored afterwards, so an interrupted xmemcpy() etc. continues correctly.
+ */
+void xmemcpy_isr(__xdata uint8_t* dst, __xdata uint8_t* src, uint8_t length) __naked {
+  __asm
+    mov   a,_xmemcpy_isr_PARM_3 ; nothing to do for length == 0
+    jz    00002$
+    mov   r7,a
+    push  _MPAGE
+    mov   _MPAGE,#0x7F          ; movx @r0 accesses 0x7Fxx
+    mov   r0,#0xE3              ; save AUTOPTRH
+    movx  a,@r0
+    push  acc
+    mov   a,(_xmemcpy_isr_PARM_2 + 1)
+    movx  @r0,a                 ; AUTOPTRH = HI8(src)
+    inc   r0                    ; save AUTOPTRL
+    movx  a,@r0
+    push  acc
+    mov   a,_xmemcpy_isr_PARM_2
+    movx  @r0,a                 ; AUTOPTRL = LO8(src)
+    inc   r0                    ; r0 -> AUTODATA
+00001$:
+    movx  a,@r0                 ; a = *src++
+    movx  @dptr,a               ; *dst++ = a
+    inc   dptr
+    djnz  r7,00001$
+    mov   r0,#0xE4              ; restore AUTOPTRL
+    pop   acc
+    movx  @r0,a
+    dec   r0                    ; restore AUTOPTRH
+    pop   acc
+    movx  @r0,a
+    pop   _MPAGE
+00002$:
+    ret
+  __endasm;
+}
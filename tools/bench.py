@@ -0,0 +1,471 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2012 by Johann Glaser <Johann.Glaser@gmx.at>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+"""Cycle benchmarks of the firmware in the SDCC simulator s51 (ucsim).
+
+Runs the firmware built with "make BENCH=1" in s51, posts the events of
+every scenario to the benchmark driver (see include/bench.h) and reads the
+profiling measurements (see include/profile.h) after each scenario. The
+results are printed as CSV table with the columns
+
+  scenario, section, calls, max, avg
+
+where max and avg are instruction cycles with the instrumentation overhead
+already subtracted. With --baseline the results are compared with a
+previously saved table and the exit code is 1 if any section got slower.
+
+Scenario scripts consist of lines "scenario <name>" followed by event lines
+"setup <8 bytes>", "i2c_start <addr> <bytes...>", "i2c <I2CS> <I2DAT>",
+"pins <PINSA> <PINSB> <PINSC>", "capture <config> <divider> <mask>
+<value>", "pattern <config> <samples...>", "spi <mode> <bytes...>" or
+"jtag <exit> <bytes...>", "stream <flags> <packets>", "copy <method>
+<length>" or "delay <microseconds LSB> <MSB>", all numbers in hex. "#" starts a comment.
+
+For every capture the sample rate is printed to stderr, calculated from the
+measured cycles of capture_poll() (including the trigger check and the loop
+setup) and 6 instruction cycles per microsecond. For every pattern the
+maximum sustained sample rate of the pattern generator is printed, derived
+from the cycles to put one packet into the FIFO and to output it with one
+Timer 0 ISR call per sample. For every SPI transfer the bit rate and for
+every JTAG scan the TCK rate is printed.
+
+For every stream the bytes per 1 ms USB frame are printed, derived from the
+cycles to produce one 64 byte EP2 IN packet and the bus time of one packet
+(at most 19 bulk packets of 64 bytes per frame at full speed). Unpaired, the
+SIE can't send while the CPU fills the only buffer and vice versa, so both
+times add up. Double buffered (EP2_FLAG_DOUBLE_BUFFER), filling one half
+overlaps sending the other one and the slower of both limits the rate.
+
+For every copy the cycles per byte are printed, for the plain pointer loop
+(method 0) and for xmemcpy() with the auto-pointer (method 1, see
+include/xmem.h). Note that s51 doesn't implement the auto-pointer, so only
+the timing of xmemcpy() is right, not the copied data.
+
+For every delay the measured time of delay_us() and its error are printed
+(delays must be shorter than 1 ms to be measured). Build the firmware with
+other optimization flags, e.g. "make clean bench OPT=--opt-code-speed", to
+check that the delays don't depend on them. Delays below 20 us use a loop
+of fixed instruction cycles, which s51 counts with the cycles of the
+classic 8051 (djnz 2 cycles instead of 3 on the EZ-USB), so they appear
+1/6 shorter than on the target.
+"""
+
+import argparse
+import csv
+import os
+import re
+import select
+import struct
+import subprocess
+import sys
+
+TOP_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+
+# see include/bench.h
+BENCH_RESET     = 0x01
+BENCH_SETUP     = 0x02
+BENCH_I2C_START = 0x03
+BENCH_I2C       = 0x04
+BENCH_CAPTURE   = 0x05
+BENCH_PATTERN   = 0x06
+BENCH_SPI       = 0x07
+BENCH_JTAG      = 0x08
+BENCH_STREAM    = 0x09
+BENCH_COPY      = 0x0A
+BENCH_DELAY     = 0x0B
+PINS            = None          # not an event, written to PINSA..PINSC
+
+EVENTS = {
+    'setup':     BENCH_SETUP,
+    'i2c_start': BENCH_I2C_START,
+    'i2c':       BENCH_I2C,
+    'capture':   BENCH_CAPTURE,
+    'pattern':   BENCH_PATTERN,
+    'spi':       BENCH_SPI,
+    'jtag':      BENCH_JTAG,
+    'stream':    BENCH_STREAM,
+    'copy':      BENCH_COPY,
+    'delay':     BENCH_DELAY,
+    'pins':      PINS,
+}
+
+# The EZ-USB takes the upper address byte of "movx @Ri" from MPAGE, a plain
+# 8052 from P2 (0xFF after reset), so the pins are written to both pages.
+PINSA_ADDRS = (0x7F99, 0xFF99)
+
+# see include/capture.h
+CYCLES_PER_SECOND    = 6000000
+CAPTURE_WIDE         = 0x04
+CAPTURE_SAMPLES      = 512
+CAPTURE_SAMPLES_WIDE = 168
+CAPTURE_MAX_CYCLES   = 6000
+
+# see include/pattern.h
+PATTERN_PORT_A       = 0x01
+PATTERN_PORT_B       = 0x02
+
+# see include/commands.h
+EP2_FLAG_DOUBLE_BUFFER = 0x01
+
+# full speed bulk transfers, see USB 2.0, table 5-10
+FRAME_US             = 1000
+FRAME_PACKETS        = 19           # max. packets of 64 bytes per frame
+
+PROFILE_ENTRY = struct.Struct('<HHL')   # TProfileEntry
+
+DEFAULT_SCRIPT = """
+scenario get_descriptor_device
+  setup 80 06 00 01 00 00 12 00
+scenario get_descriptor_config
+  setup 80 06 00 02 00 00 ff 00
+scenario get_descriptor_string
+  setup 80 06 02 03 09 04 ff 00
+scenario set_configuration
+  setup 00 09 01 00 00 00 00 00
+scenario get_version
+  setup c0 80 00 00 00 00 02 00
+scenario get_version_string
+  setup c0 81 00 00 00 00 40 00
+scenario get_status
+  setup c0 82 00 00 00 00 01 00
+scenario set_ep2_mode_loopback
+  setup 40 83 02 00 00 00 00 00
+# I2CS: DONE = 01, ACK = 02, BERR = 04
+scenario i2c_write_4
+  i2c_start 50 00 01 02 03
+  i2c 03 00
+  i2c 03 00
+  i2c 03 00
+  i2c 03 00
+  i2c 03 00
+scenario i2c_nack
+  i2c_start 50 00
+  i2c 01 00
+# the simulator doesn't change the pins, so the trigger matches immediately
+scenario capture_8_pins
+  pins 5a 00 00
+  capture 00 00 00 00
+scenario capture_8_pins_trigger
+  pins 81 00 00
+  capture 00 00 81 81
+scenario capture_24_pins
+  pins 01 02 03
+  capture 04 00 00 00
+scenario capture_24_pins_divider_1
+  capture 04 01 00 00
+scenario pattern_port_a
+  pattern 01 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+scenario pattern_ports_ab
+  pattern 03 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+# SPI modes: CPHA = 20, CPOL = 40, LSB first = 80
+scenario spi_mode_0
+  spi 00 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+scenario spi_mode_1
+  spi 20 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+scenario spi_mode_2
+  spi 40 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+scenario spi_mode_3
+  spi 60 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+scenario spi_mode_0_lsb_first
+  spi 80 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+# JTAG scans of 504 bits, staying in Shift-DR (exit = 0) or leaving it with
+# the last bit (exit = 1)
+scenario jtag_scan
+  jtag 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+scenario jtag_scan_exit
+  jtag 01 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37 38 39 3a 3b 3c 3d 3e 3f
+# EP2_MODE_STREAM, 16 packets unpaired and double buffered
+scenario stream_single
+  stream 00 10
+scenario stream_double
+  stream 01 10
+# OUT2BUF to IN2BUF, pointer loop (method 0) and xmemcpy() (method 1)
+scenario copy_loop_64
+  copy 00 40
+scenario copy_xmem_64
+  copy 01 40
+scenario copy_loop_8
+  copy 00 08
+scenario copy_xmem_8
+  copy 01 08
+# delay_us() with the cycle loop (below 20 us) and with Timer 2
+scenario delay_5us
+  delay 05 00
+scenario delay_19us
+  delay 13 00
+scenario delay_20us
+  delay 14 00
+scenario delay_100us
+  delay 64 00
+scenario delay_900us
+  delay 84 03
+"""
+
+
+def read_sections():
+    """Return {index: name} of the PROFILE_* sections in profile.h."""
+    sections = {}
+    with open(os.path.join(TOP_DIR, 'include', 'profile.h')) as f:
+        for line in f:
+            m = re.match(r'#define\s+PROFILE_(\w+)\s+(\d+)', line)
+            if m and m.group(1) != 'COUNT':
+                sections[int(m.group(2))] = m.group(1).lower()
+    return sections
+
+
+def read_map(filename):
+    """Return {symbol: address} of the linker map file."""
+    symbols = {}
+    with open(filename) as f:
+        for line in f:
+            m = re.match(r'\s*(?:[A-Z]:\s+)?([0-9A-Fa-f]{4,8})\s+(_\w+)', line)
+            if m:
+                symbols[m.group(2)] = int(m.group(1), 16)
+    return symbols
+
+
+def parse_script(text):
+    """Return a list of (name, [(event, bytes)]) scenarios."""
+    scenarios = []
+    for lineno, line in enumerate(text.splitlines(), 1):
+        words = line.split('#')[0].split()
+        if not words:
+            continue
+        if words[0] == 'scenario' and len(words) == 2:
+            scenarios.append((words[1], []))
+        elif words[0] in EVENTS and scenarios:
+            data = bytes(int(w, 16) for w in words[1:])
+            scenarios[-1][1].append((EVENTS[words[0]], data))
+        else:
+            raise ValueError('line %d: invalid statement "%s"' % (lineno, line.strip()))
+    return scenarios
+
+
+class Simulator:
+    """Drive s51 through its command console."""
+
+    PROMPT = re.compile(rb'\d+> $')
+
+    def __init__(self, s51, ihx, trace=False, timeout=60):
+        self.trace   = trace
+        self.timeout = timeout
+        self.proc = subprocess.Popen([s51, '-t', '8052', ihx],
+                                     stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT)
+        self.read_prompt()
+
+    def read_prompt(self):
+        output = b''
+        while not self.PROMPT.search(output):
+            ready, _, _ = select.select([self.proc.stdout], [], [], self.timeout)
+            if not ready:
+                raise RuntimeError('s51 timed out')
+            chunk = os.read(self.proc.stdout.fileno(), 4096)
+            if not chunk:
+                raise RuntimeError('s51 terminated')
+            output += chunk
+        output = output.decode('ascii', 'replace')
+        if self.trace:
+            sys.stderr.write(output)
+        return output
+
+    def command(self, cmd):
+        if self.trace:
+            sys.stderr.write(cmd + '\n')
+        self.proc.stdin.write((cmd + '\n').encode('ascii'))
+        self.proc.stdin.flush()
+        return self.read_prompt()
+
+    def write_xram(self, addr, data):
+        self.command('set memory xram 0x%04x %s' % (addr, ' '.join('0x%02x' % b for b in data)))
+
+    def read_xram(self, addr, length):
+        data = bytearray()
+        output = self.command('dump xram 0x%04x 0x%04x 16' % (addr, addr + length - 1))
+        for line in output.splitlines():
+            words = line.split()
+            if len(words) < 2 or not re.match(r'0x[0-9a-fA-F]+$', words[0]):
+                continue
+            count = min(16, length - len(data))
+            data += bytes(int(w, 16) for w in words[1:1 + count])
+        if len(data) != length:
+            raise RuntimeError('unexpected dump output:\n' + output)
+        return bytes(data)
+
+    def close(self):
+        try:
+            self.command('quit')
+        except RuntimeError:
+            pass
+        self.proc.wait()
+
+
+class Bench:
+    """Post events to the benchmark driver and collect the measurements."""
+
+    def __init__(self, sim, symbols, sections):
+        self.sim      = sim
+        self.mailbox  = symbols['_bench_mailbox']
+        self.table    = symbols['_profile_table']
+        self.sections = sections
+        sim.command('break 0x%04x' % symbols['_bench_idle'])
+        # initialization including ReNumeration
+        sim.command('run')
+
+    def post(self, event, data=b''):
+        self.sim.write_xram(self.mailbox, bytes([event, len(data)]) + data)
+        self.sim.command('run')
+
+    def results(self):
+        raw = self.sim.read_xram(self.table, PROFILE_ENTRY.size * len(self.sections))
+        entries = {}
+        for index, name in self.sections.items():
+            entries[name] = PROFILE_ENTRY.unpack_from(raw, index * PROFILE_ENTRY.size)
+        return entries
+
+    def run(self, name, events):
+        self.post(BENCH_RESET)
+        for event, data in events:
+            if event is PINS:
+                for addr in PINSA_ADDRS:
+                    self.sim.write_xram(addr, data)
+            else:
+                self.post(event, data)
+        entries = self.results()
+        calls, _, total = entries.pop('overhead')
+        overhead = total // calls if calls else 0
+        rows = []
+        for section, (calls, maximum, total) in entries.items():
+            if calls:
+                rows.append((name, section, calls, maximum - overhead,
+                             total // calls - overhead))
+        return rows
+
+
+def stream_rate(name, data, cycles):
+    """Print the bytes per frame of a stream scenario."""
+    packets = data[1]
+    fill_us = cycles * 1e6 / CYCLES_PER_SECOND / packets
+    bus_us  = FRAME_US / FRAME_PACKETS
+    if data[0] & EP2_FLAG_DOUBLE_BUFFER:
+        packet_us = max(fill_us, bus_us)
+    else:
+        packet_us = fill_us + bus_us
+    per_frame = min(FRAME_PACKETS, FRAME_US / packet_us) * 64
+    sys.stderr.write('%s: %.1f us per packet, %.0f bytes per frame\n'
+                     % (name, fill_us, per_frame))
+
+
+def capture_samples(config, divider):
+    """Return the number of samples of a capture, see capture_start()."""
+    wide = config & CAPTURE_WIDE
+    period = (19 if wide else 7) + (2 + 3 * divider if divider else 0)
+    groups = max(1, CAPTURE_MAX_CYCLES // (period * 4))
+    return min(groups * 4, CAPTURE_SAMPLES_WIDE if wide else CAPTURE_SAMPLES)
+
+
+def sample_rates(scenarios, rows):
+    """Print the sample (bit) rate of every capture, pattern, SPI, JTAG, stream, copy and delay scenario."""
+    cycles = {(name, section): maximum for name, section, _, maximum, _ in rows}
+    for name, events in scenarios:
+        for event, data in events:
+            if (name, 'bench') not in cycles:
+                continue
+            if event == BENCH_CAPTURE:
+                samples = capture_samples(data[0], data[1])
+            elif event == BENCH_PATTERN:
+                width = 2 if data[0] & PATTERN_PORT_A and data[0] & PATTERN_PORT_B else 1
+                samples = (len(data) - 1) // width
+            elif event in (BENCH_SPI, BENCH_JTAG):
+                bits = 8 * (len(data) - 1)
+                rate = bits * CYCLES_PER_SECOND / cycles[(name, 'bench')]
+                unit = 'bit/s' if event == BENCH_SPI else 'TCK/s'
+                sys.stderr.write('%s: %d bits in %d cycles, %.0f %s\n'
+                                 % (name, bits, cycles[(name, 'bench')], rate, unit))
+                continue
+            elif event == BENCH_STREAM:
+                stream_rate(name, data, cycles[(name, 'bench')])
+                continue
+            elif event == BENCH_COPY:
+                sys.stderr.write('%s: %d bytes in %d cycles, %.1f cycles/byte\n'
+                                 % (name, data[1], cycles[(name, 'bench')],
+                                    cycles[(name, 'bench')] / data[1]))
+                continue
+            elif event == BENCH_DELAY:
+                requested = data[0] | data[1] << 8
+                measured  = cycles[(name, 'bench')] * 1e6 / CYCLES_PER_SECOND
+                sys.stderr.write('%s: %.1f us instead of %d us, %+.1f%%\n'
+                                 % (name, measured, requested,
+                                    100.0 * (measured - requested) / requested))
+                continue
+            else:
+                continue
+            rate = samples * CYCLES_PER_SECOND / cycles[(name, 'bench')]
+            sys.stderr.write('%s: %d samples in %d cycles, %.0f samples/s\n'
+                             % (name, samples, cycles[(name, 'bench')], rate))
+
+
+def compare(rows, filename, tolerance):
+    """Report sections slower than in the baseline, return True if any."""
+    with open(filename) as f:
+        baseline = {(r['scenario'], r['section']): int(r['max']) for r in csv.DictReader(f)}
+    regression = False
+    for name, section, calls, maximum, avg in rows:
+        old = baseline.get((name, section))
+        if old is not None and maximum > old * (1 + tolerance / 100.0):
+            sys.stderr.write('%s/%s: %d cycles, baseline %d\n' % (name, section, maximum, old))
+            regression = True
+    return regression
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('ihx', help='firmware built with "make BENCH=1"')
+    parser.add_argument('--map', help='linker map file (default: IHX with .map)')
+    parser.add_argument('--s51', default='s51', help='simulator executable')
+    parser.add_argument('--script', help='scenario script (default: built-in scenarios)')
+    parser.add_argument('--output', help='write the CSV table to this file')
+    parser.add_argument('--baseline', help='CSV table of a previous run to compare with')
+    parser.add_argument('--tolerance', type=float, default=0.0,
+                        help='allowed increase of max in percent (default: 0)')
+    parser.add_argument('--trace', action='store_true', help='show the s51 console')
+    args = parser.parse_args()
+
+    if args.script:
+        with open(args.script) as f:
+            scenarios = parse_script(f.read())
+    else:
+        scenarios = parse_script(DEFAULT_SCRIPT)
+    symbols = read_map(args.map or os.path.splitext(args.ihx)[0] + '.map')
+
+    sim = Simulator(args.s51, args.ihx, args.trace)
+    try:
+        bench = Bench(sim, symbols, read_sections())
+        rows = []
+        for name, events in scenarios:
+            rows += bench.run(name, events)
+    finally:
+        sim.close()
+
+    out = open(args.output, 'w', newline='') if args.output else sys.stdout
+    writer = csv.writer(out)
+    writer.writerow(['scenario', 'section', 'calls', 'max', 'avg'])
+    writer.writerows(rows)
+    if args.output:
+        out.close()
+    sample_rates(scenarios, rows)
+
+    if args.baseline and compare(rows, args.baseline, args.tolerance):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()